@@ -0,0 +1,279 @@
+/*
+ * Just enough of the kernel API, on top of libc and pthreads, to build
+ * spifpga_core.c as a userspace library. The SPI master behind spi_async()
+ * is provided by mock_spi.c.
+ *
+ * Only what the core uses is here; it is not meant to be a general
+ * emulation of the kernel.
+ */
+
+#ifndef SPIFPGA_KCOMPAT_H
+#define SPIFPGA_KCOMPAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+typedef uint8_t         u8;
+typedef uint16_t        u16;
+typedef uint32_t        u32;
+typedef uint64_t        u64;
+typedef int32_t         s32;
+typedef int64_t         s64;
+
+#define U32_MAX                 ((u32)~0U)
+
+#define __user
+#define __force
+
+#define READ_ONCE(x)            (*(volatile __typeof__(x) *)&(x))
+#define ARRAY_SIZE(a)           (sizeof(a) / sizeof((a)[0]))
+#define min_t(type, a, b)       ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b)       ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline unsigned ilog2(u64 v)
+{
+    return 63 - __builtin_clzll(v);
+}
+
+/* Modules */
+
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+#define S_IRUGO                 (S_IRUSR | S_IRGRP | S_IROTH)
+
+#define KERN_INFO               ""
+#define printk(...)             printf(__VA_ARGS__)
+#define dev_dbg(dev, ...)       do { } while (0)
+
+/* Memory */
+
+#define GFP_KERNEL              0
+#define kmalloc(size, gfp)      malloc(size)
+#define kzalloc(size, gfp)      calloc(1, size)
+#define kcalloc(n, size, gfp)   calloc(n, size)
+#define kfree(p)                free(p)
+
+#define VERIFY_READ             0
+#define VERIFY_WRITE            1
+#define access_ok(type, addr, size)     1
+
+static inline unsigned long copy_from_user(void *to, const void *from,
+        unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_to_user(void *to, const void *from,
+        unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+#define __copy_to_user          copy_to_user
+#define __copy_from_user        copy_from_user
+
+/* Atomics */
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long long counter; } atomic64_t;
+
+#define atomic_read(v)          __atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_set(v, i)        __atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_inc(v)           __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(v)  (__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+
+#define atomic64_read(v)        __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic64_set(v, i)      __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic64_add(i, v)      __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic64_inc(v)         atomic64_add(1, v)
+
+/* Locks */
+
+typedef pthread_mutex_t spinlock_t;
+#define spin_lock_init(l)       pthread_mutex_init(l, NULL)
+#define spin_lock(l)            pthread_mutex_lock(l)
+#define spin_unlock(l)          pthread_mutex_unlock(l)
+#define spin_lock_irq(l)        pthread_mutex_lock(l)
+#define spin_unlock_irq(l)      pthread_mutex_unlock(l)
+
+struct mutex {
+    pthread_mutex_t     m;
+};
+#define mutex_init(l)           pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l)           pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l)         pthread_mutex_unlock(&(l)->m)
+
+/* Time. Jiffies are microseconds here. */
+
+typedef s64 ktime_t;
+
+static inline ktime_t ktime_get(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (s64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define ktime_get_ns()          ((u64)ktime_get())
+#define ktime_sub(a, b)         ((a) - (b))
+#define ktime_to_ns(t)          (t)
+#define ktime_us_delta(a, b)    (((a) - (b)) / 1000)
+#define usecs_to_jiffies(us)    (us)
+
+/* Wait queues and completions */
+
+typedef struct {
+    pthread_mutex_t     m;
+    pthread_cond_t      c;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->m, NULL);
+    pthread_cond_init(&wq->c, NULL);
+}
+
+static inline void wake_up(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->m);
+    pthread_cond_broadcast(&wq->c);
+    pthread_mutex_unlock(&wq->m);
+}
+#define wake_up_interruptible   wake_up
+
+/*
+ * The condition isn't checked under wq->m by the waker, so sleep in short
+ * slices rather than trusting every wakeup to arrive.
+ */
+#define wait_event_timeout(wq, condition, timeout_us)                   \
+({                                                                      \
+    ktime_t __end = ktime_get() + (s64)(timeout_us) * 1000;             \
+    while (!(condition) && ktime_get() < __end) {                       \
+        struct timespec __ts;                                           \
+        clock_gettime(CLOCK_REALTIME, &__ts);                           \
+        __ts.tv_nsec += 100000;                                         \
+        if (__ts.tv_nsec >= 1000000000) {                               \
+            __ts.tv_sec++;                                              \
+            __ts.tv_nsec -= 1000000000;                                 \
+        }                                                               \
+        pthread_mutex_lock(&(wq).m);                                    \
+        if (!(condition))                                               \
+            pthread_cond_timedwait(&(wq).c, &(wq).m, &__ts);            \
+        pthread_mutex_unlock(&(wq).m);                                  \
+    }                                                                   \
+    (condition) ? 1 : 0;                                                \
+})
+
+struct completion {
+    pthread_mutex_t     m;
+    pthread_cond_t      c;
+    int                 done;
+};
+
+#define DECLARE_COMPLETION_ONSTACK(x) \
+    struct completion x = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
+
+static inline void complete(struct completion *x)
+{
+    pthread_mutex_lock(&x->m);
+    x->done = 1;
+    pthread_cond_signal(&x->c);
+    pthread_mutex_unlock(&x->m);
+}
+
+static inline void wait_for_completion(struct completion *x)
+{
+    pthread_mutex_lock(&x->m);
+    while (!x->done)
+        pthread_cond_wait(&x->c, &x->m);
+    pthread_mutex_unlock(&x->m);
+}
+
+/* Lists */
+
+struct list_head {
+    struct list_head    *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+#define list_for_each_entry(pos, head, member)                          \
+    for (pos = container_of((head)->next, __typeof__(*pos), member);    \
+         &pos->member != (head);                                        \
+         pos = container_of(pos->member.next, __typeof__(*pos), member))
+
+/* SPI */
+
+struct dentry;
+struct spi_device;
+
+struct spi_transfer {
+    const void          *tx_buf;
+    void                *rx_buf;
+    unsigned            len;
+    unsigned            cs_change:1;
+    u8                  bits_per_word;
+    u16                 delay_usecs;
+    u32                 speed_hz;
+    struct list_head    transfer_list;
+};
+
+struct spi_message {
+    struct list_head    transfers;
+    struct spi_device   *spi;
+    void                (*complete)(void *context);
+    void                *context;
+    unsigned            actual_length;
+    int                 status;
+};
+
+static inline void spi_message_init(struct spi_message *m)
+{
+    memset(m, 0, sizeof(*m));
+    INIT_LIST_HEAD(&m->transfers);
+}
+
+static inline void spi_message_add_tail(struct spi_transfer *t,
+        struct spi_message *m)
+{
+    list_add_tail(&t->transfer_list, &m->transfers);
+}
+
+int spi_async(struct spi_device *spi, struct spi_message *message);
+size_t spi_max_transfer_size(struct spi_device *spi);
+size_t spi_max_message_size(struct spi_device *spi);
+
+#endif /* SPIFPGA_KCOMPAT_H */
@@ -0,0 +1,172 @@
+/*
+ * Mock SPI master with an emulated FPGA behind it, see mock_spi.h.
+ */
+
+#include "spifpga_core.h"
+#include "mock_spi.h"
+
+int mock_fpga_init(struct mock_fpga *fpga, size_t bytes)
+{
+    memset(fpga, 0, sizeof(*fpga));
+    fpga->words = bytes / FPGA_WORD_BYTES;
+    fpga->mem = calloc(fpga->words, sizeof(u32));
+    if (!fpga->mem)
+        return -ENOMEM;
+    fpga->hz = 4000000;
+    fpga->xfer_ns = 2000;
+    fpga->msg_ns = 20000;
+    pthread_mutex_init(&fpga->bus, NULL);
+    return 0;
+}
+
+void mock_fpga_free(struct mock_fpga *fpga)
+{
+    free(fpga->mem);
+    fpga->mem = NULL;
+}
+
+void mock_fpga_reset_counters(struct mock_fpga *fpga)
+{
+    atomic64_set(&fpga->messages, 0);
+    atomic64_set(&fpga->frames, 0);
+    atomic64_set(&fpga->wire_bytes, 0);
+    atomic64_set(&fpga->bus_ns, 0);
+}
+
+/* Answer one frame the way the gateware does */
+static void mock_fpga_frame(struct mock_fpga *fpga, const struct fpga_data *cmd,
+        struct fpga_data *rsp)
+{
+    u32         *word = &fpga->mem[(cmd->addr / FPGA_WORD_BYTES) % fpga->words];
+    struct fpga_data    r = { 0 };
+
+    if (cmd->cmd == FPGA_CMD_WRITE)
+        *word = cmd->dout;
+    else if (cmd->cmd == FPGA_CMD_READ && cmd->addr == cap_addr && !fpga->legacy &&
+            !fpga->no_burst)
+        r.din = FPGA_CAP_MAGIC | FPGA_CAP_BURST;
+    else if (cmd->cmd == FPGA_CMD_READ)
+        r.din = *word;
+    r.resp = cmd->cmd;
+
+    if (rsp)
+        memcpy(rsp, &r, sizeof(r));
+    atomic64_inc(&fpga->frames);
+}
+
+/* A whole burst frame in one transfer: header, words, status */
+static void mock_fpga_burst(struct mock_fpga *fpga, const u8 *tx, u8 *rx,
+        unsigned len)
+{
+    struct fpga_burst_hdr hdr;
+    u32         i, word;
+
+    memcpy(&hdr, tx, sizeof(hdr));
+    if (rx)
+        memset(rx, 0, len);
+    if (len != hdr.count * FPGA_WORD_BYTES + FPGA_BURST_OVERHEAD)
+        return;             /* garbled, no status */
+
+    for (i = 0; i < hdr.count; i++) {
+        u32 *mem = &fpga->mem[(hdr.addr / FPGA_WORD_BYTES + i) % fpga->words];
+
+        if (hdr.cmd == FPGA_CMD_BURST_WRITE) {
+            memcpy(&word, tx + sizeof(hdr) + i * FPGA_WORD_BYTES, sizeof(word));
+            *mem = word;
+        } else if (rx) {
+            memcpy(rx + sizeof(hdr) + i * FPGA_WORD_BYTES, mem, sizeof(*mem));
+        }
+    }
+    if (rx)
+        rx[len - 1] = hdr.cmd;
+    atomic64_inc(&fpga->frames);
+}
+
+/*
+ * A controller moves the data by DMA while the caller sleeps, so sleep
+ * through most of the wait and leave the CPU to other threads; the last
+ * stretch is spun, as the host can take 100us or more to wake a sleeper.
+ */
+#define MOCK_SPIN_NS    250000
+
+static void mock_wait_until(ktime_t end)
+{
+    struct timespec ts;
+
+    if (end - ktime_get() > MOCK_SPIN_NS) {
+        ts.tv_sec = (end - MOCK_SPIN_NS) / 1000000000;
+        ts.tv_nsec = (end - MOCK_SPIN_NS) % 1000000000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    while (ktime_get() < end)
+        ;
+}
+
+size_t spi_max_transfer_size(struct spi_device *spi)
+{
+    size_t      max = spi->fpga->max_transfer_size;
+
+    return min_t(size_t, max ? max : SIZE_MAX, spi_max_message_size(spi));
+}
+
+size_t spi_max_message_size(struct spi_device *spi)
+{
+    return spi->fpga->max_message_size ? spi->fpga->max_message_size : SIZE_MAX;
+}
+
+int spi_async(struct spi_device *spi, struct spi_message *message)
+{
+    struct mock_fpga    *fpga = spi->fpga;
+    struct spi_transfer *t;
+    ktime_t     start;
+    size_t      total = 0;
+    u64         ns;
+
+    list_for_each_entry(t, &message->transfers, transfer_list) {
+        if (t->len > spi_max_transfer_size(spi))
+            return -EMSGSIZE;
+        total += t->len;
+    }
+    if (total > spi_max_message_size(spi))
+        return -EMSGSIZE;
+
+    pthread_mutex_lock(&fpga->bus);
+    start = ktime_get();
+    ns = fpga->msg_ns;
+    message->actual_length = 0;
+
+    list_for_each_entry(t, &message->transfers, transfer_list) {
+        if (t->tx_buf && !fpga->legacy && !fpga->no_burst &&
+                t->len >= FPGA_BURST_OVERHEAD &&
+                (*(const u8 *)t->tx_buf == FPGA_CMD_BURST_READ ||
+                 *(const u8 *)t->tx_buf == FPGA_CMD_BURST_WRITE)) {
+            mock_fpga_burst(fpga, t->tx_buf, t->rx_buf, t->len);
+        } else if (t->len % sizeof(struct fpga_data) == 0 && t->tx_buf) {
+            const struct fpga_data *cmd = t->tx_buf;
+            struct fpga_data *rsp = t->rx_buf;
+            unsigned    i, n = t->len / sizeof(struct fpga_data);
+
+            if (rsp)
+                memset(rsp, 0, t->len);
+            for (i = 0; i < (fpga->legacy ? 1 : n); i++)
+                mock_fpga_frame(fpga, cmd + i, rsp ? rsp + i : NULL);
+        } else if (t->rx_buf && t->tx_buf)
+            memmove(t->rx_buf, t->tx_buf, t->len);  /* loopback */
+        else if (t->rx_buf)
+            memset(t->rx_buf, 0, t->len);
+
+        ns += fpga->xfer_ns + (u64)t->len * 8 * 1000000000 / fpga->hz;
+        message->actual_length += t->len;
+    }
+
+    atomic64_inc(&fpga->messages);
+    atomic64_add(message->actual_length, &fpga->wire_bytes);
+    atomic64_add(ns, &fpga->bus_ns);
+    if (fpga->realtime)
+        mock_wait_until(start + ns);
+    pthread_mutex_unlock(&fpga->bus);
+
+    message->status = 0;
+    message->complete(message->context);
+    return 0;
+}
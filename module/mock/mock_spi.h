@@ -0,0 +1,55 @@
+/*
+ * Mock SPI master for the userspace build of the spifpga core.
+ *
+ * spi_async() decodes every 14 byte transfer as an FPGA frame against an
+ * emulated register memory, and completes the message synchronously. Longer
+ * transfers made of whole frames are decoded as a frame stream, unless
+ * legacy is set, in which case only their first frame is answered, as old
+ * gateware would. Burst frames are understood, and advertised in the
+ * capability register at cap_addr, unless legacy or no_burst is set (the
+ * latter for gateware that streams frames but has no bursts). Messages or
+ * transfers over the controller limits fail with EMSGSIZE. Wire
+ * time is modelled from the clock rate plus fixed per-transfer (chipselect
+ * and controller setup) and per-message costs. The modelled time is always
+ * accumulated, and with realtime set the mock also waits it out (sleeping,
+ * as a caller of a DMA controller would), so wall clock benchmarks see the
+ * bus as a shared, serialised resource.
+ */
+
+#ifndef SPIFPGA_MOCK_SPI_H
+#define SPIFPGA_MOCK_SPI_H
+
+#include "kcompat.h"
+
+struct mock_fpga {
+    u32                 *mem;
+    size_t              words;      /* addresses wrap modulo the memory */
+
+    /* wire timing */
+    u32                 hz;
+    u32                 xfer_ns;    /* per spi_transfer */
+    u32                 msg_ns;     /* per spi_message */
+    bool                realtime;
+    bool                legacy;     /* no frame streaming, no bursts */
+    bool                no_burst;   /* frame streaming, no bursts */
+
+    /* controller limits in bytes, 0 for none */
+    size_t              max_transfer_size;
+    size_t              max_message_size;
+
+    pthread_mutex_t     bus;
+    atomic64_t          messages;
+    atomic64_t          frames;
+    atomic64_t          wire_bytes;
+    atomic64_t          bus_ns;     /* modelled */
+};
+
+struct spi_device {
+    struct mock_fpga    *fpga;
+};
+
+int mock_fpga_init(struct mock_fpga *fpga, size_t bytes);
+void mock_fpga_free(struct mock_fpga *fpga);
+void mock_fpga_reset_counters(struct mock_fpga *fpga);
+
+#endif /* SPIFPGA_MOCK_SPI_H */
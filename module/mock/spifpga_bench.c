@@ -0,0 +1,534 @@
+/*
+ * Benchmark for the spifpga protocol core, run against the mock SPI master.
+ *
+ * spifpga_bench [-n bytes] [-i iterations] [-b bufsiz] [-s hz]
+ *               [-x xfer_ns] [-m msg_ns] [-r] [-f] [-a window] [-w size]
+ *               [-c] [-L] [-t max_transfer] [-l max_message]
+ *
+ * By default it writes and reads back a block, checks the data, and reports
+ * throughput both in wall time and in modelled bus time. With -r the mock
+ * also spends the modelled bus time, so wall time includes it.
+ *
+ * -f runs the fairness scenario instead: FAIR_BULK_THREADS threads stream
+ * bulk reads of the block while another issues single word control writes
+ * at random intervals, first as urgent requests and then as bulk ones, and
+ * reports the control latency next to that of an idle bus. An urgent write
+ * waits for the page in flight at most, so pages are FAIR_BUFSIZ bytes
+ * unless -b says otherwise; a bulk one queues with the readers. As wall
+ * time also carries the host's scheduling, the bound is checked on the
+ * modelled bus time bulk pages took while each write waited, and the
+ * bench fails if its p99 is over one page.
+ *
+ * -a reads the block back one word at a time, as cat or a Python loop
+ * would, first straight through and then with a readahead window of the
+ * given size in bytes.
+ *
+ * -w writes the block one word at a time, first straight through and then
+ * through a write combining buffer of the given size in bytes, and reads it
+ * back to check.
+ *
+ * -c runs the default write/read/verify twice, once framed the usual way
+ * and once in stream mode (SPIFPGA_IOC_SET_STREAM), and compares the
+ * modelled bus ops/s. -L makes the mock behave like old gateware, without
+ * streaming (which the stream probe must refuse) or bursts (so bulk
+ * transfers fall back to a frame per word).
+ *
+ * -t and -l give the mock controller transfer and message size limits,
+ * which the core must size its pages to.
+ */
+
+#include <getopt.h>
+#include "spifpga_core.h"
+#include "mock_spi.h"
+
+#define BENCH_ADDR      0x00010000
+#define FAIR_BULK_THREADS 3
+#define FAIR_BUFSIZ     256
+
+struct bench_buf {
+    u8          *p;
+};
+
+static size_t bench_copy(void *ctx, void *words, size_t bytes, bool out)
+{
+    struct bench_buf *b = ctx;
+
+    if (out)
+        memcpy(b->p, words, bytes);
+    else
+        memcpy(words, b->p, bytes);
+    b->p += bytes;
+    return bytes;
+}
+
+static size_t bench_copy_out(void *ctx, void *words, size_t bytes)
+{
+    return bench_copy(ctx, words, bytes, true);
+}
+
+static size_t bench_copy_in(void *ctx, void *words, size_t bytes)
+{
+    return bench_copy(ctx, words, bytes, false);
+}
+
+static int bench_dev_init(struct spidev_data *spidev, struct spi_device *spi)
+{
+    memset(spidev, 0, sizeof(*spidev));
+    spidev->spi = spi;
+    spin_lock_init(&spidev->spi_lock);
+    mutex_init(&spidev->buf_lock);
+    init_waitqueue_head(&spidev->event_wait);
+    init_waitqueue_head(&spidev->urgent_wait);
+    spidev->proto = -1;
+    spifpga_update_limits(spidev);
+    spidev->buffer = malloc(bufsiz);
+    return spidev->buffer ? 0 : -ENOMEM;
+}
+
+static ssize_t bench_read(struct spidev_data *spidev, u32 addr, void *buf,
+        size_t bytes, bool urgent)
+{
+    struct bench_buf b = { buf };
+
+    return spifpga_xfer_read(spidev, addr, bytes / FPGA_WORD_BYTES, urgent,
+            bench_copy_out, &b);
+}
+
+static ssize_t bench_write(struct spidev_data *spidev, u32 addr, void *buf,
+        size_t bytes, bool urgent)
+{
+    struct bench_buf b = { buf };
+
+    return spifpga_xfer_write(spidev, addr, bytes / FPGA_WORD_BYTES, urgent,
+            bench_copy_in, &b);
+}
+
+static void bench_report(const char *name, struct mock_fpga *fpga,
+        size_t bytes, ktime_t ns)
+{
+    double wall_s = ns / 1e9;
+    double bus_s = atomic64_read(&fpga->bus_ns) / 1e9;
+    double wire = atomic64_read(&fpga->wire_bytes);
+
+    printf("%-6s %8zu bytes  wall %8.2f MB/s %9.0f frames/s  bus %6.3f MB/s %7.0f ops/s  payload/wire %.1f%%\n",
+            name, bytes, bytes / wall_s / 1e6,
+            atomic64_read(&fpga->frames) / wall_s,
+            bus_s > 0 ? bytes / bus_s / 1e6 : 0.0,
+            bus_s > 0 ? bytes / FPGA_WORD_BYTES / bus_s : 0.0,
+            wire > 0 ? 100.0 * bytes / wire : 0.0);
+}
+
+static int bench_throughput(struct spidev_data *spidev, struct mock_fpga *fpga,
+        size_t bytes, unsigned iterations)
+{
+    u32         *wr, *rd;
+    size_t      i;
+    unsigned    it;
+    ktime_t     start;
+    int         errors = 0;
+
+    wr = malloc(bytes);
+    rd = malloc(bytes);
+    if (!wr || !rd) {
+        printf("Failed to allocate buffers\n");
+        return 1;
+    }
+    for (i = 0; i < bytes / FPGA_WORD_BYTES; i++)
+        wr[i] = 0x5a000000 ^ i;
+
+    mock_fpga_reset_counters(fpga);
+    start = ktime_get();
+    for (it = 0; it < iterations; it++)
+        if (bench_write(spidev, BENCH_ADDR, wr, bytes, false) != (ssize_t)bytes) {
+            printf("write failed\n");
+            return 1;
+        }
+    bench_report("write", fpga, bytes * iterations, ktime_get() - start);
+
+    mock_fpga_reset_counters(fpga);
+    start = ktime_get();
+    for (it = 0; it < iterations; it++)
+        if (bench_read(spidev, BENCH_ADDR, rd, bytes, false) != (ssize_t)bytes) {
+            printf("read failed\n");
+            return 1;
+        }
+    bench_report("read", fpga, bytes * iterations, ktime_get() - start);
+
+    for (i = 0; i < bytes / FPGA_WORD_BYTES; i++)
+        if (rd[i] != wr[i])
+            errors++;
+    printf("verify: %s (%d mismatches)\n", errors ? "FAILED" : "ok", errors);
+
+    free(wr);
+    free(rd);
+    return errors ? 1 : 0;
+}
+
+static int bench_small_reads(struct spidev_data *spidev, struct mock_fpga *fpga,
+        size_t bytes, size_t window)
+{
+    struct spifpga_ra ra;
+    u32         *rd, word;
+    size_t      i;
+    ktime_t     start;
+    int         pass, errors = 0;
+    struct bench_buf b;
+
+    rd = malloc(bytes);
+    if (!rd) {
+        printf("Failed to allocate buffers\n");
+        return 1;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        memset(&ra, 0, sizeof(ra));
+        if (spifpga_ra_set_window(&ra, pass ? window : 0)) {
+            printf("bad readahead window %zu\n", window);
+            return 1;
+        }
+        /* something volatile in the middle, read it twice to check */
+        spifpga_ra_add_volatile(&ra, BENCH_ADDR + bytes / 2, FPGA_WORD_BYTES);
+
+        mock_fpga_reset_counters(fpga);
+        start = ktime_get();
+        for (i = 0; i < bytes / FPGA_WORD_BYTES; i++) {
+            b.p = (u8 *)&rd[i];
+            if (spifpga_ra_read(spidev, &ra, BENCH_ADDR + i * FPGA_WORD_BYTES,
+                    1, true, bench_copy_out, &b) != FPGA_WORD_BYTES) {
+                printf("read failed\n");
+                return 1;
+            }
+        }
+        bench_report(pass ? "ra" : "noRA", fpga, bytes, ktime_get() - start);
+        printf("       %lld messages for %zu reads\n",
+                (long long)atomic64_read(&fpga->messages),
+                bytes / FPGA_WORD_BYTES);
+
+        for (i = 0; i < bytes / FPGA_WORD_BYTES; i++)
+            if (rd[i] != fpga->mem[(BENCH_ADDR / FPGA_WORD_BYTES + i) %
+                    fpga->words])
+                errors++;
+
+        /* the volatile word must come from the device every time */
+        i = bytes / 2 / FPGA_WORD_BYTES;
+        fpga->mem[(BENCH_ADDR / FPGA_WORD_BYTES + i) % fpga->words] ^= ~0u;
+        b.p = (u8 *)&word;
+        spifpga_ra_read(spidev, &ra, BENCH_ADDR + i * FPGA_WORD_BYTES, 1,
+                true, bench_copy_out, &b);
+        if (word == rd[i])
+            errors++;
+        kfree(ra.buf);
+    }
+    printf("verify: %s (%d mismatches)\n", errors ? "FAILED" : "ok", errors);
+
+    free(rd);
+    return errors ? 1 : 0;
+}
+
+static int bench_small_writes(struct spidev_data *spidev,
+        struct mock_fpga *fpga, size_t bytes, size_t wc_size)
+{
+    struct spifpga_wc wc;
+    u32         *rd, word;
+    size_t      i;
+    ktime_t     start;
+    int         pass, errors = 0;
+    struct bench_buf b;
+
+    rd = malloc(bytes);
+    if (!rd) {
+        printf("Failed to allocate buffers\n");
+        return 1;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        memset(&wc, 0, sizeof(wc));
+        if (spifpga_wc_set_size(spidev, &wc, pass ? wc_size : 0)) {
+            printf("bad write combining size %zu\n", wc_size);
+            return 1;
+        }
+
+        mock_fpga_reset_counters(fpga);
+        start = ktime_get();
+        for (i = 0; i < bytes / FPGA_WORD_BYTES; i++) {
+            word = 0xa5000000 ^ (pass << 20) ^ i;
+            b.p = (u8 *)&word;
+            if (spifpga_wc_write(spidev, &wc, BENCH_ADDR + i * FPGA_WORD_BYTES,
+                    1, true, bench_copy_in, &b) != FPGA_WORD_BYTES) {
+                printf("write failed\n");
+                return 1;
+            }
+        }
+        if (spifpga_wc_flush(spidev, &wc) || spifpga_wc_error(&wc)) {
+            printf("flush failed\n");
+            return 1;
+        }
+        bench_report(pass ? "wc" : "noWC", fpga, bytes, ktime_get() - start);
+        printf("       %lld messages for %zu writes\n",
+                (long long)atomic64_read(&fpga->messages),
+                bytes / FPGA_WORD_BYTES);
+
+        bench_read(spidev, BENCH_ADDR, rd, bytes, false);
+        for (i = 0; i < bytes / FPGA_WORD_BYTES; i++)
+            if (rd[i] != (0xa5000000 ^ (pass << 20) ^ i))
+                errors++;
+        kfree(wc.buf);
+    }
+    printf("verify: %s (%d mismatches)\n", errors ? "FAILED" : "ok", errors);
+
+    free(rd);
+    return errors ? 1 : 0;
+}
+
+static int bench_stream(struct spidev_data *spidev, struct mock_fpga *fpga,
+        size_t bytes, unsigned iterations)
+{
+    int         status;
+
+    printf("-- one transfer per frame\n");
+    if (bench_throughput(spidev, fpga, bytes, iterations))
+        return 1;
+
+    status = spifpga_set_stream(spidev, true);
+    if (status) {
+        printf("stream mode refused (%d), still framing per transfer\n",
+                status);
+        return fpga->legacy ? 0 : 1;
+    }
+    if (fpga->legacy) {
+        printf("stream mode accepted by legacy gateware\n");
+        return 1;
+    }
+    printf("-- stream mode\n");
+    return bench_throughput(spidev, fpga, bytes, iterations);
+}
+
+struct bulk_ctx {
+    struct spidev_data  *spidev;
+    size_t              bytes;
+    volatile bool       stop;
+    unsigned long       n;
+};
+
+static void *bulk_thread(void *arg)
+{
+    struct bulk_ctx *ctx = arg;
+    void        *buf = malloc(ctx->bytes);
+
+    while (buf && !ctx->stop) {
+        bench_read(ctx->spidev, BENCH_ADDR, buf, ctx->bytes, false);
+        ctx->n++;
+    }
+    free(buf);
+    return NULL;
+}
+
+static int cmp_s64(const void *a, const void *b)
+{
+    s64 x = *(const s64 *)a, y = *(const s64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Control writes a random 0.5 to 2.5 pages apart. Returns the p99 of the
+ * modelled bus time spent while each one waited, less own_us for the
+ * write's own, in us; that is, the other traffic that went ahead of it.
+ */
+static double bench_control(struct spidev_data *spidev, struct mock_fpga *fpga,
+        const char *name, bool urgent, unsigned n_ops, double page_us,
+        double own_us)
+{
+    s64         *lat = calloc(n_ops, sizeof(s64));
+    s64         *bus = calloc(n_ops, sizeof(s64));
+    struct timespec gap = { 0, 0 };
+    double      bus_p99 = -1;
+    u32         val;
+    unsigned    i;
+    ktime_t     t0;
+    u64         b0;
+
+    if (!lat || !bus)
+        goto out;
+    for (i = 0; i < n_ops; i++) {
+        val = i;
+        b0 = atomic64_read(&fpga->bus_ns);
+        t0 = ktime_get();
+        bench_write(spidev, BENCH_ADDR - FPGA_WORD_BYTES, &val, sizeof(val),
+                urgent);
+        lat[i] = ktime_get() - t0;
+        bus[i] = atomic64_read(&fpga->bus_ns) - b0 - (s64)(own_us * 1e3);
+        gap.tv_nsec = page_us * (500 + rand() % 2000);
+        nanosleep(&gap, NULL);
+    }
+    qsort(lat, n_ops, sizeof(s64), cmp_s64);
+    qsort(bus, n_ops, sizeof(s64), cmp_s64);
+    bus_p99 = bus[(n_ops * 99) / 100] / 1e3;
+    printf("%-16s p50 %8.1f us  p99 %8.1f us  max %8.1f us  bus p99 %8.1f us\n",
+            name, lat[n_ops / 2] / 1e3, lat[(n_ops * 99) / 100] / 1e3,
+            lat[n_ops - 1] / 1e3, bus_p99);
+out:
+    free(lat);
+    free(bus);
+    return bus_p99;
+}
+
+static int bench_fairness(struct spidev_data *spidev, struct mock_fpga *fpga,
+        size_t bytes, unsigned n_ops)
+{
+    struct bulk_ctx ctx[FAIR_BULK_THREADS];
+    unsigned    per_page = spifpga_transfers_per_page(spidev), i;
+    double      page_us, own, urgent, normal;
+    unsigned long reads = 0;
+    pthread_t   bulk[FAIR_BULK_THREADS];
+
+    fpga->realtime = true;
+    if (spidev->proto == SPIFPGA_PROTO_BURST) {
+        per_page = spifpga_words_per_burst(spidev);
+        page_us = (fpga->msg_ns + fpga->xfer_ns + (per_page *
+                FPGA_WORD_BYTES + FPGA_BURST_OVERHEAD) * 8 * 1e9 / fpga->hz) / 1e3;
+    } else {
+        page_us = (fpga->msg_ns + per_page * (fpga->xfer_ns +
+                sizeof(struct fpga_data) * 8 * 1e9 / fpga->hz)) / 1e3;
+    }
+    printf("%u threads of bulk %zu bytes, %u words per page, one page %.1f us on the bus\n",
+            FAIR_BULK_THREADS, bytes, per_page, page_us);
+
+    /* on an idle bus, all of it is the write's own */
+    own = bench_control(spidev, fpga, "idle", true, n_ops, page_us, 0);
+
+    for (i = 0; i < FAIR_BULK_THREADS; i++) {
+        ctx[i] = (struct bulk_ctx){ spidev, bytes, false, 0 };
+        pthread_create(&bulk[i], NULL, bulk_thread, &ctx[i]);
+    }
+    urgent = bench_control(spidev, fpga, "bulk + urgent", true, n_ops,
+            page_us, own);
+    normal = bench_control(spidev, fpga, "bulk + normal", false, n_ops,
+            page_us, own);
+    for (i = 0; i < FAIR_BULK_THREADS; i++) {
+        ctx[i].stop = true;
+        pthread_join(bulk[i], NULL);
+        reads += ctx[i].n;
+    }
+    if (own < 0 || urgent < 0 || normal < 0)
+        return 1;
+
+    /*
+     * Wall clock latency also carries the host's scheduling, so the bound
+     * is checked on the modelled bus: an urgent write lets at most the one
+     * page already holding buf_lock go ahead of it.
+     */
+    printf("%lu bulk reads completed alongside\n", reads);
+    printf("bulk bus time ahead of a control write, p99: urgent %.1f us (bound: one page, %.1f us), normal %.1f us\n",
+            urgent, page_us, normal);
+    /* within a microsecond, for the rounding of page_us */
+    printf("bound: %s\n", urgent < page_us + 1 ? "ok" : "EXCEEDED");
+    return urgent < page_us + 1 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct mock_fpga fpga;
+    struct spi_device spi = { &fpga };
+    struct spidev_data spidev;
+    size_t      bytes = 1 << 20;
+    unsigned    iterations = 1;
+    bool        realtime = false, fairness = false, stream = false, set_bufsiz = false;
+    bool        legacy = false;
+    size_t      window = 0, wc_size = 0, max_transfer = 0, max_message = 0;
+    u32         hz = 0, xfer_ns = 0, msg_ns = 0;
+    int         c;
+
+    while ((c = getopt(argc, argv, "n:i:b:s:x:m:rfa:w:cLt:l:")) != -1)
+        switch (c) {
+        case 'n':
+            bytes = strtoul(optarg, NULL, 0) & ~(size_t)(FPGA_WORD_BYTES - 1);
+            break;
+        case 'i':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            bufsiz = strtoul(optarg, NULL, 0);
+            set_bufsiz = true;
+            break;
+        case 's':
+            hz = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            xfer_ns = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            msg_ns = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            realtime = true;
+            break;
+        case 'f':
+            fairness = true;
+            break;
+        case 'a':
+            window = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            wc_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            stream = true;
+            break;
+        case 'L':
+            legacy = true;
+            break;
+        case 't':
+            max_transfer = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            max_message = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            printf("Usage: spifpga_bench [-n bytes] [-i iterations] [-b bufsiz] [-s hz] [-x xfer_ns] [-m msg_ns] [-r] [-f] [-a window] [-w size] [-c] [-L] [-t max_transfer] [-l max_message]\n");
+            return 1;
+        }
+
+    if (fairness && !set_bufsiz)
+        bufsiz = FAIR_BUFSIZ;
+    if (bytes == 0 || iterations == 0) {
+        printf("nothing to do\n");
+        return 1;
+    }
+    if (mock_fpga_init(&fpga, 2 * bytes + (1 << 20))) {
+        printf("Failed to set up the mock device\n");
+        return 1;
+    }
+    fpga.max_transfer_size = max_transfer;
+    fpga.max_message_size = max_message;
+    if (bench_dev_init(&spidev, &spi)) {
+        printf("Failed to set up the mock device\n");
+        return 1;
+    }
+    if (hz)
+        fpga.hz = hz;
+    if (xfer_ns)
+        fpga.xfer_ns = xfer_ns;
+    if (msg_ns)
+        fpga.msg_ns = msg_ns;
+    fpga.realtime = realtime;
+    fpga.legacy = legacy;
+    /* stream mode only applies to frames, so compare on gateware without bursts */
+    fpga.no_burst = stream;
+
+    printf("mock: %u Hz, %u ns/transfer, %u ns/message, page %zu bytes%s, %s\n",
+            fpga.hz, fpga.xfer_ns, fpga.msg_ns, spifpga_page_bytes(&spidev),
+            realtime ? ", realtime" : "",
+            spifpga_probe_proto(&spidev) == SPIFPGA_PROTO_BURST ?
+            "burst protocol" : "frame protocol");
+
+    if (fairness)
+        return bench_fairness(&spidev, &fpga, bytes, 200);
+    if (window)
+        return bench_small_reads(&spidev, &fpga, bytes, window);
+    if (wc_size)
+        return bench_small_writes(&spidev, &fpga, bytes, wc_size);
+    if (stream)
+        return bench_stream(&spidev, &fpga, bytes, iterations);
+    return bench_throughput(&spidev, &fpga, bytes, iterations);
+}
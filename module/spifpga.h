@@ -0,0 +1,245 @@
+/*
+ * include/linux/spi/spifpga.h
+ *
+ * Userspace API for the /dev/spifpgaB.C register access minors.
+ * The /dev/spidevB.C minors keep the plain spidev API from spidev.h.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SPIFPGA_H
+#define SPIFPGA_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* IOCTL commands */
+
+#define SPIFPGA_IOC_MAGIC           'f'
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ * Submission/completion ring.
+ *
+ * SPIFPGA_IOC_RING_SETUP sizes the ring, and the whole thing is then mapped
+ * with mmap(fd, offset 0, ring_bytes). The mapping starts with a
+ * struct spifpga_ring_hdr; the submission entries, completion entries and
+ * payload slots follow at the offsets it gives.
+ *
+ * Userspace fills sqes[sq_tail & sq_mask], then publishes it by advancing
+ * sq_tail (store-release). The driver's worker consumes entries, moves
+ * payload words between the data area and the FPGA, and posts a cqe for
+ * each one by advancing cq_tail. Userspace consumes cqes by advancing
+ * cq_head. While the worker is idle SPIFPGA_RING_NEED_WAKEUP is set in
+ * flags, and new entries need a SPIFPGA_IOC_RING_ENTER doorbell; otherwise
+ * no syscall is needed at all.
+ */
+#define SPIFPGA_OP_NOP              0
+#define SPIFPGA_OP_READ             1   /* FPGA -> data[slot .. slot+len) */
+#define SPIFPGA_OP_WRITE            2   /* data[slot .. slot+len) -> FPGA */
+
+#define SPIFPGA_RING_NEED_WAKEUP    (1 << 0)
+
+struct spifpga_sqe {
+    __u8        op;
+    __u8        flags;
+    __u16       rsvd;
+    __u32       addr;       /* FPGA byte address of the first word */
+    __u32       len;        /* words */
+    __u32       slot;       /* word offset of the payload in the data area */
+    __u64       user_data;  /* passed back in the cqe */
+};
+
+struct spifpga_cqe {
+    __u64       user_data;
+    __s32       res;        /* words transferred, or -errno */
+    __u8        resp;       /* OR of the FPGA response codes */
+    __u8        rsvd[3];
+};
+
+struct spifpga_ring_hdr {
+    __u32       sq_head;    /* driver */
+    __u32       sq_tail;    /* user */
+    __u32       sq_mask;
+    __u32       cq_head;    /* user */
+    __u32       cq_tail;    /* driver */
+    __u32       cq_mask;
+    __u32       flags;      /* driver, SPIFPGA_RING_* */
+    __u32       cq_overflow;
+    __u32       sqes_off;   /* byte offsets from the start of the mapping */
+    __u32       cqes_off;
+    __u32       data_off;
+    __u32       data_words;
+};
+
+struct spifpga_ring_params {
+    __u32       sq_entries; /* in: requested, out: rounded up to 2^n */
+    __u32       cq_entries; /* out: 2 * sq_entries */
+    __u32       data_words; /* in/out: payload area in 32 bit words */
+    __u32       ring_bytes; /* out: length to mmap */
+};
+
+/* Create the ring for this open file */
+#define SPIFPGA_IOC_RING_SETUP      _IOWR(SPIFPGA_IOC_MAGIC, 1, struct spifpga_ring_params)
+/* Doorbell. Kicks the worker, then waits until arg completions are
+ * available (by value, 0 to not wait)
+ */
+#define SPIFPGA_IOC_RING_ENTER      _IO(SPIFPGA_IOC_MAGIC, 2)
+/* Signal the eventfd passed by value on every batch of completions,
+ * -1 to detach
+ */
+#define SPIFPGA_IOC_RING_EVENTFD    _IO(SPIFPGA_IOC_MAGIC, 3)
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ * FPGA interrupt.
+ *
+ * If the device tree node has an interrupt (or an irq-gpios line), each
+ * interrupt counts as an event, and the spifpga file polls readable while
+ * there are events it hasn't waited for yet. SPIFPGA_IOC_EVENT_WAIT blocks
+ * for the next event, and reads the registers chosen with
+ * SPIFPGA_IOC_EVENT_REGS in the same spi_message before returning, so a
+ * status/FIFO-count pair is always sampled together right after the wakeup.
+ * SPIFPGA_IOC_EVENT_TRIGGER raises an event from software, for boards
+ * without the interrupt wired and for testing.
+ */
+#define SPIFPGA_EVENT_MAX_REGS      8
+
+struct spifpga_event_regs {
+    __u32       n;          /* 0 .. SPIFPGA_EVENT_MAX_REGS */
+    __u32       addr[SPIFPGA_EVENT_MAX_REGS];
+};
+
+struct spifpga_event_wait {
+    __u32       timeout_ms; /* in: 0 waits forever */
+    __u32       events;     /* out: events since the last wait */
+    __u32       n;          /* out: registers read */
+    __u8        resp;       /* out: OR of the FPGA response codes */
+    __u8        rsvd[3];
+    __u32       val[SPIFPGA_EVENT_MAX_REGS];
+};
+
+#define SPIFPGA_IOC_EVENT_REGS      _IOW(SPIFPGA_IOC_MAGIC, 4, struct spifpga_event_regs)
+#define SPIFPGA_IOC_EVENT_WAIT      _IOWR(SPIFPGA_IOC_MAGIC, 5, struct spifpga_event_wait)
+#define SPIFPGA_IOC_EVENT_TRIGGER   _IO(SPIFPGA_IOC_MAGIC, 6)
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ * Scheduling priority of an open file, by value. Bulk transfers give up the
+ * bus between pages while urgent requests are waiting; requests that fit in
+ * one page are always urgent, SPIFPGA_PRIO_HIGH makes everything on the
+ * file urgent.
+ */
+#define SPIFPGA_PRIO_NORMAL         0
+#define SPIFPGA_PRIO_HIGH           1
+
+#define SPIFPGA_IOC_SET_PRIO        _IO(SPIFPGA_IOC_MAGIC, 7)
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ * Readahead for small sequential reads, per open file and off by default.
+ * SPIFPGA_IOC_RA_WINDOW takes the largest window in bytes by value (0 turns
+ * readahead off). Once two reads in a row are sequential, the driver reads
+ * an aligned window in one burst and serves the following reads from it,
+ * doubling the window on every refill up to that size. Writes, and seeks
+ * outside the window, drop it. Registers that change on their own must be
+ * listed with SPIFPGA_IOC_RA_VOLATILE (len 0 clears the list); they are
+ * never read ahead.
+ */
+#define SPIFPGA_RA_MAX_REGIONS      16
+
+struct spifpga_region {
+    __u32       addr;
+    __u32       len;        /* bytes */
+};
+
+#define SPIFPGA_IOC_RA_WINDOW       _IO(SPIFPGA_IOC_MAGIC, 8)
+#define SPIFPGA_IOC_RA_VOLATILE     _IOW(SPIFPGA_IOC_MAGIC, 9, struct spifpga_region)
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ * Write combining, per open file and off by default. SPIFPGA_IOC_WC_SIZE
+ * takes the buffer size in bytes by value (0 flushes and turns it off).
+ * Contiguous writes are then collected and sent as one burst when the
+ * buffer fills, when a write does not follow on from the previous one, and
+ * before a read, a ring doorbell or an event wait on the same file, on
+ * fsync() and on close().
+ *
+ * A write() that was buffered returns its full length. If the flush that
+ * later sends it fails, the buffered data is dropped and the error is
+ * returned by the next read(), write(), fsync() or close() on that file,
+ * and only once; so check fsync() or close() to know it all arrived.
+ */
+#define SPIFPGA_IOC_WC_SIZE         _IO(SPIFPGA_IOC_MAGIC, 10)
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ * Frame streaming, per device. Normally every 14 byte frame is its own
+ * spi_transfer with a chipselect toggle in between. Gateware that splits
+ * frames by byte count can instead take a whole page as one transfer under
+ * a single chipselect, which saves the per-transfer controller setup and
+ * chipselect time on every frame. SPIFPGA_IOC_SET_STREAM by value: 1 probes
+ * the FPGA (a read of address arg 0 as a stream, compared with the same
+ * read framed the old way) and only switches if it answers correctly, so
+ * old gateware fails with EOPNOTSUPP and stays as it was; 0 switches back.
+ * The setting is shared by every open file of the device.
+ */
+#define SPIFPGA_IOC_SET_STREAM      _IO(SPIFPGA_IOC_MAGIC, 11)
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ * Wire protocol. Gateware that has a capability register (see the cap_addr
+ * module parameter) and sets its burst bit gets bulk reads and writes as
+ * burst frames: a 9 byte header (cmd, start address, word count), the
+ * words, and a status byte, so a whole page moves with 10 bytes of
+ * overhead instead of 10 per word. Anything else keeps the 14 byte frame
+ * per word. The register is read before the first transfer after the
+ * device is opened; SPIFPGA_IOC_PROTO reads it again (after loading new
+ * gateware, say) and returns the SPIFPGA_PROTO_* now in use.
+ */
+#define SPIFPGA_PROTO_FRAMES        0
+#define SPIFPGA_PROTO_BURST         1
+
+/*
+ * The burst header's command byte, the same for the driver, the user
+ * library and both simulators: the frame's read/write bit and byte
+ * enables, plus 0x40 for a burst.
+ */
+#define SPIFPGA_CMD_BURST_READ      0x4F
+#define SPIFPGA_CMD_BURST_WRITE     0xCF
+
+#define SPIFPGA_IOC_PROTO           _IO(SPIFPGA_IOC_MAGIC, 12)
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ * Transfer limits of a device, as the driver found them when it bound to
+ * it. A page (the frames, or the burst, sent as one spi_message) is never
+ * bigger than page_bytes, the smallest of the bufsiz module parameter and
+ * the controller's largest transfer and message. Works on both minors, so
+ * spidev users can size their own SPI_IOC_MESSAGEs by it too.
+ */
+struct spifpga_limits {
+    __u32       bufsiz;
+    __u32       max_transfer_size;  /* controller, ~0 if unlimited */
+    __u32       max_message_size;   /* controller, ~0 if unlimited */
+    __u32       page_bytes;
+    __u32       frames_per_page;
+    __u32       words_per_burst;
+    __u32       max_speed_hz;
+    __s32       proto;              /* SPIFPGA_PROTO_*, -1 not probed yet */
+};
+
+#define SPIFPGA_IOC_GET_LIMITS      _IOR(SPIFPGA_IOC_MAGIC, 13, struct spifpga_limits)
+
+#endif /* SPIFPGA_H */
@@ -0,0 +1,985 @@
+/*
+ * Protocol and paging core of the spifpga driver, see spifpga_core.h.
+ *
+ * Copyright (C) 2006 SWAPP
+ *  Andrea Paterniani <a.paterniani@swapp-eng.it>
+ * Copyright (C) 2007 David Brownell (simplification, cleanup)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifdef __KERNEL__
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/jiffies.h>
+#include <linux/uaccess.h>
+#endif
+
+#include "spifpga_core.h"
+#include "spifpga_trace.h"
+
+unsigned int bufsiz = 2048;
+module_param(bufsiz, uint, S_IRUGO);
+MODULE_PARM_DESC(bufsiz, "data bytes in biggest supported SPI message");
+
+unsigned int cap_addr = 0xfffffffc;
+module_param(cap_addr, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cap_addr, "address of the FPGA capability register");
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Statistics. They are kept per device with atomics so that the hot paths
+ * never take a lock for them, and are shown in debugfs by spifpga_main.c.
+ * Histograms are log2: bucket 0 counts zeros, bucket k counts values in
+ * [2^(k-1), 2^k).
+ */
+void spifpga_stats_hist(atomic64_t *hist, u64 val)
+{
+    unsigned    bucket = val ? ilog2(val) + 1 : 0;
+
+    atomic64_inc(&hist[min_t(unsigned, bucket, SPIFPGA_HIST_BUCKETS - 1)]);
+}
+
+/* Take buf_lock, accounting for the time spent waiting on it */
+void spidev_lock(struct spidev_data *spidev)
+{
+    ktime_t     start = ktime_get();
+    u64         wait_ns;
+
+    mutex_lock(&spidev->buf_lock);
+    wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    atomic64_inc(&spidev->stats.lock_acquired);
+    atomic64_add(wait_ns, &spidev->stats.lock_wait_ns);
+    trace_spifpga_lock_acquire(spidev, wait_ns);
+}
+
+/* Count the frames of a page that has been sent, and their resp codes */
+void spifpga_stats_page(struct spidev_data *spidev,
+        const struct spifpga_page *pg)
+{
+    unsigned    i;
+
+    atomic64_add(pg->n, &spidev->stats.frames);
+    atomic64_add(pg->n * FPGA_WORD_BYTES, &spidev->stats.payload_bytes);
+    for (i = 0; i < pg->n; i++)
+        atomic64_inc(&spidev->stats.resp[pg->frsp[i].resp]);
+}
+
+void spifpga_stats_request(struct spidev_data *spidev, unsigned pages)
+{
+    atomic64_inc(&spidev->stats.requests);
+    atomic64_add(pages, &spidev->stats.pages);
+    spifpga_stats_hist(spidev->stats.pages_hist, pages);
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * We can't use the standard synchronous wrappers for file I/O; we
+ * need to protect against async removal of the underlying spi_device.
+ */
+
+static void spidev_complete(void *arg)
+{
+    complete(arg);
+}
+
+ssize_t
+spidev_sync(struct spidev_data *spidev, struct spi_message *message)
+{
+    DECLARE_COMPLETION_ONSTACK(done);
+    ktime_t start = ktime_get();
+    int status;
+
+    message->complete = spidev_complete;
+    message->context = &done;
+
+    trace_spifpga_page_submit(spidev, message);
+    spin_lock_irq(&spidev->spi_lock);
+    if (spidev->spi == NULL)
+        status = -ESHUTDOWN;
+    else
+        status = spi_async(spidev->spi, message);
+    spin_unlock_irq(&spidev->spi_lock);
+
+    if (status == 0) {
+        wait_for_completion(&done);
+        status = message->status;
+        if (status == 0)
+            status = message->actual_length;
+    }
+    trace_spifpga_page_complete(spidev, message, status);
+
+    atomic64_inc(&spidev->stats.messages);
+    if (status < 0)
+        atomic64_inc(&spidev->stats.errors);
+    else
+        atomic64_add(status, &spidev->stats.wire_bytes);
+    spifpga_stats_hist(spidev->stats.sync_us_hist,
+            ktime_us_delta(ktime_get(), start));
+    return status;
+}
+
+ssize_t
+spidev_sync_write(struct spidev_data *spidev, size_t len)
+{
+    struct spi_transfer t = {
+            .tx_buf     = spidev->buffer,
+            .len        = len,
+        };
+    struct spi_message  m;
+
+    spi_message_init(&m);
+    spi_message_add_tail(&t, &m);
+    return spidev_sync(spidev, &m);
+}
+
+ssize_t
+spidev_sync_read(struct spidev_data *spidev, size_t len)
+{
+    struct spi_transfer t = {
+            .rx_buf     = spidev->buffer,
+            .len        = len,
+        };
+    struct spi_message  m;
+
+    spi_message_init(&m);
+    spi_message_add_tail(&t, &m);
+    return spidev_sync(spidev, &m);
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Pages are sized to the smallest of bufsiz and what the controller takes
+ * in one transfer (stream mode and bursts send a page as a single transfer)
+ * and in one message, so a page is never refused with EMSGSIZE.
+ */
+void spifpga_update_limits(struct spidev_data *spidev)
+{
+    struct spi_device   *spi = spidev->spi;
+
+    spidev->max_message_size = spi_max_message_size(spi);
+    spidev->max_transfer_size = spi_max_transfer_size(spi);
+    spidev->page_bytes = min_t(size_t, bufsiz,
+            min_t(size_t, spidev->max_message_size,
+                spidev->max_transfer_size));
+}
+
+size_t spifpga_page_bytes(struct spidev_data *spidev)
+{
+    return spidev->page_bytes ? spidev->page_bytes : bufsiz;
+}
+
+unsigned spifpga_transfers_per_page(struct spidev_data *spidev)
+{
+    return max_t(unsigned,
+            spifpga_page_bytes(spidev) / sizeof(struct fpga_data), 1);
+}
+
+int spifpga_page_alloc(struct spidev_data *spidev, struct spifpga_page *pg,
+        size_t n_transfers)
+{
+    pg->max = min_t(size_t, n_transfers, spifpga_transfers_per_page(spidev));
+    pg->n = 0;
+    pg->fcmd = kcalloc(pg->max, sizeof(*pg->fcmd), GFP_KERNEL);
+    pg->frsp = kcalloc(pg->max, sizeof(*pg->frsp), GFP_KERNEL);
+    pg->t = kcalloc(pg->max, sizeof(*pg->t), GFP_KERNEL);
+    pg->words = kcalloc(pg->max, sizeof(*pg->words), GFP_KERNEL);
+    if (!pg->fcmd || !pg->frsp || !pg->t || !pg->words) {
+        spifpga_page_free(pg);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void spifpga_page_free(struct spifpga_page *pg)
+{
+    kfree(pg->t);
+    kfree(pg->fcmd);
+    kfree(pg->frsp);
+    kfree(pg->words);
+}
+
+void spifpga_page_reset(struct spifpga_page *pg)
+{
+    spi_message_init(&pg->msg);
+    pg->n = 0;
+}
+
+/* Queue one frame on the page. The caller fills in fcmd->dout for writes.
+ * The response frame is always captured, for the resp code.
+ */
+struct fpga_data *
+spifpga_page_add(struct spifpga_page *pg, u8 cmd, u32 addr)
+{
+    struct fpga_data    *fcmd = &pg->fcmd[pg->n];
+    struct spi_transfer *t = &pg->t[pg->n];
+
+    fcmd->cmd  = cmd;
+    fcmd->addr = addr;
+    fcmd->din  = 0; // dummy bytes whilst slave sends data back
+    fcmd->dout = 0;
+    fcmd->resp = 0;
+
+    memset(t, 0, sizeof(*t));
+    t->len = sizeof(struct fpga_data);
+    t->tx_buf = fcmd;
+    t->rx_buf = &pg->frsp[pg->n];
+    t->cs_change = 1;
+    spi_message_add_tail(t, &pg->msg);
+
+    pg->n++;
+    return fcmd;
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Scheduling between users of a device. Bulk requests take buf_lock one
+ * page at a time, and before each page they step aside while any urgent
+ * request is waiting for the lock, handing it straight back if they got it
+ * while one was queued, so an urgent request waits for at most the page in
+ * flight rather than a whole bulk transfer. Requests
+ * that fit in a single page, spidev ioctls, event waits, and everything on
+ * a file set to SPIFPGA_PRIO_HIGH are urgent. A bulk request never defers
+ * for longer than prio_max_defer_us per page, so it can't be starved.
+ */
+static unsigned int prio_max_defer_us = 10000;
+module_param(prio_max_defer_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(prio_max_defer_us, "longest a bulk page waits for urgent requests");
+
+void spifpga_lock_page(struct spidev_data *spidev, bool urgent)
+{
+    u64         end, now;
+
+    if (urgent) {
+        atomic_inc(&spidev->urgent);
+        spidev_lock(spidev);
+        if (atomic_dec_and_test(&spidev->urgent))
+            wake_up(&spidev->urgent_wait);
+        return;
+    }
+
+    end = ktime_get_ns() + prio_max_defer_us * 1000ULL;
+    for (;;) {
+        now = ktime_get_ns();
+        if (atomic_read(&spidev->urgent) && now < end)
+            wait_event_timeout(spidev->urgent_wait,
+                    atomic_read(&spidev->urgent) == 0,
+                    usecs_to_jiffies((end - now) / 1000));
+        spidev_lock(spidev);
+        /* bulk pages already queued on the lock give way too */
+        if (!atomic_read(&spidev->urgent) || ktime_get_ns() >= end)
+            return;
+        mutex_unlock(&spidev->buf_lock);
+    }
+}
+
+/*
+ * In stream mode the frames of a page, which sit back to back in fcmd and
+ * frsp, go out as a single transfer under one chipselect, and the FPGA
+ * splits them by byte count. The per-frame transfers built by
+ * spifpga_page_add() are left out of the message.
+ */
+static void spifpga_page_stream(struct spifpga_page *pg)
+{
+    struct spi_transfer *t = &pg->t[0];
+
+    spi_message_init(&pg->msg);
+    memset(t, 0, sizeof(*t));
+    t->len = pg->n * sizeof(struct fpga_data);
+    t->tx_buf = pg->fcmd;
+    t->rx_buf = pg->frsp;
+    spi_message_add_tail(t, &pg->msg);
+}
+
+ssize_t spifpga_send_page(struct spidev_data *spidev,
+        struct spifpga_page *pg, bool urgent)
+{
+    ssize_t     status;
+
+    spifpga_lock_page(spidev, urgent);
+    if (spidev->stream && pg->n > 1)
+        spifpga_page_stream(pg);
+    status = spidev_sync(spidev, &pg->msg);
+    mutex_unlock(&spidev->buf_lock);
+
+    if (status >= 0)
+        spifpga_stats_page(spidev, pg);
+    return status;
+}
+
+/*
+ * Switch stream mode. Before turning it on, read the same word framed both
+ * ways and make sure the FPGA gave the same answer to every frame; gateware
+ * that needs a chipselect per frame answers the first frame of a stream at
+ * best.
+ */
+#define SPIFPGA_STREAM_PROBE_FRAMES 4
+
+int spifpga_set_stream(struct spidev_data *spidev, bool stream)
+{
+    struct spifpga_page pg;
+    struct fpga_data    ref;
+    ssize_t     status;
+    unsigned    i;
+
+    if (!stream) {
+        spidev->stream = false;
+        return 0;
+    }
+    if (spifpga_page_alloc(spidev, &pg, SPIFPGA_STREAM_PROBE_FRAMES))
+        return -ENOMEM;
+
+    spidev_lock(spidev);
+    spidev->stream = false;
+
+    spifpga_page_reset(&pg);
+    spifpga_page_add(&pg, FPGA_CMD_READ, 0);
+    status = spidev_sync(spidev, &pg.msg);
+    ref = pg.frsp[0];
+    if (status >= 0 && (ref.resp == 0 || ref.resp == 0xff))
+        status = -EIO;      /* nothing sensible there at all */
+
+    if (status >= 0) {
+        spifpga_page_reset(&pg);
+        for (i = 0; i < pg.max; i++)
+            spifpga_page_add(&pg, FPGA_CMD_READ, 0);
+        spifpga_page_stream(&pg);
+        memset(pg.frsp, 0, pg.max * sizeof(*pg.frsp));
+        status = spidev_sync(spidev, &pg.msg);
+    }
+    for (i = 0; status >= 0 && i < pg.n; i++)
+        if (pg.frsp[i].resp != ref.resp || pg.frsp[i].din != ref.din)
+            status = -EOPNOTSUPP;
+
+    if (status >= 0)
+        spidev->stream = true;
+    mutex_unlock(&spidev->buf_lock);
+    spifpga_page_free(&pg);
+    return status < 0 ? status : 0;
+}
+
+/*
+ * Bulk reads and writes of n_transfers words starting at addr. The payload
+ * moves a page at a time through copy_out/copy_in, outside buf_lock.
+ * Returns the bytes transferred, or a negative errno if there were none.
+ */
+/*
+ * Burst protocol. Each burst is one transfer of header, payload words and
+ * status, sized to fit a page, and sent with buf_lock held like a page.
+ */
+unsigned spifpga_words_per_burst(struct spidev_data *spidev)
+{
+    size_t      bytes = spifpga_page_bytes(spidev);
+
+    if (bytes <= FPGA_BURST_OVERHEAD + FPGA_WORD_BYTES)
+        return 1;
+    return (bytes - FPGA_BURST_OVERHEAD) / FPGA_WORD_BYTES;
+}
+
+/*
+ * Read the capability register with an ordinary frame, and pick the
+ * protocol. Old gateware answers with plain register contents, which won't
+ * carry the magic.
+ */
+int spifpga_probe_proto(struct spidev_data *spidev)
+{
+    struct spifpga_page pg;
+    int         proto = SPIFPGA_PROTO_FRAMES;
+    u32         cap;
+
+    if (spifpga_page_alloc(spidev, &pg, 1))
+        return -ENOMEM;
+    spifpga_page_reset(&pg);
+    spifpga_page_add(&pg, FPGA_CMD_READ, cap_addr);
+    if (spifpga_send_page(spidev, &pg, true) >= 0) {
+        cap = pg.frsp[0].din;
+        if ((cap & FPGA_CAP_MAGIC_MASK) == FPGA_CAP_MAGIC &&
+                (cap & FPGA_CAP_BURST))
+            proto = SPIFPGA_PROTO_BURST;
+    }
+    spifpga_page_free(&pg);
+
+    spidev->proto = proto;
+    return proto;
+}
+
+static int spifpga_proto(struct spidev_data *spidev)
+{
+    int         proto = READ_ONCE(spidev->proto);
+
+    return proto < 0 ? spifpga_probe_proto(spidev) : proto;
+}
+
+/* Words a page carries in the protocol in use: a burst, or a frame each */
+unsigned spifpga_words_per_page(struct spidev_data *spidev)
+{
+    if (spifpga_proto(spidev) == SPIFPGA_PROTO_BURST)
+        return spifpga_words_per_burst(spidev);
+    return spifpga_transfers_per_page(spidev);
+}
+
+static ssize_t spifpga_burst_xfer(struct spidev_data *spidev, bool write,
+        u32 addr, size_t n_transfers, bool urgent,
+        spifpga_copy_t copy, void *ctx)
+{
+    struct spi_message  msg;
+    struct spi_transfer t;
+    struct fpga_burst_hdr *hdr;
+    u8          *tx, *rx;
+    size_t      done = 0, want, copied, per_burst = spifpga_words_per_burst(spidev);
+    ssize_t     status = 0, sync_status;
+    unsigned    pages = 0;
+    u8          resp;
+
+    tx = kzalloc(bufsiz, GFP_KERNEL);
+    rx = kmalloc(bufsiz, GFP_KERNEL);
+    if (!tx || !rx) {
+        status = -ENOMEM;
+        goto out;
+    }
+    hdr = (struct fpga_burst_hdr *)tx;
+
+    while (done < n_transfers) {
+        want = min_t(size_t, per_burst, n_transfers - done);
+        if (write) {
+            copied = copy(ctx, tx + sizeof(*hdr), want * FPGA_WORD_BYTES);
+            if (copied != want * FPGA_WORD_BYTES) {
+                /* send the whole words we got, then fail */
+                want = copied / FPGA_WORD_BYTES;
+                status = -EFAULT;
+                if (!want)
+                    break;
+            }
+        }
+        hdr->cmd = write ? FPGA_CMD_BURST_WRITE : FPGA_CMD_BURST_READ;
+        hdr->addr = addr + FPGA_WORD_BYTES * done;
+        hdr->count = want;
+
+        spi_message_init(&msg);
+        memset(&t, 0, sizeof(t));
+        t.tx_buf = tx;
+        t.rx_buf = rx;
+        t.len = want * FPGA_WORD_BYTES + FPGA_BURST_OVERHEAD;
+        spi_message_add_tail(&t, &msg);
+
+        spifpga_lock_page(spidev, urgent);
+        sync_status = spidev_sync(spidev, &msg);
+        mutex_unlock(&spidev->buf_lock);
+        pages++;
+        if (sync_status < 0) {
+            status = sync_status;
+            break;
+        }
+
+        resp = rx[t.len - 1];
+        atomic64_inc(&spidev->stats.frames);
+        atomic64_inc(&spidev->stats.bursts);
+        atomic64_add(want * FPGA_WORD_BYTES, &spidev->stats.payload_bytes);
+        atomic64_inc(&spidev->stats.resp[resp]);
+
+        if (!write) {
+            copied = copy(ctx, rx + sizeof(*hdr), want * FPGA_WORD_BYTES);
+            if (copied != want * FPGA_WORD_BYTES) {
+                done += copied / FPGA_WORD_BYTES;
+                status = -EFAULT;
+                break;
+            }
+        }
+        done += want;
+        if (status)
+            break;
+    }
+    spifpga_stats_request(spidev, pages);
+
+out:
+    kfree(tx);
+    kfree(rx);
+    if (done == 0)
+        return status;
+    return done * FPGA_WORD_BYTES;
+}
+
+ssize_t spifpga_xfer_read(struct spidev_data *spidev, u32 addr,
+        size_t n_transfers, bool urgent, spifpga_copy_t copy_out, void *ctx)
+{
+    struct spifpga_page pg;
+    size_t      done = 0, copied;
+    ssize_t     status = 0;
+    unsigned    i, pages = 0;
+
+    if (n_transfers == 0)
+        return 0;
+    if (spifpga_proto(spidev) == SPIFPGA_PROTO_BURST)
+        return spifpga_burst_xfer(spidev, false, addr, n_transfers, urgent,
+                copy_out, ctx);
+    if (spifpga_page_alloc(spidev, &pg, n_transfers))
+        return -ENOMEM;
+
+    while (done < n_transfers) {
+        spifpga_page_reset(&pg);
+        while (pg.n < pg.max && done + pg.n < n_transfers)
+            spifpga_page_add(&pg, FPGA_CMD_READ,
+                    addr + FPGA_WORD_BYTES * (done + pg.n));
+
+        status = spifpga_send_page(spidev, &pg, urgent);
+        pages++;
+        if (status < 0)
+            break;
+
+        for (i = 0; i < pg.n; i++)
+            pg.words[i] = pg.frsp[i].din;
+        copied = copy_out(ctx, pg.words, pg.n * FPGA_WORD_BYTES);
+        done += copied / FPGA_WORD_BYTES;
+        if (copied != pg.n * FPGA_WORD_BYTES) {
+            status = -EFAULT;
+            break;
+        }
+    }
+    spifpga_page_free(&pg);
+    spifpga_stats_request(spidev, pages);
+
+    if (done == 0)
+        return status;
+    return done * FPGA_WORD_BYTES;
+}
+
+ssize_t spifpga_xfer_write(struct spidev_data *spidev, u32 addr,
+        size_t n_transfers, bool urgent, spifpga_copy_t copy_in, void *ctx)
+{
+    struct spifpga_page pg;
+    struct fpga_data    *fcmd;
+    size_t      done = 0, want, copied;
+    ssize_t     status = 0;
+    unsigned    i, pages = 0;
+
+    if (n_transfers == 0)
+        return 0;
+    if (spifpga_proto(spidev) == SPIFPGA_PROTO_BURST)
+        return spifpga_burst_xfer(spidev, true, addr, n_transfers, urgent,
+                copy_in, ctx);
+    if (spifpga_page_alloc(spidev, &pg, n_transfers))
+        return -ENOMEM;
+
+    while (done < n_transfers) {
+        want = min_t(size_t, pg.max, n_transfers - done);
+        copied = copy_in(ctx, pg.words, want * FPGA_WORD_BYTES);
+        if (copied != want * FPGA_WORD_BYTES) {
+            /* send the whole words we got, then fail */
+            want = copied / FPGA_WORD_BYTES;
+            status = -EFAULT;
+        }
+
+        spifpga_page_reset(&pg);
+        for (i = 0; i < want; i++) {
+            fcmd = spifpga_page_add(&pg, FPGA_CMD_WRITE,
+                    addr + FPGA_WORD_BYTES * (done + i));
+            fcmd->dout = pg.words[i];
+        }
+
+        if (pg.n) {
+            ssize_t sync_status = spifpga_send_page(spidev, &pg, urgent);
+
+            pages++;
+            if (sync_status < 0) {
+                status = sync_status;
+                break;
+            }
+            done += pg.n;
+        }
+        if (status < 0)
+            break;
+    }
+    spifpga_page_free(&pg);
+    spifpga_stats_request(spidev, pages);
+
+    if (done == 0)
+        return status;
+    return done * FPGA_WORD_BYTES;
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Readahead. Small sequential reads (cat, dd bs=4, Python file iteration)
+ * would otherwise pay a whole message per word. After two sequential reads
+ * in a row, an aligned window around the read is fetched in one burst and
+ * later reads are served from it. The caller serialises access to ra.
+ */
+int spifpga_ra_set_window(struct spifpga_ra *ra, size_t max_bytes)
+{
+    u32         *buf = NULL;
+
+    if (max_bytes > SPIFPGA_RA_MAX_BYTES)
+        return -EINVAL;
+    if (max_bytes >= SPIFPGA_RA_MIN_WORDS * FPGA_WORD_BYTES) {
+        /* windows are aligned to their size */
+        max_bytes = 1UL << ilog2(max_bytes);
+        buf = kmalloc(max_bytes, GFP_KERNEL);
+        if (!buf)
+            return -ENOMEM;
+    }
+
+    kfree(ra->buf);
+    ra->buf = buf;
+    ra->max_words = buf ? max_bytes / FPGA_WORD_BYTES : 0;
+    ra->window = SPIFPGA_RA_MIN_WORDS;
+    ra->seq = 0;
+    spifpga_ra_invalidate(ra);
+    return 0;
+}
+
+int spifpga_ra_add_volatile(struct spifpga_ra *ra, u32 addr, u32 len)
+{
+    if (len == 0) {
+        ra->n_volatile = 0;
+        return 0;
+    }
+    if (ra->n_volatile == SPIFPGA_RA_MAX_REGIONS)
+        return -ENOSPC;
+
+    ra->volatile_regions[ra->n_volatile].addr = addr;
+    ra->volatile_regions[ra->n_volatile].len = len;
+    ra->n_volatile++;
+    spifpga_ra_invalidate(ra);
+    return 0;
+}
+
+void spifpga_ra_invalidate(struct spifpga_ra *ra)
+{
+    ra->valid = 0;
+}
+
+bool spifpga_ra_covers(const struct spifpga_ra *ra, u32 addr)
+{
+    return ra->valid && addr >= ra->base &&
+        addr - ra->base < ra->valid * FPGA_WORD_BYTES;
+}
+
+static size_t spifpga_copy_to_buf(void *ctx, void *words, size_t bytes)
+{
+    u32         **dst = ctx;
+
+    memcpy(*dst, words, bytes);
+    *dst += bytes / FPGA_WORD_BYTES;
+    return bytes;
+}
+
+/*
+ * Refill the window so that it covers [addr, addr + 4 * want). The window
+ * is aligned to its own size, unless that would take in a volatile region,
+ * in which case it starts at addr and stops short of the next one.
+ */
+static int spifpga_ra_fill(struct spidev_data *spidev, struct spifpga_ra *ra,
+        u32 addr, size_t want, bool urgent)
+{
+    size_t      words = min_t(size_t, ra->window, ra->max_words);
+    u32         base = addr & ~(u32)(words * FPGA_WORD_BYTES - 1);
+    u64         end, want_end = (u64)addr + want * FPGA_WORD_BYTES;
+    const struct spifpga_region *r;
+    u32         *dst = ra->buf;
+    ssize_t     status;
+    unsigned    i;
+
+    if (want_end > (u64)base + words * FPGA_WORD_BYTES)
+        base = addr;
+    end = (u64)base + words * FPGA_WORD_BYTES;
+
+    for (i = 0, r = ra->volatile_regions; i < ra->n_volatile; i++, r++) {
+        u64 r_end = (u64)r->addr + r->len;
+
+        if (r->addr >= end || r_end <= base)
+            continue;
+        if (r->addr < want_end && r_end > addr)
+            return -EAGAIN;     /* the read itself is volatile */
+        if (r_end <= addr)
+            base = addr;
+        else
+            end = r->addr;
+    }
+    if (end > (u64)base + words * FPGA_WORD_BYTES)
+        end = (u64)base + words * FPGA_WORD_BYTES;
+    if (end < want_end)
+        return -EAGAIN;
+
+    spifpga_ra_invalidate(ra);
+    status = spifpga_xfer_read(spidev, base,
+            (end - base) / FPGA_WORD_BYTES, urgent, spifpga_copy_to_buf, &dst);
+    if (status <= 0)
+        return status ? status : -EIO;
+
+    ra->base = base;
+    ra->valid = status / FPGA_WORD_BYTES;
+    ra->window = min_t(size_t, ra->window * 2, ra->max_words);
+    return spifpga_ra_covers(ra, addr) ? 0 : -EAGAIN;
+}
+
+ssize_t spifpga_ra_read(struct spidev_data *spidev, struct spifpga_ra *ra,
+        u32 addr, size_t n_transfers, bool urgent,
+        spifpga_copy_t copy_out, void *ctx)
+{
+    size_t      done = 0, off, n, copied;
+    ssize_t     status = 0;
+    u32         a;
+
+    if (!ra->buf)
+        return spifpga_xfer_read(spidev, addr, n_transfers, urgent,
+                copy_out, ctx);
+
+    if (addr == ra->next) {
+        ra->seq++;
+    } else {
+        ra->seq = 0;
+        ra->window = SPIFPGA_RA_MIN_WORDS;
+    }
+
+    while (done < n_transfers) {
+        a = addr + FPGA_WORD_BYTES * done;
+
+        if (spifpga_ra_covers(ra, a)) {
+            off = (a - ra->base) / FPGA_WORD_BYTES;
+            n = min_t(size_t, n_transfers - done, ra->valid - off);
+            copied = copy_out(ctx, ra->buf + off, n * FPGA_WORD_BYTES);
+            done += copied / FPGA_WORD_BYTES;
+            if (copied != n * FPGA_WORD_BYTES) {
+                status = -EFAULT;
+                break;
+            }
+            continue;
+        }
+
+        /* big or random reads go straight to the device */
+        if (ra->seq == 0 || n_transfers - done >= ra->window ||
+                spifpga_ra_fill(spidev, ra, a, n_transfers - done, urgent)) {
+            status = spifpga_xfer_read(spidev, a, n_transfers - done, urgent,
+                    copy_out, ctx);
+            if (status > 0)
+                done += status / FPGA_WORD_BYTES;
+            break;
+        }
+    }
+
+    ra->next = addr + FPGA_WORD_BYTES * done;
+    if (done == 0)
+        return status;
+    return done * FPGA_WORD_BYTES;
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Write combining. Streams of small contiguous writes are collected in a
+ * per-open buffer and sent as one burst. Flushes that happen behind the
+ * writer's back (buffer full) leave their error in wc->error, and the next
+ * call on the file reports it; see spifpga.h. The caller serialises access.
+ */
+static size_t spifpga_copy_from_buf(void *ctx, void *words, size_t bytes)
+{
+    u32         **src = ctx;
+
+    memcpy(words, *src, bytes);
+    *src += bytes / FPGA_WORD_BYTES;
+    return bytes;
+}
+
+/* Sends whatever is buffered. Fails, and drops the data, on a short write. */
+int spifpga_wc_flush(struct spidev_data *spidev, struct spifpga_wc *wc)
+{
+    u32         *src = wc->buf;
+    size_t      n = wc->n;
+    ssize_t     status;
+
+    if (!n)
+        return 0;
+    wc->n = 0;
+    status = spifpga_xfer_write(spidev, wc->base, n,
+            n <= spifpga_words_per_page(spidev), spifpga_copy_from_buf, &src);
+    if (status < 0)
+        return status;
+    return status == n * FPGA_WORD_BYTES ? 0 : -EIO;
+}
+
+/* Returns, and clears, the error of an earlier background flush */
+int spifpga_wc_error(struct spifpga_wc *wc)
+{
+    int         error = wc->error;
+
+    wc->error = 0;
+    return error;
+}
+
+int spifpga_wc_set_size(struct spidev_data *spidev, struct spifpga_wc *wc,
+        size_t max_bytes)
+{
+    u32         *buf = NULL;
+    int         status;
+
+    if (max_bytes > SPIFPGA_WC_MAX_BYTES)
+        return -EINVAL;
+    if (max_bytes >= FPGA_WORD_BYTES) {
+        buf = kmalloc(max_bytes, GFP_KERNEL);
+        if (!buf)
+            return -ENOMEM;
+    }
+
+    status = spifpga_wc_flush(spidev, wc);
+    if (!status)
+        status = spifpga_wc_error(wc);
+    kfree(wc->buf);
+    wc->buf = buf;
+    wc->max_words = max_bytes / FPGA_WORD_BYTES;
+    return status;
+}
+
+ssize_t spifpga_wc_write(struct spidev_data *spidev, struct spifpga_wc *wc,
+        u32 addr, size_t n_transfers, bool urgent,
+        spifpga_copy_t copy_in, void *ctx)
+{
+    size_t      copied;
+    int         status;
+
+    status = spifpga_wc_error(wc);
+    if (status)
+        return status;
+
+    /* what is buffered must go first, if this one can't join it */
+    if (wc->n && (addr != wc->base + wc->n * FPGA_WORD_BYTES ||
+            wc->n + n_transfers > wc->max_words)) {
+        status = spifpga_wc_flush(spidev, wc);
+        if (status)
+            return status;
+    }
+
+    if (!wc->buf || n_transfers >= wc->max_words)
+        return spifpga_xfer_write(spidev, addr, n_transfers, urgent,
+                copy_in, ctx);
+
+    if (!wc->n)
+        wc->base = addr;
+    copied = copy_in(ctx, wc->buf + wc->n, n_transfers * FPGA_WORD_BYTES);
+    if (copied != n_transfers * FPGA_WORD_BYTES)
+        return -EFAULT;     /* nothing of this write is kept */
+    wc->n += n_transfers;
+
+    if (wc->n == wc->max_words)
+        wc->error = spifpga_wc_flush(spidev, wc);
+    return copied;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int spidev_message(struct spidev_data *spidev,
+        struct spi_ioc_transfer *u_xfers, unsigned n_xfers)
+{
+    struct spi_message  msg;
+    struct spi_transfer *k_xfers;
+    struct spi_transfer *k_tmp;
+    struct spi_ioc_transfer *u_tmp;
+    unsigned        n, total;
+    u8          *buf;
+    int         status = -EFAULT;
+    u64         copy_start;
+
+    trace_spifpga_request_start(spidev, SPIFPGA_REQ_MESSAGE, 0, 0);
+    spi_message_init(&msg);
+    k_xfers = kcalloc(n_xfers, sizeof(*k_tmp), GFP_KERNEL);
+    if (k_xfers == NULL) {
+        status = -ENOMEM;
+        goto out;
+    }
+
+    /* Construct spi_message, copying any tx data to bounce buffer.
+     * We walk the array of user-provided transfers, using each one
+     * to initialize a kernel version of the same transfer.
+     */
+    buf = spidev->buffer;
+    total = 0;
+    copy_start = trace_spifpga_copy_in_enabled() ? ktime_get_ns() : 0;
+    for (n = n_xfers, k_tmp = k_xfers, u_tmp = u_xfers;
+            n;
+            n--, k_tmp++, u_tmp++) {
+        k_tmp->len = u_tmp->len;
+
+        total += k_tmp->len;
+        if (total > bufsiz) {
+            status = -EMSGSIZE;
+            goto done;
+        }
+
+        if (u_tmp->rx_buf) {
+            k_tmp->rx_buf = buf;
+            if (!access_ok(VERIFY_WRITE, (u8 __user *)
+                        (uintptr_t) u_tmp->rx_buf,
+                        u_tmp->len))
+                goto done;
+        }
+        if (u_tmp->tx_buf) {
+            k_tmp->tx_buf = buf;
+            if (copy_from_user(buf, (const u8 __user *)
+                        (uintptr_t) u_tmp->tx_buf,
+                    u_tmp->len))
+                goto done;
+        }
+        buf += k_tmp->len;
+
+        k_tmp->cs_change = !!u_tmp->cs_change;
+        k_tmp->bits_per_word = u_tmp->bits_per_word;
+        k_tmp->delay_usecs = u_tmp->delay_usecs;
+        k_tmp->speed_hz = u_tmp->speed_hz;
+#ifdef VERBOSE
+        dev_dbg(&spidev->spi->dev,
+            "  xfer len %zd %s%s%s%dbits %u usec %uHz\n",
+            u_tmp->len,
+            u_tmp->rx_buf ? "rx " : "",
+            u_tmp->tx_buf ? "tx " : "",
+            u_tmp->cs_change ? "cs " : "",
+            u_tmp->bits_per_word ? : spidev->spi->bits_per_word,
+            u_tmp->delay_usecs,
+            u_tmp->speed_hz ? : spidev->spi->max_speed_hz);
+#endif
+        spi_message_add_tail(k_tmp, &msg);
+    }
+    trace_spifpga_copy_in(total, total, copy_start);
+
+    status = spidev_sync(spidev, &msg);
+    if (status < 0)
+        goto done;
+
+    /* copy any rx data out of bounce buffer */
+    buf = spidev->buffer;
+    copy_start = trace_spifpga_copy_out_enabled() ? ktime_get_ns() : 0;
+    for (n = n_xfers, u_tmp = u_xfers; n; n--, u_tmp++) {
+        if (u_tmp->rx_buf) {
+            if (__copy_to_user((u8 __user *)
+                    (uintptr_t) u_tmp->rx_buf, buf,
+                    u_tmp->len)) {
+                status = -EFAULT;
+                goto done;
+            }
+        }
+        buf += u_tmp->len;
+    }
+    trace_spifpga_copy_out(total, total, copy_start);
+    status = total;
+
+done:
+    kfree(k_xfers);
+out:
+    trace_spifpga_request_end(spidev, SPIFPGA_REQ_MESSAGE, 0, status);
+    return status;
+}
@@ -0,0 +1,222 @@
+/*
+ * Protocol and paging core of the spifpga driver.
+ *
+ * Everything between a read/write request and spi_async() lives in
+ * spifpga_core.c: FPGA frame building, paging into bufsiz sized messages,
+ * buf_lock scheduling and statistics. It is built into the module, and
+ * also in userspace against the mock SPI master in mock/ ("make bench"),
+ * so driver changes can be tested and benchmarked without a Pi.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SPIFPGA_CORE_H
+#define SPIFPGA_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/spi/spi.h>
+#include <linux/spi/spidev.h>
+#else
+#include "kcompat.h"
+#include <linux/spi/spidev.h>
+#endif
+
+#include "spifpga.h"
+
+#define SPIFPGA_HIST_BUCKETS    32
+
+/* Only atomic64_t members, so a reset can walk it as an array */
+struct spifpga_stats {
+    atomic64_t  messages;           /* spidev_sync calls */
+    atomic64_t  errors;             /* ... that failed */
+    atomic64_t  wire_bytes;         /* bytes clocked on the bus */
+    atomic64_t  frames;
+    atomic64_t  bursts;             /* burst frames, counted in frames too */
+    atomic64_t  payload_bytes;
+    atomic64_t  requests;           /* spifpga reads and writes */
+    atomic64_t  pages;
+    atomic64_t  lock_acquired;
+    atomic64_t  lock_wait_ns;       /* waiting for buf_lock */
+    atomic64_t  resp[256];          /* frames by FPGA resp code */
+    atomic64_t  pages_hist[SPIFPGA_HIST_BUCKETS];
+    atomic64_t  sync_us_hist[SPIFPGA_HIST_BUCKETS];
+};
+
+struct spidev_data {
+    dev_t               devt;
+    spinlock_t          spi_lock;
+    struct spi_device   *spi;
+    struct list_head    device_entry;
+
+    /* buffer is NULL unless this device is open (users > 0) */
+    struct mutex        buf_lock;
+    unsigned            users;
+    u8                  *buffer;
+
+    /* FPGA interrupt, irq is 0 when only software events are available */
+    int                 irq;
+    atomic_t            events;
+    wait_queue_head_t   event_wait;
+
+    /* urgent requests waiting for buf_lock, see spifpga_lock_page() */
+    atomic_t            urgent;
+    wait_queue_head_t   urgent_wait;
+
+    /* pages go out as one transfer, see SPIFPGA_IOC_SET_STREAM */
+    bool                stream;
+
+    /* SPIFPGA_PROTO_*, or -1 until the capability register is read */
+    int                 proto;
+
+    /* controller limits, see spifpga_update_limits() */
+    size_t              max_transfer_size;
+    size_t              max_message_size;
+    size_t              page_bytes;
+
+    struct spifpga_stats stats;
+    struct dentry       *debugfs;
+};
+
+struct fpga_data {
+    unsigned char cmd;
+    unsigned int addr;
+    unsigned int dout;
+    unsigned int din;
+    unsigned char resp;
+} __attribute__((packed));
+
+#define FPGA_CMD_READ       0x78    /* read, all byte enables = 1 */
+#define FPGA_CMD_WRITE      0xF8    /* write, all byte enables = 1 */
+#define FPGA_WORD_BYTES     4
+
+/*
+ * Burst frame: this header, count words of payload, and a status byte. The
+ * address auto-increments by a word per payload word.
+ */
+struct fpga_burst_hdr {
+    unsigned char cmd;
+    unsigned int addr;
+    unsigned int count;
+} __attribute__((packed));
+
+#define FPGA_CMD_BURST_READ     SPIFPGA_CMD_BURST_READ
+#define FPGA_CMD_BURST_WRITE    SPIFPGA_CMD_BURST_WRITE
+#define FPGA_BURST_OVERHEAD     (sizeof(struct fpga_burst_hdr) + 1)
+
+/* Capability register: magic in the top half, FPGA_CAP_* flags below */
+#define FPGA_CAP_MAGIC          0x53460000
+#define FPGA_CAP_MAGIC_MASK     0xffff0000
+#define FPGA_CAP_BURST          (1 << 0)
+
+/*
+ * FPGA frames are built one spi_transfer per 32 bit word, so that the
+ * chipselect toggles between them. A page is as many frames as fit in
+ * bufsiz bytes, and is sent as a single spi_message.
+ */
+struct spifpga_page {
+    struct spi_message  msg;
+    struct spi_transfer *t;
+    struct fpga_data    *fcmd;
+    struct fpga_data    *frsp;
+    u32                 *words; /* payload of the page, in frame order */
+    unsigned            n;      /* frames queued in msg */
+    unsigned            max;    /* frames allocated */
+};
+
+/*
+ * Moves the payload of one page between the caller and the core, returning
+ * the number of bytes it managed to copy, like copy_to_iter().
+ */
+typedef size_t (*spifpga_copy_t)(void *ctx, void *words, size_t bytes);
+
+/* Per-open readahead state, see SPIFPGA_IOC_RA_WINDOW */
+#define SPIFPGA_RA_MIN_WORDS    16
+#define SPIFPGA_RA_MAX_BYTES    (1 << 20)
+
+struct spifpga_ra {
+    u32                 *buf;       /* NULL while readahead is off */
+    size_t              max_words;
+    size_t              window;     /* words fetched by the next refill */
+    u32                 base;       /* address of buf[0] */
+    size_t              valid;      /* words in buf */
+    u32                 next;       /* where a sequential read would start */
+    unsigned            seq;        /* sequential reads in a row */
+    unsigned            n_volatile;
+    struct spifpga_region volatile_regions[SPIFPGA_RA_MAX_REGIONS];
+};
+
+/* Per-open write combining state, see SPIFPGA_IOC_WC_SIZE */
+#define SPIFPGA_WC_MAX_BYTES    (1 << 20)
+
+struct spifpga_wc {
+    u32                 *buf;       /* NULL while write combining is off */
+    size_t              max_words;
+    u32                 base;       /* address of buf[0] */
+    size_t              n;          /* words buffered */
+    int                 error;      /* from a flush nobody has seen yet */
+};
+
+extern unsigned int bufsiz;
+extern unsigned int cap_addr;
+
+void spifpga_update_limits(struct spidev_data *spidev);
+size_t spifpga_page_bytes(struct spidev_data *spidev);
+unsigned spifpga_transfers_per_page(struct spidev_data *spidev);
+int spifpga_page_alloc(struct spidev_data *spidev, struct spifpga_page *pg,
+        size_t n_transfers);
+void spifpga_page_free(struct spifpga_page *pg);
+void spifpga_page_reset(struct spifpga_page *pg);
+struct fpga_data *spifpga_page_add(struct spifpga_page *pg, u8 cmd, u32 addr);
+
+void spifpga_stats_hist(atomic64_t *hist, u64 val);
+void spifpga_stats_page(struct spidev_data *spidev,
+        const struct spifpga_page *pg);
+void spifpga_stats_request(struct spidev_data *spidev, unsigned pages);
+
+ssize_t spidev_sync(struct spidev_data *spidev, struct spi_message *message);
+ssize_t spidev_sync_write(struct spidev_data *spidev, size_t len);
+ssize_t spidev_sync_read(struct spidev_data *spidev, size_t len);
+int spidev_message(struct spidev_data *spidev,
+        struct spi_ioc_transfer *u_xfers, unsigned n_xfers);
+
+void spidev_lock(struct spidev_data *spidev);
+void spifpga_lock_page(struct spidev_data *spidev, bool urgent);
+ssize_t spifpga_send_page(struct spidev_data *spidev,
+        struct spifpga_page *pg, bool urgent);
+
+int spifpga_set_stream(struct spidev_data *spidev, bool stream);
+unsigned spifpga_words_per_burst(struct spidev_data *spidev);
+unsigned spifpga_words_per_page(struct spidev_data *spidev);
+int spifpga_probe_proto(struct spidev_data *spidev);
+
+ssize_t spifpga_xfer_read(struct spidev_data *spidev, u32 addr,
+        size_t n_transfers, bool urgent, spifpga_copy_t copy_out, void *ctx);
+ssize_t spifpga_xfer_write(struct spidev_data *spidev, u32 addr,
+        size_t n_transfers, bool urgent, spifpga_copy_t copy_in, void *ctx);
+
+int spifpga_ra_set_window(struct spifpga_ra *ra, size_t max_bytes);
+int spifpga_ra_add_volatile(struct spifpga_ra *ra, u32 addr, u32 len);
+void spifpga_ra_invalidate(struct spifpga_ra *ra);
+bool spifpga_ra_covers(const struct spifpga_ra *ra, u32 addr);
+ssize_t spifpga_ra_read(struct spidev_data *spidev, struct spifpga_ra *ra,
+        u32 addr, size_t n_transfers, bool urgent,
+        spifpga_copy_t copy_out, void *ctx);
+
+int spifpga_wc_set_size(struct spidev_data *spidev, struct spifpga_wc *wc,
+        size_t max_bytes);
+int spifpga_wc_flush(struct spidev_data *spidev, struct spifpga_wc *wc);
+int spifpga_wc_error(struct spifpga_wc *wc);
+ssize_t spifpga_wc_write(struct spidev_data *spidev, struct spifpga_wc *wc,
+        u32 addr, size_t n_transfers, bool urgent,
+        spifpga_copy_t copy_in, void *ctx);
+
+#endif /* SPIFPGA_CORE_H */
@@ -0,0 +1,1661 @@
+/*
+ * Simple synchronous userspace interface to SPI devices
+ *
+ * Copyright (C) 2006 SWAPP
+ *  Andrea Paterniani <a.paterniani@swapp-eng.it>
+ * Copyright (C) 2007 David Brownell (simplification, cleanup)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/ioctl.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/list.h>
+#include <linux/errno.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/compat.h>
+#include <linux/of.h>
+#include <linux/of_device.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/delay.h>
+#include <linux/eventfd.h>
+#include <linux/interrupt.h>
+#include <linux/gpio/consumer.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+
+#include <linux/spi/spi.h>
+#include <linux/spi/spidev.h>
+
+#include "spifpga.h"
+#include "spifpga_core.h"
+
+#define CREATE_TRACE_POINTS
+#include "spifpga_trace.h"
+
+#include <asm/uaccess.h>
+
+
+/*
+ * This supports access to SPI devices using normal userspace I/O calls.
+ * Note that while traditional UNIX/POSIX I/O semantics are half duplex,
+ * and often mask message boundaries, full SPI support requires full duplex
+ * transfers.  There are several kinds of internal message boundaries to
+ * handle chipselect management and other protocol options.
+ *
+ * SPI has a character major number assigned.  We allocate minor numbers
+ * dynamically using a bitmask.  You must use hotplug tools, such as udev
+ * (or mdev with busybox) to create and destroy the /dev/spidevB.C device
+ * nodes, since there is no fixed association of minor numbers with any
+ * particular SPI bus or device.
+ */
+#define SPIFPGA_MAJOR            0  /* auto-assign */
+#define N_SPI_MINORS            32  /* ... up to 128 */
+#define MAX_MMAP_SIZE       0x4000000
+
+static DECLARE_BITMAP(minors, N_SPI_MINORS);
+static int Major;
+
+
+/* Bit masks for spi_device.mode management.  Note that incorrect
+ * settings for some settings can cause *lots* of trouble for other
+ * devices on a shared bus:
+ *
+ *  - CS_HIGH ... this device will be active when it shouldn't be
+ *  - 3WIRE ... when active, it won't behave as it should
+ *  - NO_CS ... there will be no explicit message boundaries; this
+ *  is completely incompatible with the shared bus model
+ *  - READY ... transfers may proceed when they shouldn't.
+ *
+ * REVISIT should changing those flags be privileged?
+ */
+#define SPI_MODE_MASK       (SPI_CPHA | SPI_CPOL | SPI_CS_HIGH \
+                | SPI_LSB_FIRST | SPI_3WIRE | SPI_LOOP \
+                | SPI_NO_CS | SPI_READY)
+
+struct spifpga_ring;
+
+/* Per-open state, filp->private_data for both kinds of minor */
+struct spifpga_file {
+    struct spidev_data  *spidev;
+    struct spifpga_ring *ring;
+
+    /* interrupt events already waited for, and the registers to read */
+    int                 events_seen;
+    struct spifpga_page event_pg;
+
+    int                 prio;   /* SPIFPGA_PRIO_* */
+
+    /* serialises readahead and write combining */
+    struct mutex        lock;
+    struct spifpga_ra   ra;
+    struct spifpga_wc   wc;
+};
+
+static LIST_HEAD(device_list);
+static DEFINE_MUTEX(device_list_lock);
+
+static const struct file_operations main_fops;
+static const struct file_operations spidev_fops;
+static const struct file_operations spifpga_fops;
+
+/*-------------------------------------------------------------------------*/
+
+/* The main opening routine. This runs anytime /dev/spidevA.B or /dev/spifpgaA.B
+ * are opened. It opens the file, sets file->f_op to the appropriate operations
+ * set and then returns.
+ */
+
+static int main_open(struct inode *inode, struct file *filp)
+{
+    struct spidev_data  *spidev;
+    struct spifpga_file *pf;
+    int         status = -ENXIO;
+
+    printk(KERN_INFO "Open request on file\n");
+
+    pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+    mutex_init(&pf->lock);
+
+    mutex_lock(&device_list_lock);
+
+    list_for_each_entry(spidev, &device_list, device_entry) {
+        printk(KERN_INFO "spidev: %d,%d. Inode %d,%d\n",MAJOR(spidev->devt), MINOR(spidev->devt), MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
+        //if (spidev->devt/2 == inode->i_rdev/2) {
+        if (spidev->devt/2 == inode->i_rdev/2) {
+            status = 0;
+            break;
+        }
+    }
+    if (status == 0) {
+        if (inode->i_rdev%2 == 0) {
+            printk(KERN_INFO "Got an spidev file\n");
+            filp->f_op = &spidev_fops;
+        }
+        else {
+            printk(KERN_INFO "Got an spifpga file\n");
+            filp->f_op = &spifpga_fops;
+        }
+        if (!spidev->buffer) {
+            spidev->buffer = kmalloc(bufsiz, GFP_KERNEL);
+            if (!spidev->buffer) {
+                dev_dbg(&spidev->spi->dev, "open/ENOMEM\n");
+                status = -ENOMEM;
+            }
+        }
+        if (status == 0) {
+            spidev->users++;
+            pf->spidev = spidev;
+            pf->events_seen = atomic_read(&spidev->events);
+            filp->private_data = pf;
+        }
+    } else
+        pr_debug("spidev: nothing for minor %d\n", iminor(inode));
+
+    mutex_unlock(&device_list_lock);
+    if (status != 0)
+        kfree(pf);
+    printk(KERN_INFO "Leaving open with status %d\n", status);
+    return status;
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Requests that fit in a single page, and everything on a file set to
+ * SPIFPGA_PRIO_HIGH, are urgent; see spifpga_lock_page().
+ */
+static bool spifpga_urgent(struct spifpga_file *pf, size_t n_transfers)
+{
+    return pf->prio == SPIFPGA_PRIO_HIGH ||
+        n_transfers <= spifpga_words_per_page(pf->spidev);
+}
+
+static size_t spifpga_copy_to_iter(void *ctx, void *words, size_t bytes)
+{
+    u64         start = trace_spifpga_copy_out_enabled() ? ktime_get_ns() : 0;
+    size_t      copied = copy_to_iter(words, bytes, ctx);
+
+    trace_spifpga_copy_out(bytes, copied, start);
+    return copied;
+}
+
+static size_t spifpga_copy_from_iter(void *ctx, void *words, size_t bytes)
+{
+    u64         start = trace_spifpga_copy_in_enabled() ? ktime_get_ns() : 0;
+    size_t      copied = copy_from_iter(words, bytes, ctx);
+
+    trace_spifpga_copy_in(bytes, copied, start);
+    return copied;
+}
+
+/*
+ * Reads and writes walk the iov_iter directly. The file range is contiguous,
+ * so the frames for every iovec segment are packed back to back into the same
+ * pages, and a page only goes out once it is full or the request is done.
+ */
+static ssize_t
+spifpga_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct spifpga_file *pf = iocb->ki_filp->private_data;
+    size_t      n_transfers;
+    ssize_t     status;
+
+    /* transfers not in multiples of 4 bytes have the ends chopped */
+    n_transfers = iov_iter_count(to) / FPGA_WORD_BYTES;
+    trace_spifpga_request_start(pf->spidev, SPIFPGA_REQ_READ,
+            (u32)iocb->ki_pos, n_transfers * FPGA_WORD_BYTES);
+    mutex_lock(&pf->lock);
+    /* reads see this file's own buffered writes */
+    status = spifpga_wc_flush(pf->spidev, &pf->wc);
+    if (!status)
+        status = spifpga_wc_error(&pf->wc);
+    if (!status)
+        status = spifpga_ra_read(pf->spidev, &pf->ra, (u32)iocb->ki_pos,
+                n_transfers, spifpga_urgent(pf, n_transfers),
+                spifpga_copy_to_iter, to);
+    mutex_unlock(&pf->lock);
+    trace_spifpga_request_end(pf->spidev, SPIFPGA_REQ_READ,
+            (u32)iocb->ki_pos, status);
+    if (status > 0)
+        iocb->ki_pos += status;
+    return status;
+}
+
+static ssize_t
+spifpga_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct spifpga_file *pf = iocb->ki_filp->private_data;
+    size_t      n_transfers;
+    ssize_t     status;
+
+    /* transfers not in multiples of 4 bytes have the ends chopped */
+    n_transfers = iov_iter_count(from) / FPGA_WORD_BYTES;
+    trace_spifpga_request_start(pf->spidev, SPIFPGA_REQ_WRITE,
+            (u32)iocb->ki_pos, n_transfers * FPGA_WORD_BYTES);
+
+    mutex_lock(&pf->lock);
+    /* the window may hold what we are about to overwrite */
+    spifpga_ra_invalidate(&pf->ra);
+    status = spifpga_wc_write(pf->spidev, &pf->wc, (u32)iocb->ki_pos,
+            n_transfers, spifpga_urgent(pf, n_transfers),
+            spifpga_copy_from_iter, from);
+    mutex_unlock(&pf->lock);
+    trace_spifpga_request_end(pf->spidev, SPIFPGA_REQ_WRITE,
+            (u32)iocb->ki_pos, status);
+    if (status > 0)
+        iocb->ki_pos += status;
+    return status;
+}
+
+/*
+ * Sends this file's buffered writes, returning the error of that flush or
+ * of an earlier one nobody has seen yet.
+ */
+static int spifpga_wc_sync(struct spifpga_file *pf)
+{
+    int         status;
+
+    mutex_lock(&pf->lock);
+    status = spifpga_wc_flush(pf->spidev, &pf->wc);
+    if (!status)
+        status = spifpga_wc_error(&pf->wc);
+    mutex_unlock(&pf->lock);
+    return status;
+}
+
+/*
+ * Ring ops and event register reads must not overtake earlier writes. The
+ * error, if any, is left for the next read, write, fsync or close.
+ */
+static void spifpga_wc_drain(struct spifpga_file *pf)
+{
+    int         status;
+
+    mutex_lock(&pf->lock);
+    status = spifpga_wc_flush(pf->spidev, &pf->wc);
+    if (status && !pf->wc.error)
+        pf->wc.error = status;
+    mutex_unlock(&pf->lock);
+}
+
+static int spifpga_fsync(struct file *filp, loff_t start, loff_t end,
+        int datasync)
+{
+    return spifpga_wc_sync(filp->private_data);
+}
+
+/* close(), and every close of a dup()ed descriptor */
+static int spifpga_flush(struct file *filp, fl_owner_t id)
+{
+    return spifpga_wc_sync(filp->private_data);
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Shared memory submission/completion ring, see spifpga.h for the layout.
+ * A work item drains the submission queue into pages of frames, sends
+ * each page with buf_lock held (so it interleaves with other users of the
+ * device), and posts a completion for every op once its last frame is back.
+ */
+#define SPIFPGA_RING_MAX_ENTRIES    4096
+#define SPIFPGA_RING_MAX_DATA       (1 << 22)   /* words */
+
+static unsigned int ring_idle_us = 200;
+module_param(ring_idle_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ring_idle_us, "time the ring worker polls an empty ring before sleeping");
+
+struct spifpga_ring_op {
+    struct spifpga_sqe  sqe;    /* private copy, userspace can't change it */
+    u32         queued;         /* words handed to a page so far */
+    unsigned    first;          /* first frame on the current page */
+    unsigned    n;              /* frames on the current page */
+    int         res;
+    u8          resp;
+};
+
+struct spifpga_ring {
+    struct spidev_data      *spidev;
+    struct spifpga_file     *pf;            /* the file it was set up on */
+    void                    *mem;
+    size_t                  size;
+    struct spifpga_ring_hdr *hdr;
+    struct spifpga_sqe      *sqes;
+    struct spifpga_cqe      *cqes;
+    u32                     *data;
+    u32                     sq_entries;
+    u32                     cq_entries;
+    u32                     data_words;
+
+    /* private copies of the indices the driver owns */
+    u32                     sq_head;
+    u32                     cq_tail;
+    u32                     cq_reserved;    /* cqes owed to taken sqes */
+
+    struct work_struct      work;
+    wait_queue_head_t       cq_wait;
+    spinlock_t              evfd_lock;
+    struct eventfd_ctx      *evfd;
+
+    struct spifpga_page     pg;
+    struct spifpga_ring_op  *ops;           /* ops on the current page */
+    unsigned                n_ops;
+};
+
+static bool spifpga_ring_sqe_valid(struct spifpga_ring *ring,
+        const struct spifpga_sqe *sqe)
+{
+    switch (sqe->op) {
+    case SPIFPGA_OP_NOP:
+        return true;
+    case SPIFPGA_OP_READ:
+    case SPIFPGA_OP_WRITE:
+        return sqe->len <= ring->data_words &&
+            sqe->slot <= ring->data_words - sqe->len;
+    default:
+        return false;
+    }
+}
+
+static bool spifpga_ring_cq_room(struct spifpga_ring *ring)
+{
+    u32 used = ring->cq_tail + ring->cq_reserved - READ_ONCE(ring->hdr->cq_head);
+
+    return used < ring->cq_entries;
+}
+
+static bool spifpga_ring_has_work(struct spifpga_ring *ring)
+{
+    return ring->sq_head != smp_load_acquire(&ring->hdr->sq_tail) &&
+        spifpga_ring_cq_room(ring);
+}
+
+/* Pack frames for pending submissions into the page until it is full */
+static void spifpga_ring_fill(struct spifpga_ring *ring)
+{
+    struct spifpga_page *pg = &ring->pg;
+    struct spifpga_ring_op *op;
+    struct fpga_data    *fcmd;
+    u32         tail, k, i;
+
+    spifpga_page_reset(pg);
+    tail = smp_load_acquire(&ring->hdr->sq_tail);
+
+    while (pg->n < pg->max) {
+        op = ring->n_ops ? &ring->ops[ring->n_ops - 1] : NULL;
+        if (!op || op->queued == op->sqe.len) {
+            if (ring->n_ops == pg->max || ring->sq_head == tail ||
+                    !spifpga_ring_cq_room(ring))
+                break;
+
+            op = &ring->ops[ring->n_ops++];
+            memcpy(&op->sqe, &ring->sqes[ring->sq_head & (ring->sq_entries - 1)],
+                    sizeof(op->sqe));
+            smp_store_release(&ring->hdr->sq_head, ++ring->sq_head);
+            ring->cq_reserved++;
+
+            op->queued = 0;
+            op->first = pg->n;
+            op->n = 0;
+            op->res = 0;
+            op->resp = 0;
+            if (!spifpga_ring_sqe_valid(ring, &op->sqe)) {
+                op->res = -EINVAL;
+                op->sqe.len = 0;
+            } else if (op->sqe.op == SPIFPGA_OP_NOP) {
+                op->sqe.len = 0;
+            }
+            continue;
+        }
+
+        k = min_t(u32, op->sqe.len - op->queued, pg->max - pg->n);
+        for (i = 0; i < k; i++) {
+            u32 word = op->queued + i;
+
+            if (op->sqe.op == SPIFPGA_OP_READ) {
+                spifpga_page_add(pg, FPGA_CMD_READ,
+                        op->sqe.addr + FPGA_WORD_BYTES * word);
+            } else {
+                fcmd = spifpga_page_add(pg, FPGA_CMD_WRITE,
+                        op->sqe.addr + FPGA_WORD_BYTES * word);
+                fcmd->dout = ring->data[op->sqe.slot + word];
+            }
+        }
+        op->n += k;
+        op->queued += k;
+    }
+}
+
+static bool spifpga_ring_page_writes(struct spifpga_ring *ring)
+{
+    unsigned    i;
+
+    for (i = 0; i < ring->n_ops; i++)
+        if (ring->ops[i].sqe.op == SPIFPGA_OP_WRITE && ring->ops[i].n)
+            return true;
+    return false;
+}
+
+static void spifpga_ring_post(struct spifpga_ring *ring,
+        struct spifpga_ring_op *op)
+{
+    struct spifpga_cqe  *cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+
+    cqe->user_data = op->sqe.user_data;
+    cqe->res = op->res ? op->res : op->sqe.len;
+    cqe->resp = op->resp;
+    smp_store_release(&ring->hdr->cq_tail, ++ring->cq_tail);
+    ring->cq_reserved--;
+}
+
+/* Hand back read data and post completions for the page just sent */
+static void spifpga_ring_complete(struct spifpga_ring *ring, int status)
+{
+    struct spifpga_page *pg = &ring->pg;
+    struct spifpga_ring_op *op;
+    unsigned    i, j, posted = 0;
+    u32         word;
+
+    for (i = 0, op = ring->ops; i < ring->n_ops; i++, op++) {
+        word = op->queued - op->n;
+        for (j = op->first; j < op->first + op->n; j++, word++) {
+            if (status < 0) {
+                op->res = status;
+                continue;
+            }
+            op->resp |= pg->frsp[j].resp;
+            if (op->sqe.op == SPIFPGA_OP_READ)
+                ring->data[op->sqe.slot + word] = pg->frsp[j].din;
+        }
+        if (op->queued < op->sqe.len)
+            break;
+        spifpga_ring_post(ring, op);
+        posted++;
+    }
+
+    /* an op that didn't fit carries over to the start of the next page */
+    if (i < ring->n_ops) {
+        ring->ops[0] = ring->ops[i];
+        ring->ops[0].first = 0;
+        ring->ops[0].n = 0;
+        ring->n_ops = 1;
+    } else {
+        ring->n_ops = 0;
+    }
+
+    if (posted) {
+        spin_lock(&ring->evfd_lock);
+        if (ring->evfd)
+            eventfd_signal(ring->evfd, posted);
+        spin_unlock(&ring->evfd_lock);
+        wake_up_interruptible(&ring->cq_wait);
+    }
+}
+
+static void spifpga_ring_work(struct work_struct *work)
+{
+    struct spifpga_ring *ring = container_of(work, struct spifpga_ring, work);
+    struct spidev_data  *spidev = ring->spidev;
+    unsigned long       idle_end = jiffies + usecs_to_jiffies(ring_idle_us);
+    int         status;
+
+    WRITE_ONCE(ring->hdr->flags, 0);
+    for (;;) {
+        spifpga_ring_fill(ring);
+
+        if (ring->n_ops == 0) {
+            if (time_before(jiffies, idle_end)) {
+                usleep_range(10, 20);
+                continue;
+            }
+            /* tell userspace to ring the doorbell, then look once more so
+             * a submission racing with the flag isn't lost
+             */
+            WRITE_ONCE(ring->hdr->flags, SPIFPGA_RING_NEED_WAKEUP);
+            smp_mb();
+            if (!spifpga_ring_has_work(ring))
+                break;
+            WRITE_ONCE(ring->hdr->flags, 0);
+            continue;
+        }
+
+        status = 0;
+        if (ring->pg.n)
+            status = spifpga_send_page(spidev, &ring->pg,
+                    READ_ONCE(ring->pf->prio) == SPIFPGA_PRIO_HIGH);
+        /* a read() after the completion must not see the window from
+         * before a write on this page
+         */
+        if (spifpga_ring_page_writes(ring)) {
+            mutex_lock(&ring->pf->lock);
+            spifpga_ra_invalidate(&ring->pf->ra);
+            mutex_unlock(&ring->pf->lock);
+        }
+        spifpga_ring_complete(ring, status);
+
+        idle_end = jiffies + usecs_to_jiffies(ring_idle_us);
+        cond_resched();
+    }
+}
+
+static void spifpga_ring_free(struct spifpga_ring *ring)
+{
+    cancel_work_sync(&ring->work);
+    if (ring->evfd)
+        eventfd_ctx_put(ring->evfd);
+    spifpga_page_free(&ring->pg);
+    kfree(ring->ops);
+    vfree(ring->mem);
+    kfree(ring);
+}
+
+static int spifpga_ring_setup(struct spifpga_file *pf,
+        struct spifpga_ring_params __user *uparams)
+{
+    struct spifpga_ring_params p;
+    struct spifpga_ring *ring;
+    struct spifpga_ring_hdr *hdr;
+    size_t      sqes_off, cqes_off, data_off;
+
+    if (copy_from_user(&p, uparams, sizeof(p)))
+        return -EFAULT;
+    if (p.sq_entries == 0 || p.sq_entries > SPIFPGA_RING_MAX_ENTRIES)
+        return -EINVAL;
+    if (p.data_words > SPIFPGA_RING_MAX_DATA)
+        return -EINVAL;
+
+    ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    ring->spidev = pf->spidev;
+    ring->pf = pf;
+    ring->sq_entries = roundup_pow_of_two(p.sq_entries);
+    ring->cq_entries = 2 * ring->sq_entries;
+    ring->data_words = p.data_words ? p.data_words : 16 * ring->sq_entries;
+
+    sqes_off = ALIGN(sizeof(struct spifpga_ring_hdr), L1_CACHE_BYTES);
+    cqes_off = ALIGN(sqes_off + ring->sq_entries * sizeof(struct spifpga_sqe),
+            L1_CACHE_BYTES);
+    data_off = ALIGN(cqes_off + ring->cq_entries * sizeof(struct spifpga_cqe),
+            L1_CACHE_BYTES);
+    ring->size = PAGE_ALIGN(data_off + ring->data_words * sizeof(u32));
+
+    ring->mem = vmalloc_user(ring->size);
+    ring->ops = kcalloc(spifpga_transfers_per_page(pf->spidev),
+            sizeof(*ring->ops), GFP_KERNEL);
+    if (!ring->mem || !ring->ops || spifpga_page_alloc(pf->spidev, &ring->pg,
+                spifpga_transfers_per_page(pf->spidev))) {
+        vfree(ring->mem);
+        kfree(ring->ops);
+        kfree(ring);
+        return -ENOMEM;
+    }
+
+    INIT_WORK(&ring->work, spifpga_ring_work);
+    init_waitqueue_head(&ring->cq_wait);
+    spin_lock_init(&ring->evfd_lock);
+
+    hdr = ring->mem;
+    ring->hdr = hdr;
+    ring->sqes = ring->mem + sqes_off;
+    ring->cqes = ring->mem + cqes_off;
+    ring->data = ring->mem + data_off;
+    hdr->sq_mask = ring->sq_entries - 1;
+    hdr->cq_mask = ring->cq_entries - 1;
+    hdr->flags = SPIFPGA_RING_NEED_WAKEUP;
+    hdr->sqes_off = sqes_off;
+    hdr->cqes_off = cqes_off;
+    hdr->data_off = data_off;
+    hdr->data_words = ring->data_words;
+
+    p.sq_entries = ring->sq_entries;
+    p.cq_entries = ring->cq_entries;
+    p.data_words = ring->data_words;
+    p.ring_bytes = ring->size;
+    if (copy_to_user(uparams, &p, sizeof(p))) {
+        spifpga_ring_free(ring);
+        return -EFAULT;
+    }
+
+    /* only one ring per open file */
+    if (cmpxchg(&pf->ring, NULL, ring) != NULL) {
+        spifpga_ring_free(ring);
+        return -EBUSY;
+    }
+    return 0;
+}
+
+static int spifpga_ring_enter(struct spifpga_ring *ring, u32 min_complete)
+{
+    struct spifpga_ring_hdr *hdr = ring->hdr;
+
+    if (min_complete > ring->cq_entries)
+        return -EINVAL;
+
+    queue_work(system_unbound_wq, &ring->work);
+    if (min_complete == 0)
+        return 0;
+    return wait_event_interruptible(ring->cq_wait,
+            smp_load_acquire(&hdr->cq_tail) - READ_ONCE(hdr->cq_head)
+                >= min_complete);
+}
+
+static int spifpga_ring_eventfd(struct spifpga_ring *ring, int fd)
+{
+    struct eventfd_ctx  *evfd = NULL, *old;
+
+    if (fd >= 0) {
+        evfd = eventfd_ctx_fdget(fd);
+        if (IS_ERR(evfd))
+            return PTR_ERR(evfd);
+    }
+
+    spin_lock(&ring->evfd_lock);
+    old = ring->evfd;
+    ring->evfd = evfd;
+    spin_unlock(&ring->evfd_lock);
+
+    if (old)
+        eventfd_ctx_put(old);
+    return 0;
+}
+
+static int spifpga_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct spifpga_file *pf = filp->private_data;
+    struct spifpga_ring *ring = smp_load_acquire(&pf->ring);
+
+    if (!ring)
+        return -ENXIO;
+    return remap_vmalloc_range(vma, ring->mem, vma->vm_pgoff);
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * FPGA interrupt. The handler only counts events and wakes waiters; the
+ * register reads happen in the waiter's context, where it can sleep on
+ * the SPI bus.
+ */
+static void spifpga_event_signal(struct spidev_data *spidev)
+{
+    atomic_inc(&spidev->events);
+    wake_up_interruptible(&spidev->event_wait);
+}
+
+static irqreturn_t spifpga_irq(int irq, void *dev_id)
+{
+    spifpga_event_signal(dev_id);
+    return IRQ_HANDLED;
+}
+
+/* The interrupt is optional: take spi->irq from the "interrupts" property,
+ * or failing that an "irq-gpios" line.
+ */
+static void spifpga_irq_probe(struct spidev_data *spidev)
+{
+    struct spi_device   *spi = spidev->spi;
+    struct gpio_desc    *gpio;
+    unsigned long       flags = 0;
+    int         irq = spi->irq;
+    int         status;
+
+    if (irq <= 0) {
+        gpio = devm_gpiod_get_optional(&spi->dev, "irq", GPIOD_IN);
+        if (IS_ERR_OR_NULL(gpio))
+            return;
+        irq = gpiod_to_irq(gpio);
+        if (irq < 0)
+            return;
+        flags = IRQF_TRIGGER_RISING;
+    }
+
+    status = request_irq(irq, spifpga_irq, flags, "spifpga", spidev);
+    if (status < 0) {
+        dev_warn(&spi->dev, "can't get irq %d (%d), events are software only\n",
+                irq, status);
+        return;
+    }
+    spidev->irq = irq;
+}
+
+static int spifpga_event_regs(struct spifpga_file *pf,
+        struct spifpga_event_regs __user *uregs)
+{
+    struct spifpga_event_regs regs;
+    struct spifpga_page pg = { };
+    unsigned    i;
+
+    if (copy_from_user(&regs, uregs, sizeof(regs)))
+        return -EFAULT;
+    if (regs.n > SPIFPGA_EVENT_MAX_REGS)
+        return -EINVAL;
+
+    if (regs.n) {
+        if (spifpga_page_alloc(pf->spidev, &pg, regs.n))
+            return -ENOMEM;
+        spifpga_page_reset(&pg);
+        for (i = 0; i < regs.n; i++)
+            spifpga_page_add(&pg, FPGA_CMD_READ, regs.addr[i]);
+    }
+
+    /* frames are prebuilt here, so a wait doesn't allocate */
+    spidev_lock(pf->spidev);
+    swap(pf->event_pg, pg);
+    mutex_unlock(&pf->spidev->buf_lock);
+    if (pg.max)
+        spifpga_page_free(&pg);
+    return 0;
+}
+
+static int spifpga_event_wait(struct file *filp,
+        struct spifpga_event_wait __user *uwait)
+{
+    struct spifpga_file *pf = filp->private_data;
+    struct spidev_data  *spidev = pf->spidev;
+    struct spifpga_event_wait w;
+    struct spifpga_page *pg = &pf->event_pg;
+    long        timeout;
+    int         events, status;
+    unsigned    i;
+
+    if (copy_from_user(&w, uwait, sizeof(w)))
+        return -EFAULT;
+
+#define SPIFPGA_EVENT_READY \
+    (atomic_read(&spidev->events) != pf->events_seen || !READ_ONCE(spidev->spi))
+
+    if (!SPIFPGA_EVENT_READY) {
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        timeout = w.timeout_ms ? msecs_to_jiffies(w.timeout_ms)
+            : MAX_SCHEDULE_TIMEOUT;
+        timeout = wait_event_interruptible_timeout(spidev->event_wait,
+                SPIFPGA_EVENT_READY, timeout);
+        if (timeout < 0)
+            return timeout;
+        if (timeout == 0)
+            return -ETIMEDOUT;
+    }
+#undef SPIFPGA_EVENT_READY
+
+    events = atomic_read(&spidev->events);
+    w.events = events - pf->events_seen;
+    pf->events_seen = events;
+    w.n = 0;
+    w.resp = 0;
+
+    spifpga_lock_page(spidev, true);
+    if (pg->n) {
+        /* the message is reused, so reinitialise its transfer list */
+        spi_message_init(&pg->msg);
+        for (i = 0; i < pg->n; i++)
+            spi_message_add_tail(&pg->t[i], &pg->msg);
+        status = spidev_sync(spidev, &pg->msg);
+        if (status < 0) {
+            mutex_unlock(&spidev->buf_lock);
+            return status;
+        }
+        spifpga_stats_page(spidev, pg);
+        for (i = 0; i < pg->n; i++) {
+            w.val[i] = pg->frsp[i].din;
+            w.resp |= pg->frsp[i].resp;
+        }
+        w.n = pg->n;
+    }
+    mutex_unlock(&spidev->buf_lock);
+
+    if (copy_to_user(uwait, &w, sizeof(w)))
+        return -EFAULT;
+    return 0;
+}
+
+static unsigned int spifpga_poll(struct file *filp, poll_table *wait)
+{
+    struct spifpga_file *pf = filp->private_data;
+    struct spidev_data  *spidev = pf->spidev;
+    unsigned int        mask = 0;
+
+    poll_wait(filp, &spidev->event_wait, wait);
+    if (atomic_read(&spidev->events) != pf->events_seen)
+        mask |= POLLIN | POLLRDNORM;
+    if (!READ_ONCE(spidev->spi))
+        mask |= POLLHUP;
+    return mask;
+}
+
+static loff_t spifpga_llseek(struct file *filp, loff_t offset, int origin)
+{
+
+        loff_t newpos;
+        printk(KERN_INFO "lseeking\n");
+
+        ///* only read-only opens are allowed to seek */
+        //if ((filp->f_flags & O_ACCMODE) != O_RDONLY)
+        //        return -EINVAL;
+
+        switch (origin) {
+        case SEEK_SET: /* seek relative to the beginning of the file */
+                newpos = offset;
+                break;
+        case SEEK_CUR: /* seek relative to current position in the file */
+                newpos = filp->f_pos + offset;
+                break;
+        case SEEK_END: /* seek relative to the end of the file */
+                newpos = MAX_MMAP_SIZE - offset;
+                break;
+        default:
+                return -EINVAL;
+        }
+
+        if (newpos != filp->f_pos) {
+                struct spifpga_file *pf = filp->private_data;
+
+                mutex_lock(&pf->lock);
+                if (!spifpga_ra_covers(&pf->ra, (u32)newpos))
+                        spifpga_ra_invalidate(&pf->ra);
+                mutex_unlock(&pf->lock);
+        }
+
+        filp->f_pos = newpos;
+        return newpos;
+}
+
+void spifpga_vma_open(struct vm_area_struct *vma)
+{
+        printk(KERN_NOTICE "spifpga VMA open, virt %lx, phys %lx",
+                        vma->vm_start, vma->vm_pgoff << PAGE_SHIFT);
+}
+
+void spifpga_vma_close(struct vm_area_struct *vma)
+{
+        printk(KERN_NOTICE "spifpga VMA close");
+}
+
+int spifpga_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+        printk(KERN_NOTICE "got a VMA fault\n");
+        return 0;
+}
+
+
+
+
+/*-------------------------------------------------------------------------*/
+
+/* Read-only message with current device setup */
+static ssize_t
+spidev_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct spidev_data  *spidev;
+    ssize_t         status = 0;
+
+    /* chipselect only toggles at start or end of operation */
+    if (count > bufsiz)
+        return -EMSGSIZE;
+
+    spidev = ((struct spifpga_file *)filp->private_data)->spidev;
+
+    spifpga_lock_page(spidev, true);
+    status = spidev_sync_read(spidev, count);
+    if (status > 0) {
+        unsigned long   missing;
+
+        missing = copy_to_user(buf, spidev->buffer, status);
+        if (missing == status)
+            status = -EFAULT;
+        else
+            status = status - missing;
+    }
+    mutex_unlock(&spidev->buf_lock);
+
+    return status;
+}
+
+/* Write-only message with current device setup */
+static ssize_t
+spidev_write(struct file *filp, const char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    struct spidev_data  *spidev;
+    ssize_t         status = 0;
+    unsigned long       missing;
+
+    printk(KERN_INFO "Write command on spidev\n");
+    /* chipselect only toggles at start or end of operation */
+    if (count > bufsiz)
+        return -EMSGSIZE;
+
+    spidev = ((struct spifpga_file *)filp->private_data)->spidev;
+
+    spifpga_lock_page(spidev, true);
+    missing = copy_from_user(spidev->buffer, buf, count);
+    if (missing == 0) {
+        status = spidev_sync_write(spidev, count);
+    } else
+        status = -EFAULT;
+    mutex_unlock(&spidev->buf_lock);
+
+    return status;
+}
+
+/* SPIFPGA_IOC_GET_LIMITS, on either minor */
+static int spifpga_get_limits(struct spidev_data *spidev,
+        struct spifpga_limits __user *ulimits)
+{
+    struct spifpga_limits l = { };
+    struct spi_device   *spi;
+
+    spin_lock_irq(&spidev->spi_lock);
+    spi = spidev->spi;
+    if (spi)
+        l.max_speed_hz = spi->max_speed_hz;
+    spin_unlock_irq(&spidev->spi_lock);
+    if (!spi)
+        return -ESHUTDOWN;
+
+    l.bufsiz = bufsiz;
+    l.max_transfer_size = min_t(size_t, spidev->max_transfer_size, U32_MAX);
+    l.max_message_size = min_t(size_t, spidev->max_message_size, U32_MAX);
+    l.page_bytes = spifpga_page_bytes(spidev);
+    l.frames_per_page = spifpga_transfers_per_page(spidev);
+    l.words_per_burst = spifpga_words_per_burst(spidev);
+    l.proto = READ_ONCE(spidev->proto);
+
+    if (copy_to_user(ulimits, &l, sizeof(l)))
+        return -EFAULT;
+    return 0;
+}
+
+static long
+spidev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    int         err = 0;
+    int         retval = 0;
+    struct spidev_data  *spidev;
+    struct spi_device   *spi;
+    u32         tmp;
+    unsigned        n_ioc = 0;
+    struct spi_ioc_transfer *ioc;
+
+    /* the one spifpga ioctl that is useful on the spidev minor as well */
+    if (cmd == SPIFPGA_IOC_GET_LIMITS)
+        return spifpga_get_limits(
+                ((struct spifpga_file *)filp->private_data)->spidev,
+                (struct spifpga_limits __user *)arg);
+
+    /* Check type and command number */
+    if (_IOC_TYPE(cmd) != SPI_IOC_MAGIC)
+        return -ENOTTY;
+
+    /* Check access direction once here; don't repeat below.
+     * IOC_DIR is from the user perspective, while access_ok is
+     * from the kernel perspective; so they look reversed.
+     */
+    if (_IOC_DIR(cmd) & _IOC_READ)
+        err = !access_ok(VERIFY_WRITE,
+                (void __user *)arg, _IOC_SIZE(cmd));
+    if (err == 0 && _IOC_DIR(cmd) & _IOC_WRITE)
+        err = !access_ok(VERIFY_READ,
+                (void __user *)arg, _IOC_SIZE(cmd));
+    if (err)
+        return -EFAULT;
+
+    /* guard against device removal before, or while,
+     * we issue this ioctl.
+     */
+    spidev = ((struct spifpga_file *)filp->private_data)->spidev;
+    spin_lock_irq(&spidev->spi_lock);
+    spi = spi_dev_get(spidev->spi);
+    spin_unlock_irq(&spidev->spi_lock);
+
+    if (spi == NULL)
+        return -ESHUTDOWN;
+
+    /* use the buffer lock here for triple duty:
+     *  - prevent I/O (from us) so calling spi_setup() is safe;
+     *  - prevent concurrent SPI_IOC_WR_* from morphing
+     *    data fields while SPI_IOC_RD_* reads them;
+     *  - SPI_IOC_MESSAGE needs the buffer locked "normally".
+     * These are all small, so they go ahead of bulk spifpga transfers.
+     */
+    spifpga_lock_page(spidev, true);
+
+    switch (cmd) {
+    /* read requests */
+    case SPI_IOC_RD_MODE:
+        retval = __put_user(spi->mode & SPI_MODE_MASK,
+                    (__u8 __user *)arg);
+        break;
+    case SPI_IOC_RD_LSB_FIRST:
+        retval = __put_user((spi->mode & SPI_LSB_FIRST) ?  1 : 0,
+                    (__u8 __user *)arg);
+        break;
+    case SPI_IOC_RD_BITS_PER_WORD:
+        retval = __put_user(spi->bits_per_word, (__u8 __user *)arg);
+        break;
+    case SPI_IOC_RD_MAX_SPEED_HZ:
+        retval = __put_user(spi->max_speed_hz, (__u32 __user *)arg);
+        break;
+
+    /* write requests */
+    case SPI_IOC_WR_MODE:
+        retval = __get_user(tmp, (u8 __user *)arg);
+        if (retval == 0) {
+            u8  save = spi->mode;
+
+            if (tmp & ~SPI_MODE_MASK) {
+                retval = -EINVAL;
+                break;
+            }
+
+            tmp |= spi->mode & ~SPI_MODE_MASK;
+            spi->mode = (u8)tmp;
+            retval = spi_setup(spi);
+            if (retval < 0)
+                spi->mode = save;
+            else
+                dev_dbg(&spi->dev, "spi mode %02x\n", tmp);
+        }
+        break;
+    case SPI_IOC_WR_LSB_FIRST:
+        retval = __get_user(tmp, (__u8 __user *)arg);
+        if (retval == 0) {
+            u8  save = spi->mode;
+
+            if (tmp)
+                spi->mode |= SPI_LSB_FIRST;
+            else
+                spi->mode &= ~SPI_LSB_FIRST;
+            retval = spi_setup(spi);
+            if (retval < 0)
+                spi->mode = save;
+            else
+                dev_dbg(&spi->dev, "%csb first\n",
+                        tmp ? 'l' : 'm');
+        }
+        break;
+    case SPI_IOC_WR_BITS_PER_WORD:
+        retval = __get_user(tmp, (__u8 __user *)arg);
+        if (retval == 0) {
+            u8  save = spi->bits_per_word;
+
+            spi->bits_per_word = tmp;
+            retval = spi_setup(spi);
+            if (retval < 0)
+                spi->bits_per_word = save;
+            else
+                dev_dbg(&spi->dev, "%d bits per word\n", tmp);
+        }
+        break;
+    case SPI_IOC_WR_MAX_SPEED_HZ:
+        retval = __get_user(tmp, (__u32 __user *)arg);
+        if (retval == 0) {
+            u32 save = spi->max_speed_hz;
+
+            spi->max_speed_hz = tmp;
+            retval = spi_setup(spi);
+            if (retval < 0)
+                spi->max_speed_hz = save;
+            else
+                dev_dbg(&spi->dev, "%d Hz (max)\n", tmp);
+        }
+        break;
+
+    default:
+        /* segmented and/or full-duplex I/O request */
+        if (_IOC_NR(cmd) != _IOC_NR(SPI_IOC_MESSAGE(0))
+                || _IOC_DIR(cmd) != _IOC_WRITE) {
+            retval = -ENOTTY;
+            break;
+        }
+
+        tmp = _IOC_SIZE(cmd);
+        if ((tmp % sizeof(struct spi_ioc_transfer)) != 0) {
+            retval = -EINVAL;
+            break;
+        }
+        n_ioc = tmp / sizeof(struct spi_ioc_transfer);
+        if (n_ioc == 0)
+            break;
+
+        /* copy into scratch area */
+        ioc = kmalloc(tmp, GFP_KERNEL);
+        if (!ioc) {
+            retval = -ENOMEM;
+            break;
+        }
+        if (__copy_from_user(ioc, (void __user *)arg, tmp)) {
+            kfree(ioc);
+            retval = -EFAULT;
+            break;
+        }
+
+        /* translate to spi_message, execute */
+        retval = spidev_message(spidev, ioc, n_ioc);
+        kfree(ioc);
+        break;
+    }
+
+    mutex_unlock(&spidev->buf_lock);
+    spi_dev_put(spi);
+
+    /* the frames are opaque here, so any message may have written what
+     * the readahead window holds; pf->lock nests outside buf_lock
+     */
+    if (n_ioc) {
+        struct spifpga_file *pf = filp->private_data;
+
+        mutex_lock(&pf->lock);
+        spifpga_ra_invalidate(&pf->ra);
+        mutex_unlock(&pf->lock);
+    }
+    return retval;
+}
+
+#ifdef CONFIG_COMPAT
+static long
+spidev_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    return spidev_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#else
+#define spidev_compat_ioctl NULL
+#endif /* CONFIG_COMPAT */
+
+/* The spifpga minors add their own ioctls on top of the spidev ones */
+static long
+spifpga_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct spifpga_file *pf = filp->private_data;
+    struct spifpga_ring *ring = smp_load_acquire(&pf->ring);
+    struct spifpga_region region;
+    int         status;
+
+    if (_IOC_TYPE(cmd) != SPIFPGA_IOC_MAGIC)
+        return spidev_ioctl(filp, cmd, arg);
+
+    switch (cmd) {
+    case SPIFPGA_IOC_RING_SETUP:
+        return spifpga_ring_setup(pf,
+                (struct spifpga_ring_params __user *)arg);
+    case SPIFPGA_IOC_RING_ENTER:
+        if (!ring)
+            return -ENXIO;
+        spifpga_wc_drain(pf);
+        return spifpga_ring_enter(ring, (u32)arg);
+    case SPIFPGA_IOC_RING_EVENTFD:
+        if (!ring)
+            return -ENXIO;
+        return spifpga_ring_eventfd(ring, (int)arg);
+    case SPIFPGA_IOC_EVENT_REGS:
+        return spifpga_event_regs(pf,
+                (struct spifpga_event_regs __user *)arg);
+    case SPIFPGA_IOC_EVENT_WAIT:
+        spifpga_wc_drain(pf);
+        return spifpga_event_wait(filp,
+                (struct spifpga_event_wait __user *)arg);
+    case SPIFPGA_IOC_EVENT_TRIGGER:
+        spifpga_event_signal(pf->spidev);
+        return 0;
+    case SPIFPGA_IOC_SET_PRIO:
+        if (arg != SPIFPGA_PRIO_NORMAL && arg != SPIFPGA_PRIO_HIGH)
+            return -EINVAL;
+        WRITE_ONCE(pf->prio, arg);
+        return 0;
+    case SPIFPGA_IOC_SET_STREAM:
+        if (arg > 1)
+            return -EINVAL;
+        return spifpga_set_stream(pf->spidev, arg);
+    case SPIFPGA_IOC_PROTO:
+        return spifpga_probe_proto(pf->spidev);
+    case SPIFPGA_IOC_GET_LIMITS:
+        return spifpga_get_limits(pf->spidev,
+                (struct spifpga_limits __user *)arg);
+    case SPIFPGA_IOC_WC_SIZE:
+        mutex_lock(&pf->lock);
+        status = spifpga_wc_set_size(pf->spidev, &pf->wc, arg);
+        mutex_unlock(&pf->lock);
+        return status;
+    case SPIFPGA_IOC_RA_WINDOW:
+        mutex_lock(&pf->lock);
+        status = spifpga_ra_set_window(&pf->ra, arg);
+        mutex_unlock(&pf->lock);
+        return status;
+    case SPIFPGA_IOC_RA_VOLATILE:
+        if (copy_from_user(&region, (void __user *)arg, sizeof(region)))
+            return -EFAULT;
+        mutex_lock(&pf->lock);
+        status = spifpga_ra_add_volatile(&pf->ra, region.addr, region.len);
+        mutex_unlock(&pf->lock);
+        return status;
+    default:
+        return -ENOTTY;
+    }
+}
+
+#ifdef CONFIG_COMPAT
+static long
+spifpga_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    /* these take their argument by value */
+    if (cmd == SPIFPGA_IOC_RING_ENTER || cmd == SPIFPGA_IOC_RING_EVENTFD ||
+            cmd == SPIFPGA_IOC_EVENT_TRIGGER || cmd == SPIFPGA_IOC_SET_PRIO ||
+            cmd == SPIFPGA_IOC_RA_WINDOW || cmd == SPIFPGA_IOC_WC_SIZE ||
+            cmd == SPIFPGA_IOC_SET_STREAM || cmd == SPIFPGA_IOC_PROTO)
+        return spifpga_ioctl(filp, cmd, arg);
+    return spifpga_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#else
+#define spifpga_compat_ioctl NULL
+#endif /* CONFIG_COMPAT */
+
+static int spidev_release(struct inode *inode, struct file *filp)
+{
+    struct spifpga_file *pf = filp->private_data;
+    struct spidev_data  *spidev = pf->spidev;
+    int         status = 0;
+
+    /* the ring can't still be mapped, a mapping holds the file open */
+    if (pf->ring)
+        spifpga_ring_free(pf->ring);
+    if (pf->event_pg.max)
+        spifpga_page_free(&pf->event_pg);
+    kfree(pf->ra.buf);
+    kfree(pf->wc.buf);
+    kfree(pf);
+
+    mutex_lock(&device_list_lock);
+    filp->private_data = NULL;
+
+    /* last close? */
+    spidev->users--;
+    if (!spidev->users) {
+        int     dofree;
+
+        kfree(spidev->buffer);
+        spidev->buffer = NULL;
+        /* the gateware may be reloaded before the next open */
+        spidev->proto = -1;
+
+        /* ... after we unbound from the underlying device? */
+        spin_lock_irq(&spidev->spi_lock);
+        dofree = (spidev->spi == NULL);
+        spin_unlock_irq(&spidev->spi_lock);
+
+        if (dofree)
+            kfree(spidev);
+    }
+    mutex_unlock(&device_list_lock);
+
+    return status;
+}
+
+
+/*-------------------------------------------------------------------------*/
+
+static const struct file_operations main_fops = {
+    .owner =    THIS_MODULE,
+    .open =     main_open,
+};
+
+static const struct file_operations spidev_fops = {
+    .owner =    THIS_MODULE,
+    /* REVISIT switch to aio primitives, so that userspace
+     * gets more complete API coverage.  It'll simplify things
+     * too, except for the locking.
+     */
+    .write =    spidev_write,
+    .read =     spidev_read,
+    .unlocked_ioctl = spidev_ioctl,
+    .compat_ioctl = spidev_compat_ioctl,
+    .release =  spidev_release,
+    .llseek =   no_llseek,
+};
+
+static const struct file_operations spifpga_fops = {
+    .owner =    THIS_MODULE,
+    .read_iter =    spifpga_read_iter,
+    .write_iter =   spifpga_write_iter,
+    .unlocked_ioctl = spifpga_ioctl,
+    .compat_ioctl = spifpga_compat_ioctl,
+    .mmap =     spifpga_mmap,
+    .poll =     spifpga_poll,
+    .fsync =    spifpga_fsync,
+    .flush =    spifpga_flush,
+    .release =  spidev_release,
+    .llseek =   spifpga_llseek,
+};
+
+/*-------------------------------------------------------------------------*/
+
+/* The main reason to have this class is to make mdev/udev create the
+ * /dev/spidevB.C character device nodes exposing our userspace API.
+ * It also simplifies memory management.
+ */
+
+static struct class *spidev_class;
+
+/*-------------------------------------------------------------------------*/
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * debugfs: <debugfs>/spifpga/spifpgaB.C/stats shows the counters, and
+ * writing anything to the "reset" file next to it zeroes them.
+ */
+static struct dentry *spifpga_debugfs;
+
+static void spifpga_show_hist(struct seq_file *s, const char *name,
+        atomic64_t *hist)
+{
+    unsigned    i;
+    u64         n;
+
+    seq_printf(s, "%s:\n", name);
+    for (i = 0; i < SPIFPGA_HIST_BUCKETS; i++) {
+        n = atomic64_read(&hist[i]);
+        if (n == 0)
+            continue;
+        if (i == 0)
+            seq_printf(s, "  [0, 1): %llu\n", n);
+        else
+            seq_printf(s, "  [%llu, %llu): %llu\n", 1ULL << (i - 1),
+                    1ULL << i, n);
+    }
+}
+
+static int spifpga_stats_show(struct seq_file *s, void *unused)
+{
+    struct spidev_data  *spidev = s->private;
+    struct spifpga_stats *st = &spidev->stats;
+    unsigned    i;
+
+    seq_printf(s, "bufsiz: %u\n", bufsiz);
+    seq_printf(s, "page_bytes: %zu\n", spifpga_page_bytes(spidev));
+    seq_printf(s, "frames_per_page: %u\n", spifpga_transfers_per_page(spidev));
+    seq_printf(s, "messages: %lld\n", atomic64_read(&st->messages));
+    seq_printf(s, "message_errors: %lld\n", atomic64_read(&st->errors));
+    seq_printf(s, "wire_bytes: %lld\n", atomic64_read(&st->wire_bytes));
+    seq_printf(s, "protocol: %s\n", spidev->proto < 0 ? "unknown" :
+            spidev->proto == SPIFPGA_PROTO_BURST ? "burst" : "frames");
+    seq_printf(s, "frames: %lld\n", atomic64_read(&st->frames));
+    seq_printf(s, "bursts: %lld\n", atomic64_read(&st->bursts));
+    seq_printf(s, "payload_bytes: %lld\n", atomic64_read(&st->payload_bytes));
+    seq_printf(s, "requests: %lld\n", atomic64_read(&st->requests));
+    seq_printf(s, "pages: %lld\n", atomic64_read(&st->pages));
+    seq_printf(s, "lock_acquired: %lld\n", atomic64_read(&st->lock_acquired));
+    seq_printf(s, "lock_wait_ns: %lld\n", atomic64_read(&st->lock_wait_ns));
+    for (i = 0; i < ARRAY_SIZE(st->resp); i++)
+        if (atomic64_read(&st->resp[i]))
+            seq_printf(s, "resp 0x%02x: %lld\n", i,
+                    atomic64_read(&st->resp[i]));
+    spifpga_show_hist(s, "pages_per_request", st->pages_hist);
+    spifpga_show_hist(s, "sync_latency_us", st->sync_us_hist);
+    return 0;
+}
+
+static int spifpga_stats_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, spifpga_stats_show, inode->i_private);
+}
+
+static const struct file_operations spifpga_stats_fops = {
+    .owner =    THIS_MODULE,
+    .open =     spifpga_stats_open,
+    .read =     seq_read,
+    .llseek =   seq_lseek,
+    .release =  single_release,
+};
+
+static ssize_t spifpga_stats_reset(struct file *filp, const char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    struct spidev_data  *spidev = filp->private_data;
+    atomic64_t  *counter = (atomic64_t *)&spidev->stats;
+    unsigned    i;
+
+    for (i = 0; i < sizeof(spidev->stats) / sizeof(*counter); i++)
+        atomic64_set(&counter[i], 0);
+    return count;
+}
+
+static const struct file_operations spifpga_reset_fops = {
+    .owner =    THIS_MODULE,
+    .open =     simple_open,
+    .write =    spifpga_stats_reset,
+    .llseek =   noop_llseek,
+};
+
+static void spifpga_debugfs_add(struct spidev_data *spidev)
+{
+    struct spi_device   *spi = spidev->spi;
+    char        name[32];
+
+    if (IS_ERR_OR_NULL(spifpga_debugfs))
+        return;
+
+    snprintf(name, sizeof(name), "spifpga%d.%d",
+            spi->master->bus_num, spi->chip_select);
+    spidev->debugfs = debugfs_create_dir(name, spifpga_debugfs);
+    if (IS_ERR_OR_NULL(spidev->debugfs))
+        return;
+    debugfs_create_file("stats", S_IRUSR, spidev->debugfs, spidev,
+            &spifpga_stats_fops);
+    debugfs_create_file("reset", S_IWUSR, spidev->debugfs, spidev,
+            &spifpga_reset_fops);
+}
+
+static int spidev_probe(struct spi_device *spi)
+{
+    struct spidev_data  *spidev;
+    int         status = 0;
+    int         status1 = 0;
+    unsigned long       minor;
+    printk(KERN_INFO "Probing spidev\n");
+
+    /* Allocate driver data */
+    spidev = kzalloc(sizeof(*spidev), GFP_KERNEL);
+    if (!spidev)
+        return -ENOMEM;
+
+    /* Initialize the driver data */
+    spidev->spi = spi;
+    spin_lock_init(&spidev->spi_lock);
+    mutex_init(&spidev->buf_lock);
+    init_waitqueue_head(&spidev->event_wait);
+    init_waitqueue_head(&spidev->urgent_wait);
+    spidev->proto = -1;
+
+    INIT_LIST_HEAD(&spidev->device_entry);
+
+    /* If we can allocate a minor number, hook up this device.
+     * Reusing minors is fine so long as udev or mdev is working.
+     */
+    mutex_lock(&device_list_lock);
+    /* Let all the spidev-like interfaces have even minor numbers.
+     * and give the fpga interfaces this number + 1
+     */
+    minor = find_first_zero_bit(minors, N_SPI_MINORS)*2;
+    printk(KERN_INFO "Minor number is %ld\n", minor);
+    if (minor < N_SPI_MINORS*2) {
+        struct device *dev;
+
+        spidev->devt = MKDEV(Major, minor);
+        printk(KERN_INFO "Creating devices 1\n");
+        /* Register two devices. One which acts exactly like
+         * the original spidev device, and one which we will
+         * use to send read/write commands to the FPGA
+         */
+        dev = device_create(spidev_class, &spi->dev, spidev->devt,
+                    spidev, "spidev%d.%d",
+                    spi->master->bus_num, spi->chip_select);
+        status = PTR_ERR_OR_ZERO(dev);
+        printk(KERN_INFO "Creating devices 2\n");
+        dev = device_create(spidev_class, &spi->dev, MKDEV(Major,minor + 1),
+                    spidev, "spifpga%d.%d",
+                    spi->master->bus_num, spi->chip_select);
+        status1 = PTR_ERR_OR_ZERO(dev);
+    } else {
+        dev_dbg(&spi->dev, "no minor number available!\n");
+        status = -ENODEV;
+    }
+    if (status == 0) {
+        set_bit(minor, minors);
+        list_add(&spidev->device_entry, &device_list);
+    }
+    mutex_unlock(&device_list_lock);
+
+    if (status == 0) {
+        spi_set_drvdata(spi, spidev);
+        spifpga_update_limits(spidev);
+        spifpga_irq_probe(spidev);
+        spifpga_debugfs_add(spidev);
+    } else
+        kfree(spidev);
+
+    /* This will mangle the error codes, but for now
+     * do it anyway.
+     */
+    return status + status1;
+}
+
+static int spidev_remove(struct spi_device *spi)
+{
+    struct spidev_data  *spidev = spi_get_drvdata(spi);
+
+    /* make sure ops on existing fds can abort cleanly */
+    spin_lock_irq(&spidev->spi_lock);
+    spidev->spi = NULL;
+    spi_set_drvdata(spi, NULL);
+    spin_unlock_irq(&spidev->spi_lock);
+
+    debugfs_remove_recursive(spidev->debugfs);
+    spidev->debugfs = NULL;
+
+    /* no more events, and kick anyone waiting for one */
+    if (spidev->irq)
+        free_irq(spidev->irq, spidev);
+    wake_up_interruptible(&spidev->event_wait);
+
+    /* prevent new opens */
+    mutex_lock(&device_list_lock);
+    list_del(&spidev->device_entry);
+    device_destroy(spidev_class, MKDEV(Major,MINOR(spidev->devt)));
+    device_destroy(spidev_class, MKDEV(Major,MINOR(spidev->devt) + 1));
+    clear_bit(MINOR(spidev->devt), minors);
+    if (spidev->users == 0)
+        kfree(spidev);
+    mutex_unlock(&device_list_lock);
+
+    return 0;
+}
+
+static const struct of_device_id spidev_dt_ids[] = {
+    { .compatible = "rohm,dh2228fv" },
+    {},
+};
+
+MODULE_DEVICE_TABLE(of, spidev_dt_ids);
+
+static struct spi_driver spidev_spi_driver = {
+    .driver = {
+        .name =     "spifpga",
+        .owner =    THIS_MODULE,
+        .of_match_table = of_match_ptr(spidev_dt_ids),
+    },
+    .probe =    spidev_probe,
+    .remove =   spidev_remove,
+
+    /* NOTE:  suspend/resume methods are not necessary here.
+     * We don't do anything except pass the requests to/from
+     * the underlying controller.  The refrigerator handles
+     * most issues; the controller driver handles the rest.
+     */
+};
+
+/*-------------------------------------------------------------------------*/
+
+static int __init spidev_init(void)
+{
+    int status;
+
+    /* Claim our 256 reserved device numbers.  Then register a class
+     * that will key udev/mdev to add/remove /dev nodes.  Last, register
+     * the driver which manages those device numbers.
+     */
+    BUILD_BUG_ON(2*N_SPI_MINORS > 256);
+    printk(KERN_INFO "registering chrdev\n");
+    Major = register_chrdev(SPIFPGA_MAJOR, "spifpga", &main_fops);
+    printk(KERN_INFO "Major number is %d\n", Major);
+    if (Major < 0)
+        return Major;
+
+    printk(KERN_INFO "Creating class\n");
+    spidev_class = class_create(THIS_MODULE, "spifpga");
+    if (IS_ERR(spidev_class)) {
+        unregister_chrdev(Major, spidev_spi_driver.driver.name);
+        return PTR_ERR(spidev_class);
+    }
+
+    /* debugfs is only for statistics, carry on without it */
+    spifpga_debugfs = debugfs_create_dir("spifpga", NULL);
+
+    printk(KERN_INFO "registering driver\n");
+    status = spi_register_driver(&spidev_spi_driver);
+    printk(KERN_INFO "STATUS: %d\n", status);
+    if (status < 0) {
+        debugfs_remove_recursive(spifpga_debugfs);
+        class_destroy(spidev_class);
+        unregister_chrdev(Major, spidev_spi_driver.driver.name);
+    }
+ 
+
+    return status;
+}
+module_init(spidev_init);
+
+static void __exit spidev_exit(void)
+{
+    spi_unregister_driver(&spidev_spi_driver);
+    debugfs_remove_recursive(spifpga_debugfs);
+    class_unregister(spidev_class);
+    class_destroy(spidev_class);
+    //unregister_chrdev(Major, spidev_spi_driver.driver.name);
+    printk(KERN_INFO "unregistering %s\n", spidev_spi_driver.driver.name);
+    unregister_chrdev(Major, "spifpga");
+}
+module_exit(spidev_exit);
+
+MODULE_AUTHOR("Andrea Paterniani, <a.paterniani@swapp-eng.it>");
+MODULE_DESCRIPTION("User mode SPI device interface");
+MODULE_LICENSE("GPL");
+MODULE_ALIAS("spi:spifpga");
@@ -0,0 +1,223 @@
+/*
+ * Tracepoints of the spifpga driver, in the "spifpga" trace system:
+ *
+ *  spifpga_request_start/end   a read(), write() or SPI_IOC_MESSAGE
+ *  spifpga_lock_acquire        buf_lock taken, and how long that waited
+ *  spifpga_page_submit         an spi_message handed to the controller
+ *  spifpga_page_complete       ... and back, with its status
+ *  spifpga_copy_in/out         the copy of a request's data from/to user
+ *
+ * They cost a static branch each while disabled. page_submit/complete
+ * carry the spi_message pointer, as the controller's own spi:spi_message_*
+ * events do, so the two can be joined; see spifpga_latency.bt.
+ *
+ * The userspace build (mock/) has no tracepoints, and gets empty inlines.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define SPIFPGA_REQ_READ        0
+#define SPIFPGA_REQ_WRITE       1
+#define SPIFPGA_REQ_MESSAGE     2
+
+#ifndef __KERNEL__
+
+#ifndef SPIFPGA_TRACE_H
+#define SPIFPGA_TRACE_H
+
+static inline void trace_spifpga_request_start(struct spidev_data *spidev,
+        int req, u32 addr, size_t bytes) { }
+static inline void trace_spifpga_request_end(struct spidev_data *spidev,
+        int req, u32 addr, ssize_t status) { }
+static inline void trace_spifpga_lock_acquire(struct spidev_data *spidev,
+        u64 wait_ns) { }
+static inline void trace_spifpga_page_submit(struct spidev_data *spidev,
+        struct spi_message *msg) { }
+static inline void trace_spifpga_page_complete(struct spidev_data *spidev,
+        struct spi_message *msg, ssize_t status) { }
+static inline bool trace_spifpga_copy_in_enabled(void) { return false; }
+static inline bool trace_spifpga_copy_out_enabled(void) { return false; }
+static inline void trace_spifpga_copy_in(size_t bytes, size_t copied,
+        u64 start_ns) { }
+static inline void trace_spifpga_copy_out(size_t bytes, size_t copied,
+        u64 start_ns) { }
+
+#endif /* SPIFPGA_TRACE_H */
+
+#else
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM spifpga
+
+#if !defined(SPIFPGA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SPIFPGA_TRACE_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+
+#define show_spifpga_req(req)                       \
+    __print_symbolic(req,                           \
+            { SPIFPGA_REQ_READ,     "read" },       \
+            { SPIFPGA_REQ_WRITE,    "write" },      \
+            { SPIFPGA_REQ_MESSAGE,  "message" })
+
+TRACE_EVENT(spifpga_request_start,
+
+    TP_PROTO(struct spidev_data *spidev, int req, u32 addr, size_t bytes),
+
+    TP_ARGS(spidev, req, addr, bytes),
+
+    TP_STRUCT__entry(
+        __field(dev_t,      devt)
+        __field(int,        req)
+        __field(u32,        addr)
+        __field(size_t,     bytes)
+    ),
+
+    TP_fast_assign(
+        __entry->devt = spidev->devt;
+        __entry->req = req;
+        __entry->addr = addr;
+        __entry->bytes = bytes;
+    ),
+
+    TP_printk("dev %d:%d %s addr 0x%08x bytes %zu",
+        MAJOR(__entry->devt), MINOR(__entry->devt),
+        show_spifpga_req(__entry->req), __entry->addr, __entry->bytes)
+);
+
+TRACE_EVENT(spifpga_request_end,
+
+    TP_PROTO(struct spidev_data *spidev, int req, u32 addr, ssize_t status),
+
+    TP_ARGS(spidev, req, addr, status),
+
+    TP_STRUCT__entry(
+        __field(dev_t,      devt)
+        __field(int,        req)
+        __field(u32,        addr)
+        __field(ssize_t,    status)
+    ),
+
+    TP_fast_assign(
+        __entry->devt = spidev->devt;
+        __entry->req = req;
+        __entry->addr = addr;
+        __entry->status = status;
+    ),
+
+    TP_printk("dev %d:%d %s addr 0x%08x status %zd",
+        MAJOR(__entry->devt), MINOR(__entry->devt),
+        show_spifpga_req(__entry->req), __entry->addr, __entry->status)
+);
+
+TRACE_EVENT(spifpga_lock_acquire,
+
+    TP_PROTO(struct spidev_data *spidev, u64 wait_ns),
+
+    TP_ARGS(spidev, wait_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t,      devt)
+        __field(u64,        wait_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->devt = spidev->devt;
+        __entry->wait_ns = wait_ns;
+    ),
+
+    TP_printk("dev %d:%d waited %llu ns",
+        MAJOR(__entry->devt), MINOR(__entry->devt), __entry->wait_ns)
+);
+
+TRACE_EVENT(spifpga_page_submit,
+
+    TP_PROTO(struct spidev_data *spidev, struct spi_message *msg),
+
+    TP_ARGS(spidev, msg),
+
+    TP_STRUCT__entry(
+        __field(dev_t,      devt)
+        __field(void *,     msg)
+    ),
+
+    TP_fast_assign(
+        __entry->devt = spidev->devt;
+        __entry->msg = msg;
+    ),
+
+    TP_printk("dev %d:%d msg %p",
+        MAJOR(__entry->devt), MINOR(__entry->devt), __entry->msg)
+);
+
+TRACE_EVENT(spifpga_page_complete,
+
+    TP_PROTO(struct spidev_data *spidev, struct spi_message *msg,
+        ssize_t status),
+
+    TP_ARGS(spidev, msg, status),
+
+    TP_STRUCT__entry(
+        __field(dev_t,      devt)
+        __field(void *,     msg)
+        __field(ssize_t,    status)
+    ),
+
+    TP_fast_assign(
+        __entry->devt = spidev->devt;
+        __entry->msg = msg;
+        __entry->status = status;
+    ),
+
+    TP_printk("dev %d:%d msg %p status %zd",
+        MAJOR(__entry->devt), MINOR(__entry->devt), __entry->msg,
+        __entry->status)
+);
+
+/* start_ns is 0 if the event was enabled after the copy started */
+DECLARE_EVENT_CLASS(spifpga_copy,
+
+    TP_PROTO(size_t bytes, size_t copied, u64 start_ns),
+
+    TP_ARGS(bytes, copied, start_ns),
+
+    TP_STRUCT__entry(
+        __field(size_t,     bytes)
+        __field(size_t,     copied)
+        __field(u64,        ns)
+    ),
+
+    TP_fast_assign(
+        __entry->bytes = bytes;
+        __entry->copied = copied;
+        __entry->ns = start_ns ? ktime_get_ns() - start_ns : 0;
+    ),
+
+    TP_printk("bytes %zu copied %zu in %llu ns",
+        __entry->bytes, __entry->copied, __entry->ns)
+);
+
+DEFINE_EVENT(spifpga_copy, spifpga_copy_in,
+    TP_PROTO(size_t bytes, size_t copied, u64 start_ns),
+    TP_ARGS(bytes, copied, start_ns)
+);
+
+DEFINE_EVENT(spifpga_copy, spifpga_copy_out,
+    TP_PROTO(size_t bytes, size_t copied, u64 start_ns),
+    TP_ARGS(bytes, copied, start_ns)
+);
+
+#endif /* SPIFPGA_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE spifpga_trace
+#include <trace/define_trace.h>
+
+#endif /* __KERNEL__ */
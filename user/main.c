@@ -1,84 +1,582 @@
-#include <stdbool.h>
-#include <ctype.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include "spifpga_user.h"
-
-void help();
-
-int main(int argc, char **argv)
-{
-
-	bool writeFlag = false;
-	bool readFlag = false;
-	bool addrFlag=false;
-	unsigned int addr = 0;
-	unsigned int data = 0;
-	int index;
-	int c;
-
-	opterr = 0;
-
-	while ((c = getopt (argc, argv, "a:rw:c")) != -1)
-		switch (c) {
-			case 'a':
-				addrFlag = true;
-				addr = strtol(optarg,NULL,0);
-				break;
-			case 'r':
-				readFlag = true;
-				break;
-			case 'w':
-				writeFlag = true;
-				data = strtol(optarg,NULL,0);
-				break;
-			case '?':
-				help();
-				return 1;
-			default:
-				abort ();
-		}
-
-	for (index = optind; index < argc; index++) {
-		help();
-		return 1;
-	}
-
-	if ((readFlag && writeFlag) ||
-			(!readFlag && !writeFlag) ||
-			(!addrFlag)) {
-		help();
-		return 1;
-	}
-
-
-	int fd, ret;
-
-	fd = config_spi();
-	if (fd < 1)
-	{
-		fprintf(stderr,"Failed to configure SPI\n");
-		return fd;
-	}
-
-	if (readFlag) {
-		ret = read_word(fd, addr, &data);
-		fprintf(stdout,"0x%x\n", data);
-		fprintf(stderr,"Read response was %u\n",ret);
-	} else if (writeFlag) {
-		ret = write_word(fd, addr, data);
-		fprintf(stderr,"Write response was %u\n",ret);
-	}
-
-	close(fd);
-	return 0;
-
-}
-
-void help(){
-	printf ("SPI command line tool for Jasper workflow.\n");
-	printf ("Usage:\n");
-	printf ("\tSPI read: spifpga_user -a addr -r\n");
-	printf ("\tSPI write: spifpga_user -a addr -w data\n");
-}
+#include <stdbool.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_regmap.h"
+#include "spifpga_snapshot.h"
+#include "spifpga_capture.h"
+#include "spifpga_image.h"
+#include "spifpga_checkpoint.h"
+#include "spifpga_watch.h"
+
+#define MAX_RANGES 256
+
+void help();
+
+/* A number, or a register name from the map (loaded on first use) */
+static int parse_addr(const char *s, const char *mapfile,
+		struct spifpga_regmap **map, unsigned int *addr)
+{
+	const struct regmap_entry *e;
+	char *end;
+
+	*addr = strtoul(s,&end,0);
+	if (*s && !*end)
+		return 0;
+	if (!*map)
+		*map = regmap_load(mapfile);
+	if (!*map)
+		return -1;
+	e = regmap_find(*map, s);
+	if (!e) {
+		fprintf(stderr,"No register %s in the map\n", s);
+		return -1;
+	}
+	*addr = e->addr;
+	return 0;
+}
+
+/* -S ctrl,status,bram,bytes[,done_mask] */
+static int parse_snapshot(char *spec, const char *mapfile,
+		struct spifpga_regmap **map, struct snapshot_desc *desc)
+{
+	unsigned int val[5] = { 0, 0, 0, 0, 0x80000000 };
+	char *tok, *save;
+	int n = 0;
+
+	for (tok = strtok_r(spec, ",", &save); tok && n < 5;
+			tok = strtok_r(NULL, ",", &save), n++) {
+		if (n == 3 || n == 4)
+			val[n] = strtoul(tok,NULL,0);
+		else if (parse_addr(tok, mapfile, map, &val[n]) != 0)
+			return -1;
+	}
+	if (n < 4 || tok) {
+		help();
+		return -1;
+	}
+
+	desc->ctrl_addr = val[0];
+	desc->arm_val = 1;
+	desc->status_addr = val[1];
+	desc->done_mask = val[4];
+	desc->bram_addr = val[2];
+	desc->n_bytes = val[3];
+	desc->timeout_us = 1000000;
+	return 0;
+}
+
+/* Capture count times, print the words of one capture, or the capture rate */
+static int snapshot_cmd(int fd, const struct snapshot_desc *desc, unsigned int count)
+{
+	struct snapshot_stats stats;
+	struct snapshot *snap;
+	unsigned int i, *buf;
+	int ret = 0;
+
+	snap = snapshot_new(fd, desc, NULL);
+	if (!snap)
+		return 1;
+
+	for (i = 0; i < count && ret == RESP_OK; i++)
+		ret = snapshot_capture(snap);
+	if (ret != RESP_OK) {
+		fprintf(stderr,"Capture %u failed (%d)\n", i, ret);
+	} else if (count == 1) {
+		buf = snapshot_data(snap);
+		for (i = 0; i < (desc->n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD; i++)
+			fprintf(stdout,"0x%08x\n", buf[i]);
+	} else {
+		snapshot_get_stats(snap, &stats);
+		fprintf(stderr,"%lu captures of %u bytes in %.3f s, %.1f captures/s, %lu polls\n",
+				stats.captures, desc->n_bytes, stats.seconds,
+				stats.captures / stats.seconds, stats.polls);
+	}
+	snapshot_free(snap);
+	return ret != RESP_OK;
+}
+
+static volatile sig_atomic_t interrupted;
+
+static void on_interrupt(int sig)
+{
+	interrupted = 1;
+}
+
+static void print_capture(const struct capture_stats *st, unsigned int n_blocks)
+{
+	fprintf(stderr,"%.0f s: %.2f MB/s, %llu blocks, ring %u/%u (max %u), %llu overruns, %llu errors\n",
+			st->seconds, st->seconds > 0 ? st->bytes_written / st->seconds / 1e6 : 0,
+			st->blocks, st->occupancy, n_blocks, st->max_occupancy,
+			st->overruns, st->read_errors);
+}
+
+/* -L file: stream blocks to file until count are read, or ^C */
+static int capture_cmd(int fd, const struct capture_config *cfg, const char *path)
+{
+	struct capture_stats st;
+	struct capture *cap;
+	int ticks = 0, ret;
+
+	signal(SIGINT, on_interrupt);
+	signal(SIGTERM, on_interrupt);
+	cap = capture_start(fd, cfg, path);
+	if (!cap)
+		return 1;
+	while (!interrupted && capture_running(cap)) {
+		usleep(100000);
+		if (++ticks % 10 == 0) {
+			capture_get_stats(cap, &st);
+			print_capture(&st, cfg->n_blocks);
+		}
+	}
+	ret = capture_stop(cap, &st);
+	print_capture(&st, cfg->n_blocks);
+	return ret != 0;
+}
+
+/*
+ * -R addr[:bytes],...: a register name without a length is the whole
+ * register, a number without one is a word. Returns the number of
+ * ranges, or -1.
+ */
+static int parse_ranges(char *spec, const char *mapfile, struct spifpga_regmap **map,
+		struct checkpoint_range *ranges, unsigned int max)
+{
+	const struct regmap_entry *e;
+	char *tok, *save, *len;
+	unsigned int n = 0;
+
+	for (tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (n == max) {
+			fprintf(stderr,"Too many ranges\n");
+			return -1;
+		}
+		len = strchr(tok, ':');
+		if (len)
+			*len++ = '\0';
+		if (parse_addr(tok, mapfile, map, &ranges[n].addr) != 0)
+			return -1;
+		e = *map ? regmap_find(*map, tok) : NULL;
+		ranges[n++].n_bytes = len ? strtoul(len,NULL,0) : e ? e->size : BYTES_PER_WORD;
+	}
+	return n;
+}
+
+/* The -R ranges, or without -R the rw, non-volatile registers of the map */
+static struct checkpoint *parse_checkpoint(char *spec, const char *mapfile,
+		struct spifpga_regmap **map)
+{
+	struct checkpoint_range ranges[MAX_RANGES];
+	int n;
+
+	if (!spec) {
+		if (!*map)
+			*map = regmap_load(mapfile);
+		return *map ? checkpoint_from_regmap(*map) : NULL;
+	}
+	n = parse_ranges(spec, mapfile, map, ranges, MAX_RANGES);
+	return n < 0 ? NULL : checkpoint_new(ranges, n);
+}
+
+/* -k file takes a checkpoint, -K file restores one (-y: changed words only) */
+static int checkpoint_cmd(int fd, const char *take, const char *restore, bool diff,
+		char *spec, const char *mapfile, struct spifpga_regmap **map)
+{
+	struct checkpoint_stats st;
+	struct checkpoint *cp;
+	int ret;
+
+	cp = take ? parse_checkpoint(spec, mapfile, map) : checkpoint_load(restore);
+	if (!cp)
+		return 1;
+	if (take) {
+		ret = checkpoint_take(fd, cp);
+		if (ret == RESP_OK)
+			ret = checkpoint_save(cp, take) == 0 ? RESP_OK : -1;
+	} else {
+		ret = checkpoint_restore(fd, cp, diff, &st);
+		fprintf(stderr,"%u of %u words written in %u bulk writes\n",
+				st.written, st.words, st.runs);
+	}
+	fprintf(stderr,"Checkpoint response was %d\n", ret);
+	checkpoint_free(cp);
+	return ret != RESP_OK;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_watch(const struct watch_stats *st, double seconds, double hz,
+		unsigned long long late)
+{
+	fprintf(stderr,"%.1f samples/s of %.1f, bus %.0f us/sample (max %.0f), %.1f%% busy, %llu changes, %llu late\n",
+			seconds > 0 ? st->samples / seconds : 0, hz,
+			st->samples ? st->total_bus_s * 1e6 / st->samples : 0, st->max_bus_us,
+			seconds > 0 ? 100 * st->total_bus_s / seconds : 0, st->changes, late);
+}
+
+/*
+ * -W hz: sample the ranges hz times a second until count samples or ^C,
+ * printing the words that change with the time since the start
+ */
+static int watch_cmd(int fd, const struct checkpoint_range *ranges, unsigned int n,
+		double hz, long long count)
+{
+	struct watch_change *changes;
+	struct watch_stats st;
+	struct timespec next;
+	struct watch *w;
+	unsigned long long late = 0;
+	unsigned int i, n_changes;
+	double start, t, shown = 0;
+	long long period_ns = 1e9 / hz, ns;
+	int ret = RESP_OK;
+
+	w = watch_new(fd, ranges, n);
+	if (!w)
+		return 1;
+	changes = malloc((watch_words(w) ? watch_words(w) : 1) * sizeof(*changes));
+	if (!changes) {
+		fprintf(stderr,"Failed to allocate\n");
+		watch_free(w);
+		return 1;
+	}
+	signal(SIGINT, on_interrupt);
+	signal(SIGTERM, on_interrupt);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	start = now_s();
+	for (; !interrupted && count != 0; count -= count > 0) {
+		t = now_s() - start;
+		ret = watch_sample(w, changes, &n_changes);
+		if (ret != RESP_OK) {
+			fprintf(stderr,"Sample failed (%d)\n", ret);
+			break;
+		}
+		for (i = 0; i < n_changes; i++)
+			fprintf(stdout,"%12.6f 0x%08x 0x%08x -> 0x%08x\n", t,
+					changes[i].addr, changes[i].old, changes[i].val);
+		if (n_changes)
+			fflush(stdout);
+		if (t - shown >= 1) {
+			watch_get_stats(w, &st);
+			print_watch(&st, t, hz, late);
+			shown = t;
+		}
+
+		/* the next tick, or now if this one overran it */
+		ns = next.tv_nsec + period_ns;
+		next.tv_sec += ns / 1000000000;
+		next.tv_nsec = ns % 1000000000;
+		if (now_s() > next.tv_sec + next.tv_nsec / 1e9) {
+			late++;
+			clock_gettime(CLOCK_MONOTONIC, &next);
+		} else {
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+	}
+	watch_get_stats(w, &st);
+	print_watch(&st, now_s() - start, hz, late);
+	free(changes);
+	watch_free(w);
+	return ret != RESP_OK;
+}
+
+/* A progress line on stderr, a few times a second and at the end */
+static void print_progress(const struct image_progress *p, void *ctx)
+{
+	double *last = ctx;
+
+	if (p->done < p->total && p->seconds - *last < 0.25)
+		return;
+	*last = p->seconds;
+	fprintf(stderr,"\r%5.1f%%  %llu of %llu bytes  %.2f MB/s%s",
+			p->total ? 100.0 * p->done / p->total : 100.0, p->done, p->total,
+			p->seconds > 0 ? p->done / p->seconds / 1e6 : 0,
+			p->done == p->total ? "\n" : "");
+}
+
+int main(int argc, char **argv)
+{
+
+	bool writeFlag = false;
+	bool readFlag = false;
+	bool addrFlag=false;
+	bool calibrateFlag = false;
+	char *snapSpec = NULL;
+	const char *logFile = NULL;
+	long long count = -1;
+	struct snapshot_desc desc;
+	struct capture_config cfg = { 0, 65536, 64, 0, NULL, false };
+	bool bad;
+	const char *uploadFile = NULL, *downloadFile = NULL;
+	unsigned long long length = 0, offset = 0;
+	bool hexFlag = false;
+	const char *takeFile = NULL, *restoreFile = NULL;
+	char *rangeSpec = NULL;
+	bool diffFlag = false;
+	double watchRate = 0;
+	struct checkpoint_range ranges[MAX_RANGES];
+	int n_ranges = 0;
+	double last = -1;
+	const char *device = DEVICE;
+	const char *mapfile = NULL, *reg = NULL;
+	struct spifpga_regmap *map = NULL;
+	char *end;
+	unsigned int addr = 0;
+	unsigned int data = 0;
+	int index;
+	int c;
+
+	opterr = 0;
+
+	while ((c = getopt (argc, argv, "a:rw:cCd:m:S:n:L:b:Du:o:l:O:xk:K:R:yW:")) != -1)
+		switch (c) {
+			case 'a':
+				addrFlag = true;
+				addr = strtol(optarg,&end,0);
+				if (*end)
+					reg = optarg;	/* a register name */
+				break;
+			case 'r':
+				readFlag = true;
+				break;
+			case 'w':
+				writeFlag = true;
+				data = strtol(optarg,NULL,0);
+				break;
+			case 'C':
+				calibrateFlag = true;
+				break;
+			case 'd':
+				device = optarg;
+				break;
+			case 'm':
+				mapfile = optarg;
+				break;
+			case 'S':
+				snapSpec = optarg;
+				break;
+			case 'n':
+				count = strtoull(optarg,NULL,0);
+				break;
+			case 'L':
+				logFile = optarg;
+				break;
+			case 'b':
+				cfg.block_bytes = strtoul(optarg,NULL,0);
+				break;
+			case 'D':
+				cfg.direct = true;
+				break;
+			case 'u':
+				uploadFile = optarg;
+				break;
+			case 'o':
+				downloadFile = optarg;
+				break;
+			case 'l':
+				length = strtoull(optarg,NULL,0);
+				break;
+			case 'O':
+				offset = strtoull(optarg,NULL,0);
+				break;
+			case 'x':
+				hexFlag = true;
+				break;
+			case 'k':
+				takeFile = optarg;
+				break;
+			case 'K':
+				restoreFile = optarg;
+				break;
+			case 'R':
+				rangeSpec = optarg;
+				break;
+			case 'y':
+				diffFlag = true;
+				break;
+			case 'W':
+				watchRate = strtod(optarg,NULL);
+				break;
+			case '?':
+				help();
+				return 1;
+			default:
+				abort ();
+		}
+
+	for (index = optind; index < argc; index++) {
+		help();
+		return 1;
+	}
+
+	if (watchRate)
+		bad = readFlag || writeFlag || calibrateFlag || snapSpec || logFile ||
+			uploadFile || downloadFile || takeFile || restoreFile || diffFlag ||
+			addrFlag == (rangeSpec != NULL) || watchRate < 0 || count == 0;
+	else if (takeFile || restoreFile)
+		bad = readFlag || writeFlag || calibrateFlag || snapSpec || logFile || addrFlag ||
+			uploadFile || downloadFile || (takeFile && restoreFile) ||
+			(restoreFile && rangeSpec) || (takeFile && diffFlag);
+	else if (uploadFile || downloadFile)
+		bad = readFlag || writeFlag || calibrateFlag || snapSpec || logFile ||
+			!addrFlag || (uploadFile && downloadFile) || (downloadFile && !length);
+	else if (logFile)
+		bad = readFlag || writeFlag || calibrateFlag || addrFlag == (snapSpec != NULL);
+	else if (snapSpec)
+		bad = readFlag || writeFlag || calibrateFlag || addrFlag || count == 0;
+	else
+		bad = (readFlag + writeFlag + calibrateFlag != 1) || !addrFlag;
+	if (bad) {
+		help();
+		return 1;
+	}
+
+
+	int fd, ret;
+
+	if (reg) {
+		const struct regmap_entry *e;
+
+		map = regmap_load(mapfile);
+		if (!map)
+			return 1;
+		e = regmap_find(map, reg);
+		if (!e) {
+			fprintf(stderr,"No register %s in the map\n", reg);
+			return 1;
+		}
+		addr = e->addr;
+	}
+
+	fd = config_spi_dev(device);
+	if (fd < 1)
+	{
+		fprintf(stderr,"Failed to configure SPI\n");
+		return fd;
+	}
+
+	if (snapSpec && parse_snapshot(snapSpec, mapfile, &map, &desc) != 0) {
+		close(fd);
+		regmap_free(map);
+		return 1;
+	}
+
+	if (watchRate) {
+		if (rangeSpec)
+			n_ranges = parse_ranges(rangeSpec, mapfile, &map, ranges, MAX_RANGES);
+		else {
+			ranges[0].addr = addr;
+			ranges[0].n_bytes = BYTES_PER_WORD;
+			n_ranges = 1;
+		}
+		ret = n_ranges < 0 ? 1 : watch_cmd(fd, ranges, n_ranges, watchRate, count);
+		close(fd);
+		regmap_free(map);
+		return ret;
+	} else if (takeFile || restoreFile) {
+		ret = checkpoint_cmd(fd, takeFile, restoreFile, diffFlag, rangeSpec, mapfile, &map);
+		close(fd);
+		regmap_free(map);
+		return ret;
+	} else if (uploadFile || downloadFile) {
+		if (uploadFile)
+			ret = image_upload(fd, addr, uploadFile, hexFlag || image_is_hex(uploadFile),
+					offset, length, print_progress, &last);
+		else
+			ret = image_download(fd, addr, length, downloadFile,
+					hexFlag || image_is_hex(downloadFile), offset, print_progress, &last);
+		close(fd);
+		regmap_free(map);
+		return ret != RESP_OK;
+	} else if (logFile) {
+		cfg.addr = addr;
+		cfg.max_blocks = count < 0 ? 0 : count;
+		cfg.snap = snapSpec ? &desc : NULL;
+		ret = capture_cmd(fd, &cfg, logFile);
+		close(fd);
+		regmap_free(map);
+		return ret;
+	} else if (snapSpec) {
+		ret = snapshot_cmd(fd, &desc, count < 0 ? 1 : count);
+		close(fd);
+		regmap_free(map);
+		return ret;
+	} else if (readFlag && reg) {
+		ret = read_reg(fd, map, reg, &data);
+		fprintf(stdout,"0x%x\n", data);
+		fprintf(stderr,"Read response was %u\n",ret);
+	} else if (writeFlag && reg) {
+		ret = write_reg(fd, map, reg, data);
+		fprintf(stderr,"Write response was %u\n",ret);
+	} else if (readFlag) {
+		ret = read_word(fd, addr, &data);
+		fprintf(stdout,"0x%x\n", data);
+		fprintf(stderr,"Read response was %u\n",ret);
+	} else if (writeFlag) {
+		ret = write_word(fd, addr, data);
+		fprintf(stderr,"Write response was %u\n",ret);
+	} else if (calibrateFlag) {
+		struct spi_profile profile;
+
+		if (calibrate_spi(fd, addr, &profile) != 0) {
+			close(fd);
+			return 1;
+		}
+		fprintf(stdout,"%u Hz, %u frames per message\n",
+				profile.speed, profile.burst_size);
+		if (save_profile(device, &profile) != 0) {
+			close(fd);
+			return 1;
+		}
+	}
+
+	close(fd);
+	regmap_free(map);
+	return 0;
+
+}
+
+void help(){
+	printf ("SPI command line tool for Jasper workflow.\n");
+	printf ("Usage:\n");
+	printf ("\tSPI read: spifpga_user -a addr -r\n");
+	printf ("\tSPI write: spifpga_user -a addr -w data\n");
+	printf ("\tCalibrate clock and burst size: spifpga_user -a scratch_addr -C\n");
+	printf ("\t(the register at scratch_addr is overwritten; the result is\n");
+	printf ("\tsaved in $SPIFPGA_PROFILE or %s)\n", PROFILE_FILE);
+	printf ("\tSnapshot capture: spifpga_user -S ctrl,status,bram,bytes[,done_mask] [-n count]\n");
+	printf ("\t(arms ctrl, waits for done_mask, default 0x80000000, in status and\n");
+	printf ("\treads bytes from bram; prints the words, or the capture rate of count)\n");
+	printf ("\tStream to a file: spifpga_user -a addr -L file [-b block_bytes] [-n blocks] [-D]\n");
+	printf ("\t(reads block_bytes, default 65536, from addr over and over, or\n");
+	printf ("\tsnapshots with -S instead of -a, until blocks are read or ^C;\n");
+	printf ("\t-D writes with O_DIRECT)\n");
+	printf ("\tUpload a file: spifpga_user -a addr -u file [-l max_bytes] [-O offset] [-x]\n");
+	printf ("\tDownload to a file: spifpga_user -a addr -o file -l bytes [-O offset] [-x]\n");
+	printf ("\t(binary, or hex words with -x or a .hex or .txt name; -O resumes\n");
+	printf ("\tan interrupted transfer at the offset it printed)\n");
+	printf ("\tCheckpoint registers: spifpga_user -k file [-R addr[:bytes],...]\n");
+	printf ("\tRestore a checkpoint: spifpga_user -K file [-y]\n");
+	printf ("\t(without -R, the rw, non-volatile registers of the map; -y only\n");
+	printf ("\twrites the words that differ from the FPGA's, after reading them\n");
+	printf ("\tall: faster for a mode switch, slower after a reset)\n");
+	printf ("\tWatch for changes: spifpga_user -W rate_hz {-a addr | -R addr[:bytes],...} [-n samples]\n");
+	printf ("\t(reads the registers rate_hz times a second and prints the words\n");
+	printf ("\tthat change, with the time; the sampling rate and bus time go to stderr)\n");
+	printf ("\t-d device selects the spidev device (default %s)\n", DEVICE);
+	printf ("\taddr can be a register or register.field name from the map\n");
+	printf ("\tgiven with -m mapfile, or in $%s\n", REGMAP_ENV);
+}
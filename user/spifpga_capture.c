@@ -0,0 +1,322 @@
+/*
+ * Streaming capture, see spifpga_capture.h.
+ */
+
+#define _GNU_SOURCE             /* O_DIRECT */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "spifpga_user.h"
+#include "spifpga_snapshot.h"
+#include "spifpga_capture.h"
+
+#define RING_ALIGN 4096
+
+struct capture {
+    int fd;
+    int out;
+    struct capture_config cfg;
+    struct snapshot *snap;
+    unsigned char *ring;        /* n_blocks buffers of block_bytes */
+    unsigned char *spill;       /* read into when the ring is full */
+    pthread_t reader, writer;
+    sem_t filled;               /* posted for every block queued */
+    double start;
+
+    /* head is only written by the reader, tail only by the writer */
+    atomic_ullong head;         /* blocks queued */
+    atomic_ullong tail;         /* blocks written */
+    atomic_bool stop;
+    atomic_bool reader_done;
+    atomic_int error;           /* of the reader or the writer */
+
+    atomic_ullong overruns;
+    atomic_ullong read_errors;
+    atomic_ullong bytes_written;
+    atomic_uint max_occupancy;
+    atomic_ullong max_gap_ns;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int read_block(struct capture *cap, unsigned char *buf)
+{
+    if (cap->snap)
+    {
+        snapshot_set_buffer(cap->snap, (unsigned int *) buf);
+        return snapshot_capture(cap->snap);
+    }
+    return bulk_read(cap->fd, cap->cfg.addr, cap->cfg.block_bytes, (unsigned int *) buf);
+}
+
+static void *capture_reader(void *arg)
+{
+    struct capture *cap = arg;
+    unsigned long long head = 0, reads, tail, last = 0, t, gap;
+    unsigned int occupancy;
+    unsigned char *buf;
+    bool full;
+    int ret;
+
+    for (reads = 0; !atomic_load(&cap->stop) &&
+            (!cap->cfg.max_blocks || reads < cap->cfg.max_blocks); reads++)
+    {
+        tail = atomic_load_explicit(&cap->tail, memory_order_acquire);
+        full = head - tail == cap->cfg.n_blocks;
+        buf = full ? cap->spill :
+                cap->ring + (head % cap->cfg.n_blocks) * cap->cfg.block_bytes;
+
+        t = now_ns();
+        gap = last ? t - last : 0;
+        if (gap > atomic_load_explicit(&cap->max_gap_ns, memory_order_relaxed))
+            atomic_store_explicit(&cap->max_gap_ns, gap, memory_order_relaxed);
+        ret = read_block(cap, buf);
+        last = now_ns();
+        if (ret < 0)
+        {
+            printf("capture read failed (%d), stopping\n", ret);
+            atomic_store(&cap->error, ret);
+            break;
+        }
+        if (ret != RESP_OK)
+            atomic_fetch_add_explicit(&cap->read_errors, 1, memory_order_relaxed);
+        if (full)
+        {
+            atomic_fetch_add_explicit(&cap->overruns, 1, memory_order_relaxed);
+            continue;
+        }
+
+        atomic_store_explicit(&cap->head, ++head, memory_order_release);
+        sem_post(&cap->filled);
+        occupancy = head - tail;
+        if (occupancy > atomic_load_explicit(&cap->max_occupancy, memory_order_relaxed))
+            atomic_store_explicit(&cap->max_occupancy, occupancy, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&cap->reader_done, true, memory_order_release);
+    sem_post(&cap->filled);
+    return NULL;
+}
+
+/* Write all of len from buf; returns 0, or -1 after saying why */
+static int write_all(int out, const unsigned char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len)
+    {
+        n = write(out, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            printf("capture write failed: %s\n", n < 0 ? strerror(errno) : "disk full");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *capture_writer(void *arg)
+{
+    struct capture *cap = arg;
+    unsigned long long head, tail = 0, run;
+    unsigned int n = cap->cfg.n_blocks, slot;
+    bool done;
+
+    while (1)
+    {
+        while (sem_wait(&cap->filled) != 0 && errno == EINTR)
+            ;
+        done = atomic_load_explicit(&cap->reader_done, memory_order_acquire);
+        head = atomic_load_explicit(&cap->head, memory_order_acquire);
+
+        /* the filled buffers up to the end of the ring go in one write */
+        while (tail != head)
+        {
+            slot = tail % n;
+            run = head - tail < n - slot ? head - tail : n - slot;
+            if (write_all(cap->out, cap->ring + (size_t) slot * cap->cfg.block_bytes,
+                    run * cap->cfg.block_bytes) != 0)
+            {
+                atomic_store(&cap->error, -1);
+                atomic_store(&cap->stop, true);
+                /* let the reader finish; its blocks go nowhere */
+                tail = head;
+                atomic_store_explicit(&cap->tail, tail, memory_order_release);
+                break;
+            }
+            tail += run;
+            atomic_store_explicit(&cap->tail, tail, memory_order_release);
+            atomic_fetch_add_explicit(&cap->bytes_written, run * cap->cfg.block_bytes,
+                    memory_order_relaxed);
+        }
+        if (done)
+            break;
+    }
+    return NULL;
+}
+
+static int open_output(const char *path, bool direct)
+{
+    int out, flags;
+
+    out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0 || !direct)
+        return out;
+    /* set afterwards: a pipe or tmpfs refuses it, and a pipe opens once */
+    flags = fcntl(out, F_GETFL);
+    if (flags < 0 || fcntl(out, F_SETFL, flags | O_DIRECT) != 0)
+        printf("%s doesn't take O_DIRECT, writing through the page cache\n", path);
+    return out;
+}
+
+/*
+ * Start capturing from fd into the file at path. fd belongs to the
+ * capture until capture_stop(). Returns NULL, after saying why, if it
+ * can't start.
+ */
+struct capture *capture_start(int fd, const struct capture_config *cfg, const char *path)
+{
+    struct capture *cap;
+    unsigned int block_bytes = cfg->snap ? cfg->snap->n_bytes : cfg->block_bytes;
+
+    if (!block_bytes || block_bytes % BYTES_PER_WORD || cfg->n_blocks < 2)
+    {
+        printf("a capture needs whole word blocks and at least two buffers\n");
+        return NULL;
+    }
+    if (cfg->direct && block_bytes % RING_ALIGN)
+    {
+        printf("O_DIRECT needs blocks of a multiple of %u bytes\n", RING_ALIGN);
+        return NULL;
+    }
+
+    cap = calloc(1, sizeof(*cap));
+    if (!cap)
+        return NULL;
+    cap->fd = fd;
+    cap->cfg = *cfg;
+    cap->cfg.block_bytes = block_bytes;
+    cap->out = -1;
+    if (posix_memalign((void **) &cap->ring, RING_ALIGN, (size_t) cfg->n_blocks * block_bytes) ||
+            posix_memalign((void **) &cap->spill, RING_ALIGN, block_bytes))
+    {
+        printf("Failed to allocate the capture ring\n");
+        goto fail;
+    }
+    /* touch the ring now rather than on the reader's time */
+    memset(cap->ring, 0, (size_t) cfg->n_blocks * block_bytes);
+    if (cfg->snap)
+    {
+        cap->snap = snapshot_new(fd, cfg->snap, (unsigned int *) cap->spill);
+        if (!cap->snap)
+            goto fail;
+    }
+
+    cap->out = open_output(path, cfg->direct);
+    if (cap->out < 0)
+    {
+        printf("can't open %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    sem_init(&cap->filled, 0, 0);
+    cap->start = now_s();
+    if (pthread_create(&cap->writer, NULL, capture_writer, cap) != 0)
+    {
+        printf("can't start the capture writer\n");
+        goto fail_sem;
+    }
+    if (pthread_create(&cap->reader, NULL, capture_reader, cap) != 0)
+    {
+        printf("can't start the capture reader\n");
+        atomic_store(&cap->reader_done, true);
+        sem_post(&cap->filled);
+        pthread_join(cap->writer, NULL);
+        goto fail_sem;
+    }
+    return cap;
+
+fail_sem:
+    sem_destroy(&cap->filled);
+fail:
+    if (cap->out >= 0)
+        close(cap->out);
+    snapshot_free(cap->snap);
+    free(cap->ring);
+    free(cap->spill);
+    free(cap);
+    return NULL;
+}
+
+/* False once the reader has stopped: max_blocks read, or an error */
+bool capture_running(struct capture *cap)
+{
+    return !atomic_load(&cap->reader_done);
+}
+
+void capture_get_stats(struct capture *cap, struct capture_stats *stats)
+{
+    unsigned long long head = atomic_load(&cap->head);
+
+    stats->blocks = head;
+    stats->overruns = atomic_load(&cap->overruns);
+    stats->read_errors = atomic_load(&cap->read_errors);
+    stats->bytes_written = atomic_load(&cap->bytes_written);
+    stats->occupancy = head - atomic_load(&cap->tail);
+    stats->max_occupancy = atomic_load(&cap->max_occupancy);
+    stats->max_gap_us = atomic_load(&cap->max_gap_ns) / 1e3;
+    stats->seconds = now_s() - cap->start;
+}
+
+/*
+ * Stop reading, write out what the ring holds, and free the capture.
+ * stats, if not NULL, gets the final numbers. Returns 0, or the error that
+ * stopped the capture early.
+ */
+int capture_stop(struct capture *cap, struct capture_stats *stats)
+{
+    int ret;
+
+    atomic_store(&cap->stop, true);
+    pthread_join(cap->reader, NULL);
+    pthread_join(cap->writer, NULL);
+    if (stats)
+        capture_get_stats(cap, stats);
+    ret = atomic_load(&cap->error);
+    if (close(cap->out) != 0 && ret == 0)
+    {
+        printf("capture file close failed: %s\n", strerror(errno));
+        ret = -1;
+    }
+
+    sem_destroy(&cap->filled);
+    snapshot_free(cap->snap);
+    free(cap->ring);
+    free(cap->spill);
+    free(cap);
+    return ret;
+}
@@ -0,0 +1,55 @@
+/*
+ * Streaming capture: read blocks from the FPGA without a break and log
+ * them to a file, for hours if need be.
+ *
+ * A reader thread does nothing but bulk reads, each into the next free
+ * buffer of a ring allocated (page aligned) up front, so the bus never
+ * waits on the disk. A writer thread drains filled buffers to the file,
+ * several at a time where they sit together in the ring, optionally with
+ * O_DIRECT. The two share only the ring's head and tail counters, so
+ * neither takes a lock; a semaphore wakes the writer.
+ *
+ * If the disk falls so far behind that the ring fills, the reader keeps
+ * reading (a FIFO left alone would overflow in the FPGA instead) into a
+ * spill buffer, and the block is dropped and counted as an overrun.
+ *
+ * Each block is a bulk read of block_bytes from addr (a FIFO read window,
+ * or any memory), or, with snap set, one snapshot capture (see
+ * spifpga_snapshot.h) of snap->n_bytes.
+ */
+
+#ifndef SPIFPGA_CAPTURE_H
+#define SPIFPGA_CAPTURE_H
+
+#include <stdbool.h>
+
+struct snapshot_desc;
+
+struct capture_config {
+    unsigned int addr;
+    unsigned int block_bytes;
+    unsigned int n_blocks;          /* ring buffers */
+    unsigned long long max_blocks;  /* reads, overruns too; 0 for until capture_stop() */
+    const struct snapshot_desc *snap;
+    bool direct;                    /* O_DIRECT; block_bytes a multiple of 4096 */
+};
+
+struct capture_stats {
+    unsigned long long blocks;      /* read into the ring */
+    unsigned long long overruns;    /* read with the ring full, and dropped */
+    unsigned long long read_errors; /* blocks with a bad FPGA response */
+    unsigned long long bytes_written;
+    unsigned int occupancy;         /* ring buffers waiting for the writer */
+    unsigned int max_occupancy;
+    double max_gap_us;              /* longest the bus sat idle between blocks */
+    double seconds;
+};
+
+struct capture;
+
+struct capture *capture_start(int fd, const struct capture_config *cfg, const char *path);
+bool capture_running(struct capture *cap);
+void capture_get_stats(struct capture *cap, struct capture_stats *stats);
+int capture_stop(struct capture *cap, struct capture_stats *stats);
+
+#endif /* SPIFPGA_CAPTURE_H */
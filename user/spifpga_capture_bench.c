@@ -0,0 +1,272 @@
+/*
+ * Streaming capture against a disk that stalls.
+ *
+ * spifpga_capture_bench [-n blocks] [-b block_bytes] [-r ring_blocks]
+ *                       [-s stall_ms] [-e stall_every_kb] [-F fifo_ms]
+ *                       [-o file [-D]]
+ *
+ * The simulator runs in real time with the burst protocol, and the "disk"
+ * is a pipe whose reader stops for stall_ms after every stall_every_kb.
+ * The same blocks are read and written by a loop that does both on one
+ * thread, like chained bulk_read()s in a script, and by capture_start().
+ * An FPGA FIFO that can hold fifo_ms of data loses some whenever the bus
+ * leaves it alone for longer; the gaps that long are counted.
+ *
+ * With -o the capture also goes to file (with O_DIRECT for -D), and the
+ * file is checked against the simulator's memory.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_capture.h"
+
+#define WINDOW_ADDR 0x00010000
+
+struct sink {
+    const char *path;
+    unsigned int stall_ms;
+    unsigned long stall_every;
+    unsigned long long bytes;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The slow disk: read the pipe, stalling now and then */
+static void *sink_thread(void *arg)
+{
+    struct sink *s = arg;
+    unsigned long since = 0;
+    struct timespec ts;
+    char buf[65536];
+    ssize_t n;
+    int in;
+
+    in = open(s->path, O_RDONLY);
+    if (in < 0)
+        return NULL;
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+    {
+        s->bytes += n;
+        since += n;
+        if (s->stall_ms && since >= s->stall_every)
+        {
+            since = 0;
+            ts.tv_sec = s->stall_ms / 1000;
+            ts.tv_nsec = (s->stall_ms % 1000) * 1000000L;
+            nanosleep(&ts, NULL);
+        }
+    }
+    close(in);
+    return NULL;
+}
+
+/* Read and write on one thread; returns the longest gap between reads */
+static double chained(int fd, const char *path, unsigned long long n_blocks,
+        unsigned int block_bytes, unsigned int fifo_ms, unsigned long *lost)
+{
+    unsigned int *buf = malloc(block_bytes);
+    double t, last = 0, max_gap = 0;
+    unsigned long long i;
+    ssize_t n;
+    size_t done;
+    int out;
+
+    *lost = 0;
+    out = open(path, O_WRONLY);
+    if (out < 0 || !buf)
+    {
+        free(buf);
+        return -1;
+    }
+    for (i = 0; i < n_blocks; i++)
+    {
+        t = now_s();
+        if (last && t - last > max_gap)
+            max_gap = t - last;
+        if (last && (t - last) * 1e3 > fifo_ms)
+            (*lost)++;
+        bulk_read(fd, WINDOW_ADDR, block_bytes, buf);
+        last = now_s();
+        for (done = 0; done < block_bytes; done += n)
+        {
+            n = write(out, (char *) buf + done, block_bytes - done);
+            if (n <= 0)
+                break;
+        }
+    }
+    close(out);
+    free(buf);
+    return max_gap * 1e6;
+}
+
+static int check_file(const char *path, const struct spifpga_sim *sim,
+        unsigned int block_bytes, unsigned long long blocks)
+{
+    unsigned int *buf = malloc(block_bytes);
+    unsigned long long i;
+    int in, errors = 0;
+
+    in = open(path, O_RDONLY);
+    if (in < 0 || !buf)
+    {
+        free(buf);
+        return 1;
+    }
+    for (i = 0; i < blocks; i++)
+        if (read(in, buf, block_bytes) != (ssize_t) block_bytes ||
+                memcmp(buf, &sim->mem[WINDOW_ADDR / BYTES_PER_WORD], block_bytes) != 0)
+        {
+            errors++;
+            break;
+        }
+    if (read(in, buf, block_bytes) != 0)
+        errors++;
+    close(in);
+    free(buf);
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int block_bytes = 16384, fifo_ms = 10, i;
+    char pipe_path[] = "/tmp/spifpga_capture_XXXXXX";
+    struct capture_config cfg;
+    struct capture_stats stats;
+    struct sink sink = { NULL, 300, 512 * 1024, 0 };
+    struct spifpga_sim *sim;
+    struct capture *cap;
+    const char *file = NULL;
+    pthread_t sink_tid;
+    double t0, t_chained, gap_chained;
+    unsigned long lost_chained;
+    int c, fd, errors = 0;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.n_blocks = 64;
+    cfg.max_blocks = 100;
+    while ((c = getopt(argc, argv, "n:b:r:s:e:F:o:D")) != -1)
+        switch (c) {
+            case 'n':
+                cfg.max_blocks = strtoull(optarg, NULL, 0);
+                break;
+            case 'b':
+                block_bytes = strtoul(optarg, NULL, 0) & ~(BYTES_PER_WORD - 1);
+                break;
+            case 'r':
+                cfg.n_blocks = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                sink.stall_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                sink.stall_every = strtoul(optarg, NULL, 0) * 1024;
+                break;
+            case 'F':
+                fifo_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                file = optarg;
+                break;
+            case 'D':
+                cfg.direct = true;
+                break;
+            default:
+                printf("Usage: spifpga_capture_bench [-n blocks] [-b block_bytes] [-r ring_blocks]\n"
+                        "       [-s stall_ms] [-e stall_every_kb] [-F fifo_ms] [-o file [-D]]\n");
+                return 1;
+        }
+    if (cfg.max_blocks == 0 || block_bytes == 0)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    sim = spifpga_sim_new(WINDOW_ADDR + block_bytes);
+    if (!sim)
+    {
+        printf("Failed to create the simulator\n");
+        return 1;
+    }
+    sim->realtime = true;
+    for (i = 0; i < block_bytes / BYTES_PER_WORD; i++)
+        sim->mem[WINDOW_ADDR / BYTES_PER_WORD + i] = i * 2654435761u;
+    fd = config_spi_sim(sim);
+    cfg.addr = WINDOW_ADDR;
+    cfg.block_bytes = block_bytes;
+
+    /* a fresh name for the pipe */
+    close(mkstemp(pipe_path));
+    unlink(pipe_path);
+    if (mkfifo(pipe_path, 0600) != 0)
+    {
+        printf("can't make a pipe at %s\n", pipe_path);
+        return 1;
+    }
+    sink.path = pipe_path;
+
+    pthread_create(&sink_tid, NULL, sink_thread, &sink);
+    t0 = now_s();
+    gap_chained = chained(fd, pipe_path, cfg.max_blocks, block_bytes, fifo_ms, &lost_chained);
+    pthread_join(sink_tid, NULL);
+    t_chained = now_s() - t0;
+
+    sink.bytes = 0;
+    pthread_create(&sink_tid, NULL, sink_thread, &sink);
+    cap = capture_start(fd, &cfg, pipe_path);
+    if (!cap)
+    {
+        unlink(pipe_path);
+        return 1;
+    }
+    while (capture_running(cap))
+        usleep(10000);
+    errors += capture_stop(cap, &stats) != 0;
+    pthread_join(sink_tid, NULL);
+    unlink(pipe_path);
+    if (sink.bytes != stats.blocks * block_bytes ||
+            stats.blocks + stats.overruns != cfg.max_blocks)
+        errors++;
+
+    printf("%llu blocks of %u bytes, %u ms stalls every %lu KB, %u ms FIFO\n",
+            cfg.max_blocks, block_bytes, sink.stall_ms, sink.stall_every / 1024, fifo_ms);
+    printf("one thread   %6.2f MB/s  longest gap %8.0f us  %lu gaps over the FIFO\n",
+            cfg.max_blocks * block_bytes / t_chained / 1e6, gap_chained, lost_chained);
+    printf("ring of %-4u %6.2f MB/s  longest gap %8.0f us  max occupancy %u  %llu overruns\n",
+            cfg.n_blocks, stats.bytes_written / stats.seconds / 1e6, stats.max_gap_us,
+            stats.max_occupancy, stats.overruns);
+
+    if (file)
+    {
+        cap = capture_start(fd, &cfg, file);
+        if (!cap)
+            return 1;
+        while (capture_running(cap))
+            usleep(10000);
+        errors += capture_stop(cap, &stats) != 0;
+        errors += check_file(file, sim, block_bytes, stats.blocks);
+        printf("to %s: %.2f MB/s, %llu blocks, %llu overruns\n", file,
+                stats.bytes_written / stats.seconds / 1e6, stats.blocks, stats.overruns);
+    }
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    return errors ? 1 : 0;
+}
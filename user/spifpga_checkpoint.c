@@ -0,0 +1,382 @@
+/*
+ * Register checkpoints, see spifpga_checkpoint.h.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "spifpga_user.h"
+#include "spifpga_regmap.h"
+#include "spifpga_checkpoint.h"
+
+#define CHECKPOINT_MAGIC 0x4B435053     /* "SPCK" */
+#define CHECKPOINT_VERSION 1
+
+/* Differing words in a row that go out as a bulk write of their own */
+#define DIFF_RUN_MIN 4
+
+struct checkpoint_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_ranges;
+    uint32_t n_words;
+    uint32_t sum;
+};
+
+struct checkpoint {
+    unsigned int n_ranges;
+    struct checkpoint_range *ranges;
+    unsigned int n_words;
+    unsigned int *words;        /* the ranges' words, one after the other */
+};
+
+static uint32_t words_sum(const unsigned int *words, unsigned int n)
+{
+    uint32_t h = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        h = (h ^ words[i]) * 16777619u;
+    return h;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+    const struct checkpoint_range *x = a, *y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* Sort, merge and size; ranges already belongs to cp */
+static struct checkpoint *checkpoint_setup(struct checkpoint *cp)
+{
+    unsigned int i, n = 0, end;
+
+    for (i = 0; i < cp->n_ranges; i++)
+    {
+        end = cp->ranges[i].addr + cp->ranges[i].n_bytes;
+        cp->ranges[i].addr &= ~(BYTES_PER_WORD - 1);
+        cp->ranges[i].n_bytes = (end - cp->ranges[i].addr + BYTES_PER_WORD - 1) &
+                ~(BYTES_PER_WORD - 1);
+    }
+    qsort(cp->ranges, cp->n_ranges, sizeof(*cp->ranges), range_cmp);
+    for (i = 0; i < cp->n_ranges; i++)
+    {
+        if (!cp->ranges[i].n_bytes)
+            continue;
+        if (n && cp->ranges[i].addr <= cp->ranges[n - 1].addr + cp->ranges[n - 1].n_bytes)
+        {
+            end = cp->ranges[i].addr + cp->ranges[i].n_bytes;
+            if (end > cp->ranges[n - 1].addr + cp->ranges[n - 1].n_bytes)
+                cp->ranges[n - 1].n_bytes = end - cp->ranges[n - 1].addr;
+            continue;
+        }
+        cp->ranges[n++] = cp->ranges[i];
+    }
+    cp->n_ranges = n;
+
+    cp->n_words = 0;
+    for (i = 0; i < n; i++)
+        cp->n_words += cp->ranges[i].n_bytes / BYTES_PER_WORD;
+    cp->words = calloc(cp->n_words ? cp->n_words : 1, sizeof(unsigned int));
+    if (!cp->words)
+    {
+        printf("Failed to allocate the checkpoint\n");
+        checkpoint_free(cp);
+        return NULL;
+    }
+    return cp;
+}
+
+/* A checkpoint of the given ranges, not yet taken */
+struct checkpoint *checkpoint_new(const struct checkpoint_range *ranges, unsigned int n)
+{
+    struct checkpoint *cp;
+
+    cp = calloc(1, sizeof(*cp));
+    if (!cp)
+        return NULL;
+    cp->ranges = malloc((n ? n : 1) * sizeof(*ranges));
+    if (!cp->ranges)
+    {
+        free(cp);
+        return NULL;
+    }
+    memcpy(cp->ranges, ranges, n * sizeof(*ranges));
+    cp->n_ranges = n;
+    return checkpoint_setup(cp);
+}
+
+/*
+ * A checkpoint of the registers in map that can be read and written back:
+ * rw, and not volatile.
+ */
+struct checkpoint *checkpoint_from_regmap(const struct spifpga_regmap *map)
+{
+    struct checkpoint_range *ranges;
+    const struct regmap_entry *e;
+    struct checkpoint *cp;
+    unsigned int i, n = 0;
+
+    ranges = malloc((regmap_count(map) + 1) * sizeof(*ranges));
+    if (!ranges)
+        return NULL;
+    for (i = 0; (e = regmap_at(map, i)); i++)
+        if (e->width == 32 && e->mode == (REG_READ | REG_WRITE) && !e->is_volatile)
+        {
+            ranges[n].addr = e->addr;
+            ranges[n++].n_bytes = e->size;
+        }
+    cp = checkpoint_new(ranges, n);
+    free(ranges);
+    return cp;
+}
+
+void checkpoint_free(struct checkpoint *cp)
+{
+    if (!cp)
+        return;
+    free(cp->ranges);
+    free(cp->words);
+    free(cp);
+}
+
+/* Read the ranges from the FPGA. Returns the OR of the response codes. */
+int checkpoint_take(int fd, struct checkpoint *cp)
+{
+    unsigned int i, off = 0;
+    int ret, fpga_ret = 0;
+
+    for (i = 0; i < cp->n_ranges; i++)
+    {
+        ret = bulk_read(fd, cp->ranges[i].addr, cp->ranges[i].n_bytes, cp->words + off);
+        if (ret < 0)
+            return ret;
+        fpga_ret |= ret;
+        off += cp->ranges[i].n_bytes / BYTES_PER_WORD;
+    }
+    return fpga_ret;
+}
+
+/*
+ * Queue or write the words of range r that differ from what the FPGA
+ * holds, in address order: runs of DIFF_RUN_MIN or more as bulk writes,
+ * the rest gathered into addrs and vals (*batch of them so far, across
+ * ranges) for write_words().
+ */
+static int restore_diff(int fd, const struct checkpoint_range *r, const unsigned int *want,
+        const unsigned int *have, unsigned int *addrs, unsigned int *vals,
+        unsigned int *batch, struct checkpoint_stats *stats)
+{
+    unsigned int n = r->n_bytes / BYTES_PER_WORD, i, j, k;
+    int ret, fpga_ret = 0;
+
+    for (i = 0; i < n; i = j)
+    {
+        for (; i < n && want[i] == have[i]; i++)
+            ;
+        for (j = i; j < n && want[j] != have[j]; j++)
+            ;
+        if (j - i < DIFF_RUN_MIN)
+        {
+            for (k = i; k < j; k++, (*batch)++)
+            {
+                addrs[*batch] = r->addr + k * BYTES_PER_WORD;
+                vals[*batch] = want[k];
+            }
+            continue;
+        }
+        /* the batch so far goes before this run */
+        if (*batch)
+        {
+            ret = write_words(fd, addrs, vals, *batch);
+            if (ret < 0)
+                return ret;
+            fpga_ret |= ret;
+            stats->written += *batch;
+            *batch = 0;
+        }
+        ret = bulk_write(fd, r->addr + i * BYTES_PER_WORD, (j - i) * BYTES_PER_WORD,
+                (unsigned int *) want + i);
+        if (ret < 0)
+            return ret;
+        fpga_ret |= ret;
+        stats->written += j - i;
+        stats->runs++;
+    }
+    return fpga_ret;
+}
+
+/*
+ * Read all the ranges into have, as few messages as they fit in, for a
+ * restore of only the words that differ.
+ */
+static int restore_read(int fd, const struct checkpoint *cp, unsigned int *have)
+{
+    struct read_span *spans;
+    unsigned int i, off = 0;
+    int fpga_ret;
+
+    spans = malloc((cp->n_ranges ? cp->n_ranges : 1) * sizeof(*spans));
+    if (!spans)
+    {
+        printf("Failed to allocate restore buffers\n");
+        return -1;
+    }
+    for (i = 0; i < cp->n_ranges; i++)
+    {
+        spans[i].addr = cp->ranges[i].addr;
+        spans[i].n_bytes = cp->ranges[i].n_bytes;
+        spans[i].buf = have + off;
+        off += cp->ranges[i].n_bytes / BYTES_PER_WORD;
+    }
+    fpga_ret = read_spans_ops(fd, spans, cp->n_ranges, NULL, 0);
+    free(spans);
+    return fpga_ret;
+}
+
+/*
+ * Write the checkpoint back to the FPGA: all of it, or with only_diff
+ * just the words that changed. stats, if not NULL, says how much was
+ * written. Returns the OR of the response codes.
+ */
+int checkpoint_restore(int fd, const struct checkpoint *cp, bool only_diff,
+        struct checkpoint_stats *stats)
+{
+    struct checkpoint_stats st = { cp->n_words, 0, 0 };
+    unsigned int i, off = 0, batch = 0, *have = NULL, *addrs = NULL, *vals = NULL;
+    int ret = 0, fpga_ret = 0;
+
+    if (only_diff)
+    {
+        have = malloc((cp->n_words + 1) * sizeof(*have));
+        addrs = malloc((cp->n_words + 1) * sizeof(*addrs));
+        vals = malloc((cp->n_words + 1) * sizeof(*vals));
+        if (!have || !addrs || !vals)
+        {
+            printf("Failed to allocate restore buffers\n");
+            fpga_ret = -1;
+            goto out;
+        }
+        fpga_ret = restore_read(fd, cp, have);
+        if (fpga_ret < 0)
+            goto out;
+    }
+
+    for (i = 0; i < cp->n_ranges; i++)
+    {
+        if (only_diff)
+        {
+            ret = restore_diff(fd, &cp->ranges[i], cp->words + off, have + off,
+                    addrs, vals, &batch, &st);
+        } else {
+            ret = bulk_write(fd, cp->ranges[i].addr, cp->ranges[i].n_bytes, cp->words + off);
+            st.written += cp->ranges[i].n_bytes / BYTES_PER_WORD;
+            st.runs++;
+        }
+        if (ret < 0)
+        {
+            fpga_ret = ret;
+            goto out;
+        }
+        fpga_ret |= ret;
+        off += cp->ranges[i].n_bytes / BYTES_PER_WORD;
+    }
+    if (batch)
+    {
+        ret = write_words(fd, addrs, vals, batch);
+        fpga_ret = ret < 0 ? ret : fpga_ret | ret;
+        st.written += batch;
+    }
+out:
+    if (stats)
+        *stats = st;
+    free(have);
+    free(addrs);
+    free(vals);
+    return fpga_ret;
+}
+
+int checkpoint_save(const struct checkpoint *cp, const char *path)
+{
+    struct checkpoint_header hdr = { CHECKPOINT_MAGIC, CHECKPOINT_VERSION,
+            cp->n_ranges, cp->n_words, words_sum(cp->words, cp->n_words) };
+    FILE *out;
+
+    out = fopen(path, "wb");
+    if (!out)
+    {
+        printf("can't create checkpoint %s\n", path);
+        return -1;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+            fwrite(cp->ranges, sizeof(*cp->ranges), cp->n_ranges, out) != cp->n_ranges ||
+            fwrite(cp->words, sizeof(*cp->words), cp->n_words, out) != cp->n_words)
+    {
+        printf("can't write checkpoint %s\n", path);
+        fclose(out);
+        return -1;
+    }
+    if (fclose(out) != 0)
+    {
+        printf("can't write checkpoint %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a checkpoint file back. Returns NULL, after saying why, if it can't. */
+struct checkpoint *checkpoint_load(const char *path)
+{
+    struct checkpoint_header hdr;
+    struct checkpoint *cp = NULL;
+    unsigned int i, words = 0;
+    FILE *in;
+
+    in = fopen(path, "rb");
+    if (!in)
+    {
+        printf("can't open checkpoint %s\n", path);
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != CHECKPOINT_MAGIC ||
+            hdr.version != CHECKPOINT_VERSION)
+        goto bad;
+
+    cp = calloc(1, sizeof(*cp));
+    if (!cp)
+        goto bad;
+    cp->n_ranges = hdr.n_ranges;
+    cp->n_words = hdr.n_words;
+    cp->ranges = malloc((hdr.n_ranges ? hdr.n_ranges : 1) * sizeof(*cp->ranges));
+    cp->words = malloc((hdr.n_words ? hdr.n_words : 1) * sizeof(*cp->words));
+    if (!cp->ranges || !cp->words ||
+            fread(cp->ranges, sizeof(*cp->ranges), hdr.n_ranges, in) != hdr.n_ranges ||
+            fread(cp->words, sizeof(*cp->words), hdr.n_words, in) != hdr.n_words)
+        goto bad;
+    for (i = 0; i < cp->n_ranges; i++)
+        words += cp->ranges[i].n_bytes / BYTES_PER_WORD;
+    if (words != cp->n_words || words_sum(cp->words, cp->n_words) != hdr.sum)
+        goto bad;
+    fclose(in);
+    return cp;
+
+bad:
+    printf("%s is not a good checkpoint\n", path);
+    checkpoint_free(cp);
+    fclose(in);
+    return NULL;
+}
+
+unsigned int checkpoint_ranges(const struct checkpoint *cp, const struct checkpoint_range **ranges)
+{
+    *ranges = cp->ranges;
+    return cp->n_ranges;
+}
+
+/* The words, range after range, to look at or change before a restore */
+unsigned int *checkpoint_words(struct checkpoint *cp)
+{
+    return cp->words;
+}
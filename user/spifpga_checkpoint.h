@@ -0,0 +1,50 @@
+/*
+ * Checkpoints of FPGA register state: read a set of address ranges into
+ * a compact binary file, and write them back later, after a reset or to
+ * switch between saved modes.
+ *
+ * The ranges are sorted and merged where they touch, so a checkpoint is
+ * taken with one bulk read per run of registers. Restoring writes each run
+ * back with bulk writes; with only_diff it reads all the runs first, as
+ * many to a message as fit, and writes just the words that differ, runs
+ * of them as bulk writes and scattered ones batched several to a message,
+ * so switching between two similar modes moves little more than the reads.
+ * The reads cost a pass over the registers, so after a reset, when most
+ * words differ, a plain restore is the cheaper one.
+ *
+ * The file holds a header, the ranges and the words, in the host's byte
+ * order, with a checksum over the words.
+ */
+
+#ifndef SPIFPGA_CHECKPOINT_H
+#define SPIFPGA_CHECKPOINT_H
+
+#include <stdbool.h>
+
+struct spifpga_regmap;
+
+struct checkpoint_range {
+    unsigned int addr;
+    unsigned int n_bytes;   /* rounded up to whole words */
+};
+
+struct checkpoint_stats {
+    unsigned int words;         /* in the checkpoint */
+    unsigned int written;       /* words written by the restore */
+    unsigned int runs;          /* bulk writes */
+};
+
+struct checkpoint;
+
+struct checkpoint *checkpoint_new(const struct checkpoint_range *ranges, unsigned int n);
+struct checkpoint *checkpoint_from_regmap(const struct spifpga_regmap *map);
+void checkpoint_free(struct checkpoint *cp);
+int checkpoint_take(int fd, struct checkpoint *cp);
+int checkpoint_restore(int fd, const struct checkpoint *cp, bool only_diff,
+        struct checkpoint_stats *stats);
+int checkpoint_save(const struct checkpoint *cp, const char *path);
+struct checkpoint *checkpoint_load(const char *path);
+unsigned int checkpoint_ranges(const struct checkpoint *cp, const struct checkpoint_range **ranges);
+unsigned int *checkpoint_words(struct checkpoint *cp);
+
+#endif /* SPIFPGA_CHECKPOINT_H */
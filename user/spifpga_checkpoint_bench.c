@@ -0,0 +1,197 @@
+/*
+ * Checkpoint and restore of configuration registers, against the
+ * simulator.
+ *
+ * spifpga_checkpoint_bench [-g groups] [-r registers_per_group] [-c changed_percent] [-B]
+ *
+ * The simulated design has groups of registers, each group a block of
+ * consecutive words with a gap before the next, described by a register
+ * map in which every eighth register is volatile. A checkpoint is taken
+ * from the map, saved and loaded again. After a reset the registers are
+ * restored one write_word() at a time (as from a script) and with a full
+ * restore; then, on a mode switch that changed changed_percent of them, a
+ * full restore and a restore of only the words that differ each start
+ * from the same registers, to show the writes the diff skips and the time
+ * that saves. Bus time is modelled; -B uses the burst protocol.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_regmap.h"
+#include "spifpga_checkpoint.h"
+
+#define BASE_ADDR 0x00010000
+#define GROUP_STRIDE 0x100
+
+static unsigned int reg_addr(unsigned int group, unsigned int reg)
+{
+    return BASE_ADDR + group * GROUP_STRIDE + reg * BYTES_PER_WORD;
+}
+
+/* The registers the checkpoint holds that don't match saved */
+static unsigned int mismatched(const uint32_t *mem, const uint32_t *saved,
+        unsigned int groups, unsigned int regs)
+{
+    unsigned int g, r, errors = 0;
+
+    for (g = 0; g < groups; g++)
+        for (r = 0; r < regs; r++)
+            if ((g * regs + r) % 8 != 7)
+                errors += mem[reg_addr(g, r) / BYTES_PER_WORD] !=
+                        saved[reg_addr(g, r) / BYTES_PER_WORD];
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int groups = 50, regs = 10, changed = 2, g, r, n_regs, a;
+    char map_path[] = "/tmp/spifpga_ckpt_XXXXXX", cp_path[64];
+    struct spifpga_regmap *map;
+    struct checkpoint *cp, *loaded;
+    struct checkpoint_stats st_full, st_switch, st_diff;
+    struct spifpga_sim *sim;
+    uint32_t *saved, *switched;
+    uint64_t bus_take, bus_script, bus_full, bus_switch, bus_diff;
+    bool burst = false;
+    FILE *out;
+    int c, fd, errors = 0;
+
+    while ((c = getopt(argc, argv, "g:r:c:B")) != -1)
+        switch (c) {
+            case 'g':
+                groups = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                regs = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                changed = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                burst = true;
+                break;
+            default:
+                printf("Usage: spifpga_checkpoint_bench [-g groups] [-r registers_per_group] [-c changed_percent] [-B]\n");
+                return 1;
+        }
+    if (groups == 0 || regs == 0 || regs * BYTES_PER_WORD > GROUP_STRIDE)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    fd = mkstemp(map_path);
+    out = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!out)
+    {
+        printf("can't create a temporary map\n");
+        return 1;
+    }
+    for (n_regs = g = 0; g < groups; g++)
+        for (r = 0; r < regs; r++, n_regs++)
+            fprintf(out, "g%u_r%u 0x%08x 4 rw%s\n", g, r, reg_addr(g, r),
+                    n_regs % 8 == 7 ? " volatile" : "");
+    fclose(out);
+    map = regmap_load(map_path);
+    unlink(map_path);
+    if (!map)
+        return 1;
+
+    sim = spifpga_sim_new(BASE_ADDR + groups * GROUP_STRIDE);
+    saved = calloc(sim->words, sizeof(uint32_t));
+    switched = calloc(sim->words, sizeof(uint32_t));
+    if (!sim || !saved || !switched)
+    {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+    for (g = 0; g < groups; g++)
+        for (r = 0; r < regs; r++)
+            sim->mem[reg_addr(g, r) / BYTES_PER_WORD] = (g << 16) | r;
+    memcpy(saved, sim->mem, sim->words * sizeof(uint32_t));
+    fd = config_spi_sim(sim);
+    if (!burst)
+        set_protocol(fd, PROTO_FRAMES);
+
+    cp = checkpoint_from_regmap(map);
+    if (!cp)
+        return 1;
+    spifpga_sim_reset_counters(sim);
+    errors += checkpoint_take(fd, cp) != RESP_OK;
+    bus_take = sim->bus_ns;
+    snprintf(cp_path, sizeof(cp_path), "%s.ckpt", map_path);
+    errors += checkpoint_save(cp, cp_path) != 0;
+    loaded = checkpoint_load(cp_path);
+    unlink(cp_path);
+    if (!loaded)
+        return 1;
+
+    /* a reset: everything lost */
+    for (g = 0; g < groups; g++)
+        for (r = 0; r < regs; r++)
+            sim->mem[reg_addr(g, r) / BYTES_PER_WORD] = 0;
+
+    /* one write per register, as a script would */
+    spifpga_sim_reset_counters(sim);
+    for (g = 0; g < groups; g++)
+        for (r = 0; r < regs; r++)
+            if ((g * regs + r) % 8 != 7)
+                write_word(fd, reg_addr(g, r), saved[reg_addr(g, r) / BYTES_PER_WORD]);
+    bus_script = sim->bus_ns;
+
+    for (g = 0; g < groups; g++)
+        for (r = 0; r < regs; r++)
+            sim->mem[reg_addr(g, r) / BYTES_PER_WORD] = 0;
+    spifpga_sim_reset_counters(sim);
+    errors += checkpoint_restore(fd, loaded, false, &st_full) != RESP_OK;
+    bus_full = sim->bus_ns;
+    errors += mismatched(sim->mem, saved, groups, regs);
+
+    /* a mode switch: a few registers changed, and a run of them */
+    for (a = 0; a < n_regs * changed / 100; a++)
+        sim->mem[reg_addr((a * 7919) % groups, (a * 31) % regs) / BYTES_PER_WORD] ^= 0x5A5A;
+    for (r = 0; r < regs && r < 6; r++)
+        sim->mem[reg_addr(groups / 2, r) / BYTES_PER_WORD] ^= 0xFFFF;
+    memcpy(switched, sim->mem, sim->words * sizeof(uint32_t));
+
+    /* back from it with a full restore, then with the diff from the same start */
+    spifpga_sim_reset_counters(sim);
+    errors += checkpoint_restore(fd, loaded, false, &st_switch) != RESP_OK;
+    bus_switch = sim->bus_ns;
+    errors += mismatched(sim->mem, saved, groups, regs);
+    memcpy(sim->mem, switched, sim->words * sizeof(uint32_t));
+    spifpga_sim_reset_counters(sim);
+    errors += checkpoint_restore(fd, loaded, true, &st_diff) != RESP_OK;
+    bus_diff = sim->bus_ns;
+    errors += mismatched(sim->mem, saved, groups, regs);
+
+    printf("%u registers in %u groups, %u saved, %s protocol\n", n_regs, groups,
+            st_full.words, burst ? "burst" : "frame");
+    printf("checkpoint           %8.2f ms\n", bus_take / 1e6);
+    printf("write_word each      %8.2f ms\n", bus_script / 1e6);
+    printf("restore              %8.2f ms  (%u bulk writes)\n", bus_full / 1e6, st_full.runs);
+    printf("after a mode switch:\n");
+    printf("restore              %8.2f ms  (%u words written)\n", bus_switch / 1e6,
+            st_switch.written);
+    printf("restore, diff only   %8.2f ms  (%u words written, %u skipped, %u bulk writes)\n",
+            bus_diff / 1e6, st_diff.written, st_diff.words - st_diff.written, st_diff.runs);
+    printf("diff saves           %8.2f ms  (%.1fx)\n",
+            ((int64_t) bus_switch - (int64_t) bus_diff) / 1e6,
+            bus_diff ? (double) bus_switch / bus_diff : 0.0);
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    checkpoint_free(cp);
+    checkpoint_free(loaded);
+    regmap_free(map);
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    free(saved);
+    free(switched);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Circular buffer reads, see spifpga_circ.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "spifpga_user.h"
+#include "spifpga_circ.h"
+
+struct circ {
+    int fd;
+    struct circ_desc desc;
+    unsigned int wptr;              /* as last read */
+    /* positions in the byte stream the writer has produced so far */
+    unsigned long long consumed;    /* returned up to here */
+    unsigned long long known;       /* written up to here, at the last pointer read */
+    struct circ_stats stats;
+};
+
+/* Move the writer's position on to a new pointer value */
+static void circ_advance(struct circ *c, unsigned int wptr)
+{
+    unsigned int counts;
+
+    if (c->desc.wptr_wrap)
+        counts = (wptr % c->desc.wptr_wrap + c->desc.wptr_wrap -
+                c->wptr % c->desc.wptr_wrap) % c->desc.wptr_wrap;
+    else
+        counts = wptr - c->wptr;
+    c->known += (unsigned long long) counts * c->desc.wptr_unit;
+    c->wptr = wptr;
+}
+
+/*
+ * Start reading the buffer from where the writer is now. Returns NULL,
+ * after saying why, if the pointer can't be read.
+ */
+struct circ *circ_new(int fd, const struct circ_desc *desc)
+{
+    struct circ *c;
+    int ret;
+
+    if (!desc->n_bytes || desc->n_bytes % BYTES_PER_WORD)
+    {
+        printf("a circular buffer needs a length in whole words\n");
+        return NULL;
+    }
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+    c->fd = fd;
+    c->desc = *desc;
+    if (!c->desc.wptr_unit)
+        c->desc.wptr_unit = BYTES_PER_WORD;
+
+    ret = read_word(fd, desc->wptr_addr, &c->wptr);
+    if (ret != RESP_OK)
+    {
+        printf("can't read the write pointer at 0x%x (%d)\n", desc->wptr_addr, ret);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void circ_free(struct circ *c)
+{
+    free(c);
+}
+
+/*
+ * Read up to max_bytes of new data into buf; *n_bytes says how much.
+ * Returns the OR of the response codes, or a negative error (and nothing
+ * read).
+ */
+int circ_read(struct circ *c, unsigned int *buf, unsigned int max_bytes, unsigned int *n_bytes)
+{
+    const struct circ_desc *d = &c->desc;
+    unsigned long long start, len, cut;
+    struct read_span spans[2];
+    struct word_op ptr = { d->wptr_addr, 0, false };
+    unsigned int off, n_spans = 0, wptr;
+    bool overrun = false;
+    int ret;
+
+    /*
+     * Half a buffer behind already, the data the last pointer read showed
+     * may be gone by now: read the pointer again first, and skip what it
+     * shows overwritten.
+     */
+    *n_bytes = 0;
+    if (c->known - c->consumed > d->n_bytes / 2)
+    {
+        ret = read_word(c->fd, d->wptr_addr, &wptr);
+        if (ret < 0)
+            return ret;
+        circ_advance(c, wptr);
+        if (c->known - c->consumed > d->n_bytes)
+        {
+            cut = (c->known - d->n_bytes - c->consumed + BYTES_PER_WORD - 1) &
+                    ~(unsigned long long) (BYTES_PER_WORD - 1);
+            c->consumed += cut;
+            c->stats.lost_bytes += cut;
+            overrun = true;
+        }
+    }
+
+    start = c->consumed;
+    len = c->known - start;
+    if (len > max_bytes)
+        len = max_bytes;
+    len &= ~(unsigned long long) (BYTES_PER_WORD - 1);
+
+    /* from start to the end of the BRAM, then from its beginning */
+    off = start % d->n_bytes;
+    if (len)
+    {
+        spans[0].addr = d->bram_addr + off;
+        spans[0].n_bytes = len < d->n_bytes - off ? len : d->n_bytes - off;
+        spans[0].buf = buf;
+        n_spans = 1;
+        if (spans[0].n_bytes < len)
+        {
+            spans[1].addr = d->bram_addr;
+            spans[1].n_bytes = len - spans[0].n_bytes;
+            spans[1].buf = buf + spans[0].n_bytes / BYTES_PER_WORD;
+            n_spans = 2;
+        }
+    }
+
+    ret = read_spans_ops(c->fd, spans, n_spans, &ptr, 1);
+    if (ret < 0)
+        return ret;
+    circ_advance(c, ptr.val);
+    c->stats.reads++;
+
+    /*
+     * The pointer was read after the data, so anything it has gone past
+     * by more than the buffer size may have been overwritten under us.
+     */
+    c->consumed = start + len;
+    if (c->known > start + d->n_bytes)
+    {
+        /* in whole words, so the next read starts on one */
+        cut = (c->known - d->n_bytes - start + BYTES_PER_WORD - 1) &
+                ~(unsigned long long) (BYTES_PER_WORD - 1);
+        c->stats.lost_bytes += cut;
+        overrun = true;
+        if (cut >= len)
+        {
+            c->consumed = start + cut;
+            len = 0;
+        } else {
+            memmove(buf, (unsigned char *) buf + cut, len - cut);
+            len -= cut;
+        }
+    }
+    c->stats.overruns += overrun;
+    *n_bytes = len;
+    c->stats.bytes += len;
+    return ret;
+}
+
+/* Bytes known to be waiting, as of the last pointer read */
+unsigned long long circ_pending(const struct circ *c)
+{
+    return c->known - c->consumed;
+}
+
+void circ_get_stats(const struct circ *c, struct circ_stats *stats)
+{
+    *stats = c->stats;
+}
@@ -0,0 +1,47 @@
+/*
+ * Incremental reads of a circular buffer in the FPGA: a BRAM the gateware
+ * writes round and round, and a register holding its write pointer.
+ *
+ * circ_read() returns what was written since the last call, up to the
+ * pointer as read by the last call: the new span, as one or (where it
+ * wraps) two bursts, goes out in the same SPI message as a read of the
+ * pointer for next time. The bus carries only new data and a pointer per
+ * call, however big the buffer. A reader that has fallen half a buffer
+ * behind reads the pointer first, in a message of its own, to skip what
+ * is already gone.
+ *
+ * The pointer counts in wptr_unit bytes (4 for a word index, 1 for a byte
+ * offset) and runs modulo wptr_wrap counts, or 2^32 if wptr_wrap is 0. A
+ * pointer that wraps with the buffer can't show that the writer went all
+ * the way round between two calls; a wider, free running one can, and
+ * then circ_read() drops what was overwritten, returns the rest, and
+ * counts an overrun.
+ */
+
+#ifndef SPIFPGA_CIRC_H
+#define SPIFPGA_CIRC_H
+
+struct circ_desc {
+    unsigned int wptr_addr;
+    unsigned int bram_addr;
+    unsigned int n_bytes;       /* of the BRAM, whole words */
+    unsigned int wptr_unit;     /* bytes per pointer count, 0 for 4 */
+    unsigned int wptr_wrap;     /* pointer modulus in counts, 0 for 2^32 */
+};
+
+struct circ_stats {
+    unsigned long long reads;
+    unsigned long long bytes;       /* returned */
+    unsigned long long overruns;    /* reads that found data overwritten */
+    unsigned long long lost_bytes;
+};
+
+struct circ;
+
+struct circ *circ_new(int fd, const struct circ_desc *desc);
+void circ_free(struct circ *c);
+int circ_read(struct circ *c, unsigned int *buf, unsigned int max_bytes, unsigned int *n_bytes);
+unsigned long long circ_pending(const struct circ *c);
+void circ_get_stats(const struct circ *c, struct circ_stats *stats);
+
+#endif /* SPIFPGA_CIRC_H */
@@ -0,0 +1,193 @@
+/*
+ * Incremental circular buffer reads against a simulated writer.
+ *
+ * spifpga_circ_bench [-n polls] [-b bram_bytes] [-r bytes_per_s] [-p poll_us] [-B]
+ *
+ * The simulator gets a writer that fills a BRAM round and round at
+ * bytes_per_s, numbering the words it writes, and moves a free running
+ * word pointer. The host polls every poll_us: the old way, reading the
+ * pointer and the whole BRAM and keeping the new part, and with
+ * circ_read(). Both streams are checked for gaps; wire bytes per byte of
+ * data and the share of time the bus is busy are in modelled time. -B
+ * uses the burst protocol.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_circ.h"
+
+#define WPTR_ADDR 0x00001000
+#define BRAM_ADDR 0x00010000
+
+struct writer {
+    unsigned int n_words;
+    double words_per_ns;
+    uint64_t idle_ns;       /* host time between polls, not on the bus */
+    uint32_t written;       /* the pointer: words so far */
+};
+
+/* Write what is due by now, then the pointer read sees it */
+static void writer_hook(struct spifpga_sim *sim, bool write, uint32_t addr,
+        uint32_t val, void *ctx)
+{
+    struct writer *w = ctx;
+    uint32_t due;
+
+    if (write || addr != WPTR_ADDR)
+        return;
+    due = (sim->bus_ns + w->idle_ns) * w->words_per_ns;
+    for (; w->written != due; w->written++)
+        sim->mem[BRAM_ADDR / BYTES_PER_WORD + w->written % w->n_words] = w->written;
+    sim->mem[WPTR_ADDR / BYTES_PER_WORD] = w->written;
+}
+
+/* Check a stream of word numbers for order; gaps must be owned up to */
+struct checker {
+    uint32_t next;
+    bool started;
+    unsigned long long words, skipped;
+};
+
+static int check(struct checker *ck, const unsigned int *buf, unsigned int n_words)
+{
+    unsigned int i;
+    int errors = 0;
+
+    for (i = 0; i < n_words; i++)
+    {
+        if (ck->started && buf[i] != ck->next)
+        {
+            if (buf[i] < ck->next)
+                errors++;
+            ck->skipped += buf[i] - ck->next;
+        }
+        ck->started = true;
+        ck->next = buf[i] + 1;
+    }
+    ck->words += n_words;
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int n_polls = 200, n_bytes = 16384, poll_us = 20000, i, got, ptr, old_ptr;
+    double rate = 50000;
+    struct writer w;
+    struct checker ck_old, ck_new;
+    struct circ_desc desc = { WPTR_ADDR, BRAM_ADDR, 0, 0, 0 };
+    struct circ_stats stats;
+    struct spifpga_sim *sim;
+    struct circ *c;
+    unsigned int *buf, *full;
+    uint64_t bus_old, wire_old, bus_new, wire_new, t_old, t_new;
+    bool burst = false;
+    int ch, fd, errors = 0;
+
+    while ((ch = getopt(argc, argv, "n:b:r:p:B")) != -1)
+        switch (ch) {
+            case 'n':
+                n_polls = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                n_bytes = strtoul(optarg, NULL, 0) & ~(BYTES_PER_WORD - 1);
+                break;
+            case 'r':
+                rate = strtod(optarg, NULL);
+                break;
+            case 'p':
+                poll_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                burst = true;
+                break;
+            default:
+                printf("Usage: spifpga_circ_bench [-n polls] [-b bram_bytes] [-r bytes_per_s] [-p poll_us] [-B]\n");
+                return 1;
+        }
+    if (n_polls == 0 || n_bytes == 0 || rate <= 0)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    sim = spifpga_sim_new(BRAM_ADDR + n_bytes);
+    buf = malloc(n_bytes);
+    full = malloc(n_bytes);
+    if (!sim || !buf || !full)
+    {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+    memset(&w, 0, sizeof(w));
+    w.n_words = n_bytes / BYTES_PER_WORD;
+    w.words_per_ns = rate / BYTES_PER_WORD / 1e9;
+    sim->hook = writer_hook;
+    sim->hook_ctx = &w;
+    fd = config_spi_sim(sim);
+    if (!burst)
+        set_protocol(fd, PROTO_FRAMES);
+
+    /* the old way: pointer, then all of the BRAM, and keep the new part */
+    memset(&ck_old, 0, sizeof(ck_old));
+    read_word(fd, WPTR_ADDR, &old_ptr);
+    spifpga_sim_reset_counters(sim);
+    for (i = 0; i < n_polls; i++)
+    {
+        w.idle_ns += poll_us * 1000ull;
+        read_word(fd, WPTR_ADDR, &ptr);
+        bulk_read(fd, BRAM_ADDR, n_bytes, full);
+        if (ptr - old_ptr > w.n_words)
+            old_ptr = ptr - w.n_words;
+        for (; old_ptr != ptr; old_ptr++)
+            errors += check(&ck_old, &full[old_ptr % w.n_words], 1);
+    }
+    bus_old = sim->bus_ns;
+    wire_old = sim->wire_bytes;
+    t_old = bus_old + n_polls * poll_us * 1000ull;
+
+    memset(&ck_new, 0, sizeof(ck_new));
+    spifpga_sim_reset_counters(sim);
+    w.idle_ns = 0;
+    w.written = 0;
+    desc.n_bytes = n_bytes;
+    c = circ_new(fd, &desc);
+    if (!c)
+        return 1;
+    for (i = 0; i < n_polls; i++)
+    {
+        w.idle_ns += poll_us * 1000ull;
+        if (circ_read(c, buf, n_bytes, &got) != RESP_OK)
+            errors++;
+        errors += check(&ck_new, buf, got / BYTES_PER_WORD);
+    }
+    bus_new = sim->bus_ns;
+    wire_new = sim->wire_bytes;
+    t_new = bus_new + n_polls * poll_us * 1000ull;
+    circ_get_stats(c, &stats);
+    /* what was lost after the last word returned shows as no gap */
+    if (stats.lost_bytes < ck_new.skipped * BYTES_PER_WORD)
+        errors++;
+
+    printf("%u polls %u us apart, %u byte BRAM written at %.0f bytes/s, %s protocol\n",
+            n_polls, poll_us, n_bytes, rate, burst ? "burst" : "frame");
+    printf("whole BRAM   %6.1f wire bytes per data byte, bus busy %4.1f%%, %llu bytes, %llu skipped\n",
+            (double) wire_old / (ck_old.words * BYTES_PER_WORD), 100.0 * bus_old / t_old,
+            ck_old.words * BYTES_PER_WORD, ck_old.skipped * BYTES_PER_WORD);
+    printf("circ_read    %6.1f wire bytes per data byte, bus busy %4.1f%%, %llu bytes, %llu overruns, %llu lost\n",
+            (double) wire_new / (stats.bytes ? stats.bytes : 1), 100.0 * bus_new / t_new,
+            stats.bytes, stats.overruns, stats.lost_bytes);
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    circ_free(c);
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    free(buf);
+    free(full);
+    return errors ? 1 : 0;
+}
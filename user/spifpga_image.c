@@ -0,0 +1,352 @@
+/*
+ * File images, see spifpga_image.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spifpga_user.h"
+#include "spifpga_image.h"
+
+#define HEX_WORD_BYTES 9        /* "%08x\n" */
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool image_is_hex(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+
+    return dot && (strcmp(dot, ".hex") == 0 || strcmp(dot, ".txt") == 0);
+}
+
+static void report(image_progress_fn progress, void *ctx, unsigned long long done,
+        unsigned long long total, double start)
+{
+    struct image_progress p;
+
+    if (!progress)
+        return;
+    p.done = done;
+    p.total = total;
+    p.seconds = now_s() - start;
+    progress(&p, ctx);
+}
+
+/* Ask for the file pages of the next chunk while the bus moves this one */
+static void prefetch(unsigned char *map, size_t map_len, size_t from)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = from / page * page;
+
+    if (start < map_len)
+        madvise(map + start, map_len - start < IMAGE_CHUNK + page ? map_len - start :
+                IMAGE_CHUNK + page, MADV_WILLNEED);
+}
+
+/*
+ * Open and map path: read only, setting *len to its size, or for writing,
+ * sized to *len.
+ */
+static int map_file(const char *path, int flags, size_t *len, int *fdp, unsigned char **map)
+{
+    int prot = flags == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    struct stat st;
+
+    *fdp = open(path, flags, 0644);
+    if (*fdp < 0)
+    {
+        printf("can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (flags == O_RDONLY ? fstat(*fdp, &st) != 0 : ftruncate(*fdp, *len) != 0)
+    {
+        printf("can't size %s: %s\n", path, strerror(errno));
+        close(*fdp);
+        return -1;
+    }
+    if (flags == O_RDONLY)
+        *len = st.st_size;
+    *map = NULL;
+    if (*len == 0)
+        return 0;
+    *map = mmap(NULL, *len, prot, MAP_SHARED, *fdp, 0);
+    if (*map == MAP_FAILED)
+    {
+        printf("can't map %s: %s\n", path, strerror(errno));
+        close(*fdp);
+        return -1;
+    }
+    madvise(*map, *len, MADV_SEQUENTIAL);
+    return 0;
+}
+
+/* Write n bytes from src to addr; a last part word only changes its bytes */
+static int write_chunk(int fd, unsigned int addr, const unsigned char *src, unsigned int n)
+{
+    unsigned int whole = n & ~(BYTES_PER_WORD - 1), val = 0;
+    int ret = RESP_OK;
+
+    if (whole)
+        ret = bulk_write(fd, addr, whole, (unsigned int *) src);
+    if (ret == RESP_OK && n > whole)
+    {
+        memcpy(&val, src + whole, n - whole);
+        ret = write_word_masked(fd, addr + whole, val, (1u << (8 * (n - whole))) - 1);
+    }
+    return ret;
+}
+
+static int read_chunk(int fd, unsigned int addr, unsigned char *dst, unsigned int n)
+{
+    unsigned int whole = n & ~(BYTES_PER_WORD - 1), val;
+    int ret = RESP_OK;
+
+    if (whole)
+        ret = bulk_read(fd, addr, whole, (unsigned int *) dst);
+    if (ret == RESP_OK && n > whole)
+    {
+        ret = read_word(fd, addr + whole, &val);
+        memcpy(dst + whole, &val, n - whole);
+    }
+    return ret;
+}
+
+static void stopped(int ret, unsigned long long done)
+{
+    printf("transfer failed (%d) after %llu bytes; resume from offset %llu\n",
+            ret, done, done);
+}
+
+/*
+ * The next hex word from *p, before end. Returns 1 and moves *p past it,
+ * 0 at the end of the text, or -1 for something that isn't hex.
+ */
+static int hex_token(const char **p, const char *end, unsigned int *val)
+{
+    const char *s = *p;
+    unsigned int v = 0, digits = 0;
+    int d;
+
+    while (s < end)
+    {
+        if (*s == '#')
+            while (s < end && *s != '\n')
+                s++;
+        else if (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n')
+            s++;
+        else
+            break;
+    }
+    if (s == end)
+        return 0;
+    if (end - s > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+        s += 2;
+    for (; s < end && !strchr(" \t\r\n#", *s); s++, digits++)
+    {
+        d = *s >= '0' && *s <= '9' ? *s - '0' :
+            *s >= 'a' && *s <= 'f' ? *s - 'a' + 10 :
+            *s >= 'A' && *s <= 'F' ? *s - 'A' + 10 : -1;
+        if (d < 0 || digits == 8)
+            return -1;
+        v = v << 4 | d;
+    }
+    if (!digits)
+        return -1;
+    *p = s;
+    *val = v;
+    return 1;
+}
+
+static int upload_hex(int fd, unsigned int addr, const char *text, size_t len,
+        unsigned long long offset, unsigned long long max_bytes,
+        image_progress_fn progress, void *ctx)
+{
+    const char *p = text, *end = text + len;
+    unsigned long long total = 0, done = 0;
+    unsigned int *chunk, n = 0, val;
+    double start = now_s();
+    int t, ret = RESP_OK;
+
+    /* count the words first, for the progress */
+    while ((t = hex_token(&p, end, &val)) == 1)
+        total += BYTES_PER_WORD;
+    if (t < 0)
+    {
+        printf("not a hex word at byte %ld\n", (long) (p - text));
+        return -1;
+    }
+    if (max_bytes && total > max_bytes)
+        total = max_bytes & ~(unsigned long long) (BYTES_PER_WORD - 1);
+
+    chunk = malloc(IMAGE_CHUNK);
+    if (!chunk)
+    {
+        printf("Failed to allocate the upload chunk\n");
+        return -1;
+    }
+    for (p = text; done < total && hex_token(&p, end, &val) == 1; done += BYTES_PER_WORD)
+    {
+        if (done < offset)
+            continue;
+        chunk[n++] = val;
+        if (n * BYTES_PER_WORD == IMAGE_CHUNK || done + BYTES_PER_WORD == total)
+        {
+            ret = bulk_write(fd, addr + done + BYTES_PER_WORD - n * BYTES_PER_WORD,
+                    n * BYTES_PER_WORD, chunk);
+            if (ret != RESP_OK)
+            {
+                stopped(ret, done + BYTES_PER_WORD - n * BYTES_PER_WORD);
+                break;
+            }
+            n = 0;
+            report(progress, ctx, done + BYTES_PER_WORD, total, start);
+        }
+    }
+    free(chunk);
+    return ret;
+}
+
+/*
+ * Write the image in path to FPGA memory at addr, from offset on, and no
+ * more than max_bytes of it (0 for all). Returns RESP_OK, or the response
+ * code or error that stopped it, after saying where to resume.
+ */
+int image_upload(int fd, unsigned int addr, const char *path, bool hex,
+        unsigned long long offset, unsigned long long max_bytes,
+        image_progress_fn progress, void *ctx)
+{
+    unsigned long long total, done, n;
+    unsigned char *map;
+    size_t len;
+    double start = now_s();
+    int in, ret = RESP_OK;
+
+    if (offset % BYTES_PER_WORD)
+    {
+        printf("resume offsets are whole words\n");
+        return -1;
+    }
+    if (map_file(path, O_RDONLY, &len, &in, &map) != 0)
+        return -1;
+
+    if (hex)
+    {
+        ret = upload_hex(fd, addr, (const char *) map, len, offset, max_bytes,
+                progress, ctx);
+        goto out;
+    }
+
+    total = len;
+    if (max_bytes && total > max_bytes)
+        total = max_bytes;
+    if (offset > total)
+    {
+        printf("offset %llu is past the end of %s\n", offset, path);
+        ret = -1;
+        goto out;
+    }
+    for (done = offset; done < total; done += n)
+    {
+        n = total - done < IMAGE_CHUNK ? total - done : IMAGE_CHUNK;
+        prefetch(map, len, done + n);
+        ret = write_chunk(fd, addr + done, map + done, n);
+        if (ret != RESP_OK)
+        {
+            stopped(ret, done);
+            break;
+        }
+        report(progress, ctx, done + n, total, start);
+    }
+out:
+    if (map)
+        munmap(map, len);
+    close(in);
+    return ret;
+}
+
+/*
+ * Save n_bytes of FPGA memory from addr to path, from offset on (the
+ * file's first offset bytes, or their hex words, are kept). Returns
+ * RESP_OK, or the response code or error that stopped it, after saying
+ * where to resume.
+ */
+int image_download(int fd, unsigned int addr, unsigned long long n_bytes,
+        const char *path, bool hex, unsigned long long offset,
+        image_progress_fn progress, void *ctx)
+{
+    unsigned long long words = (n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD, done, n, i;
+    size_t len = hex ? words * HEX_WORD_BYTES : n_bytes;
+    unsigned int *chunk = NULL;
+    unsigned char *map;
+    char word[HEX_WORD_BYTES + 1];
+    double start = now_s();
+    int out, ret = RESP_OK;
+
+    if (offset % BYTES_PER_WORD || offset > n_bytes)
+    {
+        printf("resume offsets are whole words within the image\n");
+        return -1;
+    }
+    if (hex && !(chunk = malloc(IMAGE_CHUNK)))
+    {
+        printf("Failed to allocate the download chunk\n");
+        return -1;
+    }
+    if (map_file(path, O_RDWR | O_CREAT, &len, &out, &map) != 0)
+    {
+        free(chunk);
+        return -1;
+    }
+
+    for (done = offset; done < n_bytes; done += n)
+    {
+        n = n_bytes - done < IMAGE_CHUNK ? n_bytes - done : IMAGE_CHUNK;
+        if (hex)
+        {
+            ret = read_chunk(fd, addr + done, (unsigned char *) chunk, n);
+            for (i = 0; ret == RESP_OK && i < (n + BYTES_PER_WORD - 1) / BYTES_PER_WORD; i++)
+            {
+                snprintf(word, sizeof(word), "%08x\n", chunk[i]);
+                memcpy(map + (done / BYTES_PER_WORD + i) * HEX_WORD_BYTES, word, HEX_WORD_BYTES);
+            }
+        } else {
+            ret = read_chunk(fd, addr + done, map + done, n);
+        }
+        if (ret != RESP_OK)
+        {
+            stopped(ret, done);
+            break;
+        }
+        /* start writing this chunk back while the next is read */
+        if (!hex)
+            msync(map + done / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE),
+                    done % sysconf(_SC_PAGESIZE) + n, MS_ASYNC);
+        report(progress, ctx, done + n, n_bytes, start);
+    }
+
+    if (map)
+    {
+        if (msync(map, len, MS_SYNC) != 0 && ret == RESP_OK)
+        {
+            printf("can't write %s: %s\n", path, strerror(errno));
+            ret = -1;
+        }
+        munmap(map, len);
+    }
+    if (close(out) != 0 && ret == RESP_OK)
+        ret = -1;
+    free(chunk);
+    return ret;
+}
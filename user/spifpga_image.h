@@ -0,0 +1,42 @@
+/*
+ * Loading images (coefficient and lookup tables, BRAM contents) from files
+ * into FPGA memory, and saving FPGA memory to files.
+ *
+ * Files are mmap()ed and the transfers run straight out of, and into, the
+ * mapping a chunk at a time, with the kernel asked to read ahead (or write
+ * back) the next chunk while the bus moves this one, so an image of any
+ * size costs no heap beyond a chunk. A binary file is the memory image
+ * itself, in the host's byte order. A hex file has a word per token
+ * ("1234abcd" or "0x1234abcd", blank space between, # to the end of a
+ * line is a comment); downloads write them "%08x\n", so every word takes
+ * 9 bytes of the file.
+ *
+ * offset restarts an interrupted transfer: the first offset bytes of the
+ * image (and of the file, for downloads) are skipped. The progress
+ * callback, if given, is called after every chunk.
+ */
+
+#ifndef SPIFPGA_IMAGE_H
+#define SPIFPGA_IMAGE_H
+
+#include <stdbool.h>
+
+#define IMAGE_CHUNK 65536
+
+struct image_progress {
+    unsigned long long done;    /* bytes of the image, offset included */
+    unsigned long long total;
+    double seconds;             /* since the start, this run */
+};
+
+typedef void (*image_progress_fn)(const struct image_progress *progress, void *ctx);
+
+bool image_is_hex(const char *path);
+int image_upload(int fd, unsigned int addr, const char *path, bool hex,
+        unsigned long long offset, unsigned long long max_bytes,
+        image_progress_fn progress, void *ctx);
+int image_download(int fd, unsigned int addr, unsigned long long n_bytes,
+        const char *path, bool hex, unsigned long long offset,
+        image_progress_fn progress, void *ctx);
+
+#endif /* SPIFPGA_IMAGE_H */
@@ -0,0 +1,180 @@
+/*
+ * Image upload and download through mapped files, against the simulator.
+ *
+ * spifpga_image_bench [-s megabytes] [-B]
+ *
+ * Writes an image file, uploads it the old way (read into the heap, one
+ * bulk_write()) and with image_upload(), downloads it again with
+ * image_download(), and round trips part of it through a hex file. An
+ * upload stopped half way and resumed from its offset, and a file that
+ * ends part way through a word, are checked too. -B uses the burst
+ * protocol.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_image.h"
+
+#define IMAGE_ADDR 0x00100000
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_file(const char *path, const void *data, size_t len)
+{
+    FILE *out = fopen(path, "w");
+
+    if (!out)
+        return -1;
+    if (fwrite(data, 1, len, out) != len)
+    {
+        fclose(out);
+        return -1;
+    }
+    return fclose(out);
+}
+
+static int same_file(const char *path, const void *data, size_t len)
+{
+    unsigned char *buf = malloc(len + 1);
+    FILE *in = fopen(path, "r");
+    int same;
+
+    same = in && buf && fread(buf, 1, len + 1, in) == len && memcmp(buf, data, len) == 0;
+    if (in)
+        fclose(in);
+    free(buf);
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    char bin[] = "/tmp/spifpga_image_XXXXXX", out[64], hex[64];
+    unsigned int mb = 4, i, *image, *heap;
+    uint32_t *mem;
+    size_t len;
+    struct spifpga_sim *sim;
+    uint64_t bus_old, bus_up, bus_down;
+    double t0, wall_old, wall_up, wall_down;
+    unsigned char tail[7] = { 1, 2, 3, 4, 5, 6, 7 };
+    bool burst = false;
+    FILE *in;
+    int c, fd, errors = 0;
+
+    while ((c = getopt(argc, argv, "s:B")) != -1)
+        switch (c) {
+            case 's':
+                mb = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                burst = true;
+                break;
+            default:
+                printf("Usage: spifpga_image_bench [-s megabytes] [-B]\n");
+                return 1;
+        }
+    if (mb == 0)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    len = (size_t) mb << 20;
+    image = malloc(len);
+    sim = spifpga_sim_new(IMAGE_ADDR + len);
+    if (!image || !sim)
+    {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+    mem = &sim->mem[IMAGE_ADDR / BYTES_PER_WORD];
+    for (i = 0; i < len / BYTES_PER_WORD; i++)
+        image[i] = i * 2654435761u;
+    close(mkstemp(bin));
+    snprintf(out, sizeof(out), "%s.out", bin);
+    snprintf(hex, sizeof(hex), "%s.hex", bin);
+    if (write_file(bin, image, len) != 0)
+    {
+        printf("can't write %s\n", bin);
+        return 1;
+    }
+    fd = config_spi_sim(sim);
+    if (!burst)
+        set_protocol(fd, PROTO_FRAMES);
+
+    /* the old way: the whole image in the heap first */
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    heap = malloc(len);
+    in = fopen(bin, "r");
+    if (!heap || !in || fread(heap, 1, len, in) != len)
+        errors++;
+    else
+        errors += bulk_write(fd, IMAGE_ADDR, len, heap) != RESP_OK;
+    if (in)
+        fclose(in);
+    free(heap);
+    wall_old = now_s() - t0;
+    bus_old = sim->bus_ns;
+
+    memset(mem, 0, len);
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    errors += image_upload(fd, IMAGE_ADDR, bin, false, 0, 0, NULL, NULL) != RESP_OK;
+    wall_up = now_s() - t0;
+    bus_up = sim->bus_ns;
+    errors += memcmp(mem, image, len) != 0;
+
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    errors += image_download(fd, IMAGE_ADDR, len, out, false, 0, NULL, NULL) != RESP_OK;
+    wall_down = now_s() - t0;
+    bus_down = sim->bus_ns;
+    errors += !same_file(out, image, len);
+
+    /* hex, stopped half way and resumed */
+    errors += image_download(fd, IMAGE_ADDR, 65536, hex, true, 0, NULL, NULL) != RESP_OK;
+    memset(mem, 0, len);
+    errors += image_upload(fd, IMAGE_ADDR, hex, true, 0, 32768, NULL, NULL) != RESP_OK;
+    errors += memcmp(mem, image, 32768) != 0 || mem[32768 / BYTES_PER_WORD] != 0;
+    errors += image_upload(fd, IMAGE_ADDR, hex, true, 32768, 0, NULL, NULL) != RESP_OK;
+    errors += memcmp(mem, image, 65536) != 0;
+
+    /* binary resumed, and a last part word leaving the rest of its word */
+    memset(mem, 0, len);
+    errors += image_upload(fd, IMAGE_ADDR, bin, false, 0, len / 2, NULL, NULL) != RESP_OK;
+    errors += image_upload(fd, IMAGE_ADDR, bin, false, len / 2, 0, NULL, NULL) != RESP_OK;
+    errors += memcmp(mem, image, len) != 0;
+    mem[1] = 0xFFFFFFFF;
+    if (write_file(out, tail, sizeof(tail)) != 0)
+        errors++;
+    errors += image_upload(fd, IMAGE_ADDR, out, false, 0, 0, NULL, NULL) != RESP_OK;
+    errors += memcmp(mem, tail, sizeof(tail)) != 0 || ((unsigned char *) mem)[7] != 0xFF;
+
+    printf("%u MB image, %s protocol, bus MB/s (wall s)\n", mb, burst ? "burst" : "frame");
+    printf("heap + bulk_write %7.3f (%.3f)\n", len / (bus_old / 1e9) / 1e6, wall_old);
+    printf("image_upload      %7.3f (%.3f)\n", len / (bus_up / 1e9) / 1e6, wall_up);
+    printf("image_download    %7.3f (%.3f)\n", len / (bus_down / 1e9) / 1e6, wall_down);
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    unlink(bin);
+    unlink(out);
+    unlink(hex);
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    free(image);
+    return errors ? 1 : 0;
+}
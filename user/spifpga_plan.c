@@ -0,0 +1,263 @@
+/*
+ * Read plans, see spifpga_plan.h.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "spifpga_user.h"
+#include "spifpga_plan.h"
+
+struct read_plan {
+    int fd;
+    unsigned int n;
+    unsigned int max_gap;
+    unsigned int *sorted;       /* the distinct addresses, ascending */
+    unsigned int n_sorted;
+    unsigned int *slot;         /* for each address asked for, its place in sorted */
+
+    /* made for this protocol and message size, see plan_build() */
+    int proto;
+    unsigned int burst_size;
+    struct read_span *spans;
+    unsigned int n_spans;
+    unsigned int *msg_spans;    /* spans in each message */
+    unsigned int n_msgs;
+    unsigned int *words;        /* the spans' words, one after the other */
+    unsigned int *map;          /* for each address asked for, its word */
+    struct read_plan_stats stats;
+};
+
+struct addr_slot {
+    unsigned int addr;
+    unsigned int i;
+};
+
+static int addr_slot_cmp(const void *a, const void *b)
+{
+    const struct addr_slot *x = a, *y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* Unwanted words a burst reads across rather than start another */
+static unsigned int bridge_words(int fd, unsigned int max_gap)
+{
+    struct spi_profile profile;
+    double byte_ns, burst_ns;
+    unsigned int n;
+
+    if (get_protocol(fd) != PROTO_BURST || max_gap == 0)
+        return 0;
+    get_profile(fd, &profile);
+    byte_ns = 8e9 / (profile.speed ? profile.speed : MAX_SPEED);
+    burst_ns = PLAN_XFER_NS + DELAY * 1000 + BURST_OVERHEAD * byte_ns;
+    n = burst_ns / (BYTES_PER_WORD * byte_ns);
+    return n < max_gap ? n : max_gap;
+}
+
+static void plan_clear(struct read_plan *p)
+{
+    free(p->spans);
+    free(p->msg_spans);
+    free(p->words);
+    free(p->map);
+    p->spans = NULL;
+    p->msg_spans = NULL;
+    p->words = NULL;
+    p->map = NULL;
+    p->n_spans = 0;
+    p->n_msgs = 0;
+}
+
+/* Runs of the sorted addresses, then spans of them packed into messages */
+static int plan_build(struct read_plan *p)
+{
+    struct spi_profile profile;
+    unsigned int bridge, i, j, k, n_runs = 0, total = 0, run, left, take, room = 0, *index;
+    unsigned int *run_addr, *run_words;
+    bool burst;
+
+    plan_clear(p);
+    p->proto = get_protocol(p->fd);
+    get_profile(p->fd, &profile);
+    p->burst_size = profile.burst_size;
+    burst = p->proto == PROTO_BURST;
+    bridge = bridge_words(p->fd, p->max_gap);
+
+    run_addr = malloc((p->n_sorted ? p->n_sorted : 1) * sizeof(*run_addr));
+    run_words = malloc((p->n_sorted ? p->n_sorted : 1) * sizeof(*run_words));
+    index = malloc((p->n_sorted ? p->n_sorted : 1) * sizeof(*index));
+    if (!run_addr || !run_words || !index)
+        goto fail;
+
+    /* adjacent addresses, and those a short enough gap away, share a run */
+    for (i = 0; i < p->n_sorted; i++)
+    {
+        unsigned int gap = 0, addr = p->sorted[i];
+
+        if (n_runs)
+        {
+            uint64_t end = run_addr[n_runs - 1] + (uint64_t) run_words[n_runs - 1] * BYTES_PER_WORD;
+
+            gap = addr - end;
+            if (addr >= end && gap % BYTES_PER_WORD == 0 && gap / BYTES_PER_WORD <= bridge)
+            {
+                run_words[n_runs - 1] += gap / BYTES_PER_WORD + 1;
+                total += gap / BYTES_PER_WORD + 1;
+                index[i] = total - 1;
+                continue;
+            }
+        }
+        run_addr[n_runs] = addr;
+        run_words[n_runs++] = 1;
+        index[i] = total++;
+    }
+
+    /* a span holds at least a word, and a message at least a span */
+    p->spans = calloc(total ? total : 1, sizeof(*p->spans));
+    p->msg_spans = calloc(total ? total : 1, sizeof(*p->msg_spans));
+    p->words = malloc((total ? total : 1) * sizeof(*p->words));
+    p->map = malloc((p->n ? p->n : 1) * sizeof(*p->map));
+    if (!p->spans || !p->msg_spans || !p->words || !p->map)
+        goto fail;
+
+    /* fill each message before starting the next, splitting runs to fit */
+    memset(&p->stats, 0, offsetof(struct read_plan_stats, builds));
+    for (run = k = 0; run < n_runs; run++)
+    {
+        for (left = run_words[run]; left; left -= take)
+        {
+            if (burst ? room < BURST_OVERHEAD + BYTES_PER_WORD : room == 0)
+            {
+                room = burst ? p->burst_size * sizeof(struct fpga_spi_cmd) : p->burst_size;
+                p->n_msgs++;
+            }
+            take = burst ? (room - BURST_OVERHEAD) / BYTES_PER_WORD : room;
+            if (take > left)
+                take = left;
+            room -= burst ? take * BYTES_PER_WORD + BURST_OVERHEAD : take;
+
+            p->spans[p->n_spans].addr = run_addr[run] + (run_words[run] - left) * BYTES_PER_WORD;
+            p->spans[p->n_spans].n_bytes = take * BYTES_PER_WORD;
+            p->spans[p->n_spans++].buf = p->words + k;
+            p->msg_spans[p->n_msgs - 1]++;
+            p->stats.wire_bytes += burst ? take * BYTES_PER_WORD + BURST_OVERHEAD :
+                    take * sizeof(struct fpga_spi_cmd);
+            k += take;
+        }
+    }
+    for (j = 0; j < p->n; j++)
+        p->map[j] = index[p->slot[j]];
+
+    p->stats.addrs = p->n;
+    p->stats.distinct = p->n_sorted;
+    p->stats.words = total;
+    p->stats.spans = p->n_spans;
+    p->stats.messages = p->n_msgs;
+    p->stats.builds++;
+    free(run_addr);
+    free(run_words);
+    free(index);
+    return 0;
+
+fail:
+    printf("Failed to allocate the read plan\n");
+    free(run_addr);
+    free(run_words);
+    free(index);
+    plan_clear(p);
+    p->burst_size = 0;          /* so the next run tries again */
+    return -1;
+}
+
+struct read_plan *read_plan_new(int fd, const unsigned int *addrs, unsigned int n,
+        unsigned int max_gap)
+{
+    struct addr_slot *order;
+    struct read_plan *p;
+    unsigned int i;
+
+    p = calloc(1, sizeof(*p));
+    order = malloc((n ? n : 1) * sizeof(*order));
+    if (p)
+    {
+        p->sorted = malloc((n ? n : 1) * sizeof(*p->sorted));
+        p->slot = malloc((n ? n : 1) * sizeof(*p->slot));
+    }
+    if (!p || !order || !p->sorted || !p->slot)
+    {
+        printf("Failed to allocate the read plan\n");
+        free(order);
+        read_plan_free(p);
+        return NULL;
+    }
+    p->fd = fd;
+    p->n = n;
+    p->max_gap = max_gap;
+
+    for (i = 0; i < n; i++)
+    {
+        order[i].addr = addrs[i];
+        order[i].i = i;
+    }
+    qsort(order, n, sizeof(*order), addr_slot_cmp);
+    for (i = 0; i < n; i++)
+    {
+        if (!p->n_sorted || p->sorted[p->n_sorted - 1] != order[i].addr)
+            p->sorted[p->n_sorted++] = order[i].addr;
+        p->slot[order[i].i] = p->n_sorted - 1;
+    }
+    free(order);
+
+    if (plan_build(p) != 0)
+    {
+        read_plan_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+void read_plan_free(struct read_plan *p)
+{
+    if (!p)
+        return;
+    plan_clear(p);
+    free(p->sorted);
+    free(p->slot);
+    free(p);
+}
+
+/*
+ * Read every address into vals, in the order they were given. Returns the
+ * OR of the response codes, or a negative error.
+ */
+int read_plan_run(struct read_plan *p, unsigned int *vals)
+{
+    struct spi_profile profile;
+    unsigned int m, s, i;
+    int ret, fpga_ret = RESP_OK;
+
+    get_profile(p->fd, &profile);
+    if ((get_protocol(p->fd) != p->proto || profile.burst_size != p->burst_size) &&
+            plan_build(p) != 0)
+        return -1;
+
+    for (m = s = 0; m < p->n_msgs; s += p->msg_spans[m++])
+    {
+        ret = read_spans_ops(p->fd, p->spans + s, p->msg_spans[m], NULL, 0);
+        if (ret < 0)
+            return ret;
+        fpga_ret |= ret;
+    }
+    for (i = 0; i < p->n; i++)
+        vals[i] = p->words[p->map[i]];
+    return fpga_ret;
+}
+
+void read_plan_get_stats(const struct read_plan *p, struct read_plan_stats *stats)
+{
+    *stats = p->stats;
+}
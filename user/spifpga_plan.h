@@ -0,0 +1,45 @@
+/*
+ * Read plans: the cheapest way to read an arbitrary list of register
+ * addresses, made once and run as often as the same list is wanted.
+ *
+ * read_plan_new() sorts the addresses and drops repeats, merges adjacent
+ * ones into runs, and with the burst protocol also reads across a gap of
+ * up to max_gap unwanted words where that is cheaper on the bus than
+ * starting another burst: a burst costs its header and status bytes and a
+ * transfer, PLAN_XFER_NS for the chipselect and controller setup plus
+ * delay_usecs, against 4 bytes a gap word, at the link's clock rate. Pass
+ * a max_gap of 0 if the gaps hold registers that must not be read. The
+ * runs are then packed into as few messages as the link takes, splitting
+ * a run where a message fills up. With single frames each word is a frame
+ * wherever it is, so nothing is bridged and the frames are just packed.
+ *
+ * read_plan_run() sends the messages and puts each value in the caller's
+ * order, repeats included, allocating nothing. If the link's protocol or
+ * message size has changed since (set_protocol(), a demotion), the plan is
+ * made again first.
+ */
+
+#ifndef SPIFPGA_PLAN_H
+#define SPIFPGA_PLAN_H
+
+#define PLAN_XFER_NS 2000
+
+struct read_plan_stats {
+    unsigned int addrs;         /* asked for */
+    unsigned int distinct;
+    unsigned int words;         /* read, gaps included */
+    unsigned int spans;         /* bursts, or runs of frames */
+    unsigned int messages;      /* per run */
+    unsigned int wire_bytes;    /* per run */
+    unsigned int builds;        /* plans made, the first included */
+};
+
+struct read_plan;
+
+struct read_plan *read_plan_new(int fd, const unsigned int *addrs, unsigned int n,
+        unsigned int max_gap);
+void read_plan_free(struct read_plan *p);
+int read_plan_run(struct read_plan *p, unsigned int *vals);
+void read_plan_get_stats(const struct read_plan *p, struct read_plan_stats *stats);
+
+#endif /* SPIFPGA_PLAN_H */
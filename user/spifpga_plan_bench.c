@@ -0,0 +1,214 @@
+/*
+ * Read plans against scattered reads, on the simulator.
+ *
+ * spifpga_plan_bench [-n addresses] [-q queries] [-g max_gap] [-B]
+ *
+ * The addresses come in short clusters at random places, some with a word
+ * or two missing, some asked for twice, in random order, as a list built
+ * from a register map tends to. Each query reads all of them, with
+ * read_word() one at a time, with read_words() in the order given, and
+ * with a read plan made once (-g caps the gap words it may read across;
+ * with -B it is run a second time without gaps). Bus time and messages per
+ * query are compared, every value is checked, and the plan is checked to
+ * remake itself when the link's message size is cut. -B uses the burst
+ * protocol.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_plan.h"
+
+#define SPACE_BYTES (1 << 20)
+#define MAX_CLUSTER 8
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int check(const struct spifpga_sim *sim, const unsigned int *addrs,
+        const unsigned int *vals, unsigned int n)
+{
+    unsigned int i, bad = 0;
+
+    for (i = 0; i < n; i++)
+        bad += vals[i] != sim->mem[addrs[i] / BYTES_PER_WORD];
+    return bad;
+}
+
+static void report(const char *what, const struct spifpga_sim *sim, unsigned int queries,
+        double host_s)
+{
+    printf("%-20s %9.1f us bus %7.1f messages %8.1f us host per query\n", what,
+            sim->bus_ns / 1e3 / queries, (double) sim->messages / queries,
+            host_s * 1e6 / queries);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int n = 512, queries = 200, max_gap = 4, i, j, q, len, tmp, *addrs, *vals;
+    struct read_plan_stats st;
+    struct spi_profile profile;
+    struct spifpga_sim *sim;
+    struct read_plan *p, *nogap = NULL;
+    double t0;
+    bool burst = false;
+    int c, fd, errors = 0;
+
+    while ((c = getopt(argc, argv, "n:q:g:B")) != -1)
+        switch (c) {
+            case 'n':
+                n = strtoul(optarg, NULL, 0);
+                break;
+            case 'q':
+                queries = strtoul(optarg, NULL, 0);
+                break;
+            case 'g':
+                max_gap = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                burst = true;
+                break;
+            default:
+                printf("Usage: spifpga_plan_bench [-n addresses] [-q queries] [-g max_gap] [-B]\n");
+                return 1;
+        }
+    if (n == 0 || queries == 0)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    sim = spifpga_sim_new(SPACE_BYTES);
+    addrs = malloc(n * sizeof(*addrs));
+    vals = malloc(n * sizeof(*vals));
+    if (!sim || !addrs || !vals)
+    {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+    for (i = 0; i < SPACE_BYTES / BYTES_PER_WORD; i++)
+        sim->mem[i] = i * 2654435761u;
+
+    /* clusters with holes, an address in sixteen repeated, then shuffled */
+    srand(1);
+    for (i = 0; i < n; )
+    {
+        tmp = rand() % (SPACE_BYTES / BYTES_PER_WORD - 2 * MAX_CLUSTER);
+        len = 1 + rand() % MAX_CLUSTER;
+        for (j = 0; j < len && i < n; j++, tmp++)
+        {
+            if (rand() % 4 == 0)
+                tmp += 1 + rand() % 2;
+            addrs[i++] = tmp * BYTES_PER_WORD;
+        }
+    }
+    for (i = 0; i < n / 16; i++)
+        addrs[rand() % n] = addrs[rand() % n];
+    for (i = n - 1; i > 0; i--)
+    {
+        j = rand() % (i + 1);
+        tmp = addrs[i];
+        addrs[i] = addrs[j];
+        addrs[j] = tmp;
+    }
+
+    fd = config_spi_sim(sim);
+    if (!burst)
+        set_protocol(fd, PROTO_FRAMES);
+
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    for (q = 0; q < queries; q++)
+    {
+        for (i = 0; i < n; i++)
+            errors += read_word(fd, addrs[i], &vals[i]) != RESP_OK;
+        errors += check(sim, addrs, vals, n);
+    }
+    report("read_word each", sim, queries, now_s() - t0);
+
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    for (q = 0; q < queries; q++)
+    {
+        errors += read_words(fd, addrs, n, vals) != RESP_OK;
+        errors += check(sim, addrs, vals, n);
+    }
+    report("read_words", sim, queries, now_s() - t0);
+
+    p = read_plan_new(fd, addrs, n, max_gap);
+    if (burst)
+        nogap = read_plan_new(fd, addrs, n, 0);
+    if (!p || (burst && !nogap))
+        return 1;
+
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    for (q = 0; q < queries; q++)
+    {
+        memset(vals, 0, n * sizeof(*vals));
+        errors += read_plan_run(p, vals) != RESP_OK;
+        errors += check(sim, addrs, vals, n);
+    }
+    report("read plan", sim, queries, now_s() - t0);
+
+    if (nogap)
+    {
+        spifpga_sim_reset_counters(sim);
+        t0 = now_s();
+        for (q = 0; q < queries; q++)
+        {
+            errors += read_plan_run(nogap, vals) != RESP_OK;
+            errors += check(sim, addrs, vals, n);
+        }
+        report("read plan, no gaps", sim, queries, now_s() - t0);
+    }
+
+    /* made afresh for every query, to see what caching the plan saves */
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    for (q = 0; q < queries; q++)
+    {
+        struct read_plan *once = read_plan_new(fd, addrs, n, max_gap);
+
+        errors += !once || read_plan_run(once, vals) != RESP_OK;
+        errors += check(sim, addrs, vals, n);
+        read_plan_free(once);
+    }
+    report("plan made each time", sim, queries, now_s() - t0);
+
+    read_plan_get_stats(p, &st);
+    printf("%u addresses, %u distinct, %u words read in %u %s, %u messages, %u wire bytes, %s protocol\n",
+            st.addrs, st.distinct, st.words, st.spans, burst ? "bursts" : "runs of frames",
+            st.messages, st.wire_bytes, burst ? "burst" : "frame");
+
+    /* a smaller message size makes the plan again */
+    get_profile(fd, &profile);
+    profile.burst_size /= 2;
+    set_profile(fd, &profile);
+    memset(vals, 0, n * sizeof(*vals));
+    errors += read_plan_run(p, vals) != RESP_OK;
+    errors += check(sim, addrs, vals, n);
+    read_plan_get_stats(p, &st);
+    errors += st.builds != 2;
+    printf("at %u frames per message: %u messages\n", profile.burst_size, st.messages);
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    read_plan_free(p);
+    read_plan_free(nogap);
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    free(addrs);
+    free(vals);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,492 @@
+/*
+ * Device pool with a worker thread per SPI bus, see spifpga_pool.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "spifpga_user.h"
+#include "spifpga_pool.h"
+
+struct pool_dev {
+    int fd;
+    int bus;
+    bool owned;             /* opened by the pool, closed by it too */
+};
+
+struct pool_bus {
+    int bus;
+    pthread_t thread;
+    struct spifpga_pool *pool;
+    unsigned int seen;      /* the last batch started before the worker was */
+};
+
+struct spifpga_pool {
+    struct pool_dev devs[MAX_LINKS];
+    unsigned int n_devs;
+    struct pool_bus buses[MAX_LINKS];
+    unsigned int n_buses;
+
+    /* the batch being run, under lock */
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    struct spifpga_pool_op *ops;
+    unsigned int n_ops;
+    unsigned int batch;     /* bumped for every batch */
+    unsigned int busy;      /* workers still on it */
+    bool running, stop;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run_op(struct spifpga_pool *pool, struct spifpga_pool_op *op)
+{
+    int fd = pool->devs[op->dev].fd;
+    unsigned long long start = now_ns();
+
+    if (op->write)
+        op->ret = bulk_write(fd, op->addr, op->n_bytes, op->buf);
+    else
+        op->ret = bulk_read(fd, op->addr, op->n_bytes, op->buf);
+    op->ns = now_ns() - start;
+}
+
+/* Runs the operations of each batch that are for this bus, in order */
+static void *bus_worker(void *arg)
+{
+    struct pool_bus *b = arg;
+    struct spifpga_pool *pool = b->pool;
+    unsigned int seen, i;
+
+    pthread_mutex_lock(&pool->lock);
+    seen = b->seen;
+    while (1)
+    {
+        while (pool->batch == seen && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->stop)
+            break;
+        seen = pool->batch;
+        pthread_mutex_unlock(&pool->lock);
+
+        for (i = 0; i < pool->n_ops; i++)
+            if (pool->devs[pool->ops[i].dev].bus == b->bus)
+                run_op(pool, &pool->ops[i]);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct spifpga_pool *spifpga_pool_new(void)
+{
+    struct spifpga_pool *pool;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    return pool;
+}
+
+void spifpga_pool_free(struct spifpga_pool *pool)
+{
+    unsigned int i;
+
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->n_buses; i++)
+        pthread_join(pool->buses[i].thread, NULL);
+
+    for (i = 0; i < pool->n_devs; i++)
+        if (pool->devs[i].owned)
+            close_spi(pool->devs[i].fd);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+/* Starts the worker for bus if it has none yet */
+static int pool_add_bus(struct spifpga_pool *pool, int bus)
+{
+    struct pool_bus *b;
+    unsigned int i;
+
+    for (i = 0; i < pool->n_buses; i++)
+        if (pool->buses[i].bus == bus)
+            return 0;
+
+    b = &pool->buses[pool->n_buses];
+    b->bus = bus;
+    b->pool = pool;
+    /* set here, under the lock, so a batch run before the thread gets
+     * the lock is still one it runs
+     */
+    b->seen = pool->batch;
+    if (pthread_create(&b->thread, NULL, bus_worker, b) != 0)
+    {
+        printf("can't start the worker for bus %d\n", bus);
+        return -1;
+    }
+    pool->n_buses++;
+    return 0;
+}
+
+/*
+ * Add a device that is already set up, on the given bus. The caller keeps
+ * the fd and closes it after spifpga_pool_free(). Returns the device's
+ * index, or -1.
+ */
+int spifpga_pool_add_fd(struct spifpga_pool *pool, int fd, int bus)
+{
+    struct pool_dev *dev;
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->running || pool->n_devs == MAX_LINKS)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        printf("can't add a device to the pool now\n");
+        return -1;
+    }
+    ret = pool_add_bus(pool, bus);
+    if (ret == 0)
+    {
+        dev = &pool->devs[pool->n_devs];
+        dev->fd = fd;
+        dev->bus = bus;
+        dev->owned = false;
+        ret = pool->n_devs++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+/* The bus number B of /dev/spidevB.C or /dev/spifpgaB.C */
+static int device_bus(const char *device)
+{
+    const char *name = strrchr(device, '/');
+    int bus, cs;
+
+    name = name ? name + 1 : device;
+    while (*name && (*name < '0' || *name > '9'))
+        name++;
+    if (sscanf(name, "%d.%d", &bus, &cs) != 2)
+        return -1;
+    return bus;
+}
+
+/*
+ * Open a spidev device, with its saved profile, or with profile if that is
+ * not NULL. Returns the device's index, or -1.
+ */
+int spifpga_pool_add(struct spifpga_pool *pool, const char *device,
+        const struct spi_profile *profile)
+{
+    int bus, fd, dev;
+
+    bus = device_bus(device);
+    if (bus < 0)
+    {
+        printf("can't tell the bus of %s\n", device);
+        return -1;
+    }
+    fd = config_spi_dev(device);
+    if (fd < 0)
+        return -1;
+    if (profile && set_profile(fd, profile) != 0)
+    {
+        printf("can't set the profile of %s\n", device);
+        close_spi(fd);
+        return -1;
+    }
+
+    dev = spifpga_pool_add_fd(pool, fd, bus);
+    if (dev < 0)
+    {
+        close_spi(fd);
+        return -1;
+    }
+    pool->devs[dev].owned = true;
+    return dev;
+}
+
+int spifpga_pool_size(struct spifpga_pool *pool)
+{
+    return pool->n_devs;
+}
+
+int spifpga_pool_fd(struct spifpga_pool *pool, int dev)
+{
+    if (dev < 0 || dev >= (int) pool->n_devs)
+        return -1;
+    return pool->devs[dev].fd;
+}
+
+/*
+ * Run n bulk reads and writes, in parallel across buses and in order on
+ * each bus, and wait for all of them. Returns the number that failed (a
+ * negative ret, or a response other than RESP_OK), or -1 if an operation
+ * names no device of the pool.
+ */
+int spifpga_pool_run(struct spifpga_pool *pool, struct spifpga_pool_op *ops, unsigned int n)
+{
+    unsigned int i;
+    int failed = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (ops[i].dev < 0 || ops[i].dev >= (int) pool->n_devs)
+        {
+            printf("pool operation %u on unknown device %d\n", i, ops[i].dev);
+            return -1;
+        }
+        ops[i].ret = -1;
+        ops[i].ns = 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pool->running = true;
+    pool->ops = ops;
+    pool->n_ops = n;
+    pool->busy = pool->n_buses;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->busy)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pool->running = false;
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < n; i++)
+        failed += ops[i].ret != RESP_OK;
+    return failed;
+}
+
+/*
+ * Write the same data (a bitstream or a coefficient table, say) to every
+ * device of the pool at once. Returns the number of devices it failed on.
+ */
+int spifpga_pool_broadcast(struct spifpga_pool *pool, unsigned int addr,
+        unsigned int n_bytes, unsigned int *buf)
+{
+    struct spifpga_pool_op *ops;
+    unsigned int i;
+    int failed;
+
+    ops = calloc(pool->n_devs, sizeof(*ops));
+    if (!ops)
+    {
+        printf("Failed to allocate pool operations\n");
+        return -1;
+    }
+    for (i = 0; i < pool->n_devs; i++)
+    {
+        ops[i].dev = i;
+        ops[i].write = true;
+        ops[i].addr = addr;
+        ops[i].n_bytes = n_bytes;
+        ops[i].buf = buf;
+    }
+    failed = spifpga_pool_run(pool, ops, pool->n_devs);
+    free(ops);
+    return failed;
+}
+
+struct spifpga_stripe {
+    struct spifpga_pool *pool;
+    int devs[STRIPE_MAX_LINKS];
+    unsigned int n_links;
+    double weight[STRIPE_MAX_LINKS];    /* bytes/s, 0 until measured */
+};
+
+/*
+ * A stripe set over n_devs devices of pool, which must all reach the same
+ * FPGA memory. Returns NULL if there are none or too many.
+ */
+struct spifpga_stripe *spifpga_stripe_new(struct spifpga_pool *pool,
+        const int *devs, unsigned int n_devs)
+{
+    struct spifpga_stripe *stripe;
+    unsigned int i;
+
+    if (n_devs == 0 || n_devs > STRIPE_MAX_LINKS)
+    {
+        printf("a stripe set takes 1 to %d links\n", STRIPE_MAX_LINKS);
+        return NULL;
+    }
+    for (i = 0; i < n_devs; i++)
+        if (spifpga_pool_fd(pool, devs[i]) < 0)
+        {
+            printf("stripe link %d is not in the pool\n", devs[i]);
+            return NULL;
+        }
+
+    stripe = calloc(1, sizeof(*stripe));
+    if (!stripe)
+        return NULL;
+    stripe->pool = pool;
+    stripe->n_links = n_devs;
+    memcpy(stripe->devs, devs, n_devs * sizeof(int));
+    return stripe;
+}
+
+void spifpga_stripe_free(struct spifpga_stripe *stripe)
+{
+    free(stripe);
+}
+
+/* The share of each link in the next transfer, summing to 1 */
+void spifpga_stripe_weights(struct spifpga_stripe *stripe, double *weights)
+{
+    double w, total = 0, avg = 0;
+    unsigned int i, n_measured = 0;
+
+    for (i = 0; i < stripe->n_links; i++)
+        if (stripe->weight[i] > 0)
+        {
+            avg += stripe->weight[i];
+            n_measured++;
+        }
+    avg = n_measured ? avg / n_measured : 1;
+
+    /*
+     * Unmeasured links count as average, and none drops below a small
+     * floor, so every link keeps being measured and can win its share back.
+     */
+    for (i = 0; i < stripe->n_links; i++)
+    {
+        w = stripe->weight[i] > 0 ? stripe->weight[i] : avg;
+        if (w < avg / (4 * stripe->n_links))
+            w = avg / (4 * stripe->n_links);
+        weights[i] = w;
+        total += w;
+    }
+    for (i = 0; i < stripe->n_links; i++)
+        weights[i] /= total;
+}
+
+#define STRIPE_EWMA 0.5     /* weight of the newest measurement */
+
+/*
+ * Deal the chunks out by smooth weighted round robin, so each link's
+ * chunks are spread over the whole range, and merge chunks that end up
+ * next to each other on one link into one operation. Returns the number of
+ * operations.
+ */
+static unsigned int stripe_plan(struct spifpga_stripe *stripe, bool write,
+        unsigned int addr, unsigned int n_bytes, unsigned int *buf,
+        struct spifpga_pool_op *ops, int *op_link)
+{
+    double weights[STRIPE_MAX_LINKS], current[STRIPE_MAX_LINKS] = { 0 };
+    unsigned int i, best, off, len, n_ops = 0;
+    int last = -1;
+
+    spifpga_stripe_weights(stripe, weights);
+    for (off = 0; off < n_bytes; off += len)
+    {
+        len = n_bytes - off < STRIPE_CHUNK ? n_bytes - off : STRIPE_CHUNK;
+        best = 0;
+        for (i = 0; i < stripe->n_links; i++)
+        {
+            current[i] += weights[i];
+            if (current[i] > current[best])
+                best = i;
+        }
+        current[best] -= 1;
+
+        if ((int) best == last)
+        {
+            ops[n_ops - 1].n_bytes += len;
+            continue;
+        }
+        ops[n_ops].dev = stripe->devs[best];
+        ops[n_ops].write = write;
+        ops[n_ops].addr = addr + off;
+        ops[n_ops].n_bytes = len;
+        ops[n_ops].buf = buf + off / BYTES_PER_WORD;
+        op_link[n_ops++] = best;
+        last = best;
+    }
+    return n_ops;
+}
+
+static int stripe_xfer(struct spifpga_stripe *stripe, bool write,
+        unsigned int addr, unsigned int n_bytes, unsigned int *buf)
+{
+    unsigned long long bytes[STRIPE_MAX_LINKS] = { 0 }, ns[STRIPE_MAX_LINKS] = { 0 };
+    unsigned int n_chunks = (n_bytes + STRIPE_CHUNK - 1) / STRIPE_CHUNK;
+    struct spifpga_pool_op *ops;
+    unsigned int i, n_ops;
+    double rate;
+    int *op_link, failed;
+
+    ops = calloc(n_chunks, sizeof(*ops));
+    op_link = calloc(n_chunks, sizeof(*op_link));
+    if (!ops || !op_link)
+    {
+        printf("Failed to allocate stripe operations\n");
+        free(ops);
+        free(op_link);
+        return -1;
+    }
+
+    n_ops = stripe_plan(stripe, write, addr, n_bytes, buf, ops, op_link);
+    failed = spifpga_pool_run(stripe->pool, ops, n_ops);
+
+    for (i = 0; i < n_ops; i++)
+    {
+        bytes[op_link[i]] += ops[i].n_bytes;
+        ns[op_link[i]] += ops[i].ns;
+    }
+    for (i = 0; i < stripe->n_links; i++)
+    {
+        if (!ns[i])
+            continue;
+        rate = bytes[i] * 1e9 / ns[i];
+        if (stripe->weight[i] > 0)
+            stripe->weight[i] += STRIPE_EWMA * (rate - stripe->weight[i]);
+        else
+            stripe->weight[i] = rate;
+    }
+
+    free(ops);
+    free(op_link);
+    return failed;
+}
+
+/*
+ * Read n_bytes from addr over all links of the stripe set. Returns the
+ * number of pieces that failed, as spifpga_pool_run() does, or -1.
+ */
+int spifpga_stripe_read(struct spifpga_stripe *stripe, unsigned int addr,
+        unsigned int n_bytes, unsigned int *buf)
+{
+    return stripe_xfer(stripe, false, addr, n_bytes, buf);
+}
+
+int spifpga_stripe_write(struct spifpga_stripe *stripe, unsigned int addr,
+        unsigned int n_bytes, unsigned int *buf)
+{
+    return stripe_xfer(stripe, true, addr, n_bytes, buf);
+}
@@ -0,0 +1,64 @@
+/*
+ * Device pool: several FPGAs, on different SPI buses and chipselects,
+ * driven from one program.
+ *
+ * Devices are added by spidev path (each with its own profile, as from
+ * config_spi_dev()) or as an fd already set up, such as a simulator from
+ * config_spi_sim(). Every bus gets a worker thread, and
+ * spifpga_pool_run() hands each operation to the worker of its device's
+ * bus: operations on one bus run one after the other, in the order given,
+ * while different buses run at the same time.
+ *
+ * A stripe set is a group of pool devices that are links to the same FPGA
+ * memory (two chipselects, or two controllers, wired to one FPGA). Its
+ * bulk transfers are cut into STRIPE_CHUNK sized pieces, dealt out to the
+ * links in proportion to their weights and run in parallel, each piece
+ * landing in its place in the caller's buffer. The weights follow the
+ * throughput each link measured in the previous transfers, so a link that
+ * runs at a lower clock, or shares its bus, gets less of the next one.
+ */
+
+#ifndef SPIFPGA_POOL_H
+#define SPIFPGA_POOL_H
+
+#include <stdbool.h>
+
+struct spifpga_pool;
+struct spi_profile;
+
+struct spifpga_pool_op {
+    int dev;                /* from spifpga_pool_add() */
+    bool write;
+    unsigned int addr;
+    unsigned int n_bytes;
+    unsigned int *buf;
+    int ret;                /* out: as from bulk_read() or bulk_write() */
+    unsigned long long ns;  /* out: how long it took */
+};
+
+#define STRIPE_CHUNK 4096
+#define STRIPE_MAX_LINKS 8
+
+struct spifpga_stripe;
+
+struct spifpga_pool *spifpga_pool_new(void);
+void spifpga_pool_free(struct spifpga_pool *pool);
+int spifpga_pool_add(struct spifpga_pool *pool, const char *device,
+        const struct spi_profile *profile);
+int spifpga_pool_add_fd(struct spifpga_pool *pool, int fd, int bus);
+int spifpga_pool_size(struct spifpga_pool *pool);
+int spifpga_pool_fd(struct spifpga_pool *pool, int dev);
+int spifpga_pool_run(struct spifpga_pool *pool, struct spifpga_pool_op *ops, unsigned int n);
+int spifpga_pool_broadcast(struct spifpga_pool *pool, unsigned int addr,
+        unsigned int n_bytes, unsigned int *buf);
+
+struct spifpga_stripe *spifpga_stripe_new(struct spifpga_pool *pool,
+        const int *devs, unsigned int n_devs);
+void spifpga_stripe_free(struct spifpga_stripe *stripe);
+int spifpga_stripe_read(struct spifpga_stripe *stripe, unsigned int addr,
+        unsigned int n_bytes, unsigned int *buf);
+int spifpga_stripe_write(struct spifpga_stripe *stripe, unsigned int addr,
+        unsigned int n_bytes, unsigned int *buf);
+void spifpga_stripe_weights(struct spifpga_stripe *stripe, double *weights);
+
+#endif /* SPIFPGA_POOL_H */
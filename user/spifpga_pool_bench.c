@@ -0,0 +1,276 @@
+/*
+ * Bulk transfers to several FPGAs, one at a time and through a device pool.
+ *
+ * spifpga_pool_bench [-b buses] [-c chipselects] [-n bytes] [-a addr]
+ *                    [device ...]
+ * spifpga_pool_bench -s [-b links] [-k slow_hz] [-i iterations] [-n bytes]
+ *                    [-a addr] [device ...]
+ *
+ * Without devices it builds buses x chipselects simulators (spifpga_sim.c)
+ * that sleep for their modelled bus time, so wall clock time behaves like
+ * the real links would. It writes an image to every device one after the
+ * other, then broadcasts it through the pool, and reads it back from all
+ * of them in parallel and checks it. With the pool, the time should scale
+ * with the number of buses rather than the number of devices, since
+ * chipselects on one bus still take turns.
+ *
+ * With device paths (/dev/spidevB.C) it runs the same on the board.
+ *
+ * -s stripes transfers to one FPGA memory over several links instead (all
+ * the devices given must reach the same FPGA). The simulated links are on
+ * separate buses, the last one clocked at slow_hz, and the link weights
+ * should settle in proportion to their clocks, with the aggregate close to
+ * the sum of what each link does alone.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_pool.h"
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int stripe_bench(struct spifpga_pool *pool, unsigned int addr,
+        unsigned int n_bytes, unsigned int iterations)
+{
+    int devs[STRIPE_MAX_LINKS];
+    double weights[STRIPE_MAX_LINKS], t0, t, single = 0;
+    struct spifpga_stripe *stripe;
+    unsigned int *image, *back, i, w, n_links;
+    int errors = 0;
+
+    n_links = spifpga_pool_size(pool);
+    for (i = 0; i < n_links; i++)
+        devs[i] = i;
+    stripe = spifpga_stripe_new(pool, devs, n_links);
+    image = malloc(n_bytes);
+    back = malloc(n_bytes);
+    if (!stripe || !image || !back)
+    {
+        printf("Failed to set up the stripe set\n");
+        return 1;
+    }
+    for (w = 0; w < n_bytes / BYTES_PER_WORD; w++)
+        image[w] = w * 2654435761u;
+
+    for (i = 0; i < n_links; i++)
+    {
+        t0 = now_s();
+        if (bulk_read(spifpga_pool_fd(pool, i), addr, n_bytes, back) != RESP_OK)
+            errors++;
+        t = now_s() - t0;
+        printf("link %u alone       %8.1f KB/s\n", i, n_bytes / t / 1024);
+        single += n_bytes / t / 1024;
+    }
+    printf("sum of links       %8.1f KB/s\n", single);
+
+    for (i = 0; i < iterations; i++)
+    {
+        t0 = now_s();
+        errors += spifpga_stripe_write(stripe, addr, n_bytes, image);
+        t = now_s() - t0;
+        memset(back, 0, n_bytes);
+        t0 = now_s();
+        errors += spifpga_stripe_read(stripe, addr, n_bytes, back);
+        t += now_s() - t0;
+        if (memcmp(back, image, n_bytes) != 0)
+        {
+            printf("striped read back wrong data\n");
+            errors++;
+        }
+        image[0]++;
+
+        spifpga_stripe_weights(stripe, weights);
+        printf("striped %2u         %8.1f KB/s  weights", i, 2 * n_bytes / t / 1024);
+        for (w = 0; w < n_links; w++)
+            printf(" %.2f", weights[w]);
+        printf("\n");
+    }
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    spifpga_stripe_free(stripe);
+    free(image);
+    free(back);
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int addr = 0x00010000, n_bytes = 64 * 1024, buses = 2, cs = 2;
+    unsigned int slow_hz = MAX_SPEED / 2, iterations = 6;
+    struct spi_profile slow = { 0, 0 };
+    bool stripe = false;
+    struct spifpga_sim *sims[MAX_LINKS];
+    int fds[MAX_LINKS];
+    struct spifpga_pool_op *ops;
+    struct spifpga_pool *pool;
+    unsigned int *image, **back, i, w, n_devs, n_sims = 0;
+    double t0, t_serial, t_pool, t_read;
+    int c, errors = 0;
+
+    while ((c = getopt(argc, argv, "b:c:n:a:sk:i:")) != -1)
+        switch (c) {
+            case 'b':
+                buses = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                cs = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                n_bytes = strtoul(optarg, NULL, 0) & ~(BYTES_PER_WORD - 1);
+                break;
+            case 'a':
+                addr = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                stripe = true;
+                break;
+            case 'k':
+                slow_hz = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: spifpga_pool_bench [-b buses] [-c chipselects] [-n bytes] [-a addr] [device ...]\n");
+                printf("       spifpga_pool_bench -s [-b links] [-k slow_hz] [-i iterations] [-n bytes] [-a addr] [device ...]\n");
+                return 1;
+        }
+    if (stripe)
+        cs = 1;
+    if (n_bytes == 0 || buses * cs == 0 || buses * cs > MAX_LINKS / 2 ||
+            (stripe && buses > STRIPE_MAX_LINKS))
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    pool = spifpga_pool_new();
+    if (!pool)
+    {
+        printf("Failed to create the pool\n");
+        return 1;
+    }
+    if (optind < argc)
+    {
+        for (i = optind; i < (unsigned int) argc; i++)
+            if (spifpga_pool_add(pool, argv[i], NULL) < 0)
+                return 1;
+    } else {
+        for (i = 0; i < buses * cs; i++)
+        {
+            if (stripe && i > 0)
+                sims[i] = spifpga_sim_new_link(sims[0]);
+            else
+                sims[i] = spifpga_sim_new(addr + n_bytes + 4096);
+            if (!sims[i])
+            {
+                printf("Failed to create the simulator\n");
+                return 1;
+            }
+            sims[i]->realtime = true;
+            n_sims++;
+            fds[i] = config_spi_sim(sims[i]);
+            if (fds[i] < 0 || spifpga_pool_add_fd(pool, fds[i], i / cs) < 0)
+                return 1;
+        }
+        if (stripe)
+        {
+            slow.speed = slow_hz;
+            set_profile(fds[buses - 1], &slow);
+            printf("simulator: %u links to one FPGA, the last at %u Hz\n", buses, slow_hz);
+        } else {
+            printf("simulator: %u buses x %u chipselects\n", buses, cs);
+        }
+    }
+    n_devs = spifpga_pool_size(pool);
+
+    if (stripe)
+    {
+        errors = stripe_bench(pool, addr, n_bytes, iterations);
+        spifpga_pool_free(pool);
+        for (i = n_sims; i-- > 0; )
+        {
+            close_spi(fds[i]);
+            spifpga_sim_free(sims[i]);
+        }
+        return errors ? 1 : 0;
+    }
+
+    image = malloc(n_bytes);
+    back = calloc(n_devs, sizeof(*back));
+    ops = calloc(n_devs, sizeof(*ops));
+    if (!image || !back || !ops)
+    {
+        printf("Failed to allocate buffers\n");
+        return 1;
+    }
+    for (w = 0; w < n_bytes / BYTES_PER_WORD; w++)
+        image[w] = w * 2654435761u;
+
+    t0 = now_s();
+    for (i = 0; i < n_devs; i++)
+        if (bulk_write(spifpga_pool_fd(pool, i), addr, n_bytes, image) != RESP_OK)
+            errors++;
+    t_serial = now_s() - t0;
+
+    t0 = now_s();
+    errors += spifpga_pool_broadcast(pool, addr, n_bytes, image);
+    t_pool = now_s() - t0;
+
+    for (i = 0; i < n_devs; i++)
+    {
+        back[i] = calloc(1, n_bytes);
+        if (!back[i])
+        {
+            printf("Failed to allocate buffers\n");
+            return 1;
+        }
+        ops[i].dev = i;
+        ops[i].write = false;
+        ops[i].addr = addr;
+        ops[i].n_bytes = n_bytes;
+        ops[i].buf = back[i];
+    }
+    t0 = now_s();
+    errors += spifpga_pool_run(pool, ops, n_devs);
+    t_read = now_s() - t0;
+
+    for (i = 0; i < n_devs; i++)
+        if (memcmp(back[i], image, n_bytes) != 0)
+        {
+            printf("device %u read back wrong data\n", i);
+            errors++;
+        }
+
+    printf("%u devices, %u bytes each\n", n_devs, n_bytes);
+    printf("one at a time  %8.3f s  %8.1f KB/s\n", t_serial, n_devs * n_bytes / t_serial / 1024);
+    printf("broadcast      %8.3f s  %8.1f KB/s\n", t_pool, n_devs * n_bytes / t_pool / 1024);
+    printf("parallel read  %8.3f s  %8.1f KB/s\n", t_read, n_devs * n_bytes / t_read / 1024);
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    spifpga_pool_free(pool);
+    for (i = 0; i < n_sims; i++)
+    {
+        close_spi(fds[i]);
+        spifpga_sim_free(sims[i]);
+    }
+    for (i = 0; i < n_devs; i++)
+        free(back[i]);
+    free(back);
+    free(ops);
+    free(image);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Control access latency on a /dev/spifpga minor while another thread
+ * streams bulk reads from the same device.
+ *
+ * spifpga_prio_bench [-d dev] [-b bulk_bytes] [-n ctrl_ops] [-a addr] [-p]
+ *
+ * Run once with -b 0 for the idle baseline, then with a bulk size to see
+ * how much the bulk transfer delays the control writes. -p puts the
+ * control file in SPIFPGA_PRIO_HIGH. It fails without the device; the
+ * mock bench's -f scenario checks the same bound without hardware.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include "spifpga.h"
+
+#define DEFAULT_DEV "/dev/spifpga0.0"
+
+static const char *dev = DEFAULT_DEV;
+static size_t bulk_bytes = 4 << 20;
+static unsigned int bulk_addr = 0x00010000;
+static volatile bool stop;
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void *bulk_thread(void *arg)
+{
+    unsigned long *n_bulk = arg;
+    char *buf;
+    int fd;
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0)
+    {
+        printf("can't open %s for the bulk reader\n", dev);
+        return NULL;
+    }
+    buf = malloc(bulk_bytes);
+    if (!buf)
+    {
+        printf("Failed to allocate bulk buffer\n");
+        close(fd);
+        return NULL;
+    }
+
+    while (!stop)
+    {
+        if (pread(fd, buf, bulk_bytes, bulk_addr) < 0)
+        {
+            printf("bulk read failed\n");
+            break;
+        }
+        (*n_bulk)++;
+    }
+
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int ctrl_addr = 0x00017108, val;
+    unsigned long n_ops = 1000, n_bulk = 0, i;
+    bool high_prio = false;
+    pthread_t bulk;
+    double *lat, t0, total = 0;
+    int fd, c;
+
+    while ((c = getopt(argc, argv, "d:b:n:a:p")) != -1)
+        switch (c) {
+            case 'd':
+                dev = optarg;
+                break;
+            case 'b':
+                bulk_bytes = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                n_ops = strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                ctrl_addr = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                high_prio = true;
+                break;
+            default:
+                printf("Usage: spifpga_prio_bench [-d dev] [-b bulk_bytes] [-n ctrl_ops] [-a addr] [-p]\n");
+                return 1;
+        }
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0)
+    {
+        printf("can't open %s (without the hardware, module/spifpga_bench -f checks the bound on the mock)\n",
+                dev);
+        return 1;
+    }
+    if (high_prio && ioctl(fd, SPIFPGA_IOC_SET_PRIO, SPIFPGA_PRIO_HIGH) < 0)
+    {
+        printf("can't set priority\n");
+        return 1;
+    }
+
+    lat = calloc(n_ops, sizeof(double));
+    if (!lat)
+    {
+        printf("Failed to allocate latency buffer\n");
+        return 1;
+    }
+
+    if (bulk_bytes)
+    {
+        pthread_create(&bulk, NULL, bulk_thread, &n_bulk);
+        /* let the bulk reader get going */
+        usleep(100000);
+    }
+
+    for (i = 0; i < n_ops; i++)
+    {
+        val = i;
+        t0 = now_us();
+        if (pwrite(fd, &val, sizeof(val), ctrl_addr) != sizeof(val))
+        {
+            printf("control write failed\n");
+            break;
+        }
+        lat[i] = now_us() - t0;
+        total += lat[i];
+        usleep(1000);
+    }
+    n_ops = i;
+
+    stop = true;
+    if (bulk_bytes)
+        pthread_join(bulk, NULL);
+
+    if (n_ops == 0)
+        return 1;
+    qsort(lat, n_ops, sizeof(double), cmp_double);
+    printf("%lu control writes, bulk %zu bytes x %lu, prio %s\n",
+            n_ops, bulk_bytes, n_bulk, high_prio ? "high" : "normal");
+    printf("latency us: mean %.1f p50 %.1f p99 %.1f max %.1f\n",
+            total / n_ops, lat[n_ops / 2], lat[(n_ops * 99) / 100],
+            lat[n_ops - 1]);
+
+    free(lat);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * USDT probes in the library, provider "spifpga", for bpftrace or perf
+ * alongside the driver's tracepoints (see module/spifpga_latency.bt):
+ *
+ *  op__begin(fd, op, addr, n_bytes)    a traced call starts, op is an enum trace_op
+ *  op__end(op, addr, ret)              ... and returns ret
+ *  burst__submit(fd, n_transfers)      a message goes to the device or simulator
+ *  burst__complete(fd, ret)            ... and is back
+ *
+ * A probe is a single nop until a tracer attaches. They are built in when
+ * <sys/sdt.h> (systemtap-sdt-dev) is found, unless SPIFPGA_NO_USDT is
+ * defined, and compile to nothing otherwise.
+ */
+
+#ifndef SPIFPGA_PROBES_H
+#define SPIFPGA_PROBES_H
+
+#if !defined(SPIFPGA_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SPIFPGA_USDT
+#endif
+#endif
+
+#ifdef SPIFPGA_USDT
+#define SPIFPGA_PROBE2(name, a, b)          DTRACE_PROBE2(spifpga, name, a, b)
+#define SPIFPGA_PROBE3(name, a, b, c)       DTRACE_PROBE3(spifpga, name, a, b, c)
+#define SPIFPGA_PROBE4(name, a, b, c, d)    DTRACE_PROBE4(spifpga, name, a, b, c, d)
+#else
+#define SPIFPGA_PROBE2(name, a, b)          do { } while (0)
+#define SPIFPGA_PROBE3(name, a, b, c)       do { } while (0)
+#define SPIFPGA_PROBE4(name, a, b, c, d)    do { } while (0)
+#endif
+
+#endif /* SPIFPGA_PROBES_H */
@@ -0,0 +1,437 @@
+/*
+ * Register map, see spifpga_regmap.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "spifpga.h"
+#include "spifpga_user.h"
+#include "spifpga_regmap.h"
+
+struct spifpga_regmap {
+    char *text;                     /* the file; names point into it */
+    struct regmap_entry *entries;
+    unsigned int n;
+    uint32_t *index;                /* entry + 1, 0 for a free slot */
+    uint32_t mask;                  /* index slots - 1 */
+};
+
+/* FNV-1a */
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name)
+    {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t width_mask(unsigned int width)
+{
+    return width >= 32 ? 0xFFFFFFFF : (1u << width) - 1;
+}
+
+const struct regmap_entry *regmap_find(const struct spifpga_regmap *map, const char *name)
+{
+    uint32_t slot = name_hash(name) & map->mask;
+    const struct regmap_entry *e;
+
+    while (map->index[slot])
+    {
+        e = &map->entries[map->index[slot] - 1];
+        if (strcmp(e->name, name) == 0)
+            return e;
+        slot = (slot + 1) & map->mask;
+    }
+    return NULL;
+}
+
+/* Index the last entry. Returns -1 if the name is taken. */
+static int regmap_insert(struct spifpga_regmap *map)
+{
+    const char *name = map->entries[map->n].name;
+    uint32_t slot = name_hash(name) & map->mask;
+
+    while (map->index[slot])
+    {
+        if (strcmp(map->entries[map->index[slot] - 1].name, name) == 0)
+            return -1;
+        slot = (slot + 1) & map->mask;
+    }
+    map->index[slot] = ++map->n;
+    return 0;
+}
+
+static char *read_file(const char *path)
+{
+    FILE *in;
+    char *text;
+    long len;
+
+    in = fopen(path, "r");
+    if (!in)
+    {
+        printf("can't open register map %s\n", path);
+        return NULL;
+    }
+    if (fseek(in, 0, SEEK_END) != 0 || (len = ftell(in)) < 0 ||
+            fseek(in, 0, SEEK_SET) != 0)
+    {
+        printf("can't read register map %s\n", path);
+        fclose(in);
+        return NULL;
+    }
+    text = malloc(len + 1);
+    if (!text || fread(text, 1, len, in) != (size_t) len)
+    {
+        printf("can't read register map %s\n", path);
+        free(text);
+        fclose(in);
+        return NULL;
+    }
+    text[len] = '\0';
+    fclose(in);
+    return text;
+}
+
+/* Parse one line, already cut out of the text; fills map->entries[map->n] */
+static int parse_line(struct spifpga_regmap *map, char *line, unsigned int lineno)
+{
+    struct regmap_entry *e = &map->entries[map->n];
+    const struct regmap_entry *reg;
+    char *tok[6], *save, *end, *dot;
+    unsigned long num[2];
+    unsigned int n_tok = 0, i;
+
+    if ((end = strchr(line, '#')))
+        *end = '\0';
+    for (tok[0] = strtok_r(line, " \t\r", &save); tok[n_tok] && n_tok < 5; )
+        tok[++n_tok] = strtok_r(NULL, " \t\r", &save);
+    if (n_tok == 0)
+        return 0;
+    if (n_tok < 3 || (n_tok == 5 && tok[5]))
+        goto bad;
+    for (i = 0; i < 2; i++)
+    {
+        num[i] = strtoul(tok[i + 1], &end, 0);
+        if (*end)
+            goto bad;
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->name = tok[0];
+    if (n_tok == 3)
+    {
+        /* name.field lsb width */
+        dot = strrchr(tok[0], '.');
+        if (!dot)
+            goto bad;
+        *dot = '\0';
+        reg = regmap_find(map, tok[0]);
+        *dot = '.';
+        if (!reg || reg->width != 32 || num[1] == 0 || num[1] > 32 ||
+                (num[0] % 32) + num[1] > 32 || num[0] + num[1] > reg->size * 8)
+        {
+            printf("%u: field %s doesn't fit a register\n", lineno, tok[0]);
+            return -1;
+        }
+        e->addr = reg->addr + num[0] / 32 * BYTES_PER_WORD;
+        e->size = reg->size;
+        e->mode = reg->mode;
+        e->is_volatile = reg->is_volatile;
+        e->lsb = num[0] % 32;
+        e->width = num[1];
+    } else {
+        /* name addr size mode [volatile] */
+        if (strcmp(tok[3], "r") == 0)
+            e->mode = REG_READ;
+        else if (strcmp(tok[3], "w") == 0)
+            e->mode = REG_WRITE;
+        else if (strcmp(tok[3], "rw") == 0)
+            e->mode = REG_READ | REG_WRITE;
+        else
+            goto bad;
+        if (n_tok == 5 && strcmp(tok[4], "volatile") != 0)
+            goto bad;
+        e->addr = num[0];
+        e->size = num[1] ? num[1] : BYTES_PER_WORD;
+        e->is_volatile = n_tok == 5;
+        e->width = 32;
+    }
+
+    if (regmap_insert(map) != 0)
+    {
+        printf("%u: %s is defined twice\n", lineno, e->name);
+        return -1;
+    }
+    return 0;
+
+bad:
+    printf("%u: can't parse register map line\n", lineno);
+    return -1;
+}
+
+/*
+ * Load a register map file, or the one named by $SPIFPGA_REGMAP if path is
+ * NULL. Returns NULL, after saying why, if it can't.
+ */
+struct spifpga_regmap *regmap_load(const char *path)
+{
+    struct spifpga_regmap *map;
+    unsigned int lines = 1, slots = 16, lineno = 0;
+    char *p, *line;
+
+    if (!path)
+        path = getenv(REGMAP_ENV);
+    if (!path)
+    {
+        printf("no register map given, and %s is not set\n", REGMAP_ENV);
+        return NULL;
+    }
+
+    map = calloc(1, sizeof(*map));
+    if (!map)
+        return NULL;
+    map->text = read_file(path);
+    if (!map->text)
+    {
+        free(map);
+        return NULL;
+    }
+
+    /* at most an entry per line, and the index at most half full */
+    for (p = map->text; (p = strchr(p, '\n')); p++)
+        lines++;
+    while (slots < 2 * lines)
+        slots *= 2;
+    map->entries = malloc(lines * sizeof(struct regmap_entry));
+    map->index = calloc(slots, sizeof(uint32_t));
+    map->mask = slots - 1;
+    if (!map->entries || !map->index)
+    {
+        printf("Failed to allocate the register map\n");
+        regmap_free(map);
+        return NULL;
+    }
+
+    for (line = map->text; line; line = p)
+    {
+        p = strchr(line, '\n');
+        if (p)
+            *p++ = '\0';
+        if (parse_line(map, line, ++lineno) != 0)
+        {
+            printf("in register map %s\n", path);
+            regmap_free(map);
+            return NULL;
+        }
+    }
+    return map;
+}
+
+void regmap_free(struct spifpga_regmap *map)
+{
+    if (!map)
+        return;
+    free(map->text);
+    free(map->entries);
+    free(map->index);
+    free(map);
+}
+
+unsigned int regmap_count(const struct spifpga_regmap *map)
+{
+    return map->n;
+}
+
+/* The i'th entry in file order, registers and fields, or NULL past the end */
+const struct regmap_entry *regmap_at(const struct spifpga_regmap *map, unsigned int i)
+{
+    return i < map->n ? &map->entries[i] : NULL;
+}
+
+/*
+ * Tell the spifpga driver not to read ahead over the volatile registers,
+ * see SPIFPGA_IOC_RA_VOLATILE. spifpga_fd is an open /dev/spifpgaB.C.
+ */
+int regmap_ra_volatile(const struct spifpga_regmap *map, int spifpga_fd)
+{
+    struct spifpga_region region;
+    unsigned int i;
+
+    for (i = 0; i < map->n; i++)
+    {
+        if (!map->entries[i].is_volatile || map->entries[i].width != 32)
+            continue;
+        region.addr = map->entries[i].addr;
+        region.len = map->entries[i].size;
+        if (ioctl(spifpga_fd, SPIFPGA_IOC_RA_VOLATILE, &region) < 0)
+        {
+            printf("can't mark %s volatile\n", map->entries[i].name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static const struct regmap_entry *lookup(const struct spifpga_regmap *map,
+        const char *name, unsigned int mode)
+{
+    const struct regmap_entry *e = regmap_find(map, name);
+
+    if (!e)
+    {
+        printf("no register %s in the map\n", name);
+        return NULL;
+    }
+    if (!(e->mode & mode))
+    {
+        printf("register %s is not %s\n", name, mode == REG_READ ? "readable" : "writable");
+        return NULL;
+    }
+    return e;
+}
+
+/*
+ * Read a register (its first word, for wider ones) or a field, shifted
+ * down. Returns the FPGA response code, like read_word(), or -1.
+ */
+int read_reg(int fd, const struct spifpga_regmap *map, const char *name, unsigned int *val)
+{
+    const struct regmap_entry *e = lookup(map, name, REG_READ);
+    int ret;
+
+    if (!e)
+        return -1;
+    ret = read_word(fd, e->addr, val);
+    *val = (*val >> e->lsb) & width_mask(e->width);
+    return ret;
+}
+
+/*
+ * Write a register, or a field without touching the rest of its word (see
+ * write_word_masked()). Returns the FPGA response code, or -1.
+ */
+int write_reg(int fd, const struct spifpga_regmap *map, const char *name, unsigned int val)
+{
+    const struct regmap_entry *e = lookup(map, name, REG_WRITE);
+
+    if (!e)
+        return -1;
+    if (val & ~width_mask(e->width))
+    {
+        printf("0x%x doesn't fit in the %u bits of %s\n", val, e->width, name);
+        return -1;
+    }
+    if (e->width == 32)
+        return write_word(fd, e->addr, val);
+    return write_word_masked(fd, e->addr, val << e->lsb, width_mask(e->width) << e->lsb);
+}
+
+/*
+ * Read n registers or fields in as few SPI messages as fit. Returns the OR
+ * of the response codes, or -1 (before anything is read) if a name is
+ * unknown.
+ */
+int read_regs(int fd, const struct spifpga_regmap *map, const char *const *names,
+        unsigned int n, unsigned int *vals)
+{
+    const struct regmap_entry **e;
+    unsigned int *addrs, i;
+    int ret = -1;
+
+    e = calloc(n, sizeof(*e));
+    addrs = calloc(n, sizeof(*addrs));
+    if (!e || !addrs)
+    {
+        printf("Failed to allocate register batch\n");
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+    {
+        e[i] = lookup(map, names[i], REG_READ);
+        if (!e[i])
+            goto out;
+        addrs[i] = e[i]->addr;
+    }
+
+    ret = read_words(fd, addrs, n, vals);
+    for (i = 0; i < n; i++)
+        vals[i] = (vals[i] >> e[i]->lsb) & width_mask(e[i]->width);
+out:
+    free(e);
+    free(addrs);
+    return ret;
+}
+
+/*
+ * Write n registers or fields, in order. Runs of whole registers go out in
+ * as few messages as fit; each field is a masked write of its own. Returns
+ * the OR of the response codes, or -1 (before anything is written) if a
+ * name is unknown or a value doesn't fit.
+ */
+int write_regs(int fd, const struct spifpga_regmap *map, const char *const *names,
+        const unsigned int *vals, unsigned int n)
+{
+    const struct regmap_entry **e;
+    unsigned int *addrs, i, start;
+    int r, ret = -1;
+
+    e = calloc(n, sizeof(*e));
+    addrs = calloc(n, sizeof(*addrs));
+    if (!e || !addrs)
+    {
+        printf("Failed to allocate register batch\n");
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+    {
+        e[i] = lookup(map, names[i], REG_WRITE);
+        if (!e[i])
+            goto out;
+        if (vals[i] & ~width_mask(e[i]->width))
+        {
+            printf("0x%x doesn't fit in the %u bits of %s\n", vals[i], e[i]->width, names[i]);
+            goto out;
+        }
+        addrs[i] = e[i]->addr;
+    }
+
+    ret = 0;
+    for (start = i = 0; i <= n; i++)
+    {
+        if (i < n && e[i]->width == 32)
+            continue;
+        if (i > start)
+        {
+            r = write_words(fd, addrs + start, vals + start, i - start);
+            if (r < 0)
+            {
+                ret = r;
+                break;
+            }
+            ret |= r;
+        }
+        if (i < n)
+        {
+            r = write_word_masked(fd, e[i]->addr, vals[i] << e[i]->lsb,
+                    width_mask(e[i]->width) << e[i]->lsb);
+            if (r < 0)
+            {
+                ret = r;
+                break;
+            }
+            ret |= r;
+        }
+        start = i + 1;
+    }
+out:
+    free(e);
+    free(addrs);
+    return ret;
+}
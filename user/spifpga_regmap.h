@@ -0,0 +1,60 @@
+/*
+ * Register map: access FPGA registers, BRAMs and register fields by name.
+ *
+ * A map file has one register per line,
+ *
+ *     name  address  size  mode  [volatile]
+ *
+ * with size in bytes, mode r, w or rw, and volatile for registers the FPGA
+ * changes on its own. Fields of a register follow it as
+ *
+ *     name.field  lsb  width
+ *
+ * and are bits lsb .. lsb + width - 1 of the register (lsb may be past 31
+ * for wider registers; the field then lives in a later word). Blank lines
+ * and everything after a '#' are ignored. Numbers are C style, so
+ * addresses are usually in hex.
+ *
+ * regmap_load() reads the file into one buffer and indexes every register
+ * and field in an open addressing hash table, so regmap_find() is a hash
+ * and usually a single compare however big the map is.
+ */
+
+#ifndef SPIFPGA_REGMAP_H
+#define SPIFPGA_REGMAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define REG_READ (1 << 0)
+#define REG_WRITE (1 << 1)
+
+#define REGMAP_ENV "SPIFPGA_REGMAP"
+
+struct regmap_entry {
+    const char *name;
+    unsigned int addr;      /* of the word holding a field */
+    unsigned int size;      /* bytes, of the whole register for a field */
+    unsigned int mode;      /* REG_READ | REG_WRITE */
+    bool is_volatile;
+    unsigned int lsb;       /* a field: bits lsb .. lsb + width - 1 of */
+    unsigned int width;     /* the word at addr; 32 and 0 for a register */
+};
+
+struct spifpga_regmap;
+
+struct spifpga_regmap *regmap_load(const char *path);
+void regmap_free(struct spifpga_regmap *map);
+unsigned int regmap_count(const struct spifpga_regmap *map);
+const struct regmap_entry *regmap_at(const struct spifpga_regmap *map, unsigned int i);
+const struct regmap_entry *regmap_find(const struct spifpga_regmap *map, const char *name);
+int regmap_ra_volatile(const struct spifpga_regmap *map, int spifpga_fd);
+
+int read_reg(int fd, const struct spifpga_regmap *map, const char *name, unsigned int *val);
+int write_reg(int fd, const struct spifpga_regmap *map, const char *name, unsigned int val);
+int read_regs(int fd, const struct spifpga_regmap *map, const char *const *names,
+        unsigned int n, unsigned int *vals);
+int write_regs(int fd, const struct spifpga_regmap *map, const char *const *names,
+        const unsigned int *vals, unsigned int n);
+
+#endif /* SPIFPGA_REGMAP_H */
@@ -0,0 +1,206 @@
+/*
+ * Register map load and lookup times, and named register access against
+ * the simulator.
+ *
+ * spifpga_regmap_bench [-n registers] [-f fields] [-i iterations] [-b batch]
+ *
+ * Writes a map of n registers with f fields each to a temporary file,
+ * times regmap_load() on it and regmap_find() over every name, then reads
+ * batch registers by name one at a time and with read_regs(), and sets
+ * fields with write_reg(), checking the results in the simulator memory.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_regmap.h"
+
+#define BASE_ADDR 0x00010000
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_map(const char *path, unsigned int n_regs, unsigned int n_fields)
+{
+    unsigned int i, f;
+    FILE *out;
+
+    out = fopen(path, "w");
+    if (!out)
+        return -1;
+    fprintf(out, "# generated by spifpga_regmap_bench\n");
+    for (i = 0; i < n_regs; i++)
+    {
+        fprintf(out, "adc%u_ctrl_%u 0x%08x 4 rw%s\n", i % 16, i,
+                BASE_ADDR + i * BYTES_PER_WORD, i % 8 == 7 ? " volatile" : "");
+        for (f = 0; f < n_fields; f++)
+            fprintf(out, "adc%u_ctrl_%u.f%u %u %u\n", i % 16, i, f,
+                    f * (32 / n_fields), 32 / n_fields);
+    }
+    return fclose(out);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int n_regs = 10000, n_fields = 4, iterations = 20, batch = 64;
+    char path[] = "/tmp/spifpga_regmap_XXXXXX", name[64], **names, **lookup;
+    const struct regmap_entry *e;
+    struct spifpga_regmap *map;
+    struct spifpga_sim *sim;
+    unsigned int i, it, *vals, val;
+    double t0, t_load, t_find, t_single, t_batch;
+    uint64_t bus_single, bus_batch;
+    int c, fd, errors = 0;
+
+    while ((c = getopt(argc, argv, "n:f:i:b:")) != -1)
+        switch (c) {
+            case 'n':
+                n_regs = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                n_fields = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: spifpga_regmap_bench [-n registers] [-f fields] [-i iterations] [-b batch]\n");
+                return 1;
+        }
+    if (n_regs == 0 || iterations == 0 || n_fields == 0 || n_fields > 32 ||
+            batch == 0 || batch > n_regs)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+        printf("can't create a temporary map\n");
+        return 1;
+    }
+    close(fd);
+    if (write_map(path, n_regs, n_fields) != 0)
+    {
+        printf("can't write %s\n", path);
+        unlink(path);
+        return 1;
+    }
+
+    t0 = now_s();
+    for (it = 0; it < iterations; it++)
+    {
+        map = regmap_load(path);
+        if (!map)
+        {
+            unlink(path);
+            return 1;
+        }
+        if (it + 1 < iterations)
+            regmap_free(map);
+    }
+    t_load = (now_s() - t0) / iterations;
+    unlink(path);
+    printf("%u entries: load %.2f ms\n", regmap_count(map), t_load * 1e3);
+
+    lookup = calloc(n_regs, sizeof(*lookup));
+    if (!lookup)
+    {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+    for (i = 0; i < n_regs; i++)
+    {
+        snprintf(name, sizeof(name), "adc%u_ctrl_%u.f%u", i % 16, i, i % n_fields);
+        lookup[i] = strdup(name);
+    }
+    t0 = now_s();
+    for (i = 0; i < n_regs; i++)
+    {
+        e = regmap_find(map, lookup[i]);
+        if (!e || e->addr != BASE_ADDR + i * BYTES_PER_WORD)
+            errors++;
+    }
+    t_find = (now_s() - t0) / n_regs;
+    printf("lookup %.0f ns\n", t_find * 1e9);
+    for (i = 0; i < n_regs; i++)
+        free(lookup[i]);
+    free(lookup);
+
+    sim = spifpga_sim_new(BASE_ADDR + n_regs * BYTES_PER_WORD);
+    names = calloc(batch, sizeof(*names));
+    vals = calloc(batch, sizeof(*vals));
+    if (!sim || !names || !vals)
+    {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+    fd = config_spi_sim(sim);
+    for (i = 0; i < n_regs; i++)
+        sim->mem[BASE_ADDR / BYTES_PER_WORD + i] = i * 2654435761u;
+    for (i = 0; i < batch; i++)
+    {
+        names[i] = malloc(64);
+        snprintf(names[i], 64, "adc%u_ctrl_%u", (i * 97) % n_regs % 16, (i * 97) % n_regs);
+    }
+
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    for (i = 0; i < batch; i++)
+        if (read_reg(fd, map, names[i], &val) != RESP_OK ||
+                val != ((i * 97) % n_regs) * 2654435761u)
+            errors++;
+    t_single = now_s() - t0;
+    bus_single = sim->bus_ns;
+
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    if (read_regs(fd, map, (const char *const *) names, batch, vals) != RESP_OK)
+        errors++;
+    t_batch = now_s() - t0;
+    bus_batch = sim->bus_ns;
+    for (i = 0; i < batch; i++)
+        if (vals[i] != ((i * 97) % n_regs) * 2654435761u)
+            errors++;
+    printf("%u named reads: one by one %.1f us bus, batched %.1f us bus (wall %.1f / %.1f us)\n",
+            batch, bus_single / 1e3, bus_batch / 1e3, t_single * 1e6, t_batch * 1e6);
+
+    /* fields: whole bytes go out as one frame, the rest read first */
+    sim->mem[BASE_ADDR / BYTES_PER_WORD] = 0x12345678;
+    snprintf(name, sizeof(name), "adc0_ctrl_0.f%u", n_fields - 1);
+    if (write_reg(fd, map, name, 0) != RESP_OK)
+        errors++;
+    if (read_reg(fd, map, name, &val) != RESP_OK || val != 0)
+        errors++;
+    if (sim->mem[BASE_ADDR / BYTES_PER_WORD] !=
+            (0x12345678 & ~(((1ull << (32 / n_fields)) - 1) << ((n_fields - 1) * (32 / n_fields)))))
+    {
+        printf("field write changed other bits: 0x%08x\n", sim->mem[BASE_ADDR / BYTES_PER_WORD]);
+        errors++;
+    }
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    for (i = 0; i < batch; i++)
+        free(names[i]);
+    free(names);
+    free(vals);
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    regmap_free(map);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Replay a trace recorded with $SPIFPGA_TRACE or trace_start() (see
+ * spifpga_trace.h) and compare its latencies with the original's.
+ *
+ * spifpga_replay [-d device | -s megabytes] [-t] [-F] [-w] trace
+ *
+ * On the device (default /dev/spidev0.0) or, with -s, on a simulator of
+ * that much memory that spends the modelled bus time in real time. -t
+ * keeps the original timing between calls instead of going as fast as
+ * possible; -F uses the frame protocol on the simulator. The trace has no
+ * write data, so on the device the calls that write are skipped unless -w
+ * is given, when they write zeros.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_trace.h"
+
+static int u32_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Latency percentiles of op in records, in us, on one line */
+static void print_latency(const char *what, const struct trace_record *records, size_t n,
+        unsigned int op, uint32_t *lat)
+{
+    size_t i, m = 0;
+
+    for (i = 0; i < n; i++)
+        if (records[i].op == op && !(records[i].flags & TRACE_SKIPPED))
+            lat[m++] = records[i].latency_ns;
+    if (!m)
+        return;
+    qsort(lat, m, sizeof(*lat), u32_cmp);
+    printf("  %-9s %8zu  %9.1f %9.1f %9.1f %9.1f\n", what, m,
+            lat[m / 2] / 1e3, lat[m * 9 / 10] / 1e3, lat[m * 99 / 100] / 1e3, lat[m - 1] / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = DEVICE;
+    struct trace_record *records, *replayed;
+    struct spifpga_sim *sim = NULL;
+    unsigned int mb = 0, op;
+    uint64_t span, took;
+    uint32_t *lat;
+    bool timed = false, frames = false, writes = false;
+    size_t n, i, first, last, bad = 0, skipped = 0;
+    int c, fd;
+
+    while ((c = getopt(argc, argv, "d:s:tFw")) != -1)
+        switch (c) {
+            case 'd':
+                device = optarg;
+                break;
+            case 's':
+                mb = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                timed = true;
+                break;
+            case 'F':
+                frames = true;
+                break;
+            case 'w':
+                writes = true;
+                break;
+            default:
+                optind = argc;
+        }
+    if (optind != argc - 1)
+    {
+        printf("Usage: spifpga_replay [-d device | -s megabytes] [-t] [-F] [-w] trace\n");
+        return 1;
+    }
+
+    /* don't trace the replay over the trace */
+    unsetenv(TRACE_ENV);
+    if (trace_load(argv[optind], &records, &n) != 0)
+        return 1;
+    if (n == 0)
+    {
+        printf("%s has no records\n", argv[optind]);
+        return 1;
+    }
+    replayed = malloc(n * sizeof(*replayed));
+    lat = malloc(n * sizeof(*lat));
+    if (!replayed || !lat)
+    {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+
+    if (mb)
+    {
+        sim = spifpga_sim_new((size_t) mb << 20);
+        if (!sim)
+            return 1;
+        sim->realtime = true;
+        fd = config_spi_sim(sim);
+        if (frames)
+            set_protocol(fd, PROTO_FRAMES);
+    } else {
+        fd = config_spi_dev(device);
+        if (fd < 1)
+        {
+            printf("Failed to configure SPI\n");
+            return 1;
+        }
+    }
+
+    if (trace_replay(fd, records, n, timed, writes, replayed) != 0)
+        return 1;
+    for (i = 0; i < n; i++)
+    {
+        skipped += replayed[i].flags & TRACE_SKIPPED;
+        bad += !(replayed[i].flags & TRACE_SKIPPED) && replayed[i].ret != RESP_OK;
+    }
+
+    span = records[n - 1].t_ns + records[n - 1].latency_ns - records[0].t_ns;
+    took = 0;
+    for (first = 0; first < n && replayed[first].flags & TRACE_SKIPPED; first++)
+        ;
+    for (last = n; last > first && replayed[last - 1].flags & TRACE_SKIPPED; last--)
+        ;
+    if (first < last)
+        took = replayed[last - 1].t_ns + replayed[last - 1].latency_ns - replayed[first].t_ns;
+    printf("%zu calls, %.3f s recorded, replayed %s in %.3f s on %s, %zu bad responses\n",
+            n, span / 1e9, timed ? "in time" : "flat out", took / 1e9,
+            sim ? "the simulator" : device, bad);
+    if (skipped)
+        printf("%zu calls that write skipped, -w to replay them\n", skipped);
+    printf("latency us        calls        p50       p90       p99       max\n");
+    for (op = 0; op < TRACE_N_OPS; op++)
+    {
+        for (i = 0; i < n && records[i].op != op; i++)
+            ;
+        if (i == n)
+            continue;
+        printf("%s\n", trace_op_name(op));
+        print_latency("recorded", records, n, op, lat);
+        print_latency("replayed", replayed, n, op, lat);
+    }
+
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    free(records);
+    free(replayed);
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,298 @@
+/*
+ * Periodic register sampling, see spifpga_sampler.h.
+ */
+
+#define _GNU_SOURCE             /* pthread_attr_setaffinity_np() */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "spifpga_user.h"
+#include "spifpga_sampler.h"
+
+#define DEFAULT_QUEUE_LEN 1024
+
+struct sampler {
+    struct sampler_config cfg;
+    struct read_batch *batch;
+    unsigned int queue_len;     /* a power of two */
+    struct sample *samples;     /* queue_len of them */
+    unsigned int *vals;         /* n_addrs words for each sample */
+    unsigned int *spill;        /* read into when the queue is full */
+    pthread_t thread;
+    bool locked;
+    unsigned long long start_ns;
+
+    /* head is only written by the sampler, tail only by sampler_pop() */
+    atomic_ullong head;
+    atomic_ullong tail;
+    atomic_bool stop;
+    atomic_bool done;
+    atomic_int error;
+
+    /* only written by the sampler */
+    atomic_ullong n_samples;
+    atomic_ullong missed;
+    atomic_ullong dropped;
+    atomic_ullong errors;
+    atomic_ullong jitter_sum_ns;
+    atomic_ullong max_jitter_ns;
+    atomic_ullong xfer_sum_ns;
+    atomic_ullong max_xfer_ns;
+    atomic_ullong jitter_hist[SAMPLER_HIST];
+};
+
+static unsigned long long ts_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts_ns(&ts);
+}
+
+/* Store v if it is bigger; only the sampler writes, so no compare and swap */
+static void store_max(atomic_ullong *max, unsigned long long v)
+{
+    if (v > atomic_load_explicit(max, memory_order_relaxed))
+        atomic_store_explicit(max, v, memory_order_relaxed);
+}
+
+static void account(struct sampler *s, unsigned long long jitter, unsigned long long xfer)
+{
+    unsigned int b;
+
+    atomic_fetch_add_explicit(&s->jitter_sum_ns, jitter, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->xfer_sum_ns, xfer, memory_order_relaxed);
+    store_max(&s->max_jitter_ns, jitter);
+    store_max(&s->max_xfer_ns, xfer);
+    for (b = 0; b < SAMPLER_HIST - 1 && jitter >= 1000ull << b; b++)
+        ;
+    atomic_fetch_add_explicit(&s->jitter_hist[b], 1, memory_order_relaxed);
+}
+
+static void *sampler_thread(void *arg)
+{
+    struct sampler *s = arg;
+    unsigned long long period = s->cfg.period_us * 1000ull, deadline = s->start_ns;
+    unsigned long long seq = 0, head = 0, tail, late;
+    struct timespec wake, sent, done;
+    struct sample *slot;
+    unsigned int *vals;
+    bool full;
+    int ret;
+
+    while (!atomic_load_explicit(&s->stop, memory_order_relaxed))
+    {
+        wake.tv_sec = deadline / 1000000000;
+        wake.tv_nsec = deadline % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+            ;
+
+        tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+        full = head - tail == s->queue_len;
+        vals = full ? s->spill : s->vals + (head & (s->queue_len - 1)) * s->cfg.n_addrs;
+        ret = read_batch_run(s->batch, vals, &sent, &done);
+        if (ret < 0)
+        {
+            atomic_store(&s->error, ret);
+            break;
+        }
+
+        atomic_fetch_add_explicit(&s->n_samples, 1, memory_order_relaxed);
+        if (ret != RESP_OK)
+            atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+        account(s, ts_ns(&sent) > deadline ? ts_ns(&sent) - deadline : 0,
+                ts_ns(&done) - ts_ns(&sent));
+        if (full)
+        {
+            atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+        } else {
+            slot = &s->samples[head & (s->queue_len - 1)];
+            slot->seq = seq;
+            slot->deadline_ns = deadline;
+            slot->sent_ns = ts_ns(&sent);
+            slot->done_ns = ts_ns(&done);
+            slot->ret = ret;
+            atomic_store_explicit(&s->head, ++head, memory_order_release);
+        }
+
+        /* skip the periods this sample ran into */
+        seq++;
+        deadline += period;
+        if (ts_ns(&done) > deadline)
+        {
+            late = (ts_ns(&done) - deadline) / period + 1;
+            atomic_fetch_add_explicit(&s->missed, late, memory_order_relaxed);
+            seq += late;
+            deadline += late * period;
+        }
+    }
+
+    atomic_store_explicit(&s->done, true, memory_order_release);
+    return NULL;
+}
+
+static void sampler_free(struct sampler *s)
+{
+    read_batch_free(s->batch);
+    free(s->samples);
+    free(s->vals);
+    free(s->spill);
+    free(s);
+}
+
+/*
+ * Start sampling cfg->addrs every cfg->period_us on fd, which belongs to
+ * the sampler until sampler_stop(). A priority or CPU that can't be had
+ * is reported and the sampler runs without it. Returns NULL, after saying
+ * why, if it can't start.
+ */
+struct sampler *sampler_start(int fd, const struct sampler_config *cfg)
+{
+    struct sched_param param;
+    pthread_attr_t attr;
+    struct sampler *s;
+    cpu_set_t cpus;
+    int err;
+
+    if (!cfg->period_us || !cfg->n_addrs)
+    {
+        printf("a sampler needs a period and registers\n");
+        return NULL;
+    }
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+    s->cfg = *cfg;
+    for (s->queue_len = 1; s->queue_len < (cfg->queue_len ? cfg->queue_len : DEFAULT_QUEUE_LEN); )
+        s->queue_len <<= 1;
+    s->batch = read_batch_new(fd, cfg->addrs, cfg->n_addrs);
+    if (!s->batch)
+    {
+        sampler_free(s);
+        return NULL;
+    }
+    /* calloc touches nothing; memset so the sampler never faults a page in */
+    s->samples = malloc(s->queue_len * sizeof(*s->samples));
+    s->vals = malloc((size_t) s->queue_len * cfg->n_addrs * sizeof(*s->vals));
+    s->spill = malloc(cfg->n_addrs * sizeof(*s->spill));
+    if (!s->samples || !s->vals || !s->spill)
+    {
+        printf("Failed to allocate the sample queue\n");
+        sampler_free(s);
+        return NULL;
+    }
+    memset(s->samples, 0, s->queue_len * sizeof(*s->samples));
+    memset(s->vals, 0, (size_t) s->queue_len * cfg->n_addrs * sizeof(*s->vals));
+
+    if (cfg->lock_memory)
+    {
+        s->locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+        if (!s->locked)
+            printf("can't lock memory: %s\n", strerror(errno));
+    }
+
+    pthread_attr_init(&attr);
+    if (cfg->priority > 0)
+    {
+        param.sched_priority = cfg->priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    if (cfg->cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(cfg->cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    s->start_ns = now_ns();
+    err = pthread_create(&s->thread, &attr, sampler_thread, s);
+    if (err == EPERM || err == EINVAL)
+    {
+        printf("can't run the sampler with priority %d on CPU %d (%s), running it normally\n",
+                cfg->priority, cfg->cpu, strerror(err));
+        err = pthread_create(&s->thread, NULL, sampler_thread, s);
+    }
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+    {
+        printf("can't start the sampler: %s\n", strerror(err));
+        if (s->locked)
+            munlockall();
+        sampler_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+/* False once the sampler has stopped on an error */
+bool sampler_running(struct sampler *s)
+{
+    return !atomic_load(&s->done);
+}
+
+/*
+ * Take the oldest sample off the queue, with its n_addrs words in vals.
+ * Returns false if there is none yet. Only one thread may call it.
+ */
+bool sampler_pop(struct sampler *s, struct sample *sample, unsigned int *vals)
+{
+    unsigned long long tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+    unsigned int i = tail & (s->queue_len - 1);
+
+    if (tail == atomic_load_explicit(&s->head, memory_order_acquire))
+        return false;
+    *sample = s->samples[i];
+    memcpy(vals, s->vals + (size_t) i * s->cfg.n_addrs, s->cfg.n_addrs * sizeof(*vals));
+    atomic_store_explicit(&s->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void sampler_get_stats(struct sampler *s, struct sampler_stats *stats)
+{
+    unsigned long long n = atomic_load(&s->n_samples);
+    unsigned int b;
+
+    stats->samples = n;
+    stats->missed = atomic_load(&s->missed);
+    stats->dropped = atomic_load(&s->dropped);
+    stats->errors = atomic_load(&s->errors);
+    stats->avg_jitter_us = n ? atomic_load(&s->jitter_sum_ns) / 1e3 / n : 0;
+    stats->max_jitter_us = atomic_load(&s->max_jitter_ns) / 1e3;
+    stats->avg_xfer_us = n ? atomic_load(&s->xfer_sum_ns) / 1e3 / n : 0;
+    stats->max_xfer_us = atomic_load(&s->max_xfer_ns) / 1e3;
+    for (b = 0; b < SAMPLER_HIST; b++)
+        stats->jitter_hist[b] = atomic_load(&s->jitter_hist[b]);
+    stats->seconds = (now_ns() - s->start_ns) / 1e9;
+}
+
+/*
+ * Stop sampling and free the sampler; samples not popped are lost. stats,
+ * if not NULL, gets the final numbers. Returns 0, or the error that
+ * stopped the sampler early.
+ */
+int sampler_stop(struct sampler *s, struct sampler_stats *stats)
+{
+    int ret;
+
+    atomic_store(&s->stop, true);
+    pthread_join(s->thread, NULL);
+    if (stats)
+        sampler_get_stats(s, stats);
+    ret = atomic_load(&s->error);
+    if (s->locked)
+        munlockall();
+    sampler_free(s);
+    return ret;
+}
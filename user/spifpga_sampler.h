@@ -0,0 +1,66 @@
+/*
+ * Periodic sampling of registers at a fixed rate, for control loops that
+ * need bounded jitter.
+ *
+ * A thread of its own (optionally SCHED_FIFO and pinned to a CPU, with
+ * the process's memory locked) sleeps to absolute CLOCK_MONOTONIC
+ * deadlines, one period apart, and at each reads the registers with a
+ * read_batch prepared up front: one SPI message, no allocation, nothing
+ * printed. Each sample is stamped just before and just after the message
+ * and put in a single producer, single consumer queue that takes no lock;
+ * sampler_pop() takes them out. When the queue is full the sample is
+ * dropped and counted.
+ *
+ * A sample that runs past the next deadline makes the sampler skip the
+ * periods it missed, rather than run them late back to back; they are
+ * counted, and seq says which period each sample belongs to. Jitter is
+ * how long after its deadline a sample's message went out.
+ */
+
+#ifndef SPIFPGA_SAMPLER_H
+#define SPIFPGA_SAMPLER_H
+
+#include <stdbool.h>
+
+#define SAMPLER_HIST 16     /* jitter buckets: under 1 us, then up to 2^i us */
+
+struct sampler_config {
+    const unsigned int *addrs;
+    unsigned int n_addrs;           /* fitting in one message */
+    unsigned int period_us;
+    int priority;                   /* SCHED_FIFO priority, 0 for the normal scheduler */
+    int cpu;                        /* to pin the thread to, -1 for any */
+    bool lock_memory;               /* mlockall() while sampling */
+    unsigned int queue_len;         /* samples, 0 for 1024 */
+};
+
+struct sample {
+    unsigned long long seq;         /* period since the start */
+    unsigned long long deadline_ns; /* CLOCK_MONOTONIC */
+    unsigned long long sent_ns;
+    unsigned long long done_ns;
+    int ret;                        /* of read_batch_run() */
+};
+
+struct sampler_stats {
+    unsigned long long samples;
+    unsigned long long missed;      /* periods skipped after a late sample */
+    unsigned long long dropped;     /* samples the queue had no room for */
+    unsigned long long errors;      /* samples with a bad response */
+    double avg_jitter_us;
+    double max_jitter_us;
+    double avg_xfer_us;             /* sent to done */
+    double max_xfer_us;
+    unsigned long long jitter_hist[SAMPLER_HIST];
+    double seconds;
+};
+
+struct sampler;
+
+struct sampler *sampler_start(int fd, const struct sampler_config *cfg);
+bool sampler_running(struct sampler *s);
+bool sampler_pop(struct sampler *s, struct sample *sample, unsigned int *vals);
+void sampler_get_stats(struct sampler *s, struct sampler_stats *stats);
+int sampler_stop(struct sampler *s, struct sampler_stats *stats);
+
+#endif /* SPIFPGA_SAMPLER_H */
@@ -0,0 +1,203 @@
+/*
+ * Periodic sampling jitter, against the simulator in real time.
+ *
+ * spifpga_sampler_bench [-p period_us] [-n registers] [-s seconds] [-P priority] [-c cpu] [-m] [-l hogs]
+ *
+ * Samples the registers every period, first with a plain loop (usleep()
+ * for the period, then read_word() each register), then with the sampler
+ * (-P SCHED_FIFO priority, -c CPU, -m to lock memory), and compares how
+ * far the time between samples strays from the period. -l starts that
+ * many threads spinning on the CPUs meanwhile. The sampled values are
+ * checked against the simulated memory.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_sampler.h"
+
+#define REG_ADDR 0x00001000
+
+static atomic_bool hogs_stop;
+
+static void *hog(void *arg)
+{
+    volatile unsigned long spin = 0;
+
+    while (!atomic_load_explicit(&hogs_stop, memory_order_relaxed))
+        spin++;
+    return NULL;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct interval_stats {
+    unsigned long long n;
+    double sum_us;
+    double max_us;
+};
+
+/* How far the interval from the last sample, periods apart, is from them */
+static void interval(struct interval_stats *st, unsigned long long last, unsigned long long t,
+        unsigned long long periods, unsigned int period_us)
+{
+    double err = ((double) t - last) / 1e3 - (double) periods * period_us;
+
+    if (err < 0)
+        err = -err;
+    st->n++;
+    st->sum_us += err;
+    if (err > st->max_us)
+        st->max_us = err;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int period_us = 1000, n = 8, seconds = 2, n_hogs = 0, i, *vals, *addrs;
+    unsigned long long t, t0, last = 0, popped = 0, last_seq = 0, k, n_loop;
+    struct interval_stats loop_st = { 0, 0, 0 }, samp_st = { 0, 0, 0 };
+    struct sampler_config cfg = { NULL, 0, 0, 0, -1, false, 0 };
+    struct sampler_stats st;
+    struct spifpga_sim *sim;
+    struct sampler *s;
+    struct sample sample;
+    pthread_t hogs[64];
+    int c, fd, errors = 0;
+
+    while ((c = getopt(argc, argv, "p:n:s:P:c:ml:")) != -1)
+        switch (c) {
+            case 'p':
+                period_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                n = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                seconds = strtoul(optarg, NULL, 0);
+                break;
+            case 'P':
+                cfg.priority = strtol(optarg, NULL, 0);
+                break;
+            case 'c':
+                cfg.cpu = strtol(optarg, NULL, 0);
+                break;
+            case 'm':
+                cfg.lock_memory = true;
+                break;
+            case 'l':
+                n_hogs = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: spifpga_sampler_bench [-p period_us] [-n registers] [-s seconds] [-P priority] [-c cpu] [-m] [-l hogs]\n");
+                return 1;
+        }
+    if (period_us == 0 || n == 0 || seconds == 0 || n_hogs > 64)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    sim = spifpga_sim_new(REG_ADDR + n * BYTES_PER_WORD);
+    addrs = malloc(n * sizeof(*addrs));
+    vals = malloc(n * sizeof(*vals));
+    if (!sim || !addrs || !vals)
+    {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        addrs[i] = REG_ADDR + i * BYTES_PER_WORD;
+        sim->mem[addrs[i] / BYTES_PER_WORD] = 0xC0DE0000 | i;
+    }
+    sim->realtime = true;
+    fd = config_spi_sim(sim);
+    for (i = 0; i < n_hogs; i++)
+        pthread_create(&hogs[i], NULL, hog, NULL);
+
+    /* sleep a period, read the registers one by one */
+    n_loop = seconds * 1000000ull / period_us;
+    t0 = now_ns();
+    for (k = 0; k < n_loop; k++)
+    {
+        usleep(period_us);
+        t = now_ns();
+        if (last)
+            interval(&loop_st, last, t, 1, period_us);
+        last = t;
+        for (i = 0; i < n; i++)
+            errors += read_word(fd, addrs[i], &vals[i]) != RESP_OK ||
+                    vals[i] != (0xC0DE0000 | i);
+    }
+    t0 = now_ns() - t0;
+
+    cfg.addrs = addrs;
+    cfg.n_addrs = n;
+    cfg.period_us = period_us;
+    s = sampler_start(fd, &cfg);
+    if (!s)
+        return 1;
+    last = 0;
+    while (sampler_running(s))
+    {
+        while (sampler_pop(s, &sample, vals))
+        {
+            if (last)
+                interval(&samp_st, last, sample.sent_ns, sample.seq - last_seq, period_us);
+            errors += (popped && sample.seq <= last_seq) || sample.ret != RESP_OK;
+            for (i = 0; i < n; i++)
+                errors += vals[i] != (0xC0DE0000 | i);
+            last = sample.sent_ns;
+            last_seq = sample.seq;
+            popped++;
+        }
+        sampler_get_stats(s, &st);
+        if (st.seconds >= seconds)
+            break;
+        usleep(10000);
+    }
+    errors += sampler_stop(s, &st) != 0;
+    errors += popped + st.dropped > st.samples || st.errors != 0;
+
+    atomic_store(&hogs_stop, true);
+    for (i = 0; i < n_hogs; i++)
+        pthread_join(hogs[i], NULL);
+
+    printf("%u registers every %u us for %u s, %u spinning threads\n",
+            n, period_us, seconds, n_hogs);
+    printf("usleep + read_word  interval error avg %7.1f us, max %8.1f us, %.0f samples/s\n",
+            loop_st.n ? loop_st.sum_us / loop_st.n : 0, loop_st.max_us,
+            n_loop / (t0 / 1e9));
+    printf("sampler             interval error avg %7.1f us, max %8.1f us, %.0f samples/s\n",
+            samp_st.n ? samp_st.sum_us / samp_st.n : 0, samp_st.max_us,
+            st.samples / st.seconds);
+    printf("sampler jitter avg %.1f us, max %.1f us; message avg %.1f us, max %.1f us\n",
+            st.avg_jitter_us, st.max_jitter_us, st.avg_xfer_us, st.max_xfer_us);
+    printf("%llu samples, %llu missed periods, %llu dropped; jitter histogram (us):",
+            st.samples, st.missed, st.dropped);
+    for (i = 0; i < SAMPLER_HIST; i++)
+        if (st.jitter_hist[i])
+            printf(" <%u:%llu", 1u << i, st.jitter_hist[i]);
+    printf("\n");
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    free(addrs);
+    free(vals);
+    return errors ? 1 : 0;
+}
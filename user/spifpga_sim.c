@@ -0,0 +1,249 @@
+/*
+ * FPGA simulator for the user library, see spifpga_sim.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+
+struct spifpga_sim *spifpga_sim_new(size_t bytes)
+{
+    struct spifpga_sim *sim;
+
+    sim = calloc(1, sizeof(*sim));
+    if (!sim)
+        return NULL;
+    sim->words = bytes / BYTES_PER_WORD;
+    sim->mem = calloc(sim->words, sizeof(uint32_t));
+    if (!sim->mem)
+    {
+        free(sim);
+        return NULL;
+    }
+    sim->hz = MAX_SPEED;
+    sim->xfer_ns = 2000;
+    sim->msg_ns = 20000;
+    return sim;
+}
+
+struct spifpga_sim *spifpga_sim_new_link(struct spifpga_sim *sim)
+{
+    struct spifpga_sim *link;
+
+    link = malloc(sizeof(*link));
+    if (!link)
+        return NULL;
+    *link = *sim;
+    link->shared = true;
+    spifpga_sim_reset_counters(link);
+    return link;
+}
+
+void spifpga_sim_free(struct spifpga_sim *sim)
+{
+    if (!sim)
+        return;
+    if (!sim->shared)
+        free(sim->mem);
+    free(sim);
+}
+
+void spifpga_sim_reset_counters(struct spifpga_sim *sim)
+{
+    sim->messages = 0;
+    sim->transfers = 0;
+    sim->frames = 0;
+    sim->wire_bytes = 0;
+    sim->bus_ns = 0;
+}
+
+/* Whether the next frame at this clock rate gets garbled */
+static bool sim_garbled(struct spifpga_sim *sim, uint32_t hz)
+{
+    return sim->max_clean_hz && hz > sim->max_clean_hz && sim->frames % 4 == 3;
+}
+
+/* The bits a write with the byte enables in the low nibble of cmd changes */
+static uint32_t byte_mask(unsigned char cmd)
+{
+    uint32_t mask = 0;
+    unsigned int i;
+
+    for (i = 0; i < BYTES_PER_WORD; i++)
+        if (cmd & (1 << i))
+            mask |= 0xFFu << (8 * i);
+    return mask;
+}
+
+/* Answer one frame the way the gateware does */
+static void sim_frame(struct spifpga_sim *sim, const struct fpga_spi_cmd *cmd,
+        struct fpga_spi_cmd *resp, uint32_t hz)
+{
+    if (sim_garbled(sim, hz))
+    {
+        memset(resp, 0xA5, sizeof(*resp));
+        sim->frames++;
+        return;
+    }
+
+    uint32_t *word = &sim->mem[(cmd->addr / BYTES_PER_WORD) % sim->words];
+
+    if (sim->hook && (cmd->cmd & 0x70) == 0x00)
+        sim->hook(sim, cmd->cmd & 0x80, cmd->addr, cmd->din, sim->hook_ctx);
+    memset(resp, 0, sizeof(*resp));
+    if (cmd->cmd == 0x8F)
+        *word = cmd->din;
+    else if ((cmd->cmd & 0xF0) == 0x80)
+        *word = (*word & ~byte_mask(cmd->cmd)) | (cmd->din & byte_mask(cmd->cmd));
+    else if (cmd->cmd == 0x0F && cmd->addr == CAP_ADDR && !sim->legacy)
+        resp->dout = CAP_MAGIC | CAP_BURST;
+    else if (cmd->cmd == 0x0F)
+        resp->dout = *word;
+    else
+        return;
+    resp->resp = RESP_OK;
+    sim->frames++;
+}
+
+/* A whole burst frame in one transfer: header, words, status */
+static void sim_burst(struct spifpga_sim *sim, const unsigned char *tx,
+        unsigned char *rx, unsigned int len, uint32_t hz)
+{
+    struct fpga_spi_burst hdr;
+    uint32_t *word;
+    unsigned int i;
+
+    memcpy(&hdr, tx, sizeof(hdr));
+    memset(rx, 0, len);
+    if (len != hdr.count * BYTES_PER_WORD + BURST_OVERHEAD)
+        return;     /* garbled, no status */
+
+    for (i = 0; i < hdr.count; i++)
+    {
+        word = &sim->mem[(hdr.addr / BYTES_PER_WORD + i) % sim->words];
+        if (hdr.cmd == BURST_WRITE_CMD)
+            memcpy(word, tx + sizeof(hdr) + i * BYTES_PER_WORD, BYTES_PER_WORD);
+        else
+            memcpy(rx + sizeof(hdr) + i * BYTES_PER_WORD, word, BYTES_PER_WORD);
+    }
+    rx[len - 1] = sim_garbled(sim, hz) ? 0 : RESP_OK;
+    sim->frames++;
+}
+
+/*
+ * Answer what the gateware sees between a chipselect and its release: a
+ * burst frame, whole frames back to back, or nothing it understands.
+ */
+static void sim_select(struct spifpga_sim *sim, const unsigned char *tx,
+        unsigned char *rx, unsigned int len, uint32_t hz)
+{
+    const struct fpga_spi_cmd *cmd = (const struct fpga_spi_cmd *) tx;
+    struct fpga_spi_cmd *resp = (struct fpga_spi_cmd *) rx;
+    unsigned int f, n_frames;
+
+    if (tx && rx && !sim->legacy && len >= BURST_OVERHEAD &&
+            (cmd->cmd == BURST_READ_CMD || cmd->cmd == BURST_WRITE_CMD))
+    {
+        sim_burst(sim, tx, rx, len, hz);
+    }
+    else if (tx && rx && len % sizeof(struct fpga_spi_cmd) == 0)
+    {
+        n_frames = len / sizeof(struct fpga_spi_cmd);
+        memset(rx, 0, len);
+        for (f = 0; f < (sim->legacy ? 1 : n_frames); f++)
+            sim_frame(sim, cmd + f, resp + f, hz);
+    }
+    else if (rx)
+    {
+        memset(rx, 0, len);
+    }
+}
+
+/*
+ * Transfers up to and including the next one with cs_change set (or the
+ * last) share a chipselect, so they are answered as one run of bytes.
+ */
+static int sim_joined(struct spifpga_sim *sim, struct spi_ioc_transfer *tr,
+        unsigned int n, uint32_t hz)
+{
+    unsigned char *tx, *rx;
+    unsigned int i, len = 0, off;
+
+    for (i = 0; i < n; i++)
+        len += tr[i].len;
+    tx = calloc(1, len ? len : 1);
+    rx = malloc(len ? len : 1);
+    if (!tx || !rx)
+    {
+        free(tx);
+        free(rx);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = off = 0; i < n; off += tr[i++].len)
+        if (tr[i].tx_buf)
+            memcpy(tx + off, (const void *)(uintptr_t) tr[i].tx_buf, tr[i].len);
+    sim_select(sim, tx, rx, len, hz);
+    for (i = off = 0; i < n; off += tr[i++].len)
+        if (tr[i].rx_buf)
+            memcpy((void *)(uintptr_t) tr[i].rx_buf, rx + off, tr[i].len);
+    free(tx);
+    free(rx);
+    return 0;
+}
+
+/* Returns the bytes transferred, like the SPI_IOC_MESSAGE ioctl */
+int spifpga_sim_message(struct spifpga_sim *sim, struct spi_ioc_transfer *tr, unsigned int n)
+{
+    unsigned int i, j;
+    int total = 0;
+    uint32_t hz;
+    uint64_t start_ns = sim->bus_ns;
+    struct timespec ts;
+
+    for (i = 0; i < n; i++)
+        total += tr[i].len;
+    if (sim->max_msg_bytes && total > sim->max_msg_bytes)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    total = 0;
+
+    sim->messages++;
+    sim->bus_ns += sim->msg_ns;
+
+    for (i = 0; i < n; i = j)
+    {
+        for (j = i; j < n - 1 && !tr[j].cs_change; j++)
+            ;
+        j++;
+        hz = tr[i].speed_hz ? tr[i].speed_hz : sim->hz;
+        if (j - i == 1)
+            sim_select(sim, (const unsigned char *)(uintptr_t) tr[i].tx_buf,
+                    (unsigned char *)(uintptr_t) tr[i].rx_buf, tr[i].len, hz);
+        else if (sim_joined(sim, tr + i, j - i, hz) != 0)
+            return -1;
+
+        for (; i < j; i++)
+        {
+            hz = tr[i].speed_hz ? tr[i].speed_hz : sim->hz;
+            sim->bus_ns += sim->xfer_ns + tr[i].delay_usecs * 1000ULL +
+                    (uint64_t) tr[i].len * 8 * 1000000000 / hz;
+            sim->transfers++;
+            sim->wire_bytes += tr[i].len;
+            total += tr[i].len;
+        }
+    }
+
+    if (sim->realtime)
+    {
+        ts.tv_sec = (sim->bus_ns - start_ns) / 1000000000;
+        ts.tv_nsec = (sim->bus_ns - start_ns) % 1000000000;
+        nanosleep(&ts, NULL);
+    }
+    return total;
+}
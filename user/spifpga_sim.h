@@ -0,0 +1,75 @@
+/*
+ * FPGA simulator for the user library.
+ *
+ * Answers the frames of an SPI_IOC_MESSAGE against an emulated register
+ * memory instead of a spidev device, so the library and the tools built on
+ * it can be tested and benchmarked without a board. Nothing is spent in
+ * real time; the bus time the message would have taken is modelled from
+ * the clock rate, the per-transfer cost (chipselect, controller setup and
+ * delay_usecs) and the per-message cost, and accumulated in bus_ns.
+ *
+ * Transfers share a chipselect up to one with cs_change set, as on the
+ * wire, and what they carry between them is answered as one: a burst
+ * frame, or whole frames back to back, anything else is garbled. A
+ * transfer made of several whole frames is a back to back stream. With
+ * legacy set the simulator behaves like gateware that needs a chipselect
+ * per frame, and only answers the first frame of a stream. Burst frames are
+ * understood, and advertised in the capability register, unless legacy is
+ * set.
+ *
+ * max_clean_hz and max_msg_bytes model a marginal board for calibration:
+ * above max_clean_hz every fourth frame comes back corrupted, and messages
+ * longer than max_msg_bytes fail with EMSGSIZE like spidev does. 0 means no
+ * limit.
+ *
+ * spifpga_sim_new_link() makes a second simulator on the memory of the
+ * first, like a board that exposes one FPGA over two SPI links. Free it
+ * before the first.
+ *
+ * hook, if set, sees every read or write frame before it is answered, so
+ * a test can model registers with side effects (a capture block, say) on
+ * top of the plain memory.
+ *
+ * With realtime set, each message also sleeps for its modelled bus time,
+ * so that wall clock measurements (of several links in parallel, say) see
+ * it.
+ */
+
+#ifndef SPIFPGA_SIM_H
+#define SPIFPGA_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/spi/spidev.h>
+
+struct spifpga_sim {
+    uint32_t *mem;
+    size_t words;           /* addresses wrap modulo the memory */
+    bool shared;            /* mem belongs to another simulator */
+
+    /* wire timing */
+    uint32_t hz;            /* when a transfer doesn't set speed_hz */
+    uint32_t xfer_ns;       /* per spi_ioc_transfer */
+    uint32_t msg_ns;        /* per SPI_IOC_MESSAGE */
+    bool legacy;            /* no frame streaming, no bursts */
+    uint32_t max_clean_hz;
+    uint32_t max_msg_bytes;
+    bool realtime;          /* sleep for the bus time of each message */
+    void (*hook)(struct spifpga_sim *sim, bool write, uint32_t addr, uint32_t val, void *ctx);
+    void *hook_ctx;
+
+    uint64_t messages;
+    uint64_t transfers;
+    uint64_t frames;
+    uint64_t wire_bytes;
+    uint64_t bus_ns;
+};
+
+struct spifpga_sim *spifpga_sim_new(size_t bytes);
+struct spifpga_sim *spifpga_sim_new_link(struct spifpga_sim *sim);
+void spifpga_sim_free(struct spifpga_sim *sim);
+void spifpga_sim_reset_counters(struct spifpga_sim *sim);
+int spifpga_sim_message(struct spifpga_sim *sim, struct spi_ioc_transfer *tr, unsigned int n);
+
+#endif /* SPIFPGA_SIM_H */
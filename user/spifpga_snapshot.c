@@ -0,0 +1,141 @@
+/*
+ * Snapshot captures, see spifpga_snapshot.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_snapshot.h"
+
+struct snapshot {
+    int fd;
+    struct snapshot_desc desc;
+    unsigned int *buf;
+    bool own_buf;
+    struct word_op arm[3];      /* ctrl = 0, ctrl = arm_val, read status */
+    unsigned int status;        /* as last read */
+    struct snapshot_stats stats;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Set up captures from desc on fd, into buf, or into a buffer of the
+ * snapshot's own if buf is NULL. Returns NULL if desc makes no sense.
+ */
+struct snapshot *snapshot_new(int fd, const struct snapshot_desc *desc, unsigned int *buf)
+{
+    struct snapshot *snap;
+
+    if (!desc->done_mask || !desc->n_bytes)
+    {
+        printf("a snapshot needs a done mask and a length\n");
+        return NULL;
+    }
+    snap = calloc(1, sizeof(*snap));
+    if (!snap)
+        return NULL;
+    snap->fd = fd;
+    snap->desc = *desc;
+    snap->buf = buf;
+    if (!buf)
+    {
+        snap->buf = calloc(1, desc->n_bytes + BYTES_PER_WORD);
+        snap->own_buf = true;
+        if (!snap->buf)
+        {
+            printf("Failed to allocate the snapshot buffer\n");
+            free(snap);
+            return NULL;
+        }
+    }
+
+    snap->arm[0].addr = desc->ctrl_addr;
+    snap->arm[0].write = true;
+    snap->arm[1].addr = desc->ctrl_addr;
+    snap->arm[1].write = true;
+    snap->arm[2].addr = desc->status_addr;
+    return snap;
+}
+
+void snapshot_free(struct snapshot *snap)
+{
+    if (!snap)
+        return;
+    if (snap->own_buf)
+        free(snap->buf);
+    free(snap);
+}
+
+/*
+ * Arm, wait for done and drain into the buffer. Returns RESP_OK, the FPGA
+ * response code or a negative error from the step that failed, or -1 if
+ * the capture didn't finish within timeout_us.
+ */
+int snapshot_capture(struct snapshot *snap)
+{
+    const struct snapshot_desc *d = &snap->desc;
+    struct word_op *poll = &snap->arm[2];
+    double start = now_s();
+    int ret;
+
+    snap->arm[0].val = 0;
+    snap->arm[1].val = d->arm_val;
+    ret = word_ops(snap->fd, snap->arm, 3);
+    snap->status = poll->val;
+    while (ret == RESP_OK && (snap->status & d->done_mask) != d->done_mask)
+    {
+        if (d->timeout_us && (now_s() - start) * 1e6 > d->timeout_us)
+        {
+            printf("snapshot at 0x%x timed out, status 0x%x\n", d->bram_addr, snap->status);
+            snap->stats.timeouts++;
+            ret = -1;
+            goto out;
+        }
+        ret = word_ops(snap->fd, poll, 1);
+        snap->status = poll->val;
+        snap->stats.polls++;
+    }
+    if (ret != RESP_OK)
+        goto out;
+
+    ret = bulk_read(snap->fd, d->bram_addr, d->n_bytes, snap->buf);
+    if (ret == RESP_OK)
+        snap->stats.captures++;
+out:
+    snap->stats.seconds += now_s() - start;
+    return ret;
+}
+
+/* Capture into buf from now on, instead of the buffer given before */
+void snapshot_set_buffer(struct snapshot *snap, unsigned int *buf)
+{
+    if (snap->own_buf)
+        free(snap->buf);
+    snap->own_buf = false;
+    snap->buf = buf;
+}
+
+unsigned int *snapshot_data(struct snapshot *snap)
+{
+    return snap->buf;
+}
+
+/* The status register as the capture left it, done bits and all */
+unsigned int snapshot_status(const struct snapshot *snap)
+{
+    return snap->status;
+}
+
+void snapshot_get_stats(const struct snapshot *snap, struct snapshot_stats *stats)
+{
+    *stats = snap->stats;
+}
@@ -0,0 +1,44 @@
+/*
+ * Snapshot captures: arm a capture block, wait for it to finish, and read
+ * its BRAM, in one call.
+ *
+ * This is the CASPER snapshot block pattern: a control register that
+ * starts a capture on a rising edge, a status register with a done bit,
+ * and a BRAM holding the samples. snapshot_new() sets up everything a
+ * capture needs once; snapshot_capture() then writes 0 and arm_val to the
+ * control register and reads the status register in the same SPI message,
+ * polls the status until all of done_mask is set, and drains the BRAM into
+ * the buffer. Captures after the first allocate nothing.
+ */
+
+#ifndef SPIFPGA_SNAPSHOT_H
+#define SPIFPGA_SNAPSHOT_H
+
+struct snapshot_desc {
+    unsigned int ctrl_addr;
+    unsigned int arm_val;       /* written after a 0 to arm, usually 1 */
+    unsigned int status_addr;
+    unsigned int done_mask;     /* done when all these status bits are set */
+    unsigned int bram_addr;
+    unsigned int n_bytes;
+    unsigned int timeout_us;    /* 0 to wait forever */
+};
+
+struct snapshot_stats {
+    unsigned long captures;     /* that completed */
+    unsigned long polls;        /* status reads after the first */
+    unsigned long timeouts;
+    double seconds;             /* in snapshot_capture() */
+};
+
+struct snapshot;
+
+struct snapshot *snapshot_new(int fd, const struct snapshot_desc *desc, unsigned int *buf);
+void snapshot_free(struct snapshot *snap);
+int snapshot_capture(struct snapshot *snap);
+void snapshot_set_buffer(struct snapshot *snap, unsigned int *buf);
+unsigned int *snapshot_data(struct snapshot *snap);
+unsigned int snapshot_status(const struct snapshot *snap);
+void snapshot_get_stats(const struct snapshot *snap, struct snapshot_stats *stats);
+
+#endif /* SPIFPGA_SNAPSHOT_H */
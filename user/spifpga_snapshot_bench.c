@@ -0,0 +1,198 @@
+/*
+ * Snapshot capture rate against a simulated CASPER snapshot block.
+ *
+ * spifpga_snapshot_bench [-n captures] [-b bytes] [-p polls] [-B]
+ *
+ * The simulator gets a capture block: a rising edge on bit 0 of the
+ * control register starts a capture, which fills the BRAM with a pattern
+ * of its sequence number and sets bit 31 of the status register after
+ * polls more status reads. The same captures are done the old way (two
+ * write_word()s, a read_word() loop, and bulk_read() into a fresh buffer)
+ * and with snapshot_capture(), and the data of every capture is checked.
+ * Rates are in modelled bus time. -B uses the burst protocol for the BRAM.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_snapshot.h"
+
+#define CTRL_ADDR 0x00001000
+#define STATUS_ADDR 0x00001004
+#define BRAM_ADDR 0x00010000
+#define STATUS_DONE 0x80000000
+
+struct capture_block {
+    unsigned int n_words;
+    unsigned int polls;         /* status reads a capture takes */
+    unsigned int polls_left;
+    unsigned int seq;
+    uint32_t ctrl;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t pattern(unsigned int seq, unsigned int i)
+{
+    return (seq << 20) ^ (i * 2654435761u);
+}
+
+static void capture_hook(struct spifpga_sim *sim, bool write, uint32_t addr,
+        uint32_t val, void *ctx)
+{
+    struct capture_block *cb = ctx;
+    uint32_t *status = &sim->mem[STATUS_ADDR / BYTES_PER_WORD];
+    unsigned int i;
+
+    if (write && addr == CTRL_ADDR)
+    {
+        if ((val & 1) && !(cb->ctrl & 1))
+        {
+            cb->seq++;
+            for (i = 0; i < cb->n_words; i++)
+                sim->mem[BRAM_ADDR / BYTES_PER_WORD + i] = pattern(cb->seq, i);
+            cb->polls_left = cb->polls;
+            *status = cb->polls ? 0 : STATUS_DONE | cb->n_words;
+        }
+        cb->ctrl = val;
+    } else if (!write && addr == STATUS_ADDR && cb->polls_left) {
+        if (--cb->polls_left == 0)
+            *status = STATUS_DONE | cb->n_words;
+    }
+}
+
+static int check(const struct capture_block *cb, const unsigned int *buf)
+{
+    unsigned int i;
+
+    for (i = 0; i < cb->n_words; i++)
+        if (buf[i] != pattern(cb->seq, i))
+            return 1;
+    return 0;
+}
+
+/* What a capture took before snapshot_capture() */
+static int old_capture(int fd, unsigned int n_bytes, const struct capture_block *cb)
+{
+    unsigned int status = 0, *buf;
+    int errors = 0;
+
+    write_word(fd, CTRL_ADDR, 0);
+    write_word(fd, CTRL_ADDR, 1);
+    while (!(status & STATUS_DONE))
+        if (read_word(fd, STATUS_ADDR, &status) != RESP_OK)
+            return 1;
+    buf = malloc(n_bytes);
+    if (!buf)
+        return 1;
+    if (bulk_read(fd, BRAM_ADDR, n_bytes, buf) != RESP_OK)
+        errors++;
+    errors += check(cb, buf);
+    free(buf);
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int n_captures = 200, n_bytes = 1024, i;
+    struct capture_block cb = { 0, 2, 0, 0, 0 };
+    struct snapshot_desc desc;
+    struct snapshot_stats stats;
+    struct spifpga_sim *sim;
+    struct snapshot *snap;
+    uint64_t bus_old, bus_new;
+    double t0, wall_old;
+    bool burst = false;
+    int c, fd, errors = 0;
+
+    while ((c = getopt(argc, argv, "n:b:p:B")) != -1)
+        switch (c) {
+            case 'n':
+                n_captures = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                n_bytes = strtoul(optarg, NULL, 0) & ~(BYTES_PER_WORD - 1);
+                break;
+            case 'p':
+                cb.polls = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                burst = true;
+                break;
+            default:
+                printf("Usage: spifpga_snapshot_bench [-n captures] [-b bytes] [-p polls] [-B]\n");
+                return 1;
+        }
+    if (n_captures == 0 || n_bytes == 0)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    sim = spifpga_sim_new(BRAM_ADDR + n_bytes);
+    if (!sim)
+    {
+        printf("Failed to create the simulator\n");
+        return 1;
+    }
+    cb.n_words = n_bytes / BYTES_PER_WORD;
+    sim->hook = capture_hook;
+    sim->hook_ctx = &cb;
+    fd = config_spi_sim(sim);
+    if (!burst)
+        set_protocol(fd, PROTO_FRAMES);
+
+    spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    for (i = 0; i < n_captures; i++)
+        errors += old_capture(fd, n_bytes, &cb);
+    wall_old = now_s() - t0;
+    bus_old = sim->bus_ns;
+
+    memset(&desc, 0, sizeof(desc));
+    desc.ctrl_addr = CTRL_ADDR;
+    desc.arm_val = 1;
+    desc.status_addr = STATUS_ADDR;
+    desc.done_mask = STATUS_DONE;
+    desc.bram_addr = BRAM_ADDR;
+    desc.n_bytes = n_bytes;
+    desc.timeout_us = 1000000;
+    snap = snapshot_new(fd, &desc, NULL);
+    if (!snap)
+        return 1;
+
+    spifpga_sim_reset_counters(sim);
+    for (i = 0; i < n_captures; i++)
+    {
+        if (snapshot_capture(snap) != RESP_OK)
+            errors++;
+        errors += check(&cb, snapshot_data(snap));
+    }
+    bus_new = sim->bus_ns;
+    snapshot_get_stats(snap, &stats);
+
+    printf("%u captures of %u bytes, %u polls each, %s protocol\n",
+            n_captures, n_bytes, cb.polls, burst ? "burst" : "frame");
+    printf("separate calls    %8.1f captures/s  (%.1f us wall each)\n",
+            n_captures / (bus_old / 1e9), wall_old / n_captures * 1e6);
+    printf("snapshot_capture  %8.1f captures/s  (%lu polls, %.1f us wall each)\n",
+            n_captures / (bus_new / 1e9), stats.polls, stats.seconds / stats.captures * 1e6);
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    snapshot_free(snap);
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    return errors ? 1 : 0;
+}
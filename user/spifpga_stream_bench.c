@@ -0,0 +1,235 @@
+/*
+ * Register ops/s of the user library with one transfer per frame, in
+ * stream mode (one transfer per burst of frames) and with burst frames.
+ *
+ * spifpga_stream_bench [-H] [-n bytes] [-i iterations] [-a addr]
+ *                      [-x xfer_ns] [-m msg_ns] [-L]
+ *                      [-c] [-e max_clean_hz] [-M max_msg_bytes]
+ *
+ * By default it runs against the simulator in spifpga_sim.c and reports
+ * ops/s in modelled bus time at the library's clock rate; -x and -m set the
+ * per-transfer and per-message costs, and -L simulates old gateware
+ * without streaming or bursts, which set_stream_mode() and set_protocol()
+ * must refuse. -H runs on the
+ * board through config_spi() instead and reports wall clock ops/s.
+ *
+ * -c calibrates first (calibrate_spi() on the register at addr - 4), with
+ * the simulator modelling a board that is only clean up to max_clean_hz and
+ * takes messages of up to max_msg_bytes (which also applies without -c;
+ * the library must size its bursts to it). After the runs, it lowers the
+ * simulator's limit to a quarter of the calibrated clock and checks that
+ * the link demotes itself.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "spifpga.h"
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct spifpga_sim *sim;
+
+/* Seconds the last run took, on the (simulated) bus or on the wall clock */
+static double run_time(double t0)
+{
+    if (sim)
+        return sim->bus_ns / 1e9;
+    return now_s() - t0;
+}
+
+static int run(int fd, const char *name, unsigned int addr, unsigned int n_bytes,
+        unsigned int iterations)
+{
+    unsigned int *wr, *rd, n_words = n_bytes / BYTES_PER_WORD, i, it;
+    double t0, s;
+    int errors = 0;
+
+    wr = malloc(n_bytes);
+    rd = malloc(n_bytes);
+    if (!wr || !rd)
+    {
+        printf("Failed to allocate buffers\n");
+        return -1;
+    }
+    for (i = 0; i < n_words; i++)
+        wr[i] = 0x5a000000 ^ i;
+
+    if (sim)
+        spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    for (it = 0; it < iterations; it++)
+        bulk_write(fd, addr, n_bytes, wr);
+    s = run_time(t0);
+    printf("%-8s bulk_write %10.0f ops/s\n", name, (double)n_words * iterations / s);
+
+    if (sim)
+        spifpga_sim_reset_counters(sim);
+    t0 = now_s();
+    for (it = 0; it < iterations; it++)
+        bulk_read(fd, addr, n_bytes, rd);
+    s = run_time(t0);
+    printf("%-8s bulk_read  %10.0f ops/s\n", name, (double)n_words * iterations / s);
+
+    for (i = 0; i < n_words; i++)
+        if (rd[i] != wr[i])
+            errors++;
+    if (errors)
+        printf("%-8s verify FAILED (%d mismatches)\n", name, errors);
+
+    free(wr);
+    free(rd);
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int addr = 0x00010000, n_bytes = 64 * 1024, iterations = 4;
+    bool hardware = false, legacy = false, calibrate = false;
+    unsigned long max_clean_hz = 12000000, max_msg_bytes = 0;
+    struct spifpga_limits limits;
+    struct spi_profile profile;
+    long xfer_ns = -1, msg_ns = -1;
+    int fd, c, errors;
+
+    while ((c = getopt(argc, argv, "Hn:i:a:x:m:Lce:M:")) != -1)
+        switch (c) {
+            case 'H':
+                hardware = true;
+                break;
+            case 'n':
+                n_bytes = strtoul(optarg, NULL, 0) & ~(BYTES_PER_WORD - 1);
+                break;
+            case 'i':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                addr = strtoul(optarg, NULL, 0);
+                break;
+            case 'x':
+                xfer_ns = strtol(optarg, NULL, 0);
+                break;
+            case 'm':
+                msg_ns = strtol(optarg, NULL, 0);
+                break;
+            case 'L':
+                legacy = true;
+                break;
+            case 'c':
+                calibrate = true;
+                break;
+            case 'e':
+                max_clean_hz = strtoul(optarg, NULL, 0);
+                break;
+            case 'M':
+                max_msg_bytes = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: spifpga_stream_bench [-H] [-n bytes] [-i iterations] [-a addr] [-x xfer_ns] [-m msg_ns] [-L] [-c] [-e max_clean_hz] [-M max_msg_bytes]\n");
+                return 1;
+        }
+    if (n_bytes == 0 || iterations == 0)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    if (hardware)
+    {
+        fd = config_spi();
+    } else {
+        sim = spifpga_sim_new(addr + n_bytes + 4096);
+        if (!sim)
+        {
+            printf("Failed to create the simulator\n");
+            return 1;
+        }
+        if (xfer_ns >= 0)
+            sim->xfer_ns = xfer_ns;
+        if (msg_ns >= 0)
+            sim->msg_ns = msg_ns;
+        sim->legacy = legacy;
+        if (calibrate)
+            sim->max_clean_hz = max_clean_hz;
+        sim->max_msg_bytes = max_msg_bytes;
+        printf("simulator: %u ns/transfer, %u ns/message%s\n",
+                sim->xfer_ns, sim->msg_ns, legacy ? ", legacy" : "");
+        fd = config_spi_sim(sim);
+    }
+    if (fd < 1)
+    {
+        printf("Failed to configure SPI\n");
+        return 1;
+    }
+
+    get_limits(fd, &limits);
+    printf("limits: %u byte messages, %u frames or %u burst words\n",
+            limits.page_bytes, limits.frames_per_page, limits.words_per_burst);
+
+    errors = 0;
+    if (calibrate)
+    {
+        if (calibrate_spi(fd, addr - BYTES_PER_WORD, &profile) != 0)
+        {
+            printf("calibration failed\n");
+            return 1;
+        }
+        printf("calibrated: %u Hz, %u frames per message\n",
+                profile.speed, profile.burst_size);
+    }
+
+    set_protocol(fd, PROTO_FRAMES);
+    errors += run(fd, "frames", addr, n_bytes, iterations);
+    if (set_stream_mode(fd, 1) == 0)
+    {
+        if (legacy)
+        {
+            printf("stream mode accepted by legacy gateware\n");
+            errors++;
+        }
+        errors += run(fd, "stream", addr, n_bytes, iterations);
+    } else if (!legacy) {
+        errors++;
+    }
+
+    set_stream_mode(fd, 0);
+    if (set_protocol(fd, PROTO_BURST) == PROTO_BURST)
+    {
+        if (legacy)
+        {
+            printf("burst protocol accepted by legacy gateware\n");
+            errors++;
+        }
+        errors += run(fd, "burst", addr, n_bytes, iterations);
+    } else if (!legacy) {
+        printf("burst protocol not found\n");
+        errors++;
+    }
+
+    if (calibrate && sim)
+    {
+        sim->max_clean_hz = profile.speed / 4;
+        run(fd, "degraded", addr, n_bytes, iterations);
+        get_profile(fd, &profile);
+        printf("after degrading: %u Hz, %u frames per message\n",
+                profile.speed, profile.burst_size);
+        if (profile.speed > sim->max_clean_hz)
+            errors++;
+    }
+
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    return errors ? 1 : 0;
+}
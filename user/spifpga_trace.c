@@ -0,0 +1,470 @@
+/*
+ * Transaction traces, see spifpga_trace.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include "spifpga_user.h"
+#include "spifpga_trace.h"
+#include "spifpga_probes.h"
+
+#define TRACE_MAGIC 0x52545053      /* "SPTR" */
+#define TRACE_VERSION 1
+#define FLUSH_NS 20000000           /* between drains, unless woken sooner */
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_bytes;
+    uint32_t reserved;
+    uint64_t start_ns;
+};
+
+/* One thread's records; head only written by it, tail by the flusher */
+struct trace_buf {
+    struct trace_record records[TRACE_BUF_RECORDS];
+    atomic_uint head;
+    atomic_uint tail;
+    unsigned int thread;
+    struct trace_buf *next;
+};
+
+static struct {
+    atomic_bool on;
+    atomic_uint gen;                /* bumped by each trace_start() */
+    FILE *out;
+    pthread_t flusher;
+    sem_t wake;                     /* posted by a thread half way full */
+    atomic_bool stop;
+    pthread_mutex_t lock;           /* bufs and threads */
+    struct trace_buf *bufs;
+    unsigned int threads;
+    unsigned long long records;     /* written; the flusher's */
+    atomic_ullong dropped;
+    atomic_uint writers;            /* threads inside trace_end() */
+    int error;
+} tracer = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct trace_buf *my_buf;
+static __thread unsigned int my_gen;
+static __thread unsigned int depth;     /* traced calls this thread is inside */
+
+static const char *op_names[TRACE_N_OPS] = {
+    "read_word", "write_word", "write_word_masked", "read_words",
+    "write_words", "word_ops", "bulk_read", "bulk_write",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+const char *trace_op_name(unsigned int op)
+{
+    return op < TRACE_N_OPS ? op_names[op] : "?";
+}
+
+bool trace_enabled(void)
+{
+    return atomic_load_explicit(&tracer.on, memory_order_relaxed);
+}
+
+/* Write what the buffers hold; the flusher's, or trace_stop()'s after it */
+static void drain(void)
+{
+    struct trace_buf *b;
+    unsigned int head, tail, n;
+
+    pthread_mutex_lock(&tracer.lock);
+    for (b = tracer.bufs; b; b = b->next)
+    {
+        head = atomic_load_explicit(&b->head, memory_order_acquire);
+        tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+        while (tail != head)
+        {
+            /* up to the end of the buffer, then from its start */
+            n = head - tail;
+            if (tail % TRACE_BUF_RECORDS + n > TRACE_BUF_RECORDS)
+                n = TRACE_BUF_RECORDS - tail % TRACE_BUF_RECORDS;
+            if (!tracer.error &&
+                    fwrite(&b->records[tail % TRACE_BUF_RECORDS], sizeof(struct trace_record),
+                        n, tracer.out) != n)
+            {
+                printf("trace write failed: %s\n", strerror(errno));
+                tracer.error = -1;
+            }
+            if (!tracer.error)
+                tracer.records += n;
+            tail += n;
+        }
+        atomic_store_explicit(&b->tail, tail, memory_order_release);
+    }
+    pthread_mutex_unlock(&tracer.lock);
+}
+
+static void *trace_flusher(void *arg)
+{
+    struct timespec ts;
+
+    while (!atomic_load(&tracer.stop))
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += FLUSH_NS;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        sem_timedwait(&tracer.wake, &ts);
+        drain();
+    }
+    return NULL;
+}
+
+/*
+ * Record every library call to the file at path, until trace_stop().
+ * Returns 0, or -1 after saying why.
+ */
+int trace_start(const char *path)
+{
+    struct trace_header hdr = { TRACE_MAGIC, TRACE_VERSION, sizeof(struct trace_record), 0, 0 };
+
+    if (trace_enabled())
+    {
+        printf("already tracing\n");
+        return -1;
+    }
+    tracer.out = fopen(path, "wb");
+    if (!tracer.out)
+    {
+        printf("can't create trace %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    hdr.start_ns = now_ns();
+    if (fwrite(&hdr, sizeof(hdr), 1, tracer.out) != 1)
+    {
+        printf("can't write trace %s\n", path);
+        fclose(tracer.out);
+        return -1;
+    }
+    tracer.bufs = NULL;
+    tracer.threads = 0;
+    tracer.records = 0;
+    tracer.error = 0;
+    atomic_store(&tracer.dropped, 0);
+    atomic_store(&tracer.stop, false);
+    sem_init(&tracer.wake, 0, 0);
+    if (pthread_create(&tracer.flusher, NULL, trace_flusher, NULL) != 0)
+    {
+        printf("can't start the trace flusher\n");
+        sem_destroy(&tracer.wake);
+        fclose(tracer.out);
+        return -1;
+    }
+    atomic_fetch_add(&tracer.gen, 1);
+    atomic_store(&tracer.on, true);
+    return 0;
+}
+
+/*
+ * Stop tracing, write out the rest, and close the file. stats, if not
+ * NULL, says how much was written and dropped. Returns 0, or -1 if the
+ * file couldn't be written.
+ */
+int trace_stop(struct trace_stats *stats)
+{
+    struct trace_buf *b;
+    int ret;
+
+    if (!trace_enabled())
+        return -1;
+    atomic_store(&tracer.on, false);
+    /* a call that saw tracing on may still be writing its record */
+    while (atomic_load(&tracer.writers))
+        sched_yield();
+    atomic_store(&tracer.stop, true);
+    sem_post(&tracer.wake);
+    pthread_join(tracer.flusher, NULL);
+    sem_destroy(&tracer.wake);
+    drain();
+    ret = tracer.error;
+    if (fclose(tracer.out) != 0 && ret == 0)
+    {
+        printf("trace close failed: %s\n", strerror(errno));
+        ret = -1;
+    }
+    if (stats)
+    {
+        stats->records = tracer.records;
+        stats->dropped = atomic_load(&tracer.dropped);
+        stats->threads = tracer.threads;
+    }
+    while ((b = tracer.bufs))
+    {
+        tracer.bufs = b->next;
+        free(b);
+    }
+    return ret;
+}
+
+/* This thread's buffer, made and listed on its first call of a trace */
+static struct trace_buf *thread_buf(void)
+{
+    unsigned int gen = atomic_load_explicit(&tracer.gen, memory_order_relaxed);
+    struct trace_buf *b;
+
+    if (my_buf && my_gen == gen)
+        return my_buf;
+    b = calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+    pthread_mutex_lock(&tracer.lock);
+    b->thread = tracer.threads++;
+    b->next = tracer.bufs;
+    tracer.bufs = b;
+    pthread_mutex_unlock(&tracer.lock);
+    my_buf = b;
+    my_gen = gen;
+    return b;
+}
+
+/* The start time of a call, or 0 if it isn't traced */
+uint64_t trace_begin(int fd, unsigned int op, unsigned int addr, unsigned int n_bytes)
+{
+    SPIFPGA_PROBE4(op__begin, fd, op, addr, n_bytes);
+    if (!trace_enabled())
+        return 0;
+    depth++;
+    return now_ns();
+}
+
+/* Record the call that trace_begin() gave start, unless it is inside another; returns ret */
+int trace_end(uint64_t start, unsigned int op, unsigned int addr, unsigned int n_bytes,
+        unsigned int arg, int ret)
+{
+    struct trace_record *r;
+    struct trace_buf *b;
+    unsigned int head, used;
+    uint64_t end;
+
+    SPIFPGA_PROBE3(op__end, op, addr, ret);
+    if (!start || --depth)
+        return ret;
+    /* counted before looking, so trace_stop() can wait for us */
+    atomic_fetch_add(&tracer.writers, 1);
+    if (!atomic_load(&tracer.on))
+        goto out;
+    end = now_ns();
+    b = thread_buf();
+    if (!b)
+        goto out;
+    head = atomic_load_explicit(&b->head, memory_order_relaxed);
+    used = head - atomic_load_explicit(&b->tail, memory_order_acquire);
+    if (used == TRACE_BUF_RECORDS / 2)
+        sem_post(&tracer.wake);
+    if (used == TRACE_BUF_RECORDS)
+    {
+        atomic_fetch_add_explicit(&tracer.dropped, 1, memory_order_relaxed);
+        goto out;
+    }
+    r = &b->records[head % TRACE_BUF_RECORDS];
+    r->t_ns = start;
+    r->addr = addr;
+    r->n_bytes = n_bytes;
+    r->arg = arg;
+    r->latency_ns = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+    r->ret = ret < INT16_MIN ? INT16_MIN : ret;
+    r->op = op;
+    r->thread = b->thread;
+    r->flags = 0;
+    atomic_store_explicit(&b->head, head + 1, memory_order_release);
+out:
+    atomic_fetch_sub_explicit(&tracer.writers, 1, memory_order_release);
+    return ret;
+}
+
+static int record_cmp(const void *a, const void *b)
+{
+    const struct trace_record *x = a, *y = b;
+
+    return x->t_ns < y->t_ns ? -1 : x->t_ns > y->t_ns;
+}
+
+/*
+ * Read the trace at path into *records (malloc'd, sorted by time), n of
+ * them. Returns 0, or -1 after saying why.
+ */
+int trace_load(const char *path, struct trace_record **records, size_t *n)
+{
+    struct trace_header hdr;
+    struct trace_record *r = NULL;
+    size_t len = 0, cap = 0;
+    FILE *in;
+
+    in = fopen(path, "rb");
+    if (!in)
+    {
+        printf("can't open trace %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != TRACE_MAGIC ||
+            hdr.version != TRACE_VERSION || hdr.record_bytes != sizeof(*r))
+    {
+        printf("%s is not a trace\n", path);
+        fclose(in);
+        return -1;
+    }
+    for (;;)
+    {
+        if (len == cap)
+        {
+            cap = cap ? cap * 2 : 4096;
+            *records = realloc(r, cap * sizeof(*r));
+            if (!*records)
+            {
+                printf("Failed to allocate the trace\n");
+                free(r);
+                fclose(in);
+                return -1;
+            }
+            r = *records;
+        }
+        if (fread(&r[len], sizeof(*r), 1, in) != 1)
+            break;
+        len++;
+    }
+    fclose(in);
+    qsort(r, len, sizeof(*r), record_cmp);
+    *records = r;
+    *n = len;
+    return 0;
+}
+
+/* Whether replaying the record writes to the FPGA */
+static bool record_writes(const struct trace_record *r)
+{
+    switch (r->op)
+    {
+        case TRACE_WRITE_WORD:
+        case TRACE_WRITE_MASKED:
+        case TRACE_WRITE_WORDS:
+        case TRACE_BULK_WRITE:
+            return true;
+        case TRACE_WORD_OPS:
+            return r->arg != 0;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Issue the n records on fd in time order, as fast as possible or, with
+ * timed, each at its original offset from the first. Calls that write are
+ * skipped unless fd is a simulator or writes is set. replayed[i] gets
+ * record i with the replay's start time, latency and response, or
+ * TRACE_SKIPPED. Returns 0, or -1 if it couldn't allocate.
+ */
+int trace_replay(int fd, const struct trace_record *records, size_t n, bool timed,
+        bool writes, struct trace_record *replayed)
+{
+    unsigned int max_bytes = BYTES_PER_WORD, *buf, *addrs, i, words;
+    struct word_op *ops;
+    struct timespec ts;
+    uint64_t base = now_ns(), at, start;
+    size_t k;
+    int ret;
+
+    writes = writes || is_spi_sim(fd);
+
+    for (k = 0; k < n; k++)
+        if (records[k].n_bytes > max_bytes)
+            max_bytes = records[k].n_bytes;
+    max_bytes = (max_bytes + BYTES_PER_WORD - 1) & ~(BYTES_PER_WORD - 1);
+    buf = calloc(max_bytes / BYTES_PER_WORD, sizeof(*buf));
+    addrs = malloc(max_bytes / BYTES_PER_WORD * sizeof(*addrs));
+    ops = calloc(max_bytes / BYTES_PER_WORD, sizeof(*ops));
+    if (!buf || !addrs || !ops)
+    {
+        printf("Failed to allocate replay buffers\n");
+        free(buf);
+        free(addrs);
+        free(ops);
+        return -1;
+    }
+
+    for (k = 0; k < n; k++)
+    {
+        replayed[k] = records[k];
+        if (!writes && record_writes(&records[k]))
+        {
+            replayed[k].latency_ns = 0;
+            replayed[k].flags = TRACE_SKIPPED;
+            continue;
+        }
+        if (timed)
+        {
+            at = base + (records[k].t_ns - records[0].t_ns);
+            ts.tv_sec = at / 1000000000;
+            ts.tv_nsec = at % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+        words = (records[k].n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD;
+        for (i = 0; i < words; i++)
+        {
+            addrs[i] = records[k].addr + i * BYTES_PER_WORD;
+            ops[i].addr = addrs[i];
+            ops[i].val = 0;
+            ops[i].write = records[k].arg &
+                    (1u << (i < TRACE_OPS_LAST ? i : TRACE_OPS_LAST));
+        }
+        start = now_ns();
+        switch (records[k].op)
+        {
+            case TRACE_READ_WORD:
+                ret = read_word(fd, records[k].addr, buf);
+                break;
+            case TRACE_WRITE_WORD:
+                ret = write_word(fd, records[k].addr, 0);
+                break;
+            case TRACE_WRITE_MASKED:
+                ret = write_word_masked(fd, records[k].addr, 0, records[k].arg);
+                break;
+            case TRACE_READ_WORDS:
+                ret = read_words(fd, addrs, words, buf);
+                break;
+            case TRACE_WRITE_WORDS:
+                memset(buf, 0, words * sizeof(*buf));
+                ret = write_words(fd, addrs, buf, words);
+                break;
+            case TRACE_WORD_OPS:
+                ret = word_ops(fd, ops, words);
+                break;
+            case TRACE_BULK_READ:
+                ret = bulk_read(fd, records[k].addr, records[k].n_bytes, buf);
+                break;
+            case TRACE_BULK_WRITE:
+                memset(buf, 0, words * sizeof(*buf));
+                ret = bulk_write(fd, records[k].addr, records[k].n_bytes, buf);
+                break;
+            default:
+                ret = -1;
+        }
+        replayed[k].t_ns = start;
+        replayed[k].flags = 0;
+        at = now_ns() - start;
+        replayed[k].latency_ns = at > UINT32_MAX ? UINT32_MAX : at;
+        replayed[k].ret = ret < INT16_MIN ? INT16_MIN : ret;
+    }
+    free(buf);
+    free(addrs);
+    free(ops);
+    return 0;
+}
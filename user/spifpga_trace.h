@@ -0,0 +1,91 @@
+/*
+ * Transaction traces: a record of every library call (read_word(),
+ * write_word(), write_word_masked(), read_words(), write_words(),
+ * word_ops(), bulk_read() and bulk_write()) with its start time, address,
+ * length, response and latency, for replaying the same mix later.
+ *
+ * Tracing is off until trace_start(), or until config_spi_dev() finds
+ * $SPIFPGA_TRACE naming a file, and then costs a flag test per call. While
+ * on, each thread appends fixed size records to a buffer of its own
+ * without a lock, and a background thread drains the buffers to the file;
+ * a thread that gets TRACE_BUF_RECORDS ahead of it drops records, and
+ * counts them. Calls made inside another (the read of a masked write, say)
+ * are not recorded on their own. trace_stop() waits for the calls other
+ * threads are recording to finish.
+ *
+ * The file is a header and the records in the host's byte order, each
+ * thread's in order. trace_load() reads them back sorted by time, and
+ * trace_replay() issues them again on one fd, as fast as it can or at the
+ * original times. Write data and the addresses past the first of
+ * read_words(), write_words() and word_ops() aren't recorded: writes
+ * replay zeros, and scattered words replay at consecutive addresses. The
+ * ops of word_ops() replay as the reads and writes they were. As that
+ * would write zeros to registers on a real device, calls that write are
+ * only replayed on a simulator, or with writes set; otherwise they are
+ * skipped, and flagged TRACE_SKIPPED in replayed.
+ */
+
+#ifndef SPIFPGA_TRACE_H
+#define SPIFPGA_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TRACE_ENV "SPIFPGA_TRACE"
+#define TRACE_BUF_RECORDS 16384
+
+/*
+ * The arg of a word_ops() record has bit i set if op i wrote, for ops
+ * before TRACE_OPS_LAST, and bit TRACE_OPS_LAST if any op from there on
+ * did, which then all replay as writes.
+ */
+#define TRACE_OPS_LAST 31
+
+#define TRACE_SKIPPED (1 << 0)      /* flags: a write not replayed */
+
+enum trace_op {
+    TRACE_READ_WORD,
+    TRACE_WRITE_WORD,
+    TRACE_WRITE_MASKED,
+    TRACE_READ_WORDS,
+    TRACE_WRITE_WORDS,
+    TRACE_WORD_OPS,
+    TRACE_BULK_READ,
+    TRACE_BULK_WRITE,
+    TRACE_N_OPS
+};
+
+struct trace_record {
+    uint64_t t_ns;          /* call start, CLOCK_MONOTONIC */
+    uint32_t addr;
+    uint32_t n_bytes;
+    uint32_t arg;           /* the mask of a masked write, which word_ops() write */
+    uint32_t latency_ns;
+    int16_t ret;            /* response code, or negative error */
+    uint8_t op;
+    uint8_t thread;         /* in the order threads first made a call */
+    uint32_t flags;         /* TRACE_SKIPPED, in a replay */
+};
+
+struct trace_stats {
+    unsigned long long records;     /* written to the file */
+    unsigned long long dropped;
+    unsigned int threads;
+};
+
+int trace_start(const char *path);
+bool trace_enabled(void);
+int trace_stop(struct trace_stats *stats);
+const char *trace_op_name(unsigned int op);
+
+/* Around each traced call in spifpga_user.c, also firing the USDT probes */
+uint64_t trace_begin(int fd, unsigned int op, unsigned int addr, unsigned int n_bytes);
+int trace_end(uint64_t start, unsigned int op, unsigned int addr, unsigned int n_bytes,
+        unsigned int arg, int ret);
+
+int trace_load(const char *path, struct trace_record **records, size_t *n);
+int trace_replay(int fd, const struct trace_record *records, size_t n, bool timed,
+        bool writes, struct trace_record *replayed);
+
+#endif /* SPIFPGA_TRACE_H */
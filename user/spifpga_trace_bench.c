@@ -0,0 +1,232 @@
+/*
+ * Trace recording overhead and replay, against the simulator.
+ *
+ * spifpga_trace_bench [-n calls] [-j threads] [-B]
+ *
+ * Each thread runs a mix of read_word(), write_word(), write_word_masked()
+ * (with a mask that needs a read first), read_words(), word_ops(),
+ * bulk_read() and bulk_write() on a simulator of its own, untraced and
+ * then traced, and the time per call of the two is compared. The trace
+ * is loaded back and checked (a record per call, none for the calls made
+ * inside a masked write, each thread's in order), then replayed on one
+ * simulator, which must see the frames, and the write frames among them,
+ * that the threads' simulators saw unless records were dropped. -B uses
+ * the burst protocol.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_trace.h"
+
+#define MEM_BYTES (1 << 20)
+#define MIX 8           /* calls per round of the mix */
+#define MAX_THREADS 16
+
+struct worker {
+    pthread_t thread;
+    struct spifpga_sim *sim;
+    int fd;
+    unsigned int rounds;
+    double seconds;
+    int errors;
+};
+
+static bool burst;
+
+/* Counts the write frames a simulator answers */
+static void count_write(struct spifpga_sim *sim, bool write, uint32_t addr, uint32_t val,
+        void *ctx)
+{
+    *(uint64_t *) ctx += write;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int buf[64], addrs[8], val, r, i;
+    struct word_op ops[4];
+    double t0 = now_s();
+
+    for (r = 0; r < w->rounds; r++)
+    {
+        for (i = 0; i < 8; i++)
+            addrs[i] = (r * 64 + i * 12) % (MEM_BYTES / 2);
+        for (i = 0; i < 4; i++)
+        {
+            ops[i].addr = addrs[i];
+            ops[i].val = i;
+            ops[i].write = i % 2;
+        }
+        w->errors += write_word(w->fd, addrs[0], r) != RESP_OK;
+        w->errors += read_word(w->fd, addrs[0], &val) != RESP_OK || val != r;
+        w->errors += write_word_masked(w->fd, addrs[1], r, 0x0FF0) != RESP_OK;
+        w->errors += read_words(w->fd, addrs, 8, buf) != RESP_OK;
+        w->errors += write_words(w->fd, addrs, buf, 4) != RESP_OK;
+        w->errors += word_ops(w->fd, ops, 4) != RESP_OK;
+        w->errors += bulk_read(w->fd, MEM_BYTES / 2 + r % 64 * 256, sizeof(buf), buf) != RESP_OK;
+        w->errors += bulk_write(w->fd, MEM_BYTES / 2 + r % 64 * 256, sizeof(buf), buf) != RESP_OK;
+    }
+    w->seconds = now_s() - t0;
+    return NULL;
+}
+
+/* Run the mix on every worker at once; returns the mean ns per call */
+static double run(struct worker *workers, unsigned int n_workers, unsigned int rounds,
+        int *errors)
+{
+    double seconds = 0;
+    unsigned int i;
+
+    for (i = 0; i < n_workers; i++)
+    {
+        workers[i].rounds = rounds;
+        workers[i].errors = 0;
+        spifpga_sim_reset_counters(workers[i].sim);
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+    for (i = 0; i < n_workers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        seconds += workers[i].seconds;
+        *errors += workers[i].errors;
+    }
+    return seconds * 1e9 / n_workers / rounds / MIX;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int calls = 80000, n_workers = 2, rounds, i, count[TRACE_N_OPS];
+    char path[] = "/tmp/spifpga_trace_XXXXXX";
+    struct worker workers[MAX_THREADS];
+    struct trace_record *records, *replayed;
+    uint64_t last[MAX_THREADS], frames = 0, transfers = 0, written[MAX_THREADS + 1];
+    struct spifpga_sim *sim;
+    struct trace_stats st;
+    double off, on;
+    size_t n, k;
+    int c, fd, errors = 0;
+
+    while ((c = getopt(argc, argv, "n:j:B")) != -1)
+        switch (c) {
+            case 'n':
+                calls = strtoul(optarg, NULL, 0);
+                break;
+            case 'j':
+                n_workers = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                burst = true;
+                break;
+            default:
+                printf("Usage: spifpga_trace_bench [-n calls] [-j threads] [-B]\n");
+                return 1;
+        }
+    rounds = calls / MIX / (n_workers ? n_workers : 1);
+    if (rounds == 0 || n_workers == 0 || n_workers > MAX_THREADS)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+
+    for (i = 0; i < n_workers; i++)
+    {
+        workers[i].sim = spifpga_sim_new(MEM_BYTES);
+        if (!workers[i].sim)
+            return 1;
+        workers[i].sim->hook = count_write;
+        workers[i].sim->hook_ctx = &written[i];
+        workers[i].fd = config_spi_sim(workers[i].sim);
+        if (!burst)
+            set_protocol(workers[i].fd, PROTO_FRAMES);
+    }
+
+    off = run(workers, n_workers, rounds, &errors);
+    close(mkstemp(path));
+    if (trace_start(path) != 0)
+        return 1;
+    memset(written, 0, sizeof(written));
+    on = run(workers, n_workers, rounds, &errors);
+    errors += trace_stop(&st) != 0;
+    for (i = 0; i < n_workers; i++)
+    {
+        frames += workers[i].sim->frames;
+        transfers += workers[i].sim->transfers;
+        written[MAX_THREADS] += written[i];
+    }
+
+    /*
+     * a record per call, each thread's in order; a flusher starved of CPU
+     * by the workers may leave some dropped, and then the replay can't
+     * match
+     */
+    errors += trace_load(path, &records, &n) != 0;
+    unlink(path);
+    errors += n + st.dropped != (size_t) rounds * MIX * n_workers || st.records != n ||
+            st.threads != n_workers;
+    memset(count, 0, sizeof(count));
+    memset(last, 0, sizeof(last));
+    for (k = 0; k < n; k++)
+    {
+        errors += records[k].op >= TRACE_N_OPS || records[k].thread >= n_workers ||
+                records[k].ret != RESP_OK || records[k].t_ns < last[records[k].thread % MAX_THREADS];
+        last[records[k].thread % MAX_THREADS] = records[k].t_ns;
+        count[records[k].op % TRACE_N_OPS]++;
+    }
+    for (i = 0; i < TRACE_N_OPS && !st.dropped; i++)
+        errors += count[i] != rounds * n_workers;
+
+    /* the same frames again, from one thread */
+    sim = spifpga_sim_new(MEM_BYTES);
+    replayed = malloc(n * sizeof(*replayed));
+    if (!sim || !replayed)
+        return 1;
+    fd = config_spi_sim(sim);
+    if (!burst)
+        set_protocol(fd, PROTO_FRAMES);
+    spifpga_sim_reset_counters(sim);
+    written[0] = 0;
+    sim->hook = count_write;
+    sim->hook_ctx = &written[0];
+    errors += trace_replay(fd, records, n, false, false, replayed) != 0;
+    for (k = 0; k < n; k++)
+        errors += replayed[k].ret != RESP_OK || replayed[k].op != records[k].op ||
+                replayed[k].flags;
+    errors += !st.dropped && (sim->frames != frames || sim->transfers != transfers ||
+            written[0] != written[MAX_THREADS]);
+
+    printf("%zu calls on %u threads, %s protocol\n", n, n_workers, burst ? "burst" : "frame");
+    printf("untraced %8.1f ns per call\n", off);
+    printf("traced   %8.1f ns per call, %llu records, %llu dropped\n", on, st.records, st.dropped);
+    printf("replayed %llu frames in %llu transfers, %llu writes (recorded %llu in %llu, %llu writes)\n",
+            (unsigned long long) sim->frames, (unsigned long long) sim->transfers,
+            (unsigned long long) written[0], (unsigned long long) frames,
+            (unsigned long long) transfers, (unsigned long long) written[MAX_THREADS]);
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    for (i = 0; i < n_workers; i++)
+    {
+        close_spi(workers[i].fd);
+        spifpga_sim_free(workers[i].sim);
+    }
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    free(records);
+    free(replayed);
+    return errors ? 1 : 0;
+}
@@ -7,6 +7,7 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,17 +15,206 @@
 #include <getopt.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <errno.h>
+#include <time.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
+#include "spifpga.h"
 #include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_trace.h"
+#include "spifpga_probes.h"
 
 static uint32_t speed = MAX_SPEED;
 static uint8_t bits = BITS;
 static uint8_t mode;
 static uint16_t delay = DELAY;
 
-/* Write a single word to the FPGA */
-int write_word(int fd, unsigned int addr, unsigned int val)
+enum { SCRATCH_TX, SCRATCH_RX, SCRATCH_TR, N_SCRATCH };
+
+/*
+ * What the library knows about each open link, by fd. A link is either a
+ * spidev device or a simulator (see spifpga_sim.h).
+ */
+struct spi_link {
+    bool stream;                /* bursts go out as one transfer */
+    bool burst;                 /* bulk transfers use burst frames */
+    uint32_t speed;             /* 0 for the default speed */
+    unsigned int burst_size;    /* frames per message, 0 for the largest */
+    uint32_t max_msg;           /* largest message in bytes, see get_limits() */
+    unsigned int ops, bad;      /* frames in the current demotion window */
+    struct spifpga_sim *sim;
+
+    /* transfer buffers, kept for the next transfer, see link_scratch() */
+    void *scratch[N_SCRATCH];
+    size_t scratch_len[N_SCRATCH];
+};
+
+static struct spi_link links[MAX_LINKS];
+
+static struct spi_link *get_link(int fd)
+{
+    static struct spi_link none;
+    struct spi_link keep;
+
+    if (fd < 0 || fd >= MAX_LINKS)
+    {
+        /* default settings, but keep the buffers */
+        keep = none;
+        memset(&none, 0, sizeof(none));
+        memcpy(none.scratch, keep.scratch, sizeof(none.scratch));
+        memcpy(none.scratch_len, keep.scratch_len, sizeof(none.scratch_len));
+        return &none;
+    }
+    return &links[fd];
+}
+
+/* Forget everything about a link, when it is opened or closed */
+static void link_reset(int fd)
+{
+    struct spi_link *link = get_link(fd);
+    unsigned int i;
+
+    for (i = 0; i < N_SCRATCH; i++)
+        free(link->scratch[i]);
+    memset(link, 0, sizeof(*link));
+}
+
+/*
+ * A zeroed buffer of len bytes for a transfer on this link. It stays
+ * allocated for the next transfer, so repeated reads and writes of the
+ * same size (register polling, snapshot captures) don't allocate at all.
+ */
+static void *link_scratch(int fd, unsigned int which, size_t len)
+{
+    struct spi_link *link = get_link(fd);
+    void *p;
+
+    if (len > link->scratch_len[which])
+    {
+        p = realloc(link->scratch[which], len);
+        if (!p)
+            return NULL;
+        link->scratch[which] = p;
+        link->scratch_len[which] = len;
+    }
+    memset(link->scratch[which], 0, len);
+    return link->scratch[which];
+}
+
+static uint32_t link_speed(int fd)
+{
+    return get_link(fd)->speed ? get_link(fd)->speed : speed;
+}
+
+static unsigned int link_max_frames(int fd)
+{
+    uint32_t max_msg = get_link(fd)->max_msg ? get_link(fd)->max_msg : DEFAULT_BUFSIZ;
+
+    return max_msg / sizeof(struct fpga_spi_cmd);
+}
+
+static unsigned int link_burst_size(int fd)
+{
+    unsigned int n = get_link(fd)->burst_size;
+
+    return n && n < link_max_frames(fd) ? n : link_max_frames(fd);
+}
+
+/* Clock rates calibrate_spi() tries, and demotion steps down through */
+static const uint32_t speed_steps[] = {
+    500000, 1000000, 2000000, 4000000, 8000000,
+    12000000, 16000000, 24000000, 32000000,
+};
+#define N_SPEED_STEPS (sizeof(speed_steps) / sizeof(speed_steps[0]))
+
+static int set_link_speed(int fd, uint32_t hz)
+{
+    get_link(fd)->speed = hz;
+    if (get_link(fd)->sim)
+        return 0;
+    return ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &hz);
+}
+
+/*
+ * Runtime demotion. Frames are counted in windows of DEMOTE_WINDOW, and if
+ * more than DEMOTE_MAX_BAD of them in a window came back without RESP_OK
+ * (or their message failed), the link drops to the next lower clock, or
+ * halves its burst size once it is at the lowest one. It never promotes
+ * itself again; run calibrate_spi() for that.
+ */
+#define DEMOTE_WINDOW 256
+#define DEMOTE_MAX_BAD 2
+#define MIN_BURST_SIZE 16
+
+static void link_account(int fd, unsigned int ops, unsigned int bad)
+{
+    struct spi_link *link = get_link(fd);
+    uint32_t cur = link_speed(fd), lower = 0;
+    unsigned int i;
+
+    link->ops += ops;
+    link->bad += bad;
+    if (link->ops < DEMOTE_WINDOW && link->bad <= DEMOTE_MAX_BAD)
+        return;
+
+    if (link->bad > DEMOTE_MAX_BAD)
+    {
+        for (i = 0; i < N_SPEED_STEPS && speed_steps[i] < cur; i++)
+            lower = speed_steps[i];
+        if (lower)
+        {
+            printf("%u bad frames out of %u, demoting link to %u Hz\n",
+                    link->bad, link->ops, lower);
+            set_link_speed(fd, lower);
+        } else if (link_burst_size(fd) > MIN_BURST_SIZE) {
+            link->burst_size = link_burst_size(fd) / 2;
+            printf("%u bad frames out of %u, demoting link to %u frames per message\n",
+                    link->bad, link->ops, link->burst_size);
+        }
+    }
+    link->ops = 0;
+    link->bad = 0;
+}
+
+/* Send one message of n transfers, to the device or the simulator */
+static int spi_message(int fd, struct spi_ioc_transfer *tr, unsigned int n)
+{
+    struct spi_link *link = get_link(fd);
+    int ret;
+
+    SPIFPGA_PROBE2(burst__submit, fd, n);
+    if (link->sim)
+        ret = spifpga_sim_message(link->sim, tr, n);
+    else
+        ret = ioctl(fd, SPI_IOC_MESSAGE(n), tr);
+    SPIFPGA_PROBE2(burst__complete, fd, ret);
+    return ret;
+}
+
+/*
+ * In stream mode the frames of a burst, which are back to back in fcmd and
+ * fresp, go out as a single transfer under one chipselect and the FPGA
+ * splits them by byte count. Returns the number of transfers to send.
+ */
+static unsigned int stream_burst(int fd, struct spi_ioc_transfer *tr,
+        struct fpga_spi_cmd *fcmd, struct fpga_spi_cmd *fresp, unsigned int m)
+{
+    if (!get_link(fd)->stream || m < 2)
+        return m;
+
+    memset(tr, 0, sizeof(*tr));
+    tr->len = m * sizeof(struct fpga_spi_cmd);
+    tr->tx_buf = (unsigned long) fcmd;
+    tr->rx_buf = (unsigned long) fresp;
+    tr->delay_usecs = delay;
+    tr->speed_hz = link_speed(fd);
+    tr->bits_per_word = bits;
+    return 1;
+}
+
+/* Send one write frame, cmd giving the byte enables */
+static int frame_write(int fd, unsigned char cmd, unsigned int addr, unsigned int val)
 {
     //printf("trying to write %u to address %u of %d\n", val, addr, fd);
 
@@ -32,17 +222,11 @@ int write_word(int fd, unsigned int addr, unsigned int val)
     struct fpga_spi_cmd *fresp;
     int spidev_ret, fpga_ret=0;
 
-    fcmd = malloc(sizeof(struct fpga_spi_cmd));
-    if (!fcmd)
-    {
-        printf("Failed to allocate fcmd\n");
-        return -1;
-    }
-
-    fresp = malloc(sizeof(struct fpga_spi_cmd));
-    if (!fresp)
+    fcmd = link_scratch(fd, SCRATCH_TX, sizeof(struct fpga_spi_cmd));
+    fresp = link_scratch(fd, SCRATCH_RX, sizeof(struct fpga_spi_cmd));
+    if (!fcmd || !fresp)
     {
-        printf("Failed to allocate fresp\n");
+        printf("Failed to allocate transfer buffers\n");
         return -1;
     }
 
@@ -51,34 +235,108 @@ int write_word(int fd, unsigned int addr, unsigned int val)
 		.rx_buf = (unsigned long) fresp,
 		.len = sizeof(struct fpga_spi_cmd),
 		.delay_usecs = delay,
-		.speed_hz = speed,
+		.speed_hz = link_speed(fd),
 		.bits_per_word = bits,
 	};
 
     
-    fcmd->cmd = 0x8F; //write command, all byte enables=1
+    fcmd->cmd = cmd; //write command, byte enables in the low nibble
     fcmd->addr = addr;
     fcmd->din = val;
     fcmd->dout = 0; //Dummy bytes while slave sends back data
     fcmd->resp = 0; //Dummy bytes while slave sends back data
 
     //printf("Sending SPI message\n");
-	spidev_ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
+	spidev_ret = spi_message(fd, &tr, 1);
 	if (spidev_ret < 1)
     {
 		printf("can't send spi message\n");
+        link_account(fd, 1, 1);
         return spidev_ret;
     }
 
     //printf("FPGA return value: %u\n", fresp->resp);
     fpga_ret = fresp->resp;
-    free(fcmd);
-    free(fresp);
+    link_account(fd, 1, fpga_ret != RESP_OK);
     return fpga_ret;
 }
 
-/* Read multiple words from the FPGA */
-int bulk_read(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned int *buf)
+/* Write a single word to the FPGA */
+int write_word(int fd, unsigned int addr, unsigned int val)
+{
+    uint64_t t = trace_begin(fd, TRACE_WRITE_WORD, addr, BYTES_PER_WORD);
+
+    return trace_end(t, TRACE_WRITE_WORD, addr, BYTES_PER_WORD, 0,
+            frame_write(fd, 0x8F, addr, val));
+}
+
+/*
+ * Move n_words with burst frames, as many per message as fit in the bytes
+ * of link_burst_size() frames. Returns the
+ * OR of the status bytes, like bulk_read() and bulk_write().
+ */
+static int burst_xfer(int fd, bool write, unsigned int start_addr,
+        unsigned int n_words, unsigned int *buf)
+{
+    struct fpga_spi_burst *hdr;
+    unsigned char *tx, *rx;
+    unsigned int done = 0, m, len, max_words;
+    int spidev_ret, fpga_ret = 0;
+
+    max_words = (link_burst_size(fd) * sizeof(struct fpga_spi_cmd) - BURST_OVERHEAD) / BYTES_PER_WORD;
+    tx = link_scratch(fd, SCRATCH_TX, max_words * BYTES_PER_WORD + BURST_OVERHEAD);
+    rx = link_scratch(fd, SCRATCH_RX, max_words * BYTES_PER_WORD + BURST_OVERHEAD);
+    if (!tx || !rx)
+    {
+        printf("Failed to allocate burst buffers\n");
+        return -1;
+    }
+    hdr = (struct fpga_spi_burst *) tx;
+
+    while (done < n_words)
+    {
+        m = n_words - done;
+        if (m > max_words)
+            m = max_words;
+        len = m * BYTES_PER_WORD + BURST_OVERHEAD;
+
+        hdr->cmd = write ? BURST_WRITE_CMD : BURST_READ_CMD;
+        hdr->addr = start_addr + done * BYTES_PER_WORD;
+        hdr->count = m;
+        if (write)
+            memcpy(tx + sizeof(*hdr), buf + done, m * BYTES_PER_WORD);
+        else
+            memset(tx + sizeof(*hdr), 0, m * BYTES_PER_WORD);
+        tx[len - 1] = 0;
+
+        struct spi_ioc_transfer tr = {
+            .tx_buf = (unsigned long) tx,
+            .rx_buf = (unsigned long) rx,
+            .len = len,
+            .delay_usecs = delay,
+            .speed_hz = link_speed(fd),
+            .bits_per_word = bits,
+        };
+
+        spidev_ret = spi_message(fd, &tr, 1);
+        if (spidev_ret < 1)
+        {
+            printf("can't send spi message! (error %d)\n", spidev_ret);
+            link_account(fd, m, m);
+            fpga_ret = spidev_ret;
+            break;
+        }
+        if (!write)
+            memcpy(buf + done, rx + sizeof(*hdr), m * BYTES_PER_WORD);
+        fpga_ret |= rx[len - 1];
+        link_account(fd, m, rx[len - 1] != RESP_OK ? m : 0);
+        done += m;
+    }
+
+    return fpga_ret;
+}
+
+static int bulk_read_msgs(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned int *buf)
 {
 
     struct fpga_spi_cmd *fcmd, *fcmd_loop, *fresp, *fresp_loop;
@@ -87,36 +345,29 @@ int bulk_read(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned in
     unsigned int *buf_loop;
 
     int n_transfers = (n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD;
-    int n_bursts = (n_transfers + MAX_BURST_SIZE - 1) / MAX_BURST_SIZE;
+    int burst_size = link_burst_size(fd);
+    int n_bursts = (n_transfers + burst_size - 1) / burst_size;
 
     int n_trans_per_buf;
-    int l, n, m, tx_word_cnt=0, rx_word_cnt=0;
+    int l, n, m, bad, tx_word_cnt=0, rx_word_cnt=0;
+
+    if (get_link(fd)->burst)
+        return burst_xfer(fd, false, start_addr, n_transfers, buf);
 
     if (n_bursts > 1)
     {
-        n_trans_per_buf = MAX_BURST_SIZE;
+        n_trans_per_buf = burst_size;
     } else {
         n_trans_per_buf = n_transfers;
     }
 
 
-    fcmd = calloc(n_trans_per_buf, sizeof(struct fpga_spi_cmd));
-    if (!fcmd)
+    fcmd = link_scratch(fd, SCRATCH_TX, n_trans_per_buf * sizeof(struct fpga_spi_cmd));
+    fresp = link_scratch(fd, SCRATCH_RX, n_trans_per_buf * sizeof(struct fpga_spi_cmd));
+    tr = link_scratch(fd, SCRATCH_TR, n_trans_per_buf * sizeof(struct spi_ioc_transfer));
+    if (!fcmd || !fresp || !tr)
     {
-        printf("Failed to allocate fcmd\n");
-        return -1;
-    }
-
-    fresp = calloc(n_trans_per_buf, sizeof(struct fpga_spi_cmd));
-    if (!fresp)
-    {
-        printf("Failed to allocate fresp\n");
-        return -1;
-    }
-    tr = calloc(n_trans_per_buf, sizeof(struct spi_ioc_transfer));
-    if (!tr)
-    {
-        printf("Failed to allocate tr\n");
+        printf("Failed to allocate transfer buffers\n");
         return -1;
     }
 
@@ -138,7 +389,7 @@ int bulk_read(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned in
             tr_loop->tx_buf = (unsigned long) fcmd_loop;
             tr_loop->rx_buf = (unsigned long) fresp_loop;
             tr_loop->delay_usecs = delay;
-            tr_loop->speed_hz = speed;
+            tr_loop->speed_hz = link_speed(fd);
             tr_loop->bits_per_word = bits;
             tr_loop->cs_change = 1;
 
@@ -147,12 +398,14 @@ int bulk_read(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned in
         }
         
         //printf("Sending SPI message burst %d n_messages: %d\n", n, m);
-	    spidev_ret = ioctl(fd, SPI_IOC_MESSAGE(m), tr);
+	    spidev_ret = spi_message(fd, tr, stream_burst(fd, tr, fcmd, fresp, m));
     	if (spidev_ret < 1)
         {
 		    printf("can't send spi message! (error %d)\n", spidev_ret);
+            link_account(fd, m, m);
             return spidev_ret;
         }
+        bad = 0;
         
         for (m=0, fresp_loop=fresp, buf_loop=buf; m<n_trans_per_buf; m++, fresp_loop++, buf_loop++)
         {
@@ -160,20 +413,28 @@ int bulk_read(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned in
             //printf("readback value fresp_loop->dout: %u\n", fresp_loop->dout);
             *(buf + rx_word_cnt) = fresp_loop->dout;
             fpga_ret = fpga_ret | fresp_loop->resp;
+            bad += fresp_loop->resp != RESP_OK;
             if (++rx_word_cnt == n_transfers)
             {
+                m++;
                 break;
             }
         }
+        link_account(fd, m, bad);
     }
-    free(fcmd);
-    free(fresp);
-    free(tr);
     return fpga_ret;
 }
 
-/* Write multiple words from the FPGA */
-int bulk_write(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned int *buf)
+/* Read multiple words from the FPGA */
+int bulk_read(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned int *buf)
+{
+    uint64_t t = trace_begin(fd, TRACE_BULK_READ, start_addr, n_bytes);
+
+    return trace_end(t, TRACE_BULK_READ, start_addr, n_bytes, 0,
+            bulk_read_msgs(fd, start_addr, n_bytes, buf));
+}
+
+static int bulk_write_msgs(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned int *buf)
 {
 
     struct fpga_spi_cmd *fcmd, *fcmd_loop, *fresp, *fresp_loop;
@@ -182,36 +443,29 @@ int bulk_write(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned i
     unsigned int *buf_loop;
 
     int n_transfers = (n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD;
-    int n_bursts = (n_transfers + MAX_BURST_SIZE - 1) / MAX_BURST_SIZE;
+    int burst_size = link_burst_size(fd);
+    int n_bursts = (n_transfers + burst_size - 1) / burst_size;
 
     int n_trans_per_buf;
-    int l, n, m, tx_word_cnt=0, rx_word_cnt=0;
+    int l, n, m, bad, tx_word_cnt=0, rx_word_cnt=0;
+
+    if (get_link(fd)->burst)
+        return burst_xfer(fd, true, start_addr, n_transfers, buf);
 
     if (n_bursts > 1)
     {
-        n_trans_per_buf = MAX_BURST_SIZE;
+        n_trans_per_buf = burst_size;
     } else {
         n_trans_per_buf = n_transfers;
     }
 
 
-    fcmd = calloc(n_trans_per_buf, sizeof(struct fpga_spi_cmd));
-    if (!fcmd)
-    {
-        printf("Failed to allocate fcmd\n");
-        return -1;
-    }
-
-    fresp = calloc(n_trans_per_buf, sizeof(struct fpga_spi_cmd));
-    if (!fresp)
+    fcmd = link_scratch(fd, SCRATCH_TX, n_trans_per_buf * sizeof(struct fpga_spi_cmd));
+    fresp = link_scratch(fd, SCRATCH_RX, n_trans_per_buf * sizeof(struct fpga_spi_cmd));
+    tr = link_scratch(fd, SCRATCH_TR, n_trans_per_buf * sizeof(struct spi_ioc_transfer));
+    if (!fcmd || !fresp || !tr)
     {
-        printf("Failed to allocate fresp\n");
-        return -1;
-    }
-    tr = calloc(n_trans_per_buf, sizeof(struct spi_ioc_transfer));
-    if (!tr)
-    {
-        printf("Failed to allocate tr\n");
+        printf("Failed to allocate transfer buffers\n");
         return -1;
     }
 
@@ -234,7 +488,7 @@ int bulk_write(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned i
             tr_loop->tx_buf = (unsigned long) fcmd_loop;
             tr_loop->rx_buf = (unsigned long) fresp_loop;
             tr_loop->delay_usecs = delay;
-            tr_loop->speed_hz = speed;
+            tr_loop->speed_hz = link_speed(fd);
             tr_loop->bits_per_word = bits;
             tr_loop->cs_change = 1;
 
@@ -243,47 +497,51 @@ int bulk_write(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned i
         }
         
         //printf("Sending SPI message burst %d n_messages: %d\n", n, m);
-	    spidev_ret = ioctl(fd, SPI_IOC_MESSAGE(m), tr);
+	    spidev_ret = spi_message(fd, tr, stream_burst(fd, tr, fcmd, fresp, m));
     	if (spidev_ret < 1)
         {
 		    printf("can't send spi message! (error %d)\n", spidev_ret);
+            link_account(fd, m, m);
             return spidev_ret;
         }
+        bad = 0;
         
         for (m=0, fresp_loop=fresp; m<n_trans_per_buf; m++, fresp_loop++)
         {
             fpga_ret = fpga_ret | fresp_loop->resp;
+            bad += fresp_loop->resp != RESP_OK;
             if (++rx_word_cnt == n_transfers)
             {
+                m++;
                 break;
             }
         }
+        link_account(fd, m, bad);
     }
-    free(fcmd);
-    free(fresp);
-    free(tr);
     return fpga_ret;
 }
 
-/* Read a single word to the FPGA */
-int read_word(int fd, unsigned int addr, unsigned int *val)
+/* Write multiple words from the FPGA */
+int bulk_write(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned int *buf)
+{
+    uint64_t t = trace_begin(fd, TRACE_BULK_WRITE, start_addr, n_bytes);
+
+    return trace_end(t, TRACE_BULK_WRITE, start_addr, n_bytes, 0,
+            bulk_write_msgs(fd, start_addr, n_bytes, buf));
+}
+
+static int frame_read(int fd, unsigned int addr, unsigned int *val)
 {
 
     struct fpga_spi_cmd *fcmd;
     struct fpga_spi_cmd *fresp;
     int spidev_ret, fpga_ret=0;
 
-    fcmd = malloc(sizeof(struct fpga_spi_cmd));
-    if (!fcmd)
+    fcmd = link_scratch(fd, SCRATCH_TX, sizeof(struct fpga_spi_cmd));
+    fresp = link_scratch(fd, SCRATCH_RX, sizeof(struct fpga_spi_cmd));
+    if (!fcmd || !fresp)
     {
-        printf("Failed to allocate fcmd\n");
-        return -1;
-    }
-
-    fresp = malloc(sizeof(struct fpga_spi_cmd));
-    if (!fresp)
-    {
-        printf("Failed to allocate fresp\n");
+        printf("Failed to allocate transfer buffers\n");
         return -1;
     }
 
@@ -292,7 +550,7 @@ int read_word(int fd, unsigned int addr, unsigned int *val)
 		.rx_buf = (unsigned long) fresp,
 		.len = sizeof(struct fpga_spi_cmd),
 		.delay_usecs = delay,
-		.speed_hz = speed,
+		.speed_hz = link_speed(fd),
 		.bits_per_word = bits,
 	};
 
@@ -305,31 +563,720 @@ int read_word(int fd, unsigned int addr, unsigned int *val)
 
 
     //printf("Sending SPI message\n");
-	spidev_ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
+	spidev_ret = spi_message(fd, &tr, 1);
 	if (spidev_ret < 1)
     {
 		printf("can't send spi message");
+        link_account(fd, 1, 1);
         return spidev_ret;
     }
 
     memcpy(val, &fresp->dout, sizeof(unsigned int));
     fpga_ret = fresp->resp;
-    free(fcmd);
-    free(fresp);
+    link_account(fd, 1, fpga_ret != RESP_OK);
+    return fpga_ret;
+}
+
+/* Read a single word to the FPGA */
+int read_word(int fd, unsigned int addr, unsigned int *val)
+{
+    uint64_t t = trace_begin(fd, TRACE_READ_WORD, addr, BYTES_PER_WORD);
+
+    return trace_end(t, TRACE_READ_WORD, addr, BYTES_PER_WORD, 0, frame_read(fd, addr, val));
+}
+
+/*
+ * Read or write n words at scattered addresses, a frame each, packing as
+ * many frames per message as link_burst_size() allows. Frame i is ops[i],
+ * or with ops NULL, a read or write (as write says) of addrs[i] and
+ * vals[i]. Returns the OR of the response codes, like bulk_read().
+ */
+static int word_batch(int fd, struct word_op *ops, bool write,
+        const unsigned int *addrs, unsigned int *vals, unsigned int n)
+{
+    struct fpga_spi_cmd *fcmd, *fresp;
+    struct spi_ioc_transfer *tr;
+    unsigned int burst_size = link_burst_size(fd);
+    unsigned int i, m, done, bad;
+    int spidev_ret, fpga_ret = 0;
+    bool w;
+
+    m = n < burst_size ? n : burst_size;
+    fcmd = link_scratch(fd, SCRATCH_TX, m * sizeof(struct fpga_spi_cmd));
+    fresp = link_scratch(fd, SCRATCH_RX, m * sizeof(struct fpga_spi_cmd));
+    tr = link_scratch(fd, SCRATCH_TR, m * sizeof(struct spi_ioc_transfer));
+    if (!fcmd || !fresp || !tr)
+    {
+        printf("Failed to allocate transfer buffers\n");
+        return -1;
+    }
+
+    for (done = 0; done < n; done += m)
+    {
+        m = n - done < burst_size ? n - done : burst_size;
+        for (i = 0; i < m; i++)
+        {
+            w = ops ? ops[done + i].write : write;
+            fcmd[i].cmd = w ? 0x8F : 0x0F;
+            fcmd[i].addr = ops ? ops[done + i].addr : addrs[done + i];
+            fcmd[i].din = !w ? 0 : ops ? ops[done + i].val : vals[done + i];
+            memset(&tr[i], 0, sizeof(tr[i]));
+            tr[i].len = sizeof(struct fpga_spi_cmd);
+            tr[i].tx_buf = (unsigned long) &fcmd[i];
+            tr[i].rx_buf = (unsigned long) &fresp[i];
+            tr[i].delay_usecs = delay;
+            tr[i].speed_hz = link_speed(fd);
+            tr[i].bits_per_word = bits;
+            tr[i].cs_change = 1;
+        }
+
+        spidev_ret = spi_message(fd, tr, stream_burst(fd, tr, fcmd, fresp, m));
+        if (spidev_ret < 1)
+        {
+            printf("can't send spi message! (error %d)\n", spidev_ret);
+            link_account(fd, m, m);
+            return spidev_ret;
+        }
+        bad = 0;
+        for (i = 0; i < m; i++)
+        {
+            if (ops && !ops[done + i].write)
+                ops[done + i].val = fresp[i].dout;
+            else if (!ops && !write)
+                vals[done + i] = fresp[i].dout;
+            fpga_ret |= fresp[i].resp;
+            bad += fresp[i].resp != RESP_OK;
+        }
+        link_account(fd, m, bad);
+    }
+    return fpga_ret;
+}
+
+/* Read n words from scattered addresses, in as few messages as fit */
+int read_words(int fd, const unsigned int *addrs, unsigned int n, unsigned int *vals)
+{
+    uint64_t t = trace_begin(fd, TRACE_READ_WORDS, n ? addrs[0] : 0, n * BYTES_PER_WORD);
+
+    return trace_end(t, TRACE_READ_WORDS, n ? addrs[0] : 0, n * BYTES_PER_WORD, 0,
+            word_batch(fd, NULL, false, addrs, vals, n));
+}
+
+/* Write n words to scattered addresses, in as few messages as fit */
+int write_words(int fd, const unsigned int *addrs, const unsigned int *vals, unsigned int n)
+{
+    uint64_t t = trace_begin(fd, TRACE_WRITE_WORDS, n ? addrs[0] : 0, n * BYTES_PER_WORD);
+
+    return trace_end(t, TRACE_WRITE_WORDS, n ? addrs[0] : 0, n * BYTES_PER_WORD, 0,
+            word_batch(fd, NULL, true, addrs, (unsigned int *) vals, n));
+}
+
+/*
+ * A mix of reads and writes, sent in order in as few messages as fit, so
+ * that (say) arming a capture and the first status read share a message.
+ * Read values are stored in ops[i].val.
+ */
+int word_ops(int fd, struct word_op *ops, unsigned int n)
+{
+    uint64_t t = trace_begin(fd, TRACE_WORD_OPS, n ? ops[0].addr : 0, n * BYTES_PER_WORD);
+    unsigned int i, writes = 0;
+
+    /* which ops write, for the trace; see TRACE_OPS_LAST */
+    for (i = 0; t && i < n; i++)
+        if (ops[i].write)
+            writes |= 1u << (i < TRACE_OPS_LAST ? i : TRACE_OPS_LAST);
+    return trace_end(t, TRACE_WORD_OPS, n ? ops[0].addr : 0, n * BYTES_PER_WORD, writes,
+            word_batch(fd, ops, false, NULL, NULL, n));
+}
+
+/*
+ * A read of the same scattered words over and over, for sampling: the
+ * frames and transfers are built once by read_batch_new(), so each
+ * read_batch_run() is one SPI message, with nothing allocated and nothing
+ * printed (unless the link is demoted). The words must fit in a message.
+ */
+struct read_batch {
+    int fd;
+    unsigned int n;
+    unsigned int n_tr;
+    struct fpga_spi_cmd *fcmd, *fresp;
+    struct spi_ioc_transfer *tr;
+};
+
+struct read_batch *read_batch_new(int fd, const unsigned int *addrs, unsigned int n)
+{
+    struct read_batch *b;
+    unsigned int i;
+
+    if (n == 0 || n > link_burst_size(fd))
+    {
+        printf("a read batch of %u words doesn't fit in a message of %u frames\n",
+                n, link_burst_size(fd));
+        return NULL;
+    }
+    b = calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+    b->fd = fd;
+    b->n = n;
+    b->fcmd = calloc(n, sizeof(*b->fcmd));
+    b->fresp = calloc(n, sizeof(*b->fresp));
+    b->tr = calloc(n, sizeof(*b->tr));
+    if (!b->fcmd || !b->fresp || !b->tr)
+    {
+        printf("Failed to allocate transfer buffers\n");
+        read_batch_free(b);
+        return NULL;
+    }
+    for (i = 0; i < n; i++)
+    {
+        b->fcmd[i].cmd = 0x0F;
+        b->fcmd[i].addr = addrs[i];
+        b->tr[i].len = sizeof(struct fpga_spi_cmd);
+        b->tr[i].tx_buf = (unsigned long) &b->fcmd[i];
+        b->tr[i].rx_buf = (unsigned long) &b->fresp[i];
+        b->tr[i].delay_usecs = delay;
+        b->tr[i].speed_hz = link_speed(fd);
+        b->tr[i].bits_per_word = bits;
+        b->tr[i].cs_change = 1;
+    }
+    b->n_tr = stream_burst(fd, b->tr, b->fcmd, b->fresp, n);
+    return b;
+}
+
+void read_batch_free(struct read_batch *b)
+{
+    if (!b)
+        return;
+    free(b->fcmd);
+    free(b->fresp);
+    free(b->tr);
+    free(b);
+}
+
+/*
+ * Read the words into vals. sent and done, if not NULL, get the
+ * CLOCK_MONOTONIC time just before and just after the message. Returns
+ * the OR of the response codes, or a negative error.
+ */
+int read_batch_run(struct read_batch *b, unsigned int *vals,
+        struct timespec *sent, struct timespec *done)
+{
+    uint32_t hz = link_speed(b->fd);
+    unsigned int i, bad = 0;
+    int spidev_ret, fpga_ret = 0;
+
+    /* the link may have been demoted since */
+    for (i = 0; i < b->n_tr; i++)
+        b->tr[i].speed_hz = hz;
+    if (sent)
+        clock_gettime(CLOCK_MONOTONIC, sent);
+    spidev_ret = spi_message(b->fd, b->tr, b->n_tr);
+    if (done)
+        clock_gettime(CLOCK_MONOTONIC, done);
+    if (spidev_ret < 1)
+    {
+        link_account(b->fd, b->n, b->n);
+        return spidev_ret < 0 ? spidev_ret : -1;
+    }
+    for (i = 0; i < b->n; i++)
+    {
+        vals[i] = b->fresp[i].dout;
+        fpga_ret |= b->fresp[i].resp;
+        bad += b->fresp[i].resp != RESP_OK;
+    }
+    link_account(b->fd, b->n, bad);
+    return fpga_ret;
+}
+
+/*
+ * The message read_spans_ops() would send: its bytes, transfers and total
+ * words in *len, *n_tr and *total. Returns whether it fits in one message.
+ */
+static bool spans_size(int fd, const struct read_span *spans, unsigned int n_spans,
+        unsigned int n_ops, unsigned int *len, unsigned int *n_tr, unsigned int *total)
+{
+    unsigned int i, words = 0, bytes = 0;
+    bool burst = get_link(fd)->burst;
+
+    for (i = 0; i < n_spans; i++)
+    {
+        words += (spans[i].n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD;
+        bytes += (spans[i].n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD * BYTES_PER_WORD +
+                BURST_OVERHEAD;
+    }
+    *total = words + n_ops;
+    *len = (burst ? bytes : words * sizeof(struct fpga_spi_cmd)) +
+            n_ops * sizeof(struct fpga_spi_cmd);
+    *n_tr = (burst ? n_spans : words) + n_ops;
+    return burst ? bytes + n_ops * sizeof(struct fpga_spi_cmd) <=
+                link_burst_size(fd) * sizeof(struct fpga_spi_cmd) :
+            words + n_ops <= link_burst_size(fd);
+}
+
+/*
+ * Build the bursts (one per span) or read frames, then the frames of ops,
+ * in the zeroed tx and tr. Returns the number of transfers to send.
+ */
+static unsigned int spans_build(int fd, const struct read_span *spans, unsigned int n_spans,
+        const struct word_op *ops, unsigned int n_ops, unsigned char *tx, unsigned char *rx,
+        struct spi_ioc_transfer *tr)
+{
+    struct fpga_spi_cmd *frames, *fresp;
+    struct fpga_spi_burst *hdr;
+    unsigned int i, j, k, words, off, n_tr;
+    bool burst = get_link(fd)->burst;
+
+    for (i = k = off = 0; i < n_spans; i++)
+    {
+        words = (spans[i].n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD;
+        if (burst && words)
+        {
+            hdr = (struct fpga_spi_burst *) (tx + off);
+            hdr->cmd = BURST_READ_CMD;
+            hdr->addr = spans[i].addr;
+            hdr->count = words;
+            tr[k].len = words * BYTES_PER_WORD + BURST_OVERHEAD;
+            tr[k].tx_buf = (unsigned long) (tx + off);
+            tr[k].rx_buf = (unsigned long) (rx + off);
+            tr[k].cs_change = 1;    /* a chipselect per burst frame */
+            off += tr[k++].len;
+        }
+        for (j = 0; !burst && j < words; j++)
+        {
+            frames = (struct fpga_spi_cmd *) (tx + off);
+            frames->cmd = 0x0F;
+            frames->addr = spans[i].addr + j * BYTES_PER_WORD;
+            tr[k].len = sizeof(struct fpga_spi_cmd);
+            tr[k].tx_buf = (unsigned long) (tx + off);
+            tr[k].rx_buf = (unsigned long) (rx + off);
+            tr[k++].cs_change = 1;
+            off += sizeof(struct fpga_spi_cmd);
+        }
+    }
+    frames = (struct fpga_spi_cmd *) (tx + off);
+    fresp = (struct fpga_spi_cmd *) (rx + off);
+    for (i = 0; i < n_ops; i++, k++)
+    {
+        frames[i].cmd = ops[i].write ? 0x8F : 0x0F;
+        frames[i].addr = ops[i].addr;
+        frames[i].din = ops[i].write ? ops[i].val : 0;
+        tr[k].len = sizeof(struct fpga_spi_cmd);
+        tr[k].tx_buf = (unsigned long) &frames[i];
+        tr[k].rx_buf = (unsigned long) &fresp[i];
+        tr[k].cs_change = 1;
+    }
+    n_tr = k;
+    for (k = 0; k < n_tr; k++)
+    {
+        tr[k].delay_usecs = delay;
+        tr[k].speed_hz = link_speed(fd);
+        tr[k].bits_per_word = bits;
+    }
+
+    /* all frames: they're back to back, so they can stream */
+    return burst ? n_tr :
+            stream_burst(fd, tr, (struct fpga_spi_cmd *) tx, (struct fpga_spi_cmd *) rx, n_tr);
+}
+
+/*
+ * Copy the words of each span from rx, to its buf or, if words is not
+ * NULL, one span after another into words, and the read values of ops.
+ * Returns the OR of the response codes.
+ */
+static int spans_collect(int fd, const struct read_span *spans, unsigned int n_spans,
+        unsigned int *words, struct word_op *ops, unsigned int n_ops, const unsigned char *rx,
+        unsigned int total)
+{
+    const struct fpga_spi_cmd *fresp;
+    unsigned int i, j, n, off, bad = 0, *buf;
+    int fpga_ret = 0;
+    bool burst = get_link(fd)->burst;
+
+    for (i = off = 0; i < n_spans; i++)
+    {
+        n = (spans[i].n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD;
+        buf = words ? words : spans[i].buf;
+        if (burst && n)
+        {
+            memcpy(buf, rx + off + sizeof(struct fpga_spi_burst), n * BYTES_PER_WORD);
+            off += n * BYTES_PER_WORD + BURST_OVERHEAD;
+            fpga_ret |= rx[off - 1];
+            bad += rx[off - 1] != RESP_OK ? n : 0;
+        }
+        for (j = 0; !burst && j < n; j++)
+        {
+            fresp = (const struct fpga_spi_cmd *) (rx + off);
+            buf[j] = fresp->dout;
+            fpga_ret |= fresp->resp;
+            bad += fresp->resp != RESP_OK;
+            off += sizeof(struct fpga_spi_cmd);
+        }
+        if (words)
+            words += n;
+    }
+    fresp = (const struct fpga_spi_cmd *) (rx + off);
+    for (i = 0; i < n_ops; i++)
+    {
+        if (!ops[i].write)
+            ops[i].val = fresp[i].dout;
+        fpga_ret |= fresp[i].resp;
+        bad += fresp[i].resp != RESP_OK;
+    }
+    link_account(fd, total, bad);
     return fpga_ret;
 }
 
+/*
+ * Read each of the spans, then do ops, in one SPI message when it all
+ * fits in a page; otherwise the spans go as many to a message as fit (one
+ * too big for a page is bulk_read() alone) and the ops are sent after
+ * them. Either way the ops happen after the reads, so a pointer
+ * register read among them says how far the FPGA had got by the time the
+ * data was read. Returns the OR of the response codes.
+ */
+int read_spans_ops(int fd, const struct read_span *spans, unsigned int n_spans,
+        struct word_op *ops, unsigned int n_ops)
+{
+    struct spi_ioc_transfer *tr;
+    unsigned char *tx, *rx;
+    unsigned int i, k, n_tr, len, total;
+    int spidev_ret, fpga_ret = 0, ret;
+
+    if (!spans_size(fd, spans, n_spans, n_ops, &len, &n_tr, &total))
+    {
+        for (i = 0; i < n_spans; i += k)
+        {
+            /* as many spans as fit in a message, or one alone, bulk_read() */
+            for (k = 1; i + k < n_spans &&
+                    spans_size(fd, spans + i, k + 1, 0, &len, &n_tr, &total); k++)
+                ;
+            if (k > 1 || spans_size(fd, spans + i, 1, 0, &len, &n_tr, &total))
+                ret = read_spans_ops(fd, spans + i, k, NULL, 0);
+            else
+                ret = bulk_read(fd, spans[i].addr, spans[i].n_bytes, spans[i].buf);
+            if (ret < 0)
+                return ret;
+            fpga_ret |= ret;
+        }
+        if (n_ops == 0)
+            return fpga_ret;
+        ret = word_ops(fd, ops, n_ops);
+        return ret < 0 ? ret : fpga_ret | ret;
+    }
+
+    tx = link_scratch(fd, SCRATCH_TX, len);
+    rx = link_scratch(fd, SCRATCH_RX, len);
+    tr = link_scratch(fd, SCRATCH_TR, n_tr * sizeof(struct spi_ioc_transfer));
+    if (!tx || !rx || !tr || n_tr == 0)
+    {
+        if (n_tr)
+            printf("Failed to allocate transfer buffers\n");
+        return n_tr ? -1 : RESP_OK;
+    }
+
+    n_tr = spans_build(fd, spans, n_spans, ops, n_ops, tx, rx, tr);
+    spidev_ret = spi_message(fd, tr, n_tr);
+    if (spidev_ret < 1)
+    {
+        printf("can't send spi message! (error %d)\n", spidev_ret);
+        link_account(fd, total, total);
+        return spidev_ret;
+    }
+    return spans_collect(fd, spans, n_spans, NULL, ops, n_ops, rx, total);
+}
+
+/*
+ * The same spans read over and over, for watching: the message of
+ * read_spans_ops() is built once by read_spans_new(), and each
+ * read_spans_run() only refreshes the clock rate and sends it, with
+ * nothing allocated. It is made again if the link's protocol, stream mode
+ * or message size changes. Spans that don't fit in one message are
+ * bulk_read() in turn instead.
+ */
+struct read_spans {
+    int fd;
+    struct read_span *spans;
+    unsigned int n_spans;
+
+    /* made for these link settings, see read_spans_build() */
+    bool burst, stream;
+    unsigned int burst_size;
+    bool fits;
+    unsigned int n_tr, total;
+    unsigned char *tx, *rx;
+    struct spi_ioc_transfer *tr;
+};
+
+static int read_spans_build(struct read_spans *p)
+{
+    struct spi_link *link = get_link(p->fd);
+    unsigned int len, n_tr;
+
+    free(p->tx);
+    free(p->rx);
+    free(p->tr);
+    p->tx = p->rx = NULL;
+    p->tr = NULL;
+    p->burst = link->burst;
+    p->stream = link->stream;
+    p->burst_size = link_burst_size(p->fd);
+    p->fits = spans_size(p->fd, p->spans, p->n_spans, 0, &len, &n_tr, &p->total);
+    if (!p->fits || n_tr == 0)
+    {
+        p->n_tr = 0;
+        return 0;
+    }
+
+    p->tx = calloc(1, len);
+    p->rx = calloc(1, len);
+    p->tr = calloc(n_tr, sizeof(*p->tr));
+    if (!p->tx || !p->rx || !p->tr)
+    {
+        printf("Failed to allocate transfer buffers\n");
+        p->burst_size = 0;      /* so the next run tries again */
+        return -1;
+    }
+    p->n_tr = spans_build(p->fd, p->spans, p->n_spans, NULL, 0, p->tx, p->rx, p->tr);
+    return 0;
+}
+
+/* Only the addr and n_bytes of spans are used */
+struct read_spans *read_spans_new(int fd, const struct read_span *spans, unsigned int n)
+{
+    struct read_spans *p;
+    unsigned int i;
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+    p->fd = fd;
+    p->n_spans = n;
+    p->spans = calloc(n ? n : 1, sizeof(*p->spans));
+    if (!p->spans)
+    {
+        read_spans_free(p);
+        return NULL;
+    }
+    for (i = 0; i < n; i++)
+    {
+        p->spans[i].addr = spans[i].addr;
+        p->spans[i].n_bytes = spans[i].n_bytes;
+    }
+    if (read_spans_build(p) != 0)
+    {
+        read_spans_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+void read_spans_free(struct read_spans *p)
+{
+    if (!p)
+        return;
+    free(p->spans);
+    free(p->tx);
+    free(p->rx);
+    free(p->tr);
+    free(p);
+}
+
+/*
+ * Read the spans into words, one after another. Returns the OR of the
+ * response codes, or a negative error.
+ */
+int read_spans_run(struct read_spans *p, unsigned int *words)
+{
+    struct spi_link *link = get_link(p->fd);
+    uint32_t hz = link_speed(p->fd);
+    unsigned int i;
+    int spidev_ret, fpga_ret = 0, ret;
+
+    if ((link->burst != p->burst || link->stream != p->stream ||
+                link_burst_size(p->fd) != p->burst_size) && read_spans_build(p) != 0)
+        return -1;
+
+    if (!p->fits)
+    {
+        for (i = 0; i < p->n_spans; i++)
+        {
+            ret = bulk_read(p->fd, p->spans[i].addr, p->spans[i].n_bytes, words);
+            if (ret < 0)
+                return ret;
+            fpga_ret |= ret;
+            words += (p->spans[i].n_bytes + BYTES_PER_WORD - 1) / BYTES_PER_WORD;
+        }
+        return fpga_ret;
+    }
+    if (p->n_tr == 0)
+        return RESP_OK;
+
+    /* the link may have been demoted since */
+    for (i = 0; i < p->n_tr; i++)
+        p->tr[i].speed_hz = hz;
+    spidev_ret = spi_message(p->fd, p->tr, p->n_tr);
+    if (spidev_ret < 1)
+    {
+        link_account(p->fd, p->total, p->total);
+        return spidev_ret < 0 ? spidev_ret : -1;
+    }
+    return spans_collect(p->fd, p->spans, p->n_spans, words, NULL, 0, p->rx, p->total);
+}
+
+/*
+ * Change only the bits of mask in the word at addr. A mask of whole bytes
+ * is one write with just those byte enables set (bit i of the low nibble of
+ * the command enables bits 8i+7..8i); any other mask reads the word first.
+ */
+static int masked_write(int fd, unsigned int addr, unsigned int val, unsigned int mask)
+{
+    unsigned int old, i, be = 0;
+    int ret;
+
+    if (mask == 0xFFFFFFFF)
+        return write_word(fd, addr, val);
+
+    for (i = 0; i < BYTES_PER_WORD; i++)
+    {
+        if (((mask >> (8 * i)) & 0xFF) == 0xFF)
+            be |= 1 << i;
+        else if ((mask >> (8 * i)) & 0xFF)
+            break;
+    }
+    if (i == BYTES_PER_WORD)
+    {
+        if (!be)
+            return RESP_OK;
+        return frame_write(fd, 0x80 | be, addr, val);
+    }
+
+    ret = read_word(fd, addr, &old);
+    if (ret != RESP_OK)
+        return ret;
+    return write_word(fd, addr, (old & ~mask) | (val & mask));
+}
+
+int write_word_masked(int fd, unsigned int addr, unsigned int val, unsigned int mask)
+{
+    uint64_t t = trace_begin(fd, TRACE_WRITE_MASKED, addr, BYTES_PER_WORD);
+
+    return trace_end(t, TRACE_WRITE_MASKED, addr, BYTES_PER_WORD, mask,
+            masked_write(fd, addr, val, mask));
+}
+
+/*
+ * Where the driver doesn't answer SPIFPGA_IOC_GET_LIMITS, its bufsiz module
+ * parameter is the largest message it takes. Returns 0 if neither module
+ * is loaded.
+ */
+static uint32_t module_bufsiz(void)
+{
+    static const char *const params[] = {
+        "/sys/module/spifpga/parameters/bufsiz",
+        "/sys/module/spidev/parameters/bufsiz",
+    };
+    unsigned int i, val;
+    FILE *in;
+
+    for (i = 0; i < sizeof(params) / sizeof(params[0]); i++)
+    {
+        in = fopen(params[i], "r");
+        if (!in)
+            continue;
+        if (fscanf(in, "%u", &val) != 1)
+            val = 0;
+        fclose(in);
+        if (val)
+            return val;
+    }
+    return 0;
+}
+
+/*
+ * The transfer limits of a link: from the spifpga driver if it is behind
+ * fd, otherwise from the bufsiz module parameter of spidev (with the
+ * controller limits unknown), or the simulator's. Bursts are sized to
+ * page_bytes. Returns 0, or -1 if none of that could be found and the
+ * spidev default of DEFAULT_BUFSIZ is assumed.
+ */
+int get_limits(int fd, struct spifpga_limits *limits)
+{
+    struct spi_link *link = get_link(fd);
+    uint32_t bufsiz = 0;
+    int ret = 0;
+
+    memset(limits, 0, sizeof(*limits));
+    limits->proto = link->burst ? PROTO_BURST : PROTO_FRAMES;
+    limits->max_speed_hz = link_speed(fd);
+    limits->max_transfer_size = ~0U;
+    limits->max_message_size = ~0U;
+
+    if (link->sim)
+    {
+        limits->bufsiz = DEFAULT_BUFSIZ;
+        if (link->sim->max_msg_bytes)
+            limits->max_message_size = link->sim->max_msg_bytes;
+    } else if (ioctl(fd, SPIFPGA_IOC_GET_LIMITS, limits) == 0) {
+        /* page_bytes is already the smallest of them */
+        bufsiz = limits->page_bytes;
+    } else {
+        limits->bufsiz = module_bufsiz();
+        if (!limits->bufsiz)
+        {
+            limits->bufsiz = DEFAULT_BUFSIZ;
+            ret = -1;
+        }
+    }
+
+    if (!bufsiz)
+    {
+        bufsiz = limits->bufsiz;
+        if (limits->max_message_size < bufsiz)
+            bufsiz = limits->max_message_size;
+        if (limits->max_transfer_size < bufsiz)
+            bufsiz = limits->max_transfer_size;
+        limits->page_bytes = bufsiz;
+    }
+    limits->frames_per_page = bufsiz / sizeof(struct fpga_spi_cmd);
+    limits->words_per_burst = (bufsiz - BURST_OVERHEAD) / BYTES_PER_WORD;
+    link->max_msg = bufsiz;
+    return ret;
+}
+
 int config_spi()
 {
+	return config_spi_dev(DEVICE);
+}
+
+static void stop_trace(void)
+{
+    trace_stop(NULL);
+}
+
+/*
+ * Open and set up a spidev device (or the spidev minor of a spifpga
+ * device) by path. Each device gets its own saved profile and limits.
+ */
+
+int config_spi_dev(const char *device)
+{
+	struct spi_profile profile;
+	struct spifpga_limits limits;
 	int fd;
     int ret;
 
-	fd = open(DEVICE, O_RDWR);
+	fd = open(device, O_RDWR);
 	if (fd < 0)
     {
-		printf("can't open device\n");
+		printf("can't open %s\n", device);
         return fd;
     }
+	if (fd >= MAX_LINKS)
+	{
+		printf("too many open links for %s\n", device);
+		close(fd);
+		return -1;
+	}
 
 	/*
 	 * spi mode
@@ -386,9 +1333,361 @@ int config_spi()
 	printf("bits per word: %d\n", bits);
 	printf("max speed: %d Hz (%d KHz)\n", speed, speed/1000);
 
+	link_reset(fd);
+	if (get_limits(fd, &limits) != 0)
+		printf("transfer limits unknown, assuming %u bytes\n", DEFAULT_BUFSIZ);
+	printf("largest message: %u bytes (%u frames)\n",
+			limits.page_bytes, limits.frames_per_page);
+
+	/* the fastest clean setting calibrate_spi() found for this device */
+	if (load_profile(device, &profile) == 0 && set_profile(fd, &profile) == 0)
+		printf("profile: %u Hz, %u frames per message\n",
+				profile.speed, profile.burst_size);
+
+	if (set_protocol(fd, PROTO_BURST) == PROTO_BURST)
+		printf("protocol: burst\n");
+
+	/* the calls from here on, when $SPIFPGA_TRACE asks for a trace */
+	if (getenv(TRACE_ENV) && !trace_enabled() && trace_start(getenv(TRACE_ENV)) == 0)
+	{
+		printf("tracing to %s\n", getenv(TRACE_ENV));
+		atexit(stop_trace);
+	}
+
 	return fd;
 }
 
+/*
+ * Use a simulator instead of a device. Returns an fd that the rest of the
+ * library accepts like the one from config_spi(); close it with close_spi().
+ */
+int config_spi_sim(struct spifpga_sim *sim)
+{
+    struct spifpga_limits limits;
+    int fd;
+
+    fd = open("/dev/null", O_RDWR);
+    if (fd < 0)
+    {
+        printf("can't open /dev/null for the simulator\n");
+        return fd;
+    }
+    if (fd >= MAX_LINKS)
+    {
+        printf("too many open links for the simulator\n");
+        close(fd);
+        return -1;
+    }
+    link_reset(fd);
+    get_link(fd)->sim = sim;
+    get_limits(fd, &limits);
+    set_protocol(fd, PROTO_BURST);
+    return fd;
+}
+
+/* Whether fd is a simulator from config_spi_sim() rather than a device */
+bool is_spi_sim(int fd)
+{
+    return get_link(fd)->sim != NULL;
+}
 
+int close_spi(int fd)
+{
+    link_reset(fd);
+    return close(fd);
+}
 
+/*
+ * Switch stream mode for this link. Turning it on first reads address 0
+ * framed both ways and checks that every frame of the stream got the same
+ * answer as the single frame; gateware that needs a chipselect per frame
+ * fails that, and the link stays as it was.
+ */
+#define STREAM_PROBE_FRAMES 4
+
+int set_stream_mode(int fd, int on)
+{
+    struct fpga_spi_cmd fcmd[STREAM_PROBE_FRAMES], fresp[STREAM_PROBE_FRAMES];
+    struct spi_ioc_transfer tr;
+    unsigned int ref_val;
+    int i, ref_resp;
+
+    get_link(fd)->stream = false;
+    if (!on)
+        return 0;
+
+    ref_resp = read_word(fd, 0, &ref_val);
+    if (ref_resp <= 0 || ref_resp == 0xff)
+    {
+        printf("no answer from the FPGA, not streaming\n");
+        return -1;
+    }
 
+    memset(fcmd, 0, sizeof(fcmd));
+    memset(fresp, 0, sizeof(fresp));
+    for (i = 0; i < STREAM_PROBE_FRAMES; i++)
+        fcmd[i].cmd = 0x0F; //read command, all byte enables =1
+    memset(&tr, 0, sizeof(tr));
+    tr.len = sizeof(fcmd);
+    tr.tx_buf = (unsigned long) fcmd;
+    tr.rx_buf = (unsigned long) fresp;
+    tr.delay_usecs = delay;
+    tr.speed_hz = link_speed(fd);
+    tr.bits_per_word = bits;
+    if (spi_message(fd, &tr, 1) < 1)
+    {
+        printf("can't send spi message\n");
+        return -1;
+    }
+
+    for (i = 0; i < STREAM_PROBE_FRAMES; i++)
+        if (fresp[i].resp != ref_resp || fresp[i].dout != ref_val)
+        {
+            printf("FPGA does not support streaming\n");
+            return -1;
+        }
+    get_link(fd)->stream = true;
+    return 0;
+}
+
+/*
+ * Pick the wire protocol for this link. PROTO_BURST reads the capability
+ * register and uses burst frames for bulk transfers if the gateware has
+ * them; old gateware answers with plain register contents, without the
+ * magic, and keeps single frames. Returns the protocol now in use.
+ */
+int set_protocol(int fd, int proto)
+{
+    unsigned int cap = 0;
+    int ret;
+
+    get_link(fd)->burst = false;
+    if (proto != PROTO_BURST)
+        return PROTO_FRAMES;
+
+    ret = read_word(fd, CAP_ADDR, &cap);
+    if (ret < 0)
+        return PROTO_FRAMES;
+    if ((cap & CAP_MAGIC_MASK) == CAP_MAGIC && (cap & CAP_BURST))
+    {
+        get_link(fd)->burst = true;
+        return PROTO_BURST;
+    }
+    return PROTO_FRAMES;
+}
+
+/* The wire protocol this link uses for bulk transfers */
+int get_protocol(int fd)
+{
+    return get_link(fd)->burst ? PROTO_BURST : PROTO_FRAMES;
+}
+
+/*
+ * Calibration. Every check sends one message of alternating write and
+ * read-back frames on the scratch register, with a different data pattern
+ * in each pair, and passes if every frame came back RESP_OK and every read
+ * returned what was just written.
+ */
+#define CALIB_FRAMES 64
+#define CALIB_ROUNDS 8
+#define MAX_CALIB_BURST 4096
+
+static unsigned int calib_pattern(unsigned int k)
+{
+    switch (k % 6) {
+        case 0: return 0x00000000;
+        case 1: return 0xFFFFFFFF;
+        case 2: return 0xAAAAAAAA;
+        case 3: return 0x55555555;
+        case 4: return 1u << (k % 32);
+        default: return (k * 2654435761u) ^ 0x5a5a5a5a;
+    }
+}
+
+/* Returns 0 if the message came back clean */
+static int check_frames(int fd, unsigned int addr, unsigned int n_frames, unsigned int seed)
+{
+    struct fpga_spi_cmd *fcmd, *fresp;
+    struct spi_ioc_transfer *tr;
+    unsigned int i;
+    int ret = 0;
+
+    fcmd = calloc(n_frames, sizeof(struct fpga_spi_cmd));
+    fresp = calloc(n_frames, sizeof(struct fpga_spi_cmd));
+    tr = calloc(n_frames, sizeof(struct spi_ioc_transfer));
+    if (!fcmd || !fresp || !tr)
+    {
+        printf("Failed to allocate calibration buffers\n");
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < n_frames; i++)
+    {
+        fcmd[i].cmd = (i % 2) ? 0x0F : 0x8F;
+        fcmd[i].addr = addr;
+        if (!(i % 2))
+            fcmd[i].din = calib_pattern(seed + i / 2);
+        tr[i].len = sizeof(struct fpga_spi_cmd);
+        tr[i].tx_buf = (unsigned long) &fcmd[i];
+        tr[i].rx_buf = (unsigned long) &fresp[i];
+        tr[i].delay_usecs = delay;
+        tr[i].speed_hz = link_speed(fd);
+        tr[i].bits_per_word = bits;
+        tr[i].cs_change = 1;
+    }
+
+    if (spi_message(fd, tr, stream_burst(fd, tr, fcmd, fresp, n_frames)) < 1)
+    {
+        ret = 1;
+        goto out;
+    }
+    for (i = 0; i < n_frames; i++)
+        if (fresp[i].resp != RESP_OK ||
+                ((i % 2) && fresp[i].dout != calib_pattern(seed + i / 2)))
+            ret = 1;
+
+out:
+    free(fcmd);
+    free(fresp);
+    free(tr);
+    return ret;
+}
+
+/*
+ * Find the fastest clock at which the scratch register reads back clean
+ * CALIB_ROUNDS times in a row, then, at that clock, the largest message
+ * (in frames, doubling) that still goes through clean. The link is left at
+ * the result, which is also returned in profile. Returns -1, with the link
+ * back where it was, if not even the slowest clock works.
+ */
+int calibrate_spi(int fd, unsigned int scratch_addr, struct spi_profile *profile)
+{
+    struct spi_profile old, best = { 0, 0 };
+    unsigned int i, round, n;
+
+    get_profile(fd, &old);
+    get_link(fd)->burst_size = 0;
+
+    for (i = 0; i < N_SPEED_STEPS; i++)
+    {
+        set_link_speed(fd, speed_steps[i]);
+        for (round = 0; round < CALIB_ROUNDS; round++)
+            if (check_frames(fd, scratch_addr, CALIB_FRAMES, round * CALIB_FRAMES))
+                break;
+        if (round < CALIB_ROUNDS)
+            break;
+        best.speed = speed_steps[i];
+    }
+    if (!best.speed)
+    {
+        printf("no clean clock rate found\n");
+        set_profile(fd, &old);
+        return -1;
+    }
+
+    set_link_speed(fd, best.speed);
+    for (n = CALIB_FRAMES / 2; n <= MAX_CALIB_BURST && n <= link_max_frames(fd); n *= 2)
+    {
+        if (check_frames(fd, scratch_addr, n, n))
+            break;
+        best.burst_size = n;
+    }
+    if (!best.burst_size)
+    {
+        printf("no clean burst size found\n");
+        set_profile(fd, &old);
+        return -1;
+    }
+
+    set_profile(fd, &best);
+    *profile = best;
+    return 0;
+}
+
+void get_profile(int fd, struct spi_profile *profile)
+{
+    profile->speed = link_speed(fd);
+    profile->burst_size = link_burst_size(fd);
+}
+
+int set_profile(int fd, const struct spi_profile *profile)
+{
+    struct spi_link *link = get_link(fd);
+
+    link->burst_size = profile->burst_size;
+    link->ops = 0;
+    link->bad = 0;
+    return set_link_speed(fd, profile->speed);
+}
+
+static const char *profile_file(void)
+{
+    const char *path = getenv("SPIFPGA_PROFILE");
+
+    return path ? path : PROFILE_FILE;
+}
+
+/*
+ * The profile file has a line per device: "device speed_hz burst_frames".
+ * Lines starting with # are comments.
+ */
+int load_profile(const char *device, struct spi_profile *profile)
+{
+    char line[512], dev[256];
+    unsigned int s, b;
+    FILE *f;
+    int ret = -1;
+
+    f = fopen(profile_file(), "r");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%255s %u %u", dev, &s, &b) == 3 &&
+                strcmp(dev, device) == 0 && s && b)
+        {
+            profile->speed = s;
+            profile->burst_size = b;
+            ret = 0;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+/* Replace the device's line, keeping everything else in the file */
+int save_profile(const char *device, const struct spi_profile *profile)
+{
+    const char *path = profile_file();
+    char line[512], dev[256], tmp[4096];
+    FILE *in, *out;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    out = fopen(tmp, "w");
+    if (!out)
+    {
+        printf("can't write %s\n", tmp);
+        return -1;
+    }
+    in = fopen(path, "r");
+    while (in && fgets(line, sizeof(line), in))
+    {
+        if (line[0] != '#' && sscanf(line, "%255s", dev) == 1 &&
+                strcmp(dev, device) == 0)
+            continue;
+        fputs(line, out);
+    }
+    if (in)
+        fclose(in);
+    fprintf(out, "%s %u %u\n", device, profile->speed, profile->burst_size);
+    if (fclose(out) != 0 || rename(tmp, path) != 0)
+    {
+        printf("can't write %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -1,9 +1,14 @@
+#include <stdbool.h>
+#include "spifpga.h"
+
 #define DEVICE "/dev/spidev0.0"
 #define MAX_SPEED 4000000
 #define DELAY 1
 #define BITS 8
-#define MAX_BURST_SIZE 256
+#define DEFAULT_BUFSIZ 4096
 #define BYTES_PER_WORD 4
+#define RESP_OK 0x8F
+#define PROFILE_FILE "/etc/spifpga.profile"
 
 struct fpga_spi_cmd {
     unsigned char cmd;
@@ -13,9 +18,90 @@ struct fpga_spi_cmd {
     unsigned char resp;
 } __attribute__((packed));
 
+/*
+ * Burst frame: this header, count words of payload (auto-incrementing
+ * address), then a status byte. Only used when the capability register
+ * says the gateware has it.
+ */
+struct fpga_spi_burst {
+    unsigned char cmd;
+    unsigned int addr;
+    unsigned int count;
+} __attribute__((packed));
+
+#define BURST_READ_CMD SPIFPGA_CMD_BURST_READ
+#define BURST_WRITE_CMD SPIFPGA_CMD_BURST_WRITE
+#define BURST_OVERHEAD (sizeof(struct fpga_spi_burst) + 1)
+
+/* Capability register: magic in the top half, CAP_* flags below */
+#define CAP_ADDR 0xFFFFFFFC
+#define CAP_MAGIC 0x53460000
+#define CAP_MAGIC_MASK 0xFFFF0000
+#define CAP_BURST (1 << 0)
+
+#define PROTO_FRAMES 0
+#define PROTO_BURST 1
+
+/* Per-fd link settings, for fds below MAX_LINKS */
+#define MAX_LINKS 64
+
+/* One frame of a word_ops() batch */
+struct word_op {
+    unsigned int addr;
+    unsigned int val;       /* written, or read back */
+    bool write;
+};
+
+struct read_span {
+    unsigned int addr;
+    unsigned int n_bytes;
+    unsigned int *buf;
+};
+
+struct spifpga_sim;
+struct spifpga_limits;
+struct read_batch;
+struct read_spans;
+struct timespec;
+
+/*
+ * Link settings found by calibrate_spi(). burst_size is the largest
+ * message in frames; burst frames are sized to the same number of bytes.
+ */
+struct spi_profile {
+    unsigned int speed;
+    unsigned int burst_size;
+};
+
 int config_spi();
+int config_spi_dev(const char *device);
+int config_spi_sim(struct spifpga_sim *sim);
+int close_spi(int fd);
+bool is_spi_sim(int fd);
+int set_stream_mode(int fd, int on);
+int set_protocol(int fd, int proto);
+int get_protocol(int fd);
+int get_limits(int fd, struct spifpga_limits *limits);
+int calibrate_spi(int fd, unsigned int scratch_addr, struct spi_profile *profile);
+void get_profile(int fd, struct spi_profile *profile);
+int set_profile(int fd, const struct spi_profile *profile);
+int load_profile(const char *device, struct spi_profile *profile);
+int save_profile(const char *device, const struct spi_profile *profile);
 int write_word(int fd, unsigned int addr, unsigned int val);
 int read_word(int fd, unsigned int addr, unsigned int *val);
+int write_word_masked(int fd, unsigned int addr, unsigned int val, unsigned int mask);
+int read_words(int fd, const unsigned int *addrs, unsigned int n, unsigned int *vals);
+int write_words(int fd, const unsigned int *addrs, const unsigned int *vals, unsigned int n);
+int word_ops(int fd, struct word_op *ops, unsigned int n);
+int read_spans_ops(int fd, const struct read_span *spans, unsigned int n_spans,
+        struct word_op *ops, unsigned int n_ops);
+struct read_spans *read_spans_new(int fd, const struct read_span *spans, unsigned int n);
+void read_spans_free(struct read_spans *p);
+int read_spans_run(struct read_spans *p, unsigned int *words);
+struct read_batch *read_batch_new(int fd, const unsigned int *addrs, unsigned int n);
+void read_batch_free(struct read_batch *b);
+int read_batch_run(struct read_batch *b, unsigned int *vals,
+        struct timespec *sent, struct timespec *done);
 int bulk_read(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned int *buf);
 int bulk_write(int fd, unsigned int start_addr, unsigned int n_bytes, unsigned int *buf);
 
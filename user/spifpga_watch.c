@@ -0,0 +1,194 @@
+/*
+ * Register watching, see spifpga_watch.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_checkpoint.h"
+#include "spifpga_watch.h"
+
+/* Words compared at a time, four vectors of four */
+#define BLOCK_WORDS 16
+
+typedef unsigned int watch_vec __attribute__((vector_size(16)));
+
+struct watch {
+    int fd;
+    struct read_spans *msg;     /* the ranges' read, built once */
+    unsigned int n_words;
+    unsigned int n_padded;      /* n_words up to whole blocks, zero filled */
+    unsigned int *addrs;        /* of each word */
+    unsigned int *cur;          /* the last sample */
+    unsigned int *next;         /* read into, then swapped with cur */
+    bool primed;
+    struct watch_stats stats;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Watch the ranges, sorted and merged where they touch */
+struct watch *watch_new(int fd, const struct checkpoint_range *ranges, unsigned int n)
+{
+    const struct checkpoint_range *merged;
+    struct checkpoint *cp;
+    struct read_span *spans;
+    struct watch *w;
+    unsigned int i, j, off = 0;
+    void *cur = NULL, *next = NULL;
+    size_t size;
+
+    cp = checkpoint_new(ranges, n);
+    if (!cp)
+        return NULL;
+    n = checkpoint_ranges(cp, &merged);
+
+    w = calloc(1, sizeof(*w));
+    if (!w)
+    {
+        checkpoint_free(cp);
+        return NULL;
+    }
+    w->fd = fd;
+    for (i = 0; i < n; i++)
+        w->n_words += merged[i].n_bytes / BYTES_PER_WORD;
+    w->n_padded = (w->n_words + BLOCK_WORDS - 1) / BLOCK_WORDS * BLOCK_WORDS;
+    size = (w->n_padded ? w->n_padded : BLOCK_WORDS) * BYTES_PER_WORD;
+    spans = calloc(n ? n : 1, sizeof(*spans));
+    w->addrs = malloc((w->n_words ? w->n_words : 1) * sizeof(*w->addrs));
+    if (posix_memalign(&cur, sizeof(watch_vec), size) != 0)
+        cur = NULL;
+    if (posix_memalign(&next, sizeof(watch_vec), size) != 0)
+        next = NULL;
+    w->cur = cur;
+    w->next = next;
+    if (!spans || !w->addrs || !w->cur || !w->next)
+    {
+        printf("Failed to allocate the watch\n");
+        checkpoint_free(cp);
+        free(spans);
+        watch_free(w);
+        return NULL;
+    }
+    memset(w->cur, 0, size);
+    memset(w->next, 0, size);
+
+    for (i = 0; i < n; i++)
+    {
+        spans[i].addr = merged[i].addr;
+        spans[i].n_bytes = merged[i].n_bytes;
+        for (j = 0; j < merged[i].n_bytes / BYTES_PER_WORD; j++)
+            w->addrs[off + j] = merged[i].addr + j * BYTES_PER_WORD;
+        off += merged[i].n_bytes / BYTES_PER_WORD;
+    }
+    checkpoint_free(cp);
+    w->msg = read_spans_new(fd, spans, n);
+    free(spans);
+    if (!w->msg)
+    {
+        watch_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+void watch_free(struct watch *w)
+{
+    if (!w)
+        return;
+    read_spans_free(w->msg);
+    free(w->addrs);
+    free(w->cur);
+    free(w->next);
+    free(w);
+}
+
+unsigned int watch_words(const struct watch *w)
+{
+    return w->n_words;
+}
+
+/* The words of next that differ from cur, skipping blocks that match */
+static unsigned int diff(const struct watch *w, struct watch_change *changes)
+{
+    const watch_vec *a = (const watch_vec *) w->next, *b = (const watch_vec *) w->cur;
+    unsigned int i, j, end, n = 0;
+    watch_vec x;
+
+    for (i = 0; i < w->n_padded / 4; i += BLOCK_WORDS / 4)
+    {
+        x = (a[i] ^ b[i]) | (a[i + 1] ^ b[i + 1]) | (a[i + 2] ^ b[i + 2]) | (a[i + 3] ^ b[i + 3]);
+        if (!(x[0] | x[1] | x[2] | x[3]))
+            continue;
+        end = i * 4 + BLOCK_WORDS < w->n_words ? i * 4 + BLOCK_WORDS : w->n_words;
+        for (j = i * 4; j < end; j++)
+            if (w->next[j] != w->cur[j])
+            {
+                changes[n].addr = w->addrs[j];
+                changes[n].old = w->cur[j];
+                changes[n++].val = w->next[j];
+            }
+    }
+    return n;
+}
+
+/*
+ * Read the ranges and put the words that changed since the last sample
+ * in changes, which has room for watch_words(w) of them, in address
+ * order. Returns the OR of the response codes; a sample with a bad
+ * response is not compared, and the next is compared with the last good
+ * one.
+ */
+int watch_sample(struct watch *w, struct watch_change *changes, unsigned int *n_changes)
+{
+    unsigned int i, *swap;
+    double t0, us;
+    int ret;
+
+    *n_changes = 0;
+    t0 = now_s();
+    ret = read_spans_run(w->msg, w->next);
+    us = (now_s() - t0) * 1e6;
+
+    w->stats.samples++;
+    w->stats.bus_us = us;
+    if (us > w->stats.max_bus_us)
+        w->stats.max_bus_us = us;
+    w->stats.total_bus_s += us / 1e6;
+    if (ret != RESP_OK)
+        return ret;
+
+    if (!w->primed)
+    {
+        for (i = 0; i < w->n_words; i++)
+        {
+            changes[i].addr = w->addrs[i];
+            changes[i].old = 0;
+            changes[i].val = w->next[i];
+        }
+        *n_changes = w->n_words;
+        w->primed = true;
+    } else {
+        *n_changes = diff(w, changes);
+    }
+    w->stats.changes += *n_changes;
+
+    swap = w->cur;
+    w->cur = w->next;
+    w->next = swap;
+    return ret;
+}
+
+void watch_get_stats(const struct watch *w, struct watch_stats *stats)
+{
+    *stats = w->stats;
+}
@@ -0,0 +1,43 @@
+/*
+ * Watching registers for changes: a set of address ranges read over and
+ * over, reporting only the words that changed since the last read.
+ *
+ * The message is built once, by read_spans_new(), so each watch_sample()
+ * only resends it, a single SPI message while the ranges fit in one
+ * (bursts, or read frames), and compares the new words against
+ * the last ones. The compare goes sixteen words at a time with the
+ * compiler's vector types and only looks at single words in blocks that
+ * differ, so watching thousands of mostly quiet registers costs little
+ * more than the reads.
+ *
+ * The first sample reports every word, as a change from 0.
+ */
+
+#ifndef SPIFPGA_WATCH_H
+#define SPIFPGA_WATCH_H
+
+#include "spifpga_checkpoint.h"
+
+struct watch_change {
+    unsigned int addr;
+    unsigned int old;
+    unsigned int val;
+};
+
+struct watch_stats {
+    unsigned long long samples;
+    unsigned long long changes;
+    double bus_us;              /* last sample's read */
+    double max_bus_us;
+    double total_bus_s;
+};
+
+struct watch;
+
+struct watch *watch_new(int fd, const struct checkpoint_range *ranges, unsigned int n);
+void watch_free(struct watch *w);
+unsigned int watch_words(const struct watch *w);
+int watch_sample(struct watch *w, struct watch_change *changes, unsigned int *n_changes);
+void watch_get_stats(const struct watch *w, struct watch_stats *stats);
+
+#endif /* SPIFPGA_WATCH_H */
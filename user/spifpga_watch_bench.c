@@ -0,0 +1,165 @@
+/*
+ * Watching registers for changes, against the simulator.
+ *
+ * spifpga_watch_bench [-w words] [-r ranges] [-s samples] [-c changes] [-B]
+ *
+ * The words are spread over ranges with gaps between them. Each sample,
+ * changes random words are changed in the simulated memory; the bench
+ * checks that watch_sample() reports exactly those, and compares the bus
+ * time of a sample with reading every word with read_word(), as a shell
+ * loop around spifpga_user -r does. -B uses the burst protocol.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "spifpga_user.h"
+#include "spifpga_sim.h"
+#include "spifpga_watch.h"
+
+#define BASE_ADDR 0x00020000
+#define RANGE_STRIDE 0x1000
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int words = 256, n_ranges = 8, samples = 1000, n_changes = 4;
+    unsigned int per_range, i, j, s, n, got, addr, val;
+    struct checkpoint_range *ranges;
+    struct watch_change *changes;
+    struct watch_stats st;
+    struct spifpga_sim *sim;
+    struct watch *w;
+    uint32_t *shadow;
+    uint64_t bus_loop, bus_watch;
+    double t0, host_watch;
+    bool burst = false;
+    int c, fd, errors = 0;
+
+    while ((c = getopt(argc, argv, "w:r:s:c:B")) != -1)
+        switch (c) {
+            case 'w':
+                words = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                n_ranges = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                samples = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                n_changes = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                burst = true;
+                break;
+            default:
+                printf("Usage: spifpga_watch_bench [-w words] [-r ranges] [-s samples] [-c changes] [-B]\n");
+                return 1;
+        }
+    per_range = n_ranges ? words / n_ranges : 0;
+    if (per_range == 0 || per_range * BYTES_PER_WORD > RANGE_STRIDE / 2 || samples == 0)
+    {
+        printf("nothing to do\n");
+        return 1;
+    }
+    words = per_range * n_ranges;
+
+    sim = spifpga_sim_new(BASE_ADDR + n_ranges * RANGE_STRIDE);
+    ranges = malloc(n_ranges * sizeof(*ranges));
+    changes = malloc(words * sizeof(*changes));
+    shadow = malloc(words * sizeof(*shadow));
+    if (!sim || !ranges || !changes || !shadow)
+    {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+    for (i = 0; i < n_ranges; i++)
+    {
+        ranges[i].addr = BASE_ADDR + i * RANGE_STRIDE;
+        ranges[i].n_bytes = per_range * BYTES_PER_WORD;
+        for (j = 0; j < per_range; j++)
+            sim->mem[ranges[i].addr / BYTES_PER_WORD + j] = i << 16 | j;
+    }
+    fd = config_spi_sim(sim);
+    if (!burst)
+        set_protocol(fd, PROTO_FRAMES);
+
+    /* a word at a time, as from a shell loop */
+    spifpga_sim_reset_counters(sim);
+    for (s = 0; s < samples; s++)
+        for (i = 0; i < n_ranges; i++)
+            for (j = 0; j < per_range; j++)
+                read_word(fd, ranges[i].addr + j * BYTES_PER_WORD, &val);
+    bus_loop = sim->bus_ns;
+
+    w = watch_new(fd, ranges, n_ranges);
+    if (!w)
+        return 1;
+    errors += watch_sample(w, changes, &got) != RESP_OK || got != words;
+    for (i = 0; i < got && i < words; i++)
+    {
+        shadow[i] = changes[i].val;
+        errors += changes[i].addr != ranges[i / per_range].addr + i % per_range * BYTES_PER_WORD ||
+                changes[i].val != sim->mem[changes[i].addr / BYTES_PER_WORD];
+    }
+
+    spifpga_sim_reset_counters(sim);
+    host_watch = 0;
+    for (s = 0; s < samples; s++)
+    {
+        for (n = 0; n < n_changes; n++)
+        {
+            i = rand() % words;
+            sim->mem[ranges[i / per_range].addr / BYTES_PER_WORD + i % per_range] ^= 1u << (rand() % 32);
+        }
+        t0 = now_s();
+        errors += watch_sample(w, changes, &got) != RESP_OK;
+        host_watch += now_s() - t0;
+
+        /* exactly the words that differ from the last sample, in order */
+        for (i = n = 0; i < words; i++)
+        {
+            addr = ranges[i / per_range].addr + i % per_range * BYTES_PER_WORD;
+            val = sim->mem[addr / BYTES_PER_WORD];
+            if (val == shadow[i])
+                continue;
+            errors += n >= got || changes[n].addr != addr || changes[n].old != shadow[i] ||
+                    changes[n].val != val;
+            n++;
+            shadow[i] = val;
+        }
+        errors += n != got;
+    }
+    bus_watch = sim->bus_ns;
+    watch_get_stats(w, &st);
+
+    printf("%u words in %u ranges, %u samples, %u changes each, %s protocol\n",
+            words, n_ranges, samples, n_changes, burst ? "burst" : "frame");
+    printf("read_word each      %9.1f us bus per sample, %7.0f samples/s at most\n",
+            bus_loop / 1e3 / samples, samples / (bus_loop / 1e9));
+    printf("watch_sample        %9.1f us bus per sample, %7.0f samples/s at most\n",
+            bus_watch / 1e3 / samples, samples / (bus_watch / 1e9));
+    printf("host time per sample %8.1f us (simulator included), %llu changes reported\n",
+            host_watch * 1e6 / samples, st.changes - words);
+    printf("verify: %s\n", errors ? "FAILED" : "ok");
+
+    watch_free(w);
+    close_spi(fd);
+    spifpga_sim_free(sim);
+    free(ranges);
+    free(changes);
+    free(shadow);
+    return errors ? 1 : 0;
+}